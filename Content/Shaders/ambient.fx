@@ -23,6 +23,9 @@
 // This D3DX Effect file implements simple ambient lighting. It just colors the
 // geometry with a uniform ambient color.
 //
+// The AmbientImpostor technique draws a sphere as a disc on a camera facing
+// quad. With a uniform color the two look the same.
+//
 //-----------------------------------------------------------------------------
 
 //-----------------------------------------------------------------------------
@@ -33,6 +36,10 @@ float4x4 worldViewProjectionMatrix;
 float ambientIntensity;
 float4 ambientColor;
 
+float3 cameraRight;
+float3 cameraUp;
+float impostorRadius;
+
 //-----------------------------------------------------------------------------
 // Vertex Shaders.
 //-----------------------------------------------------------------------------
@@ -42,6 +49,23 @@ float4 VS_AmbientLighting(float3 position : POSITION) : POSITION
     return mul(float4(position, 1.0f), worldViewProjectionMatrix);
 }
 
+struct VS_IMPOSTOR_OUTPUT
+{
+    float4 position : POSITION;
+    float2 corner : TEXCOORD0;
+};
+
+VS_IMPOSTOR_OUTPUT VS_AmbientImpostor(float2 corner : TEXCOORD0)
+{
+    VS_IMPOSTOR_OUTPUT OUT;
+    float3 position = (corner.x * cameraRight + corner.y * cameraUp) * impostorRadius;
+
+    OUT.position = mul(float4(position, 1.0f), worldViewProjectionMatrix);
+    OUT.corner = corner;
+
+    return OUT;
+}
+
 //-----------------------------------------------------------------------------
 // Pixel Shaders.
 //-----------------------------------------------------------------------------
@@ -51,6 +75,12 @@ float4 PS_AmbientLighting() : COLOR
     return ambientIntensity * ambientColor;
 }
 
+float4 PS_AmbientImpostor(float2 corner : TEXCOORD0) : COLOR
+{
+    clip(1.0f - dot(corner, corner));
+    return ambientIntensity * ambientColor;
+}
+
 //-----------------------------------------------------------------------------
 // Techniques.
 //-----------------------------------------------------------------------------
@@ -63,3 +93,12 @@ technique AmbientLighting
         PixelShader = compile ps_2_0 PS_AmbientLighting();
     }
 }
+
+technique AmbientImpostor
+{
+    pass
+    {
+        VertexShader = compile vs_2_0 VS_AmbientImpostor();
+        PixelShader = compile ps_2_0 PS_AmbientImpostor();
+    }
+}
@@ -61,6 +61,13 @@ float4 globalAmbient;
 PointLight lights[MAX_POINT_LIGHTS];
 Material material;
 
+// Packed room vertices store positions relative to the room's bounding box
+// and octahedral normals. The defaults leave full precision vertices as is.
+
+float3 positionScale = {1.0f, 1.0f, 1.0f};
+float3 positionOffset = {0.0f, 0.0f, 0.0f};
+bool packedNormals = false;
+
 //-----------------------------------------------------------------------------
 // Textures.
 //-----------------------------------------------------------------------------
@@ -80,6 +87,15 @@ sampler2D colorMap = sampler_state
 // Vertex Shaders.
 //-----------------------------------------------------------------------------
 
+float3 DecodeOctahedralNormal(float2 encoded)
+{
+	float3 n = float3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+	float t = saturate(-n.z);
+
+	n.xy += (n.xy >= 0.0f) ? -t : t;
+	return normalize(n);
+}
+
 struct VS_INPUT
 {
 	float3 position : POSITION;
@@ -99,12 +115,14 @@ struct VS_OUTPUT
 VS_OUTPUT VS_PointLighting(VS_INPUT IN)
 {
 	VS_OUTPUT OUT;
+	float3 position = IN.position * positionScale + positionOffset;
+	float3 normal = packedNormals ? DecodeOctahedralNormal(IN.normal.xy) : IN.normal;
 
-	OUT.position = mul(float4(IN.position, 1.0f), worldViewProjectionMatrix);
-	OUT.worldPos = mul(float4(IN.position, 1.0f), worldMatrix).xyz;
+	OUT.position = mul(float4(position, 1.0f), worldViewProjectionMatrix);
+	OUT.worldPos = mul(float4(position, 1.0f), worldMatrix).xyz;
 	OUT.texCoord = IN.texCoord;
 	OUT.viewDir = cameraPos - OUT.worldPos;
-	OUT.normal = mul(IN.normal, (float3x3)worldInverseTransposeMatrix);
+	OUT.normal = mul(normal, (float3x3)worldInverseTransposeMatrix);
 	
 	return OUT;
 }
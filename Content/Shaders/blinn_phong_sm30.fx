@@ -23,9 +23,20 @@
 // Multiple per-pixel point lights in a single pass using shader model 3.0.
 // This effect file limits the number of point lights to 8.
 //
+// The PerPixelPointLightingAtlas technique draws the whole room in one call.
+// Each vertex carries the rectangle of its surface's tile in the room atlas
+// and an index into the material table.
+//
+// With useLightmap set both techniques add the lighting baked into the
+// lightmap, and only loop over the lights that weren't baked. The lightmap
+// has one chart for each direction a surface faces, and a surface's
+// lightmap coordinates are found from its position with the chart's planes.
+//
 //-----------------------------------------------------------------------------
 
 #define MAX_POINT_LIGHTS 8
+#define MAX_MATERIALS 2
+#define LIGHTMAP_FACES 6
 
 struct PointLight
 {
@@ -59,6 +70,18 @@ int numLights;
 
 PointLight lights[MAX_POINT_LIGHTS];
 Material material;
+Material materials[MAX_MATERIALS];
+
+// Packed room vertices store positions relative to the room's bounding box
+// and octahedral normals. The defaults leave full precision vertices as is.
+
+float3 positionScale = {1.0f, 1.0f, 1.0f};
+float3 positionOffset = {0.0f, 0.0f, 0.0f};
+bool packedNormals = false;
+
+bool useLightmap = false;
+float4 lightmapU[LIGHTMAP_FACES];
+float4 lightmapV[LIGHTMAP_FACES];
 
 //-----------------------------------------------------------------------------
 // Textures.
@@ -75,10 +98,56 @@ sampler2D colorMap = sampler_state
     MaxAnisotropy = 16;
 };
 
+texture atlasTexture;
+
+sampler2D atlasMap = sampler_state
+{
+	Texture = <atlasTexture>;
+    MagFilter = Linear;
+    MinFilter = Anisotropic;
+    MipFilter = Linear;
+    MaxAnisotropy = 16;
+    AddressU = Clamp;
+    AddressV = Clamp;
+};
+
+texture lightmapTexture;
+
+sampler2D lightmap = sampler_state
+{
+	Texture = <lightmapTexture>;
+    MagFilter = Linear;
+    MinFilter = Linear;
+    MipFilter = None;
+    AddressU = Clamp;
+    AddressV = Clamp;
+};
+
 //-----------------------------------------------------------------------------
 // Vertex Shaders.
 //-----------------------------------------------------------------------------
 
+float3 DecodeOctahedralNormal(float2 encoded)
+{
+	float3 n = float3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+	float t = saturate(-n.z);
+
+	n.xy += (n.xy >= 0.0f) ? -t : t;
+	return normalize(n);
+}
+
+float2 GetLightmapCoord(float3 position, float3 normal)
+{
+	// Picks the chart of the direction +X, -X, +Y, -Y, +Z or -Z nearest
+	// the normal, as GetLightmapFace() does.
+
+	float3 a = abs(normal);
+	int face = (a.x >= a.y && a.x >= a.z) ? ((normal.x > 0.0f) ? 0 : 1) :
+	           ((a.y >= a.z) ? ((normal.y > 0.0f) ? 2 : 3) : ((normal.z > 0.0f) ? 4 : 5));
+
+	return float2(dot(float4(position, 1.0f), lightmapU[face]), dot(float4(position, 1.0f), lightmapV[face]));
+}
+
 struct VS_INPUT
 {
 	float3 position : POSITION;
@@ -93,28 +162,76 @@ struct VS_OUTPUT
 	float2 texCoord : TEXCOORD1;
 	float3 viewDir : TEXCOORD2;
 	float3 normal : TEXCOORD3;
+	float2 lightmapCoord : TEXCOORD4;
 };
 
 VS_OUTPUT VS_PointLighting(VS_INPUT IN)
 {
 	VS_OUTPUT OUT;
+	float3 position = IN.position * positionScale + positionOffset;
+	float3 normal = packedNormals ? DecodeOctahedralNormal(IN.normal.xy) : IN.normal;
 
-	OUT.position = mul(float4(IN.position, 1.0f), worldViewProjectionMatrix);
-	OUT.worldPos = mul(float4(IN.position, 1.0f), worldMatrix).xyz;
+	OUT.position = mul(float4(position, 1.0f), worldViewProjectionMatrix);
+	OUT.worldPos = mul(float4(position, 1.0f), worldMatrix).xyz;
 	OUT.texCoord = IN.texCoord;
 	OUT.viewDir = cameraPos - OUT.worldPos;
-	OUT.normal = mul(IN.normal, (float3x3)worldInverseTransposeMatrix);
+	OUT.normal = mul(normal, (float3x3)worldInverseTransposeMatrix);
+	OUT.lightmapCoord = GetLightmapCoord(position, normal);
 	
 	return OUT;
 }
 
+struct VS_ATLAS_INPUT
+{
+	float3 position : POSITION;
+	float2 texCoord : TEXCOORD0;
+	float3 normal : NORMAL;
+	float4 atlasRect : TEXCOORD1;
+	float material : TEXCOORD2;
+};
+
+struct VS_ATLAS_OUTPUT
+{
+	float4 position : POSITION;
+	float3 worldPos : TEXCOORD0;
+	float2 texCoord : TEXCOORD1;
+	float3 viewDir : TEXCOORD2;
+	float3 normal : TEXCOORD3;
+	float4 atlasRect : TEXCOORD4;
+	float4 ambient : TEXCOORD5;
+	float4 diffuse : TEXCOORD6;
+	float4 specular : TEXCOORD7;	// w is the shininess
+	float2 lightmapCoord : TEXCOORD8;
+};
+
+VS_ATLAS_OUTPUT VS_AtlasPointLighting(VS_ATLAS_INPUT IN)
+{
+	VS_ATLAS_OUTPUT OUT;
+	int i = (int)IN.material;
+	float3 position = IN.position * positionScale + positionOffset;
+	float3 normal = packedNormals ? DecodeOctahedralNormal(IN.normal.xy) : IN.normal;
+
+	OUT.position = mul(float4(position, 1.0f), worldViewProjectionMatrix);
+	OUT.worldPos = mul(float4(position, 1.0f), worldMatrix).xyz;
+	OUT.texCoord = IN.texCoord;
+	OUT.viewDir = cameraPos - OUT.worldPos;
+	OUT.normal = mul(normal, (float3x3)worldInverseTransposeMatrix);
+	OUT.atlasRect = IN.atlasRect;
+	OUT.ambient = materials[i].ambient;
+	OUT.diffuse = materials[i].diffuse;
+	OUT.specular = float4(materials[i].specular.rgb, materials[i].shininess);
+	OUT.lightmapCoord = GetLightmapCoord(position, normal);
+
+	return OUT;
+}
+
 //-----------------------------------------------------------------------------
 // Pixel Shaders.
 //-----------------------------------------------------------------------------
 
 float4 PS_PointLighting(VS_OUTPUT IN) : COLOR
 {
-    float4 color = float4(0.0f, 0.0f, 0.0f, 0.0f);
+    float4 color = useLightmap ? tex2Dlod(lightmap, float4(IN.lightmapCoord, 0.0f, 0.0f)) : float4(0.0f, 0.0f, 0.0f, 0.0f);
     
     float3 n = normalize(IN.normal);
     float3 v = normalize(IN.viewDir);
@@ -146,6 +263,48 @@ float4 PS_PointLighting(VS_OUTPUT IN) : COLOR
 	return color * tex2D(colorMap, IN.texCoord);
 }
 
+float4 PS_AtlasPointLighting(VS_ATLAS_OUTPUT IN) : COLOR
+{
+    float4 color = useLightmap ? tex2Dlod(lightmap, float4(IN.lightmapCoord, 0.0f, 0.0f)) : float4(0.0f, 0.0f, 0.0f, 0.0f);
+    
+    float3 n = normalize(IN.normal);
+    float3 v = normalize(IN.viewDir);
+    float3 l = float3(0.0f, 0.0f, 0.0f);
+    float3 h = float3(0.0f, 0.0f, 0.0f);
+    
+    float atten = 0.0f;
+    float nDotL = 0.0f;
+    float nDotH = 0.0f;
+    float power = 0.0f;
+    
+    for (int i = 0; i < numLights; ++i)
+    {
+        l = (lights[i].pos - IN.worldPos) / lights[i].radius;
+        atten = saturate(1.0f - dot(l, l));
+        
+        l = normalize(l);
+        h = normalize(l + v);
+        
+        nDotL = saturate(dot(n, l));
+        nDotH = saturate(dot(n, h));
+        power = (nDotL == 0.0f) ? 0.0f : pow(nDotH, IN.specular.w);
+        
+        color += (IN.ambient * (globalAmbient + (atten * lights[i].ambient))) +
+                 (IN.diffuse * lights[i].diffuse * nDotL * atten) +
+                 (float4(IN.specular.rgb, 1.0f) * lights[i].specular * power * atten);
+    }
+
+    // Wrap the tiling texture coordinates into the surface's tile. The
+    // gradients come from the unwrapped coordinates so that the mip level
+    // doesn't jump where the coordinates wrap.
+
+    float2 atlasCoord = IN.atlasRect.xy + frac(IN.texCoord) * IN.atlasRect.zw;
+    float2 dx = ddx(IN.texCoord) * IN.atlasRect.zw;
+    float2 dy = ddy(IN.texCoord) * IN.atlasRect.zw;
+
+	return color * tex2Dgrad(atlasMap, atlasCoord, dx, dy);
+}
+
 //-----------------------------------------------------------------------------
 // Techniques.
 //-----------------------------------------------------------------------------
@@ -158,3 +317,12 @@ technique PerPixelPointLighting
         PixelShader = compile ps_3_0 PS_PointLighting();
     }
 }
+
+technique PerPixelPointLightingAtlas
+{
+    pass
+    {
+        VertexShader = compile vs_3_0 VS_AtlasPointLighting();
+        PixelShader = compile ps_3_0 PS_AtlasPointLighting();
+    }
+}
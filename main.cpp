@@ -64,17 +64,30 @@
 #include <windows.h>
 #include <d3d9.h>
 #include <d3dx9.h>
+#include <wincodec.h>
+#include <psapi.h>
+#include <intrin.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include <cfloat>
+#include <climits>
 #include <cmath>
+#include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <new>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #if defined(_DEBUG)
 #include <crtdbg.h>
 #endif
 
+#pragma intrinsic(_ReturnAddress)
+
 //-----------------------------------------------------------------------------
 // Macros.
 //-----------------------------------------------------------------------------
@@ -122,6 +135,20 @@ const float ROOM_FLOOR_TILE_V = 4.0f;
 const float ROOM_CEILING_TILE_U = 4.0f;
 const float ROOM_CEILING_TILE_V = 4.0f;
 
+const int ROOM_SURFACE_WALLS = 0;
+const int ROOM_SURFACE_CEILING = 1;
+const int ROOM_SURFACE_FLOOR = 2;
+const int ROOM_SURFACE_COUNT = 3;
+const int ROOM_MAX_BATCHES = ROOM_SURFACE_COUNT;
+
+const int ROOM_ATLAS_TILE_SIZE = 512;
+const int ROOM_ATLAS_PADDING = 64;
+const int ROOM_ATLAS_LEVELS = 7;        // the padding is 1 texel wide in the smallest level
+const int ROOM_ATLAS_COLUMNS = 2;
+
+const int VERTEX_CACHE_SCORE_SIZE = 32;     // entries of the LRU cache modelled when ordering triangles
+const int VERTEX_CACHE_MAX_VALENCE = 32;    // remaining triangles per vertex that still change its score
+
 const float DOLLY_MAX = max(max(ROOM_SIZE_X, ROOM_SIZE_Y), ROOM_SIZE_Z) * 2.0f;
 const float DOLLY_MIN = CAMERA_ZNEAR;
 
@@ -133,9 +160,143 @@ const float LIGHT_OBJECT_SPEED = 80.0f;
 const float LIGHT_RADIUS_MAX = max(max(ROOM_SIZE_X, ROOM_SIZE_Y), ROOM_SIZE_Z) * 1.25f;
 const float LIGHT_RADIUS_MIN = 0.0f;
 
+// Light markers are drawn as the coarsest sphere whose facets cut no more
+// than LIGHT_LOD_MAX_ERROR pixels into its outline, and as a camera facing
+// quad once they are smaller than LIGHT_LOD_IMPOSTOR_RADIUS pixels across.
+const int LIGHT_LOD_SPHERES = 4;
+const int LIGHT_LOD_SEGMENTS[LIGHT_LOD_SPHERES] = {LIGHT_OBJECT_SLICES, 16, 8, 4};
+const int LIGHT_LOD_IMPOSTOR = LIGHT_LOD_SPHERES;
+const int LIGHT_LOD_COUNT = LIGHT_LOD_SPHERES + 1;
+const float LIGHT_LOD_MAX_ERROR = 0.5f;
+const float LIGHT_LOD_IMPOSTOR_RADIUS = 1.0f;
+const float LIGHT_LOD_HYSTERESIS = 0.15f;  // fraction past a switch point needed to coarsen
+
 const int MAX_LIGHTS_SM20 = 2;
 const int MAX_LIGHTS_SM30 = 8;
 
+const float SIMULATION_RATE_HZ = 60.0f;
+const int SIMULATION_MAX_STEPS_PER_FRAME = 8;
+
+const int PIPELINE_MAX_DEPTH = 3;
+const DWORD PIPELINE_WAIT_TIMEOUT_MS = 100;
+
+const int WORKER_MAX_THREADS = 32;
+const int WORKER_MAX_JOBS = 256;
+const int IO_THREADS = 2;
+
+const int IMAGE_MAX_LEVELS = 16;
+
+const int SRGB_ENCODE_TABLE_SIZE = 16384;
+
+const int TEXTURE_LAYOUT_LINEAR = 0;
+const int TEXTURE_LAYOUT_MORTON = 1;
+const int TEXTURE_FILTER_BILINEAR = 0;      // bilinear in the nearest mip level
+const int TEXTURE_FILTER_TRILINEAR = 1;
+const int TEXTURE_FILTER_ANISOTROPIC = 2;   // trilinear taps along the major axis
+const int SAMPLER_MAX_ANISOTROPY = 16;
+
+const int COMPRESS_QUALITY_FAST = 0;       // range fit
+const int COMPRESS_QUALITY_NORMAL = 1;     // plus cluster fit (BC1) or end point refinement (BC7)
+const int COMPRESS_QUALITY_HIGH = 2;       // plus more iterations and, for BC7, every p-bit pair
+const int BC7_INDEX_WEIGHTS[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+// Direct3D 9 has no BC7 format. This one is only used by the encoder.
+const D3DFORMAT FORMAT_BC7 = static_cast<D3DFORMAT>(MAKEFOURCC('B', 'C', '7', ' '));
+
+const DWORD TEXTURE_CACHE_MAGIC = 0x58544342;   // 'BCTX'
+const DWORD TEXTURE_CACHE_VERSION = 1;
+#define TEXTURE_CACHE_EXTENSION ".bctex"
+const int TEXTURE_CACHE_QUALITY = COMPRESS_QUALITY_NORMAL;
+
+const DWORD VIRTUAL_TEXTURE_MAGIC = 0x58455456;     // 'VTEX'
+const DWORD VIRTUAL_TEXTURE_VERSION = 1;
+const int VIRTUAL_PAGE_SIZE = 128;          // texels across a page, not counting its border
+const int VIRTUAL_PAGE_BORDER = 4;          // texels repeated from the neighboring pages on each side
+const int VIRTUAL_PAGE_STRIDE = VIRTUAL_PAGE_SIZE + VIRTUAL_PAGE_BORDER * 2;
+const int VIRTUAL_PHYSICAL_PAGES = 256;
+const int VIRTUAL_MAX_PAGE_LOADS = 32;      // page loads in flight at once
+const int VIRTUAL_FEEDBACK_SCALE = 8;       // screen pixels per feedback pixel, in each direction
+const int VIRTUAL_WALL_TEXTURE_SIZE = 16384;
+const DWORD MESH_CACHE_MAGIC = 0x4853454d;    // 'MESH'
+const DWORD MESH_CACHE_VERSION = 1;
+#define MESH_CACHE_EXTENSION ".mesh"
+const int OBJ_CHUNK_SIZE = 1024 * 1024;     // bytes of OBJ text per parse job
+const float MODEL_FIT_SIZE = 96.0f;         // largest extent of a loaded model in the room
+const int SCENE_LAYOUT_GRID = 0;            // rooms joined to every neighbor by a door
+const int SCENE_LAYOUT_MAZE = 1;            // corridors with exactly one path between any two cells
+const int SCENE_DOOR_NEG_X = 1;
+const int SCENE_DOOR_POS_X = 2;
+const int SCENE_DOOR_NEG_Z = 4;
+const int SCENE_DOOR_POS_Z = 8;
+const float SCENE_DOOR_WIDTH = 64.0f;
+const float SCENE_DOOR_HEIGHT = 96.0f;
+const float SCENE_CORRIDOR_WIDTH = 64.0f;   // corridor cells are open where they join
+const float SCENE_CORRIDOR_HEIGHT = 96.0f;
+const float SCENE_PROP_SIZE_MIN = 8.0f;
+const float SCENE_PROP_SIZE_MAX = 32.0f;
+const float SCENE_TILE_SIZE = ROOM_SIZE_X / ROOM_WALL_TILE_U;  // world units per texture repeat
+const unsigned int SCENE_DEFAULT_SEED = 1;
+const int SCENE_PROPS_PER_ROOM = 4;         // props in each room of a scene given on the command line
+const int OCTREE_MAX_DEPTH = 6;          // deeper nodes cost more to visit than the tests they save
+const int FRUSTUM_PLANES = 6;
+const int FRUSTUM_ALL_PLANES = (1 << FRUSTUM_PLANES) - 1;
+const int OCCLUSION_BUFFER_WIDTH = 256;     // 1080p scaled down 7.5 times
+const int OCCLUSION_BUFFER_HEIGHT = 144;
+const int OCCLUSION_MAX_LEVELS = 10;
+const float OCCLUSION_MIN_OCCLUDER_SIZE = 0.05f;   // smallest occluder size to distance ratio drawn
+const int OCCLUSION_MAX_TEST_TEXELS = 4;   // most texels across a box's rectangle in the level tested
+const float LIGHTMAP_TEXEL_SIZE = 2.0f;     // world units across a lightmap texel
+const int LIGHTMAP_PADDING = 1;            // texels around each chart repeating its edge
+const int LIGHTMAP_FACES = 6;              // directions a surface can face, one chart for each
+const int LIGHTMAP_MAX_SIZE = 2048;
+const int LIGHTMAP_BAND_ROWS = 8;          // rows baked by each job
+const float LIGHTMAP_SHADOW_BIAS = 0.05f;  // how far off the surface shadow rays start
+const int SHADOW_CUBE_FACES = 6;
+const int SHADOW_TILE_SIZE = 128;          // texels across a cube map face, a multiple of 4
+const int SHADOW_ATLAS_TILES = 256;        // faces resident at once, 16 MB at 128x128
+const int SHADOW_FACE_BUDGET = 24;         // most faces drawn in a frame
+const float SHADOW_NEAR_PLANE = 1.0f;
+const float SHADOW_MAX_DISTANCE = 640.0f;  // lights farther from the camera cast no shadows
+const float SHADOW_DEPTH_BIAS = 0.02f;     // fraction of its depth a receiver may be behind a caster and still be lit
+const float SHADOW_NORMAL_OFFSET = 1.5f;   // texels receivers are looked up off their surface
+const int LIGHT_SAMPLES_PER_PIXEL = 4;     // lights sampled per pixel by EstimateLighting()
+const int LIGHT_DENOISE_RADIUS = 2;        // pixels on each side of the denoise filter
+const float LIGHT_DENOISE_DISTANCE = 8.0f; // world units between points that makes them count for 0.6 of each other
+const float LIGHT_HISTORY_WEIGHT = 0.2f;   // share of each new frame in temporally accumulated lighting
+const float LIGHT_CUT_MAX_ERROR = 0.02f;   // share of a point's lighting any one cluster of a light cut may be wrong by; the errors add up
+const int LIGHT_CUT_MAX_SIZE = 1000;       // most clusters in a light cut
+const float IRRADIANCE_CELL_SIZE = 16.0f;  // world units between the irradiance volume's samples
+const int IRRADIANCE_SPLAT_BANDS = 16;     // groups of lights splatted in parallel, each into a grid of its own
+const int IRRADIANCE_REBUILD_UPDATES = 256;    // updates between full rebuilds, which clear rounding drift
+const int LIGHTING_CACHE_REFRESH_TILE = 2;     // one pixel of each tile this many pixels across is shaded afresh each frame
+const int LIGHTING_CACHE_MAX_AGE = 8;          // frames a pixel's lighting may be reused for
+const float LIGHTING_CACHE_DEPTH_TOLERANCE = 0.02f;    // share of its depth a surface may be off by and keep its history
+const float LIGHTING_CACHE_MIN_NORMAL_DOT = 0.9f;     // least cosine between normals that keeps history
+const int MIP_PARALLEL_MIN_PIXELS = 64 * 64;
+const int PARALLEL_FOR_MAX_JOBS = 64;
+
+const int GLYPH_FIRST_CHAR = 32;
+const int GLYPH_LAST_CHAR = 126;
+const int GLYPH_COUNT = GLYPH_LAST_CHAR - GLYPH_FIRST_CHAR + 1;
+const int GLYPH_PADDING = 1;
+const int GLYPH_ATLAS_WIDTH = 256;
+const int GLYPH_TAB_SPACES = 8;
+
+const int HUD_TEXT_MAX_CHARS = 2048;
+const int HUD_TEXT_MAX_VERTICES = HUD_TEXT_MAX_CHARS * 6;
+
+const int ALLOCATION_HEADER_SIZE = 16;
+const int ALLOCATION_MAX_ZONES = 32;
+const int ALLOCATION_MAX_SITES = 1024;      // must be a power of 2
+const int ALLOCATION_REPORT_TOP_SITES = 5;
+const int ALLOCATION_WARMUP_FRAMES = 120;
+
+const size_t FRAME_ARENA_SIZE = 1024 * 1024;
+const size_t FRAME_ARENA_DEFAULT_ALIGNMENT = 16;
+const int FRAME_ARENA_MAX_BUFFERS = 3;
+
+#define BENCHMARK_OUTPUT_FILE "benchmark.txt"
+
 //-----------------------------------------------------------------------------
 // Types.
 //-----------------------------------------------------------------------------
@@ -169,6 +330,317 @@ struct Material
 	float shininess;
 };
 
+struct PackedVertex
+{
+    // A Vertex quantized to half the size. The position is signed
+    // normalized relative to the mesh's bounding box (see
+    // VertexQuantization), and the normal is an octahedral encoding.
+
+    SHORT pos[4];               // D3DDECLTYPE_SHORT4N, w is unused
+    D3DXFLOAT16 texCoord[2];    // D3DDECLTYPE_FLOAT16_2
+    SHORT normal[2];            // D3DDECLTYPE_SHORT2N
+};
+
+struct VertexQuantization
+{
+    // Maps a mesh's bounding box to the -1 to 1 range of packed positions:
+    // position = packed * halfExtent + center.
+
+    float center[3];
+    float halfExtent[3];
+};
+
+struct Mesh
+{
+    // An indexed triangle list in system memory.
+
+    std::vector<Vertex> vertices;
+    std::vector<DWORD> indices;
+};
+
+struct RoomAtlasVertex
+{
+    // Second vertex stream of the room when it's drawn using the atlas.
+
+    float atlasRect[4];     // offset and scale of the surface's tile in the atlas
+    float material;         // index into the effect's material table
+};
+
+struct RoomBatch
+{
+    // One effect Begin()/End() round drawing part of the room.
+
+    int firstIndex;
+    int primitiveCount;
+    const Material *pMaterial;              // 0 when the vertices index the material table
+    IDirect3DTexture9 *const *ppTexture;    // the global holding the color map
+    const char *pszTextureName;             // effect parameter the color map is bound to
+};
+
+struct SubmissionCounters
+{
+    int effectRounds;       // Begin()/End() pairs
+    int drawCalls;
+    int parameterSets;      // effect SetValue()/SetFloat()/SetTexture() calls
+    int textureBinds;
+};
+
+struct AllocationHeader
+{
+    size_t size;
+    int zone;
+};
+
+struct AllocationCounters
+{
+    LONG volatile allocations;
+    LONGLONG volatile bytes;
+};
+
+struct AllocationSite
+{
+    void * volatile pAddress;   // return address of the caller of operator new
+    LONG volatile zone;
+    LONG volatile allocations;
+    LONGLONG volatile bytes;
+};
+
+struct AllocationStats
+{
+    int frames;                     // frames completed since startup
+    LONG startupAllocations;
+    LONGLONG startupBytes;
+    LONG frameStartAllocations;     // counters at the start of the current frame
+    LONGLONG frameStartBytes;
+    int frameAllocations;           // allocations made during the last frame
+    LONGLONG frameBytes;
+    int budgetViolations;
+
+    // Accumulated over one second and then published for the HUD.
+
+    int accumFrames;
+    LONGLONG accumAllocations;
+    LONGLONG accumBytes;
+    int accumMaxAllocations;
+    float allocationsPerFrame;
+    float bytesPerFrame;
+    int maxAllocationsPerFrame;
+};
+
+struct AllocationZone
+{
+    // Attributes all heap allocations made by the current thread to the
+    // named zone for the lifetime of this object. Zones nest. The name must
+    // be a string literal (or otherwise outlive the program).
+
+    AllocationZone(const char *pszName);
+    ~AllocationZone();
+
+    int previousZone;
+};
+
+struct FrameArena
+{
+    // A linear (bump pointer) allocator for transient per-frame data. The
+    // arena owns several buffers that are used round robin, one per frame.
+    // Memory allocated during a frame therefore stays valid for the next
+    // numBuffers - 1 frames, which lets data outlive the frame that created
+    // it while that frame is still being consumed. Nothing is ever freed
+    // individually; a buffer is reset wholesale when it comes around again.
+
+    BYTE *pBuffers[FRAME_ARENA_MAX_BUFFERS];
+    void *pOverflow[FRAME_ARENA_MAX_BUFFERS];   // heap blocks used once a buffer is full
+    size_t capacity;
+    size_t offset;
+    size_t highWaterMark;
+    size_t lastFrameBytes;
+    int numBuffers;
+    int current;
+    int overflows;
+
+    bool create(size_t bufferSize, int buffers);
+    void destroy();
+    void *allocate(size_t size, size_t alignment = FRAME_ARENA_DEFAULT_ALIGNMENT);
+    void nextFrame();
+    void releaseOverflow(int buffer);
+
+    template <typename T>
+    T *allocateArray(size_t count)
+    {
+        return static_cast<T*>(allocate(sizeof(T) * count, __alignof(T)));
+    }
+};
+
+bool FrameArena::create(size_t bufferSize, int buffers)
+{
+    memset(this, 0, sizeof(*this));
+
+    if (buffers < 1 || buffers > FRAME_ARENA_MAX_BUFFERS)
+        return false;
+
+    for (int i = 0; i < buffers; ++i)
+    {
+        if (!(pBuffers[i] = static_cast<BYTE*>(_aligned_malloc(bufferSize, 64))))
+        {
+            destroy();
+            return false;
+        }
+    }
+
+    capacity = bufferSize;
+    numBuffers = buffers;
+    return true;
+}
+
+void FrameArena::destroy()
+{
+    for (int i = 0; i < FRAME_ARENA_MAX_BUFFERS; ++i)
+    {
+        releaseOverflow(i);
+        _aligned_free(pBuffers[i]);
+        pBuffers[i] = 0;
+    }
+
+    numBuffers = 0;
+    capacity = offset = 0;
+}
+
+void *FrameArena::allocate(size_t size, size_t alignment)
+{
+    // The alignment must be a power of 2.
+
+    UINT_PTR base = reinterpret_cast<UINT_PTR>(pBuffers[current]);
+    UINT_PTR aligned = (base + offset + alignment - 1) & ~(alignment - 1);
+
+    if (aligned - base + size <= capacity)
+    {
+        offset = aligned - base + size;
+
+        if (offset > highWaterMark)
+            highWaterMark = offset;
+
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    // The current buffer is full. Fall back to the heap so the caller still
+    // gets valid memory. The block is chained to the buffer and released the
+    // next time the buffer is reset. Overflows are counted so the buffer size
+    // can be tuned.
+
+    size_t headerSize = (sizeof(void*) + alignment - 1) & ~(alignment - 1);
+    BYTE *pBlock = static_cast<BYTE*>(_aligned_malloc(headerSize + size,
+                        (alignment > sizeof(void*)) ? alignment : sizeof(void*)));
+
+    if (!pBlock)
+        return 0;
+
+    *reinterpret_cast<void**>(pBlock) = pOverflow[current];
+    pOverflow[current] = pBlock;
+    ++overflows;
+
+    return pBlock + headerSize;
+}
+
+void FrameArena::nextFrame()
+{
+    lastFrameBytes = offset;
+    current = (current + 1) % numBuffers;
+    offset = 0;
+    releaseOverflow(current);
+}
+
+void FrameArena::releaseOverflow(int buffer)
+{
+    void *pBlock = pOverflow[buffer];
+
+    while (pBlock)
+    {
+        void *pNext = *static_cast<void**>(pBlock);
+
+        _aligned_free(pBlock);
+        pBlock = pNext;
+    }
+
+    pOverflow[buffer] = 0;
+}
+
+template <typename T>
+struct FrameAllocator
+{
+    // Standard library compatible allocator that allocates from a
+    // FrameArena. Deallocation is a no-op. Containers using this allocator
+    // must not outlive the arena buffer they were allocated from.
+
+    typedef T value_type;
+
+    FrameAllocator(FrameArena &arena) : pArena(&arena) {}
+
+    template <typename U>
+    FrameAllocator(const FrameAllocator<U> &other) : pArena(other.pArena) {}
+
+    T *allocate(size_t count)
+    {
+        T *pMemory = pArena->allocateArray<T>(count);
+
+        if (!pMemory)
+            throw std::bad_alloc();
+
+        return pMemory;
+    }
+
+    void deallocate(T *, size_t)
+    {
+    }
+
+    FrameArena *pArena;
+};
+
+template <typename T, typename U>
+bool operator==(const FrameAllocator<T> &lhs, const FrameAllocator<U> &rhs)
+{
+    return lhs.pArena == rhs.pArena;
+}
+
+template <typename T, typename U>
+bool operator!=(const FrameAllocator<T> &lhs, const FrameAllocator<U> &rhs)
+{
+    return lhs.pArena != rhs.pArena;
+}
+
+struct Glyph
+{
+    float texCoord[4];      // left, top, right, bottom
+    int x;                  // position of the glyph's cell in the atlas
+    int y;
+    int width;              // advance width in pixels
+};
+
+struct GlyphAtlas
+{
+    int width;
+    int height;
+    int lineHeight;
+    BYTE *pCoverage;        // width * height 8-bit coverage values
+    Glyph glyphs[GLYPH_COUNT];
+};
+
+struct TextVertex
+{
+    float pos[4];           // pre-transformed x, y, z, rhw
+    D3DCOLOR color;
+    float texCoord[2];
+};
+
+struct TextLayout
+{
+    char text[HUD_TEXT_MAX_CHARS];  // the text the vertices were laid out for
+    int x;
+    int y;
+    D3DCOLOR color;
+    int numQuads;
+    TextVertex vertices[HUD_TEXT_MAX_VERTICES];
+};
+
 struct PointLight
 {
 	float pos[3];
@@ -177,8 +649,11 @@ struct PointLight
 	float specular[4];
 	float radius;
     D3DXVECTOR3 velocity;
+    float prevPos[3];       // position at the previous simulation step
+    float renderPos[3];     // position interpolated between the last two steps
 
     void init();
+    void interpolate(float alpha);
     void update(float elapsedTimeSec);
 };
 
@@ -200,12 +675,28 @@ void PointLight::init()
     velocity.x = rho * cosf(phi) * cosf(theta);
     velocity.y = rho * sinf(phi);
     velocity.z = rho * cosf(phi) * sinf(theta);
+
+    memcpy(prevPos, pos, sizeof(pos));
+    memcpy(renderPos, pos, sizeof(pos));
+}
+
+void PointLight::interpolate(float alpha)
+{
+    // The simulation runs at a fixed rate that is independent of the frame
+    // rate. Render the light part way between its last two simulated
+    // positions so that its motion still appears smooth.
+
+    renderPos[0] = prevPos[0] + (pos[0] - prevPos[0]) * alpha;
+    renderPos[1] = prevPos[1] + (pos[1] - prevPos[1]) * alpha;
+    renderPos[2] = prevPos[2] + (pos[2] - prevPos[2]) * alpha;
 }
 
 void PointLight::update(float elapsedTimeSec)
 {
     // Move the light.
 
+    memcpy(prevPos, pos, sizeof(pos));
+
     pos[0] += velocity.x * elapsedTimeSec;
     pos[1] += velocity.y * elapsedTimeSec;
     pos[2] += velocity.z * elapsedTimeSec;
@@ -233,1635 +724,15695 @@ void PointLight::update(float elapsedTimeSec)
         velocity.z = -velocity.z;
 }
 
-//-----------------------------------------------------------------------------
-// Globals.
-//-----------------------------------------------------------------------------
+struct FrameInput
+{
+    // Input state sampled by the main thread and consumed by the simulation
+    // stage. Protected by g_frameInputLock.
 
-HWND                         g_hWnd;
-HINSTANCE                    g_hInstance;
-D3DPRESENT_PARAMETERS        g_params;
-IDirect3D9                  *g_pDirect3D;
-IDirect3DDevice9            *g_pDevice;
-ID3DXFont                   *g_pFont;
-IDirect3DVertexDeclaration9 *g_pRoomVertexDecl;
-IDirect3DVertexBuffer9      *g_pRoomVertexBuffer;
-IDirect3DTexture9           *g_pNullTexture;
-IDirect3DTexture9           *g_pWallColorTexture;
-IDirect3DTexture9           *g_pCeilingColorTexture;
-IDirect3DTexture9           *g_pFloorColorTexture;
-ID3DXEffect                 *g_pBlinnPhongEffectSM20;
-ID3DXEffect                 *g_pBlinnPhongEffectSM30;
-ID3DXEffect                 *g_pBlinnPhongEffect;
-ID3DXEffect                 *g_pAmbientEffect;
-ID3DXMesh                   *g_pLightMesh;
-D3DCAPS9                     g_caps;
-bool                         g_enableVerticalSync;
-bool                         g_isFullScreen;
-bool                         g_hasFocus;
-bool                         g_displayHelp;
-bool                         g_disableColorMapTexture;
-bool                         g_wireframe;
-bool                         g_animateLights = true;
-bool                         g_renderLights = true;
-bool                         g_enableMultipassLighting;
-bool                         g_supportsShaderModel30;
-DWORD                        g_msaaSamples;
-DWORD                        g_maxAnisotrophy;
-int                          g_framesPerSecond;
-int                          g_windowWidth;
-int                          g_windowHeight;
-int                          g_numLights;
-float                        g_sceneAmbient[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+    D3DXMATRIX viewProjectionMatrix;
+    D3DXVECTOR3 cameraPos;
+    double time;            // when the input was sampled
+    bool animateLights;
+};
 
-Camera g_camera =
+struct FrameSnapshot
 {
-    0.0f,
-    ROOM_SIZE_Z,
-    D3DXVECTOR3(1.0f, 0.0f, 0.0f),
-    D3DXVECTOR3(0.0f, 1.0f, 0.0f),
-    D3DXVECTOR3(0.0f, 0.0f, 1.0f),
-    D3DXVECTOR3(0.0f, 0.0f, 0.0f),
-    D3DXVECTOR3(0.0f, 0.0f, 0.0f),
-    D3DXQUATERNION(0.0f, 0.0f, 0.0f, 1.0f),
-    D3DXMATRIX()
+    // Everything the render stage needs to draw one frame. A snapshot is
+    // built by the simulation stage and is never modified once published.
+
+    D3DXMATRIX viewProjectionMatrix;
+    D3DXVECTOR3 cameraPos;
+    PointLight lights[MAX_LIGHTS_SM30];
+    double inputTime;       // when the input this frame was built from was sampled
+    int frameNumber;
+    bool animateLights;
 };
 
-PointLight g_lights[] =
+struct FramePipeline
 {
-    // 1st point light - WHITE
-    {
-        0.0f, 0.0f, 0.0f,
-        1.0f, 1.0f, 1.0f, 1.0f,
-        1.0f, 1.0f, 1.0f, 1.0f,
-        1.0f, 1.0f, 1.0f, 1.0f,
-        100.0f,
-        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
-    },
+    // A bounded queue of frame snapshots between the simulation thread
+    // (producer) and the main thread (consumer). The depth is the number of
+    // frames the simulation may run ahead of the frame being rendered.
+
+    FrameSnapshot slots[PIPELINE_MAX_DEPTH];
+    HANDLE hThread;
+    HANDLE hFreeSlots;      // semaphore counting slots the producer may fill
+    HANDLE hFilledSlots;    // semaphore counting slots the consumer may read
+    HANDLE hQuitEvent;
+    int depth;              // 0 when frames are simulated and rendered serially
+    int writeIndex;         // only used by the producer
+    int readIndex;          // only used by the consumer
+    LONG volatile framesSimulated;
+};
 
-    // 2nd point light - RED
-    {
-        0.0f, 0.0f, 0.0f,
-        1.0f, 0.0f, 0.0f, 1.0f,
-        1.0f, 0.0f, 0.0f, 1.0f,
-        1.0f, 0.0f, 0.0f, 1.0f,
-        100.0f,
-        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
-    },
+struct WorkerJob
+{
+    void (*pfnRun)(void *pParam);
+    void *pParam;
+};
 
-    // 3rd point light - GREEN
-    {
-        0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f, 1.0f,
-        0.0f, 1.0f, 0.0f, 1.0f,
-        0.0f, 1.0f, 0.0f, 1.0f,
-        100.0f,
-        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
-    },
+struct WorkerPool
+{
+    // A fixed number of threads running jobs from a shared FIFO queue.
+    // Threads that wait for the pool help out by running queued jobs
+    // themselves. A pool without threads runs every job immediately on the
+    // thread that submits it.
+
+    HANDLE hThreads[WORKER_MAX_THREADS];
+    HANDLE hJobsAvailable;      // semaphore signaled once per submitted job
+    HANDLE hJobDone;
+    HANDLE hQuitEvent;
+    CRITICAL_SECTION lock;      // protects the job queue
+    WorkerJob jobs[WORKER_MAX_JOBS];
+    int head;
+    int count;
+    int numThreads;
+    LONG volatile pendingJobs;  // jobs queued or running
+    bool initialized;
+
+    bool create(int threads);
+    void destroy();
+    bool runOne();
+    void submit(void (*pfnRun)(void *pParam), void *pParam);
+    void wait();
+};
 
-    // 4th point light - BLUE
-    {
-        0.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 1.0f,
-        0.0f, 0.0f, 1.0f, 1.0f,
-        0.0f, 0.0f, 1.0f, 1.0f,
-        100.0f,
-        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
-    },
+DWORD WINAPI WorkerThreadProc(LPVOID pParam);
 
-    // 5th point light - YELLOW
-    {
-        0.0f, 0.0f, 0.0f,
-        1.0f, 1.0f, 0.0f, 1.0f,
-        1.0f, 1.0f, 0.0f, 1.0f,
-        1.0f, 1.0f, 0.0f, 1.0f,
-        100.0f,
-        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
-    },
+bool WorkerPool::create(int threads)
+{
+    memset(this, 0, sizeof(*this));
 
-    // 6th point light - CYAN
+    if (threads < 0 || threads > WORKER_MAX_THREADS)
+        return false;
+
+    InitializeCriticalSection(&lock);
+    initialized = true;
+
+    hJobsAvailable = CreateSemaphore(0, 0, 0x7fffffff, 0);
+    hJobDone = CreateEvent(0, FALSE, FALSE, 0);
+    hQuitEvent = CreateEvent(0, TRUE, FALSE, 0);
+
+    if (!hJobsAvailable || !hJobDone || !hQuitEvent)
     {
-        0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 1.0f, 1.0f,
-        0.0f, 1.0f, 1.0f, 1.0f,
-        0.0f, 1.0f, 1.0f, 1.0f,
-        100.0f,
-        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
-    },
+        destroy();
+        return false;
+    }
 
-    // 7th point light - MAGENTA
+    for (; numThreads < threads; ++numThreads)
     {
-        0.0f, 0.0f, 0.0f,
-        1.0f, 0.0f, 1.0f, 1.0f,
-        1.0f, 0.0f, 1.0f, 1.0f,
-        1.0f, 0.0f, 1.0f, 1.0f,
-        100.0f,
-        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
-    },
+        if (!(hThreads[numThreads] = CreateThread(0, 0, WorkerThreadProc, this, 0, 0)))
+        {
+            destroy();
+            return false;
+        }
+    }
 
-    // 8th point light - CORNFLOWER BLUE
+    return true;
+}
+
+void WorkerPool::destroy()
+{
+    if (!initialized)
+        return;
+
+    // Finish whatever is still queued before stopping the threads so that
+    // no job is silently lost.
+
+    wait();
+
+    if (hQuitEvent)
+        SetEvent(hQuitEvent);
+
+    for (int i = 0; i < numThreads; ++i)
     {
-        0.0f, 0.0f, 0.0f,
-        (100.0f / 255.0f), (149.0f / 255.0f), (237.0f / 255.0f), 1.0f,
-        (100.0f / 255.0f), (149.0f / 255.0f), (237.0f / 255.0f), 1.0f,
-        (100.0f / 255.0f), (149.0f / 255.0f), (237.0f / 255.0f), 1.0f,
-        100.0f,
-        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+        WaitForSingleObject(hThreads[i], INFINITE);
+        CloseHandle(hThreads[i]);
+        hThreads[i] = 0;
+    }
+
+    if (hQuitEvent)
+        CloseHandle(hQuitEvent);
+
+    if (hJobDone)
+        CloseHandle(hJobDone);
+
+    if (hJobsAvailable)
+        CloseHandle(hJobsAvailable);
+
+    DeleteCriticalSection(&lock);
+
+    hQuitEvent = hJobDone = hJobsAvailable = 0;
+    numThreads = 0;
+    initialized = false;
+}
+
+bool WorkerPool::runOne()
+{
+    // Runs the oldest queued job on the calling thread. Returns false if the
+    // queue was empty.
+
+    WorkerJob job = {0};
+
+    EnterCriticalSection(&lock);
+
+    if (count > 0)
+    {
+        job = jobs[head];
+        head = (head + 1) % WORKER_MAX_JOBS;
+        --count;
+    }
+
+    LeaveCriticalSection(&lock);
+
+    if (!job.pfnRun)
+        return false;
+
+    job.pfnRun(job.pParam);
+
+    InterlockedDecrement(&pendingJobs);
+    SetEvent(hJobDone);
+    return true;
+}
+
+void WorkerPool::submit(void (*pfnRun)(void *pParam), void *pParam)
+{
+    if (numThreads > 0)
+    {
+        EnterCriticalSection(&lock);
+
+        if (count < WORKER_MAX_JOBS)
+        {
+            WorkerJob &job = jobs[(head + count) % WORKER_MAX_JOBS];
+
+            job.pfnRun = pfnRun;
+            job.pParam = pParam;
+            ++count;
+            InterlockedIncrement(&pendingJobs);
+
+            LeaveCriticalSection(&lock);
+            ReleaseSemaphore(hJobsAvailable, 1, 0);
+            return;
+        }
+
+        LeaveCriticalSection(&lock);
+    }
+
+    // No threads, or the queue is full. Run the job right here.
+
+    pfnRun(pParam);
+}
+
+void WorkerPool::wait()
+{
+    // Blocks until every submitted job has finished, running queued jobs on
+    // the calling thread in the meantime. Jobs submitted by other jobs are
+    // waited for as well.
+
+    while (pendingJobs > 0)
+    {
+        if (!runOne())
+            WaitForSingleObject(hJobDone, 1);
     }
+}
+
+struct ParallelForJob
+{
+    void (*pfnRun)(void *pParam, int begin, int end);
+    void *pParam;
+    int begin;
+    int end;
+    LONG volatile *pRemaining;
 };
 
-Material g_dullMaterial =
+struct MipLevelJob
 {
-    0.2f, 0.2f, 0.2f, 1.0f,
-    0.8f, 0.8f, 0.8f, 1.0f,
-    0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f
+    // Source and destination of one mip level being generated.
+
+    const DWORD *pSrc;
+    int srcWidth;
+    int srcHeight;
+    DWORD *pDst;
+    int dstWidth;
+    int dstHeight;
 };
 
-Material g_shinyMaterial =
+struct Image
 {
-    0.2f, 0.2f, 0.2f, 1.0f,
-    0.8f, 0.8f, 0.8f, 1.0f,
-    0.0f, 0.0f, 0.0f, 1.0f,
-    1.0f, 1.0f, 1.0f, 1.0f,
-    32.0f
+    // A 32-bit BGRA image in system memory with room for its mip chain. The
+    // levels are stored one after another, each one tightly packed.
+
+    int width;
+    int height;
+    int levels;
+    DWORD *pPixels;
+    size_t levelOffsets[IMAGE_MAX_LEVELS];  // in pixels from pPixels
 };
 
-D3DVERTEXELEMENT9 g_roomVertexElements[] =
+struct SoftwareTexture
 {
-    {0,  0, D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0},
-    {0, 12, D3DDECLTYPE_FLOAT2, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0},
-    {0, 20, D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL,   0},
-    D3DDECL_END()
+    // A power of 2 BGRA texture and its mip chain for the software sampler.
+    // With TEXTURE_LAYOUT_MORTON the texels of each level are stored in
+    // Z-order so that texels close together in 2D are close in memory
+    // whichever direction the texture is walked in.
+
+    int width;
+    int height;
+    int widthLog2;
+    int heightLog2;
+    int levels;
+    int layout;
+    DWORD *pTexels;
+    size_t levelOffsets[IMAGE_MAX_LEVELS];  // in texels from pTexels
 };
 
-Vertex g_room[36] =
+struct SampleFootprint
 {
-    // Wall: -Z face
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  0.0f,  1.0f},
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, 0.0f,                    0.0f,  0.0f,  1.0f},
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        0.0f,  0.0f,  1.0f},
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        0.0f,  0.0f,  1.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, ROOM_WALL_TILE_V,                    0.0f,  0.0f,  1.0f},
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  0.0f,  1.0f},
+    // Which mip levels a sample reads and where its taps go, worked out from
+    // the texture coordinate gradients.
+
+    int level0;
+    int level1;
+    float levelWeight;      // of level1
+    int taps;
+    float stepU;            // between taps, in texture coordinates
+    float stepV;
+};
 
-    // Wall: +Z face
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  0.0f, -1.0f},
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, 0.0f,                    0.0f,  0.0f, -1.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        0.0f,  0.0f, -1.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        0.0f,  0.0f, -1.0f},
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, ROOM_WALL_TILE_V,                    0.0f,  0.0f, -1.0f},
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  0.0f, -1.0f},
+struct CompressedImage
+{
+    // A block compressed (DXT1, DXT5 or BC7) image and its mip chain. The blocks
+    // either live in heap memory owned by the image, or in a read only view
+    // of a mapped texture cache file.
+
+    D3DFORMAT format;
+    int width;
+    int height;
+    int levels;
+    const BYTE *pData;
+    DWORD levelOffsets[IMAGE_MAX_LEVELS];   // in bytes from pData
+    DWORD levelSizes[IMAGE_MAX_LEVELS];
+    DWORD dataSize;
+    BYTE *pMemory;          // heap memory owned by the image, if any
+    HANDLE hFile;           // the mapped cache file, if any
+    HANDLE hMapping;
+    const void *pView;
+};
 
-    // Wall: -X face
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                1.0f,  0.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, 0.0f,                    1.0f,  0.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        1.0f,  0.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        1.0f,  0.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, ROOM_WALL_TILE_V,                    1.0f,  0.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                1.0f,  0.0f,  0.0f},
+struct CompressJob
+{
+    const Image *pImage;
+    CompressedImage *pCompressed;
+    int level;
+    int quality;
+};
 
-    // Wall: +X face
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                               -1.0f,  0.0f,  0.0f},
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, 0.0f,                   -1.0f,  0.0f,  0.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,       -1.0f,  0.0f,  0.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,       -1.0f,  0.0f,  0.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, ROOM_WALL_TILE_V,                   -1.0f,  0.0f,  0.0f},
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                               -1.0f,  0.0f,  0.0f},
+struct TextureCacheHeader
+{
+    // Header of a texture cache file. The level data follows it directly,
+    // in the same layout as CompressedImage::pData.
+
+    DWORD magic;
+    DWORD version;
+    ULONGLONG sourceHash;   // of the source image file the cache was built from
+    DWORD format;
+    int width;
+    int height;
+    int levels;
+    DWORD levelOffsets[IMAGE_MAX_LEVELS];
+    DWORD levelSizes[IMAGE_MAX_LEVELS];
+    DWORD dataSize;
+};
 
-    // Ceiling: +Y face
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f, -1.0f,  0.0f},
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_CEILING_TILE_U, 0.0f,                 0.0f, -1.0f,  0.0f},
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_CEILING_TILE_U, ROOM_CEILING_TILE_V,  0.0f, -1.0f,  0.0f},
-    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_CEILING_TILE_U, ROOM_CEILING_TILE_V,  0.0f, -1.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, ROOM_CEILING_TILE_V,                 0.0f, -1.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f, -1.0f,  0.0f},
+struct ObjCorner
+{
+    // One corner of an OBJ face with its indices made 0-based. A negative
+    // (relative) OBJ index can't be resolved until the chunks before it have
+    // been counted, so until then it is kept relative to its own chunk.
 
-    // Floor: -Y face
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  1.0f,  0.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_FLOOR_TILE_U, 0.0f,                   0.0f,  1.0f,  0.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_FLOOR_TILE_U, ROOM_FLOOR_TILE_V,      0.0f,  1.0f,  0.0f},
-    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_FLOOR_TILE_U, ROOM_FLOOR_TILE_V,      0.0f,  1.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, ROOM_FLOOR_TILE_V,                   0.0f,  1.0f,  0.0f},
-    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  1.0f,  0.0f}
+    int index[3];           // position, texture coordinate, normal
+    BYTE present;           // bit c set if index[c] was given
+    BYTE relative;          // bit c set if index[c] is relative to the chunk
 };
 
-//-----------------------------------------------------------------------------
-// Function Prototypes.
-//-----------------------------------------------------------------------------
+struct ObjChunk
+{
+    // A run of whole lines of an OBJ file and what parsing them produced.
+    // Each face is already split into triangles, 3 corners apiece.
+
+    const char *pBegin;
+    const char *pEnd;
+    std::vector<float> positions;       // 3 floats each
+    std::vector<float> texCoords;       // 2 floats each
+    std::vector<float> normals;         // 3 floats each
+    std::vector<ObjCorner> corners;
+    int positionBase;                   // counts in the chunks before this one
+    int texCoordBase;
+    int normalBase;
+    size_t firstCorner;
+};
 
-void    ChooseBestMSAAMode(D3DFORMAT backBufferFmt, D3DFORMAT depthStencilFmt,
-                           BOOL windowed, D3DMULTISAMPLE_TYPE &type,
-                           DWORD &qualityLevels, DWORD &samplesPerPixel);
-void    Cleanup();
-void    CleanupApp();
-HWND    CreateAppWindow(const WNDCLASSEX &wcl, const char *pszTitle);
-bool    CreateNullTexture(int width, int height, LPDIRECT3DTEXTURE9 &pTexture);
-bool    DeviceIsValid();
-float   GetElapsedTimeInSeconds();
-bool    Init();
-void    InitApp();
-bool    InitD3D();
-bool    InitFont(const char *pszFont, int ptSize, LPD3DXFONT &pFont);
-void    InitRoom();
-bool    LoadShader(const char *pszFilename, LPD3DXEFFECT &pEffect);
-void    Log(const char *pszMessage);
-bool    MSAAModeSupported(D3DMULTISAMPLE_TYPE type, D3DFORMAT backBufferFmt,
-                          D3DFORMAT depthStencilFmt, BOOL windowed,
-                          DWORD &qualityLevels);
-void    ProcessMouseInput(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
-void    RenderFrame();
-void    RenderRoomUsingBlinnPhong();
-void    RenderLight(int i);
-void    RenderText();
-bool    ResetDevice();
-void    SetProcessorAffinity();
-void    ToggleFullScreen();
-void    UpdateFrame(float elapsedTimeSec);
-void    UpdateFrameRate(float elapsedTimeSec);
-void    UpdateEffects();
-void    UpdateLights(float elapsedTimeSec);
-LRESULT CALLBACK WindowProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
+struct ObjParseJob
+{
+    ObjChunk *pChunks;
+    const float *pPositions;
+    const float *pTexCoords;
+    const float *pNormals;
+    int positionCount;
+    int texCoordCount;
+    int normalCount;
+    Vertex *pTriangles;
+    LONG volatile failed;
+};
+
+struct CookedMesh
+{
+    // An indexed mesh laid out the way it is stored in a mesh cache file:
+    // the vertices, then 32-bit indices. The data either lives in heap
+    // memory owned by the mesh, or in a read only view of a mapped mesh
+    // cache file.
+
+    const Vertex *pVertices;
+    const DWORD *pIndices;
+    DWORD vertexCount;
+    DWORD indexCount;
+    float boundsMin[3];
+    float boundsMax[3];
+    size_t dataSize;
+    BYTE *pMemory;          // heap memory owned by the mesh, if any
+    HANDLE hFile;           // the mapped cache file, if any
+    HANDLE hMapping;
+    const void *pView;
+};
+
+struct MeshCacheHeader
+{
+    // Header of a mesh cache file. The data follows it directly, in the same
+    // layout as CookedMesh. The OBJ file's size and time stamp stand in for
+    // a hash of it, which for a large file would take longer to compute
+    // than mapping the cache.
+
+    DWORD magic;
+    DWORD version;
+    ULONGLONG sourceSize;
+    ULONGLONG sourceTime;
+    DWORD vertexCount;
+    DWORD indexCount;
+    float boundsMin[3];
+    float boundsMax[3];
+};
+
+struct SceneDesc
+{
+    // What GenerateScene() builds. The same description always gives the
+    // same scene.
+
+    int layout;             // SCENE_LAYOUT_*
+    int rooms;
+    int props;              // shared out evenly between the rooms
+    int lights;             // shared out evenly between the rooms
+    unsigned int seed;
+};
+
+struct SceneChunk
+{
+    // A run of a scene's vertices drawn with one room surface's material and
+    // color map, and the box bounding them.
+
+    float boundsMin[3];
+    float boundsMax[3];
+    int firstVertex;
+    int vertexCount;
+    int surface;            // ROOM_SURFACE_*, props are drawn like the walls
+    int room;
+};
+
+struct SceneRoom
+{
+    // One cell of a generated scene. Its walls, ceiling, floor and props are
+    // chunks [firstChunk, firstChunk + chunkCount) of the scene.
+
+    float center[3];
+    int doors;              // SCENE_DOOR_* bits of the walls with an opening
+    int firstVertex;
+    int vertexCount;
+    int firstChunk;
+    int chunkCount;
+    int propCount;
+    int firstLight;
+    int lightCount;
+};
+
+struct Scene
+{
+    // A generated world of rooms laid out roomsWide to a row on the XZ
+    // plane. The vertices use the room's layout and are a triangle list.
+
+    SceneDesc desc;
+    int roomsWide;
+    float cellSize[3];
+    float doorSize[2];      // width and height of the opening in a wall with a door
+    float boundsMin[3];
+    float boundsMax[3];
+    std::vector<SceneRoom> rooms;
+    std::vector<SceneChunk> chunks;
+    std::vector<Vertex> vertices;
+    std::vector<PointLight> lights;
+};
+
+struct SceneJob
+{
+    Scene *pScene;
+    bool write;             // false to only count each room's vertices and chunks
+};
+
+struct OctreeNode
+{
+    // A node of a loose octree. The node's cell is the cube centered on
+    // center and halfSize * 2 across, but the items stored in it may stick
+    // out of the cell by up to halfSize, so only the loose cube twice the
+    // cell's size bounds them.
+
+    float center[3];
+    float halfSize;
+    int depth;
+    int cell[3];            // position of the cell among those of its depth
+    int parent;             // -1 for the root, the next free node when unused
+    int children[8];        // -1 where there is no child
+    int firstItem;          // head of the list of items stored in this node
+    int itemCount;          // items stored in this node and in all of its descendants
+    int lastCulledPlane;    // frustum plane that culled the node last, tested first
+};
+
+struct OctreeItem
+{
+    float boundsMin[3];
+    float boundsMax[3];
+    int node;               // -1 when the item isn't in the tree
+    int prev;
+    int next;               // the next free item when unused
+    int value;              // what the item stands for, for example a scene chunk
+    int lastCulledPlane;
+};
+
+struct Octree
+{
+    // A loose octree over boxes. An item is stored in the deepest node
+    // whose cell is at least as big as the item and contains its center,
+    // which is found from the item's bounds alone. Nodes are only kept
+    // while they or their descendants hold items.
+
+    float center[3];
+    float halfSize;
+    std::vector<OctreeNode> nodes;      // nodes[0] is the root
+    std::vector<OctreeItem> items;
+    int freeNode;
+    int freeItem;
+};
+
+struct OctreeBuildJob
+{
+    // Shared by the passes of BuildSceneOctree(). Each of the root's
+    // octants is built on its own into octantNodes, with child indices
+    // relative to the octant, and then copied into the tree.
+
+    Octree *pTree;
+    const Scene *pScene;
+    std::vector<int> depths;
+    std::vector<int> cells;                 // 3 per item
+    std::vector<int> octantItems[8];
+    std::vector<OctreeNode> octantNodes[8];
+    int octantFirstNode[8];
+};
+
+struct OctreeCullStats
+{
+    int nodesVisited;
+    int nodesCulled;
+    int itemsTested;        // items tested against the frustum one by one
+    int itemsVisible;
+    int itemsCulled;
+};
+
+struct Occluder
+{
+    float boundsMin[3];
+    float boundsMax[3];
+    int firstVertex;
+    int vertexCount;
+};
+
+struct OccluderSet
+{
+    // Triangles that hide what is behind them, kept in system memory for
+    // the occlusion rasterizer. The vertices are a triangle list.
+
+    std::vector<Occluder> occluders;
+    std::vector<D3DXVECTOR3> positions;
+};
+
+struct OcclusionBuffer
+{
+    // A small depth buffer that occluders are rasterized into, with the
+    // levels of its hierarchical Z pyramid stored after it. Depth is stored
+    // as 1 / w, which is 0 infinitely far away, interpolates linearly in
+    // screen space and, unlike z / w with the camera's near plane, keeps
+    // its precision across the scene. Level 0 holds the nearest occluder's
+    // depth at each pixel, and each texel of a higher level the farthest
+    // depth of the 2x2 texels below it. Level 0 rows are 16 byte aligned.
+
+    int width;              // a multiple of 4
+    int height;
+    int levels;
+    int levelWidths[OCCLUSION_MAX_LEVELS];
+    int levelHeights[OCCLUSION_MAX_LEVELS];
+    size_t levelOffsets[OCCLUSION_MAX_LEVELS];  // in texels from pDepth
+    float *pDepth;
+    D3DXMATRIX viewProjection;
+};
+
+struct OcclusionStats
+{
+    int occluders;          // rasterized this frame
+    int triangles;
+    int objectsTested;
+    int objectsOccluded;
+    int lightsTested;
+    int lightsOccluded;
+    float rasterizeTimeMs;
+};
+
+struct OcclusionJob
+{
+    // Rasterizes a frame's occluders on a worker thread while the thread
+    // that started it gets on with the frame.
+
+    const OccluderSet *pOccluders;
+    OcclusionBuffer *pBuffer;
+    D3DXMATRIX viewProjection;
+    D3DXVECTOR3 cameraPos;
+    OcclusionStats stats;
+    LONG volatile done;
+    bool pending;           // started and not yet waited for
+};
+
+struct LightmapChart
+{
+    // A flat surface's rectangle in a lightmap, LIGHTMAP_PADDING texels
+    // bigger on each side than the surface. The surface lies in a plane
+    // facing along one of the axes, and its texels are laid out along the
+    // other two, uAxis and vAxis, starting from origin.
+
+    float origin[3];        // the surface's corner nearest minus infinity
+    float normal[3];
+    float size[2];          // along uAxis and vAxis
+    int uAxis;
+    int vAxis;
+    int x;
+    int y;
+    int width;
+    int height;
+    int surface;            // ROOM_SURFACE_*
+    bool used;
+};
+
+struct Lightmap
+{
+    // Light baked into texels covering the surfaces of a mesh. Every
+    // direction a surface can face has its own chart, chosen with
+    // GetLightmapFace().
+
+    int width;
+    int height;
+    float texelSize;        // in world units
+    LightmapChart charts[LIGHTMAP_FACES];
+    std::vector<int> texelCharts;   // -1 for texels outside every chart
+    std::vector<float> texels;      // RGBA, rows from the top
+};
+
+struct LightmapBake;
+
+struct LightmapBakeBand
+{
+    LightmapBake *pBake;
+    int firstRow;
+    int rowCount;
+    int raysTraced;
+    double endTime;
+};
+
+struct LightmapBake
+{
+    // Lights being baked into a lightmap by the worker pool, a band of
+    // rows per job. Shadows are traced against the occluder triangles,
+    // which are items of an octree, when there are any.
+
+    Lightmap *pLightmap;
+    const Material *pMaterials[ROOM_SURFACE_COUNT];
+    const Octree *pOccluders;                   // 0 to bake without shadows
+    const D3DXVECTOR3 *pOccluderTriangles;      // 3 vertices per item of the octree
+    float ambient[4];
+    PointLight lights[MAX_LIGHTS_SM30];
+    int numLights;
+    ULONGLONG lightsHash;   // of the lights being baked, as given to StartLightmapBake()
+    std::vector<LightmapBakeBand> bands;
+    LONG volatile remainingBands;
+    LONG volatile cancel;
+    double startTime;
+    float bakeTimeMs;       // of the last bake to finish
+    int raysTraced;
+    bool pending;           // started and not yet waited for
+};
+
+struct ShadowFace
+{
+    // One face of a light's cube shadow map. A face is out of date from
+    // when its light moves or a caster in front of it changes until it is
+    // drawn again, and until then is looked up as it was drawn.
+
+    D3DXMATRIX viewProjection;      // from where the light is now, for the next time the face is drawn
+    D3DXMATRIX drawnViewProjection; // the face's depth was drawn with
+    int tile;               // -1 when the face isn't resident in the atlas
+    int dirtyFrame;         // frame the face went out of date, -1 when it is up to date
+};
+
+struct ShadowLight
+{
+    // The cube shadow map of a point light. Faces look along +X, -X, +Y,
+    // -Y, +Z and -Z, the directions GetLightmapFace() picks between, and
+    // reach as far as the light does.
+
+    float pos[3];
+    float radius;
+    ShadowFace faces[SHADOW_CUBE_FACES];
+};
+
+struct ShadowCache
+{
+    // Cube shadow maps for many lights sharing an atlas of square depth
+    // tiles, one cube map face per tile. Only faces that can light what is
+    // in view are kept resident, and of those only the ones out of date are
+    // drawn again, a budgeted number per frame. Tiles are stored one after
+    // another rather than in rows of the atlas so that each is a depth
+    // buffer the occlusion rasterizer can draw into. Depth is stored as
+    // 1 / w of the nearest caster, as in OcclusionBuffer.
+
+    int tileSize;
+    int maxTiles;
+    float *pTexels;                 // maxTiles tiles of tileSize * tileSize texels
+    std::vector<int> tileFaces;     // light * SHADOW_CUBE_FACES + face, -1 when free
+    std::vector<int> tileLastUsed;  // last frame the tile's face was needed
+    std::vector<int> freeTiles;
+    std::vector<ShadowLight> lights;
+    std::vector<std::pair<float, int> > candidates;   // faces that want drawing, by priority
+    std::vector<int> updates;       // faces drawn this frame
+    const OccluderSet *pCasters;
+    int frame;
+};
+
+struct ShadowStats
+{
+    int facesNeeded;        // faces of lights in view that face the view
+    int facesUpdated;       // drawn this frame
+    int facesStale;         // needed and resident, but left out of date by the budget
+    int facesMissing;       // needed, but not resident
+    int tilesEvicted;
+    float updateTimeMs;
+};
+
+struct LightTreeNode
+{
+    // A cluster of lights: the box around their render positions, the
+    // largest of their radii and the sums of their colors' channels, which
+    // bound how much the lights can add to a point. Leaves hold a single
+    // light.
+
+    float boundsMin[3];
+    float boundsMax[3];
+    float radius;
+    float ambientPower;     // of the lights' ambient colors
+    float diffusePower;
+    float specularPower;
+    int children[2];        // -1 for a leaf
+    int light;              // the leaf's light, -1 for an inner node
+};
+
+struct LightTree
+{
+    // A binary tree of light clusters over an array of lights, split at
+    // the median along the longest axis of each cluster's box. Each
+    // cluster also has a light standing in for all of its lights: one of
+    // them, picked in proportion to its power, with their colors summed.
+
+    const PointLight *pLights;
+    std::vector<LightTreeNode> nodes;   // nodes[0] is the root
+    std::vector<PointLight> clusterLights;      // one for each node
+    std::vector<std::pair<float, int> > order;  // lights keyed along the axis split while building
+    unsigned int seed;                  // picks the clusters' representative lights while building
+};
+
+struct IrradianceVolume
+{
+    // The ambient term of many lights, the sum of each light's ambient
+    // color times its attenuation, sampled at the corners of a grid of
+    // cells and interpolated in between. The term has no direction, so a
+    // corner only needs the constant band of spherical harmonics, a
+    // color. Updates only splat the lights that changed, first taking out
+    // what they added before.
+
+    float origin[3];            // the first corner
+    float cellSize;
+    int corners[3];             // along each axis
+    std::vector<float> colors;  // 4 for each corner, x fastest, then y and z
+    std::vector<PointLight> splatted;   // each light as it was last splatted
+    std::vector<int> changed;   // lights being splatted by the current update
+    std::vector<float> bandColors;      // a grid of changes for each band of them
+    const PointLight *pLights;
+    int bandSize;               // lights in each band
+    int updates;                // since the grid was last rebuilt
+    bool rebuild;               // nothing to take out, the grid was cleared
+};
+
+struct LightingCache
+{
+    // The last frame's lighting of each pixel, the surface the pixel saw
+    // and the view projection it was seen with, for the next frame to
+    // reproject. Pixels that find the same surface there reuse its
+    // lighting, but for those of a rotating pattern that are shaded
+    // afresh each frame, so moving lights show up a few frames later.
+
+    int width;
+    int height;
+    int frame;
+    bool valid;                     // there is a last frame
+    D3DXMATRIX viewProjection;      // the last frame's
+    std::vector<float> colors;      // 4 for each of the last frame's pixels
+    std::vector<float> positions;   // 3 for each
+    std::vector<float> normals;     // 3 for each
+    std::vector<int> ages;          // frames since each was shaded
+    std::vector<int> nextAges;      // the same for the current frame's pixels
+};
+
+struct VirtualTextureHeader
+{
+    // Header of a virtual texture page file. The pages follow it directly,
+    // level by level and row by row within a level. Every page is the same
+    // size, so a page's place in the file follows from its index.
+
+    DWORD magic;
+    DWORD version;
+    DWORD format;           // of the pages
+    int width;
+    int height;
+    int levels;
+    int pageSize;
+    int pageBorder;
+    DWORD pageBytes;
+};
+
+struct VirtualCookJob
+{
+    const Image *pSource;
+    int width;              // of level 0 of the virtual texture
+    int height;
+    int level;
+    int pageY;
+    DWORD pageBytes;
+    BYTE *pPages;           // one row of compressed pages
+};
+
+struct VirtualTextureStats
+{
+    // Counted by UpdateVirtualTexture() since the stats were last cleared.
+
+    int updates;
+    int pagesRequested;     // distinct pages the feedback asked for
+    int pageHits;           // already resident
+    int pageMisses;
+    int loadsStarted;
+    int loadsDeferred;      // no free load, so asked for again next update
+    int pagesLoaded;
+    int pagesEvicted;
+    ULONGLONG bytesStreamed;
+};
+
+struct VirtualPageLoad
+{
+    // A page being read and decompressed on an I/O thread.
+
+    const struct VirtualTexture *pTexture;
+    int page;               // -1 when the load isn't in use
+    LONG volatile done;
+    bool succeeded;
+    DWORD *pTexels;         // VIRTUAL_PAGE_STRIDE x VIRTUAL_PAGE_STRIDE texels
+};
+
+struct VirtualTexture
+{
+    // A texture too large to keep in memory, streamed a page at a time from
+    // a page file. The page table maps each virtual page to a slot of a
+    // fixed size physical page cache, or to nothing. Slots are reused least
+    // recently used first, except for those holding the mip tail (the
+    // levels that fit in a single page), which are loaded up front and
+    // never evicted so that every sample finds something.
+    //
+    // Missing pages are read on the load pool. The page table and cache are
+    // only changed by UpdateVirtualTexture(), on the thread that samples
+    // the texture, so sampling needs no locks.
+
+    HANDLE hFile;
+    VirtualTextureHeader header;
+    WorkerPool *pLoadPool;
+    int levelFirstPage[IMAGE_MAX_LEVELS];
+    int levelPagesWide[IMAGE_MAX_LEVELS];
+    int levelPagesHigh[IMAGE_MAX_LEVELS];
+    int pageCount;
+    int *pPageTable;        // slot of each virtual page, or -1
+    bool *pPageLoading;
+    bool *pPageRequested;   // scratch for GetVirtualPagesFromFeedback()
+    DWORD *pPhysical;       // VIRTUAL_PHYSICAL_PAGES pages of VIRTUAL_PAGE_STRIDE squared texels
+    int slotPages[VIRTUAL_PHYSICAL_PAGES];  // virtual page in each slot, or -1
+    int slotPrev[VIRTUAL_PHYSICAL_PAGES];   // LRU list, most recently used first
+    int slotNext[VIRTUAL_PHYSICAL_PAGES];
+    int lruHead;
+    int lruTail;
+    int tailSlots;          // slots [0, tailSlots) hold the mip tail
+    VirtualPageLoad loads[VIRTUAL_MAX_PAGE_LOADS];
+    VirtualTextureStats stats;
+};
+
+struct VirtualFeedbackSample
+{
+    // What one feedback pixel needs: a texture coordinate and the finest
+    // mip level its filter would read.
+
+    float u;
+    float v;
+    int level;
+};
+
+struct TextureLoad
+{
+    // A texture loaded in the background. The file is read on an I/O thread
+    // and then decoded and mipmapped on a worker thread. Only the upload of
+    // the finished image into a Direct3D texture happens on the main thread.
+    //
+    // When the texture cache is in use, a cache file whose hash matches the
+    // source file is mapped instead and nothing is decoded. Otherwise the
+    // decoded image is block compressed and a new cache file written.
+
+    const char *pszFilename;
+    char szCacheFilename[MAX_PATH];
+    WorkerPool *pDecodePool;
+    std::vector<BYTE> fileData;
+    ULONGLONG sourceHash;
+    Image image;
+    CompressedImage compressed;
+    bool useCache;
+    bool fromCache;
+    bool succeeded;
+};
+
+struct ShaderCompile
+{
+    // An effect compiled in the background. Creating the effect from the
+    // compiled code requires the device and so happens on the main thread.
+
+    const char *pszFilename;
+    ID3DXBuffer *pEffectCode;
+    ID3DXBuffer *pErrors;
+};
+
+//-----------------------------------------------------------------------------
+// Globals.
+//-----------------------------------------------------------------------------
+
+HWND                         g_hWnd;
+HINSTANCE                    g_hInstance;
+D3DPRESENT_PARAMETERS        g_params;
+IDirect3D9                  *g_pDirect3D;
+IDirect3DDevice9            *g_pDevice;
+ID3DXFont                   *g_pFont;
+IDirect3DVertexDeclaration9 *g_pRoomVertexDecl;
+IDirect3DVertexBuffer9      *g_pRoomVertexBuffer;
+IDirect3DIndexBuffer9       *g_pRoomIndexBuffer;
+IDirect3DVertexDeclaration9 *g_pRoomPackedVertexDecl;
+IDirect3DVertexDeclaration9 *g_pRoomPackedAtlasVertexDecl;
+IDirect3DVertexBuffer9      *g_pRoomPackedVertexBuffer;
+IDirect3DVertexDeclaration9 *g_pRoomAtlasVertexDecl;
+IDirect3DVertexBuffer9      *g_pModelVertexBuffer;
+IDirect3DIndexBuffer9       *g_pModelIndexBuffer;
+IDirect3DVertexBuffer9      *g_pRoomAtlasVertexBuffer;
+IDirect3DTexture9           *g_pRoomAtlasTexture;
+IDirect3DTexture9           *g_pNullTexture;
+IDirect3DTexture9           *g_pWallColorTexture;
+IDirect3DTexture9           *g_pCeilingColorTexture;
+IDirect3DTexture9           *g_pFloorColorTexture;
+IDirect3DTexture9           *g_pGlyphAtlasTexture;
+ID3DXEffect                 *g_pBlinnPhongEffectSM20;
+ID3DXEffect                 *g_pBlinnPhongEffectSM30;
+ID3DXEffect                 *g_pBlinnPhongEffect;
+ID3DXEffect                 *g_pAmbientEffect;
+ID3DXMesh                   *g_pLightMeshes[LIGHT_LOD_SPHERES];
+IDirect3DVertexDeclaration9 *g_pLightImpostorVertexDecl;
+IDirect3DVertexBuffer9      *g_pLightImpostorVertexBuffer;
+IDirect3DVertexBuffer9      *g_pSceneVertexBuffer;
+D3DCAPS9                     g_caps;
+bool                         g_enableVerticalSync;
+bool                         g_isFullScreen;
+bool                         g_hasFocus;
+bool                         g_displayAllocations;
+bool                         g_displayHelp;
+bool                         g_disableColorMapTexture;
+bool                         g_wireframe;
+bool                         g_animateLights = true;
+bool                         g_renderLights = true;
+bool                         g_enableMultipassLighting;
+bool                         g_failOnAllocationBudget;
+bool                         g_runBenchmarks;
+bool                         g_fixedRandomSeed;
+bool                         g_supportsShaderModel30;
+bool                         g_useGlyphAtlasText = true;
+bool                         g_serialLoading;
+bool                         g_useTextureCache = true;
+bool                         g_useRoomAtlas = true;
+bool                         g_usePackedVertices = true;
+bool                         g_modelFromCache;
+bool                         g_useSceneOctree = true;
+bool                         g_useOcclusionCulling = true;
+DWORD                        g_msaaSamples;
+DWORD                        g_maxAnisotrophy;
+int                          g_framesPerSecond;
+int                          g_windowWidth;
+int                          g_windowHeight;
+int                          g_numLights;
+int                          g_allocationBudget;
+int                          g_simulationSteps;
+int                          g_simulationStepsDropped;
+int                          g_pipelineDepth;
+int                          g_simulatedFramesPerSecond;
+int                          g_lightLods[MAX_LIGHTS_SM30];
+int                          g_lightTriangles;
+int                          g_sceneVisibleChunks;
+int                          g_sceneDrawCalls;
+unsigned int                 g_randomSeed;
+float                        g_sceneAmbient[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+float                        g_roomAtlasRects[ROOM_SURFACE_COUNT][4];
+float                        g_srgbToLinear[256];
+BYTE                         g_linearToSrgb[SRGB_ENCODE_TABLE_SIZE];
+float                        g_simulationTimestep = 1.0f / SIMULATION_RATE_HZ;
+double                       g_simulationAccumulator;
+float                        g_textTimeMs;
+double                       g_textTimeAccumMs;
+int                          g_textTimeSamples;
+float                        g_inputLatencyMs;
+float                        g_assetLoadTimeMs;
+int                          g_texturesFromCache;
+UINT                         g_modelVertexCount;
+UINT                         g_modelTriangleCount;
+float                        g_modelLoadTimeMs;
+float                        g_timeToFirstFrameMs;
+double                       g_startupTime;
+double                       g_inputLatencyAccumMs;
+int                          g_inputLatencySamples;
+GlyphAtlas                   g_glyphAtlas;
+TextLayout                   g_hudLayout;
+AllocationStats              g_allocationStats;
+SubmissionCounters           g_roomSubmissions;
+Mesh                         g_roomMesh;
+Scene                        g_scene;
+SceneDesc                    g_sceneDesc;
+Octree                       g_sceneOctree;
+OctreeCullStats              g_sceneCullStats;
+OccluderSet                  g_sceneOccluders;
+OcclusionBuffer              g_occlusionBuffer;
+OcclusionJob                 g_occlusionJob;
+OcclusionStats               g_occlusionStats;
+Lightmap                     g_lightmap;
+LightmapBake                 g_lightmapBake;
+IDirect3DTexture9           *g_pLightmapTexture;
+bool                         g_useLightmap = true;
+bool                         g_lightmapActive;
+ULONGLONG                    g_lightmapHash;
+std::vector<D3DXVECTOR3>     g_modelTriangles;
+Octree                       g_modelOctree;
+VertexQuantization           g_roomQuantization;
+FrameArena                   g_frameArena;
+FrameInput                   g_frameInput;
+FrameSnapshot                g_renderFrame;
+FramePipeline                g_framePipeline;
+CRITICAL_SECTION             g_frameInputLock;
+WorkerPool                   g_ioPool;
+WorkerPool                   g_workerPool;
+FILE                        *g_pBenchmarkFile;
+std::string                  g_benchmarkFilter;
+std::string                  g_modelFilename;
+
+// Heap allocation tracking. These are updated from operator new and
+// operator delete, possibly before any constructors have run, so they are
+// all plain zero initialized data.
+
+AllocationCounters           g_allocations;
+AllocationCounters           g_zoneAllocations[ALLOCATION_MAX_ZONES];
+AllocationSite               g_allocationSites[ALLOCATION_MAX_SITES];
+const char                  *g_allocationZoneNames[ALLOCATION_MAX_ZONES] = {"Unattributed"};
+LONG volatile                g_numAllocationZones = 1;
+LONG volatile                g_allocationZoneLock;
+LONGLONG volatile            g_liveHeapBytes;
+LONGLONG volatile            g_peakHeapBytes;
+__declspec(thread) int       g_currentAllocationZone;
+
+Camera g_camera =
+{
+    0.0f,
+    ROOM_SIZE_Z,
+    D3DXVECTOR3(1.0f, 0.0f, 0.0f),
+    D3DXVECTOR3(0.0f, 1.0f, 0.0f),
+    D3DXVECTOR3(0.0f, 0.0f, 1.0f),
+    D3DXVECTOR3(0.0f, 0.0f, 0.0f),
+    D3DXVECTOR3(0.0f, 0.0f, 0.0f),
+    D3DXQUATERNION(0.0f, 0.0f, 0.0f, 1.0f),
+    D3DXMATRIX()
+};
+
+PointLight g_lights[] =
+{
+    // 1st point light - WHITE
+    {
+        0.0f, 0.0f, 0.0f,
+        1.0f, 1.0f, 1.0f, 1.0f,
+        1.0f, 1.0f, 1.0f, 1.0f,
+        1.0f, 1.0f, 1.0f, 1.0f,
+        100.0f,
+        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+    },
+
+    // 2nd point light - RED
+    {
+        0.0f, 0.0f, 0.0f,
+        1.0f, 0.0f, 0.0f, 1.0f,
+        1.0f, 0.0f, 0.0f, 1.0f,
+        1.0f, 0.0f, 0.0f, 1.0f,
+        100.0f,
+        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+    },
+
+    // 3rd point light - GREEN
+    {
+        0.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 0.0f, 1.0f,
+        0.0f, 1.0f, 0.0f, 1.0f,
+        0.0f, 1.0f, 0.0f, 1.0f,
+        100.0f,
+        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+    },
+
+    // 4th point light - BLUE
+    {
+        0.0f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 1.0f,
+        0.0f, 0.0f, 1.0f, 1.0f,
+        0.0f, 0.0f, 1.0f, 1.0f,
+        100.0f,
+        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+    },
+
+    // 5th point light - YELLOW
+    {
+        0.0f, 0.0f, 0.0f,
+        1.0f, 1.0f, 0.0f, 1.0f,
+        1.0f, 1.0f, 0.0f, 1.0f,
+        1.0f, 1.0f, 0.0f, 1.0f,
+        100.0f,
+        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+    },
+
+    // 6th point light - CYAN
+    {
+        0.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 1.0f, 1.0f,
+        0.0f, 1.0f, 1.0f, 1.0f,
+        0.0f, 1.0f, 1.0f, 1.0f,
+        100.0f,
+        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+    },
+
+    // 7th point light - MAGENTA
+    {
+        0.0f, 0.0f, 0.0f,
+        1.0f, 0.0f, 1.0f, 1.0f,
+        1.0f, 0.0f, 1.0f, 1.0f,
+        1.0f, 0.0f, 1.0f, 1.0f,
+        100.0f,
+        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+    },
+
+    // 8th point light - CORNFLOWER BLUE
+    {
+        0.0f, 0.0f, 0.0f,
+        (100.0f / 255.0f), (149.0f / 255.0f), (237.0f / 255.0f), 1.0f,
+        (100.0f / 255.0f), (149.0f / 255.0f), (237.0f / 255.0f), 1.0f,
+        (100.0f / 255.0f), (149.0f / 255.0f), (237.0f / 255.0f), 1.0f,
+        100.0f,
+        D3DXVECTOR3(0.0f, 0.0f, 0.0f)
+    }
+};
+
+Material g_dullMaterial =
+{
+    0.2f, 0.2f, 0.2f, 1.0f,
+    0.8f, 0.8f, 0.8f, 1.0f,
+    0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f
+};
+
+Material g_shinyMaterial =
+{
+    0.2f, 0.2f, 0.2f, 1.0f,
+    0.8f, 0.8f, 0.8f, 1.0f,
+    0.0f, 0.0f, 0.0f, 1.0f,
+    1.0f, 1.0f, 1.0f, 1.0f,
+    32.0f
+};
+
+D3DVERTEXELEMENT9 g_lightImpostorVertexElements[] =
+{
+    {0, 0, D3DDECLTYPE_FLOAT2, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0},
+    D3DDECL_END()
+};
+
+D3DVERTEXELEMENT9 g_roomVertexElements[] =
+{
+    {0,  0, D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0},
+    {0, 12, D3DDECLTYPE_FLOAT2, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0},
+    {0, 20, D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL,   0},
+    D3DDECL_END()
+};
+
+D3DVERTEXELEMENT9 g_roomAtlasVertexElements[] =
+{
+    {0,  0, D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0},
+    {0, 12, D3DDECLTYPE_FLOAT2, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0},
+    {0, 20, D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL,   0},
+    {1,  0, D3DDECLTYPE_FLOAT4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 1},
+    {1, 16, D3DDECLTYPE_FLOAT1, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 2},
+    D3DDECL_END()
+};
+
+D3DVERTEXELEMENT9 g_roomPackedVertexElements[] =
+{
+    {0,  0, D3DDECLTYPE_SHORT4N,    D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0},
+    {0,  8, D3DDECLTYPE_FLOAT16_2,  D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0},
+    {0, 12, D3DDECLTYPE_SHORT2N,    D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL,   0},
+    D3DDECL_END()
+};
+
+D3DVERTEXELEMENT9 g_roomPackedAtlasVertexElements[] =
+{
+    {0,  0, D3DDECLTYPE_SHORT4N,    D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0},
+    {0,  8, D3DDECLTYPE_FLOAT16_2,  D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0},
+    {0, 12, D3DDECLTYPE_SHORT2N,    D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL,   0},
+    {1,  0, D3DDECLTYPE_FLOAT4,     D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 1},
+    {1, 16, D3DDECLTYPE_FLOAT1,     D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 2},
+    D3DDECL_END()
+};
+
+Vertex g_room[36] =
+{
+    // Wall: -Z face
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  0.0f,  1.0f},
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, 0.0f,                    0.0f,  0.0f,  1.0f},
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        0.0f,  0.0f,  1.0f},
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        0.0f,  0.0f,  1.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, ROOM_WALL_TILE_V,                    0.0f,  0.0f,  1.0f},
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  0.0f,  1.0f},
+
+    // Wall: +Z face
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  0.0f, -1.0f},
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, 0.0f,                    0.0f,  0.0f, -1.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        0.0f,  0.0f, -1.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        0.0f,  0.0f, -1.0f},
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, ROOM_WALL_TILE_V,                    0.0f,  0.0f, -1.0f},
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  0.0f, -1.0f},
+
+    // Wall: -X face
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                1.0f,  0.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, 0.0f,                    1.0f,  0.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        1.0f,  0.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,        1.0f,  0.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, ROOM_WALL_TILE_V,                    1.0f,  0.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                1.0f,  0.0f,  0.0f},
+
+    // Wall: +X face
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                               -1.0f,  0.0f,  0.0f},
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, 0.0f,                   -1.0f,  0.0f,  0.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,       -1.0f,  0.0f,  0.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_WALL_TILE_U, ROOM_WALL_TILE_V,       -1.0f,  0.0f,  0.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, ROOM_WALL_TILE_V,                   -1.0f,  0.0f,  0.0f},
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                               -1.0f,  0.0f,  0.0f},
+
+    // Ceiling: +Y face
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f, -1.0f,  0.0f},
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_CEILING_TILE_U, 0.0f,                 0.0f, -1.0f,  0.0f},
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_CEILING_TILE_U, ROOM_CEILING_TILE_V,  0.0f, -1.0f,  0.0f},
+    { ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_CEILING_TILE_U, ROOM_CEILING_TILE_V,  0.0f, -1.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, ROOM_CEILING_TILE_V,                 0.0f, -1.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF,  ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f, -1.0f,  0.0f},
+
+    // Floor: -Y face
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  1.0f,  0.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    ROOM_FLOOR_TILE_U, 0.0f,                   0.0f,  1.0f,  0.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_FLOOR_TILE_U, ROOM_FLOOR_TILE_V,      0.0f,  1.0f,  0.0f},
+    { ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    ROOM_FLOOR_TILE_U, ROOM_FLOOR_TILE_V,      0.0f,  1.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF,    0.0f, ROOM_FLOOR_TILE_V,                   0.0f,  1.0f,  0.0f},
+    {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF,  ROOM_SIZE_Z_HALF,    0.0f, 0.0f,                                0.0f,  1.0f,  0.0f}
+};
+
+//-----------------------------------------------------------------------------
+// Function Prototypes.
+//-----------------------------------------------------------------------------
+
+bool    AcquireFrame(FrameSnapshot &frame);
+void    AddSceneQuad(Vertex *pVertices, int &count, const D3DXVECTOR3 &corner,
+                     const D3DXVECTOR3 &edgeU, const D3DXVECTOR3 &edgeV);
+void    AddSceneWall(Vertex *pVertices, int &count, const D3DXVECTOR3 &center, const D3DXVECTOR3 &normal,
+                     float halfWidth, float halfHeight, float doorWidth, float doorHeight);
+int     AllocateShadowTile(ShadowCache &cache, int face, ShadowStats &stats);
+void   *AllocateTracked(size_t size, void *pCaller);
+void    AppendAllocationReport(char *pszText, int maxLength, int &length);
+void    AppendText(char *pszText, int maxLength, int &length, const char *pszFormat, ...);
+void    BakeLightmapBand(void *pParam);
+void    BenchmarkAssetLoading();
+void    BenchmarkFrameArena();
+void    BenchmarkLightLods();
+void    BenchmarkLightingCache();
+void    BenchmarkLightmapBaking();
+void    BenchmarkManyLights();
+void    BenchmarkMeshLoading();
+void    BenchmarkMipGeneration();
+void    BenchmarkOcclusionCulling();
+void    BenchmarkPrint(const char *pszFormat, ...);
+void    BenchmarkRoomSubmission();
+void    BenchmarkSceneCulling();
+void    BenchmarkSceneGeneration();
+void    BenchmarkShadowMaps();
+void    BenchmarkSimulation();
+void    BenchmarkTextRendering();
+void    BenchmarkTextureCache();
+void    BenchmarkTextureEncoder();
+void    BenchmarkTextureSampler();
+void    BenchmarkVertexCache();
+void    BenchmarkVertexFormat();
+void    BenchmarkVirtualTexture();
+__m128  BlendTexels(DWORD texel00, DWORD texel10, DWORD texel01, DWORD texel11, float fracX, float fracY);
+void    BuildLightTree(const PointLight *pLights, int count, LightTree &tree);
+int     BuildLightTreeNode(LightTree &tree, int begin, int end);
+void    BuildOcclusionPyramid(OcclusionBuffer &buffer);
+void    BuildOctreeOctants(void *pParam, int begin, int end);
+int     BuildRoomBatches(bool useAtlas, RoomBatch *pBatches);
+void    BuildSceneOctree(const Scene &scene, WorkerPool &pool, Octree &tree);
+void    BuildTriangleOctree(const D3DXVECTOR3 *pTriangles, int count, Octree &tree);
+void    CastRoomView(const D3DXVECTOR3 &eye, const D3DXVECTOR3 &forward, const D3DXVECTOR3 &right,
+                     const D3DXVECTOR3 &up, int width, int height, float *pPositions, float *pNormals,
+                     float *pViewDirs, int *pSurfaces);
+void    ChooseBestMSAAMode(D3DFORMAT backBufferFmt, D3DFORMAT depthStencilFmt,
+                           BOOL windowed, D3DMULTISAMPLE_TYPE &type,
+                           DWORD &qualityLevels, DWORD &samplesPerPixel);
+void    Cleanup();
+void    CleanupApp();
+void    CloseVirtualTexture(VirtualTexture &texture);
+void    CompileShaderJob(void *pParam);
+void    CompressBlockBC1ClusterFit(const DWORD *pPixels, int iterations, BYTE *pBlock);
+void    CompressBlockBC3Alpha(const DWORD *pPixels, BYTE *pBlock);
+void    CompressBlockBC7(const DWORD *pPixels, int quality, BYTE *pBlock);
+void    CompressBlockRows(void *pParam, int begin, int end);
+void    CompressBlocksBC1(const DWORD *pPixels[4], BYTE *pBlocks[4]);
+bool    CompressImage(const Image &image, D3DFORMAT format, int quality,
+                      CompressedImage &compressed, WorkerPool &pool);
+void    CookVirtualPages(void *pParam, int begin, int end);
+bool    CookVirtualTexture(const char *pszFilename, const Image &source, int width, int height,
+                           WorkerPool &pool);
+bool    CopyLightmapToTexture(const Lightmap &lightmap, IDirect3DTexture9 *pTexture);
+void    CopyOctreeOctants(void *pParam, int begin, int end);
+HWND    CreateAppWindow(const WNDCLASSEX &wcl, const char *pszTitle);
+bool    CreateCookedMesh(const Mesh &mesh, CookedMesh &cooked);
+bool    CreateGlyphAtlas(const char *pszFont, int ptSize, GlyphAtlas &atlas);
+bool    CreateGlyphAtlasTexture(const GlyphAtlas &atlas, LPDIRECT3DTEXTURE9 &pTexture);
+HFONT   CreateGlyphFont(HDC hDC, const char *pszFont, int ptSize);
+void    CreateGridTriangles(int columns, int rows, bool shuffle, unsigned int seed,
+                            std::vector<Vertex> &triangles);
+bool    CreateImage(int width, int height, int levels, Image &image);
+bool    CreateImageFromTexture(LPDIRECT3DTEXTURE9 pTexture, Image &image);
+void    CreateIndexedMesh(const Vertex *pVertices, int count, Mesh &mesh);
+bool    CreateIrradianceVolume(const float boundsMin[3], const float boundsMax[3], float cellSize,
+                               IrradianceVolume &volume);
+bool    CreateLightingCache(int width, int height, LightingCache &cache);
+bool    CreateLightmap(const Vertex *pTriangles, const int *pSurfaces, int count, float texelSize,
+                       Lightmap &lightmap);
+bool    CreateNullTexture(int width, int height, LPDIRECT3DTEXTURE9 &pTexture);
+bool    CreateOcclusionBuffer(int width, int height, OcclusionBuffer &buffer);
+bool    CreateRoomAtlasImage(const Image *pTiles, WorkerPool &pool, Image &atlas,
+                             float rects[][4]);
+void    CreateRoomMesh(Mesh &mesh);
+void    CreateSceneOccluders(const Scene &scene, OccluderSet &occluders);
+bool    CreateShadowCache(int lightCount, int tileSize, int maxTiles, ShadowCache &cache);
+void    CreateShadowCasters(const Scene &scene, OccluderSet &casters);
+bool    CreateSoftwareTexture(const Image &image, int layout, SoftwareTexture &texture);
+bool    CreateTextureFromCompressedImage(const CompressedImage &image, LPDIRECT3DTEXTURE9 &pTexture);
+bool    CreateTextureFromImage(const Image &image, LPDIRECT3DTEXTURE9 &pTexture);
+bool    CullBox(const D3DXPLANE *pPlanes, const float boundsMin[3], const float boundsMax[3],
+                int &planeMask, int &lastCulledPlane);
+int     CullOctree(Octree &tree, const D3DXPLANE *pPlanes, int *pVisible, OctreeCullStats &stats);
+void    CullOctreeNode(Octree &tree, int index, const D3DXPLANE *pPlanes, int planeMask,
+                       int *pVisible, int &count, OctreeCullStats &stats);
+int     CullSceneChunks(const Scene &scene, const D3DXPLANE *pPlanes, int *pVisible, OctreeCullStats &stats);
+bool    DecodeImage(const BYTE *pData, size_t size, Image &image);
+void    DecodeOctahedralNormal(const SHORT encoded[2], float normal[3]);
+void    DecodeTextureJob(void *pParam);
+void    DecompressBlockBC1(const BYTE *pBlock, bool fourColorOnly, DWORD *pPixels);
+void    DecompressBlockBC3Alpha(const BYTE *pBlock, DWORD *pPixels);
+void    DecompressBlockBC7(const BYTE *pBlock, DWORD *pPixels);
+void    DenoiseLighting(const float *pColors, const float *pPositions, const float *pNormals, int width, int height,
+                        float *pResult);
+void    DenoiseLightingOverFrames(const float *pColors, int count, bool first, float *pHistory);
+void    DestroyCompressedImage(CompressedImage &image);
+void    DestroyCookedMesh(CookedMesh &mesh);
+void    DestroyGlyphAtlas(GlyphAtlas &atlas);
+void    DestroyImage(Image &image);
+void    DestroyOcclusionBuffer(OcclusionBuffer &buffer);
+void    DestroyShadowCache(ShadowCache &cache);
+void    DestroySoftwareTexture(SoftwareTexture &texture);
+bool    DeviceIsValid();
+void    DrawTextLayout(const TextLayout &layout);
+void    DrawTextLayoutToBuffer(const GlyphAtlas &atlas, const TextLayout &layout,
+                               DWORD *pPixels, int width, int height, int pitch);
+bool    DrawTextWithGdi(const char *pszFont, int ptSize, const char *pszText, int x, int y,
+                        int width, int height, BYTE *pCoverage);
+void    EncodeOctahedralNormal(const float normal[3], SHORT encoded[2]);
+void    EstimateLighting(const LightTree &tree, const float pos[3], const float normal[3], const float *pViewDir,
+                         const Material &material, int samples, unsigned int &seed, float color[4]);
+void    FillOcclusionTriangle(OcclusionBuffer &buffer, const float *v0, const float *v1, const float *v2);
+int     FindAllocationZone(const char *pszName);
+bool    FinishLightmapBake(LightmapBake &bake, WorkerPool &pool);
+void    FinishOcclusionJob(OcclusionJob &job, WorkerPool &pool);
+SHORT   FloatToSnorm16(float value);
+void    FreeTracked(void *pMemory);
+void    GatherRoomWallFeedback(const VirtualTexture &texture, const D3DXMATRIX &viewProjection,
+                               int screenWidth, int screenHeight,
+                               std::vector<VirtualFeedbackSample> &samples);
+void    GenerateMipChain(Image &image, WorkerPool &pool);
+void    GenerateMipChainReference(Image &image);
+void    GenerateMipRows(void *pParam, int begin, int end);
+bool    GenerateScene(const SceneDesc &desc, WorkerPool &pool, Scene &scene);
+void    GenerateSceneCells(void *pParam, int begin, int end);
+void    GenerateSceneRoom(Scene &scene, int index, bool write);
+void    GenerateSceneRooms(void *pParam, int begin, int end);
+D3DXHANDLE GetBlinnPhongTechnique(bool useAtlas);
+float   GetElapsedTimeInSeconds();
+double  GetCompressedImagePSNR(const Image &image, const CompressedImage &compressed);
+DWORD   GetCompressedLevelSize(D3DFORMAT format, int width, int height);
+bool    GetFileStamp(const char *pszFilename, ULONGLONG &size, ULONGLONG &time);
+void    GetFrustumPlanes(const D3DXMATRIX &viewProjection, D3DXPLANE *pPlanes);
+float   GetLightClusterImportance(const LightTreeNode &node, const float pos[3], const float normal[3],
+                                  const float *pReflectances);
+int     GetLightLod(float projectedRadius);
+int     GetLightLodTriangles(int lod);
+int     GetLightmapFace(const float normal[3]);
+void    GetLightmapPlanes(const Lightmap &lightmap, float uPlanes[LIGHTMAP_FACES][4],
+                          float vPlanes[LIGHTMAP_FACES][4]);
+void    GetLightmapTexelPosition(const Lightmap &lightmap, const LightmapChart &chart, int x, int y,
+                                 float pos[3]);
+int     GetMipFilterTaps(int dst, int srcSize, int dstSize, double weights[3]);
+int     GetOctreeCell(const Octree &tree, const float boundsMin[3], const float boundsMax[3], int cell[3]);
+int     GetProcessorCount();
+float   GetProjectedRadius(const D3DXMATRIX &viewProjection, const float pos[3], float radius,
+                           int viewportHeight);
+double  GetRelativeError(const float *pColors, const float *pReference, int count, double *pSquares);
+const Material &GetRoomSurfaceMaterial(int surface);
+void    GetRoomTriangleSurfaces(int *pSurfaces);
+int     GetRoomWallCoords(const D3DXVECTOR3 &origin, const D3DXVECTOR3 &direction, float &u, float &v);
+void    GetSampleFootprint(const SoftwareTexture &texture, int filter, int maxAnisotropy,
+                           const float gradients[4], SampleFootprint &footprint);
+int     GetSceneOpenings(const Scene &scene, int index);
+unsigned int GetSceneSeed(const SceneDesc &desc, int index, int stream);
+void    GetShadowFaceBounds(const ShadowLight &light, int face, float boundsMin[3], float boundsMax[3]);
+size_t  GetTexelIndex(const SoftwareTexture &texture, int level, int x, int y);
+double  GetTimeInSeconds();
+float   GetVertexCacheScore(int cachePosition, int remainingTriangles);
+void    GetVertexCacheStats(const DWORD *pIndices, int indexCount, int vertexCount, int cacheSize,
+                            double &acmr, double &atvr);
+void    GetVertexQuantization(const Vertex *pVertices, int count, VertexQuantization &quantization);
+int     GetVirtualPageIndex(const VirtualTexture &texture, int level, int x, int y);
+void    GetVirtualPagesFromFeedback(VirtualTexture &texture, const std::vector<VirtualFeedbackSample> &samples,
+                                    std::vector<int> &pages);
+ULONGLONG HashBytes(const void *pData, size_t size);
+bool    Init();
+void    InitApp();
+bool    InitD3D();
+bool    InitFont(const char *pszFont, int ptSize, LPD3DXFONT &pFont);
+void    InitLightMeshes();
+void    InitLightmap();
+void    InitModel();
+void    InitOctree(Octree &tree, const float boundsMin[3], const float boundsMax[3]);
+void    InitOctreeNode(const Octree &tree, int depth, const int cell[3], int parent, OctreeNode &node);
+void    InitRoom();
+void    InitRoomAtlas();
+void    InitRoomPackedVertices();
+void    InitScene();
+void    InitSceneChunk(Scene &scene, int chunk, int firstVertex, int vertexCount, int surface, int room);
+void    InitSrgbTables();
+int     InsertOctreeItem(Octree &tree, const float boundsMin[3], const float boundsMax[3], int value);
+bool    IntersectSegmentBox(const float from[3], const float delta[3], const float boundsMin[3],
+                            const float boundsMax[3]);
+bool    IntersectSegmentTriangle(const float from[3], const float delta[3], const D3DXVECTOR3 *pTriangle);
+void    InvalidateShadowCasters(ShadowCache &cache, const float boundsMin[3], const float boundsMax[3]);
+bool    IsSegmentBlocked(const Octree &tree, const D3DXVECTOR3 *pTriangles, const float from[3],
+                         const float to[3]);
+void    LayoutText(const GlyphAtlas &atlas, const char *pszText, int x, int y,
+                   D3DCOLOR color, TextLayout &layout);
+void    LinkOctreeItem(Octree &tree, int index);
+bool    LoadModel(const char *pszFilename, WorkerPool &pool, bool useCache,
+                  CookedMesh &mesh, bool &fromCache);
+bool    LoadShader(ShaderCompile &shader, LPD3DXEFFECT &pEffect);
+void    LoadVirtualPageJob(void *pParam);
+void    Log(const char *pszMessage);
+bool    MapMeshCache(const char *pszFilename, ULONGLONG sourceSize, ULONGLONG sourceTime,
+                     CookedMesh &mesh);
+bool    MapTextureCache(const char *pszFilename, ULONGLONG sourceHash, CompressedImage &image);
+bool    MSAAModeSupported(D3DMULTISAMPLE_TYPE type, D3DFORMAT backBufferFmt,
+                          D3DFORMAT depthStencilFmt, BOOL windowed,
+                          DWORD &qualityLevels);
+size_t  MortonIndex(int x, int y, int widthLog2, int heightLog2);
+bool    MoveOctreeItem(Octree &tree, int index, const float boundsMin[3], const float boundsMax[3]);
+unsigned int NextRandom(unsigned int &seed);
+float   NextRandomFloat(unsigned int &seed);
+bool    OpenVirtualTexture(const char *pszFilename, WorkerPool &loadPool, VirtualTexture &texture);
+void    OptimizeVertexCache(DWORD *pIndices, int indexCount, int vertexCount);
+void    OptimizeVertexFetch(Mesh &mesh);
+void    PackVertices(const Vertex *pVertices, int count, const VertexQuantization &quantization,
+                     PackedVertex *pPacked);
+void    ParallelFor(WorkerPool &pool, int count, void (*pfnRun)(void *pParam, int begin, int end),
+                    void *pParam);
+void    ParallelForJobProc(void *pParam);
+void    ParseCommandLine(const char *pszCmdLine);
+bool    ParseObj(const char *pText, size_t size, WorkerPool &pool, std::vector<Vertex> &triangles);
+bool    ParseObjChunk(ObjChunk &chunk);
+void    ParseObjChunks(void *pParam, int begin, int end);
+bool    ParseObjFile(const char *pszFilename, WorkerPool &pool, std::vector<Vertex> &triangles);
+bool    ParseObjFloat(const char *&p, const char *pEnd, float &value);
+bool    ParseObjIndex(const char *&p, const char *pEnd, int &value);
+void    PlaceOctreeItems(void *pParam, int begin, int end);
+void    ProcessMouseInput(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
+void    PublishFrameInput();
+void    RasterizeOccluderTriangle(OcclusionBuffer &buffer, const D3DXVECTOR3 *pPositions);
+DWORD   ReadBlockBits(const BYTE *pBlock, int &offset, int count);
+bool    ReadFileContents(const char *pszFilename, std::vector<BYTE> &data);
+void    ReadTextureJob(void *pParam);
+bool    ReadVirtualPage(const VirtualTexture &texture, int page, DWORD *pTexels);
+void    RecordAllocationSite(void *pAddress, int zone, size_t size);
+void    RemoveOctreeItem(Octree &tree, int index);
+void    RenderFrame(const FrameSnapshot &frame);
+void    RenderRoomUsingBlinnPhong();
+void    RenderLight(const FrameSnapshot &frame, int i);
+void    RenderModelUsingBlinnPhong();
+void    RenderOccluders(const OccluderSet &occluders, const D3DXMATRIX &viewProjection,
+                        const D3DXVECTOR3 &cameraPos, OcclusionBuffer &buffer, OcclusionStats &stats);
+void    RenderOccludersJob(void *pParam);
+void    RenderSceneUsingBlinnPhong(const FrameSnapshot &frame);
+void    RenderShadowFaces(void *pParam, int begin, int end);
+void    RenderText(const FrameSnapshot &frame);
+int     ReprojectLighting(LightingCache &cache, const float *pPositions, const float *pNormals, float *pColors,
+                          int *pShade);
+bool    ResetDevice();
+bool    ResizeImage(const Image &src, int width, int height, Image &dst);
+void    ResolveObjChunks(void *pParam, int begin, int end);
+void    RunBenchmarks();
+void    SampleBilinear4(const SoftwareTexture &texture, int level, __m128 u, __m128 v, __m128 channels[4]);
+void    SampleIrradianceVolume(const IrradianceVolume &volume, const float pos[3], float color[4]);
+void    SampleLightmap(const Lightmap &lightmap, const float coords[2], float color[4]);
+bool    SampleShadowMap(const ShadowCache &cache, int light, const float pos[3], const float normal[3]);
+void    SampleTexture4(const SoftwareTexture &texture, int filter, int maxAnisotropy,
+                       const float u[4], const float v[4], const float gradients[4],
+                       __m128 colors[4]);
+__m128  SampleVirtualTexture(const VirtualTexture &texture, float u, float v, int level,
+                             int &residentLevel);
+__m128  SelectPS(__m128 mask, __m128 a, __m128 b);
+__m128i SelectEpi32(__m128i mask, __m128i a, __m128i b);
+void    SetProcessorAffinity();
+int     ShadeLightCut(const LightTree &tree, const float pos[3], const float normal[3], const float *pViewDir,
+                      const Material &material, float maxError, float color[4]);
+void    ShadePointLight(const PointLight &light, const float pos[3], const float normal[3],
+                        const float *pViewDir, const Material &material, const float globalAmbient[4],
+                        bool visible, float color[4]);
+void    SimulateFrame(float elapsedTimeSec, FrameSnapshot &frame);
+DWORD WINAPI SimulationThreadProc(LPVOID pParam);
+float   Snorm16ToFloat(SHORT value);
+void    SplatIrradianceBands(void *pParam, int begin, int end);
+void    SplatIrradianceLight(const IrradianceVolume &volume, const PointLight &light, float sign, float *pColors);
+bool    StartFramePipeline(int depth);
+void    StartLightmapBake(LightmapBake &bake, WorkerPool &pool, const PointLight *pLights, int count,
+                          ULONGLONG lightsHash);
+void    StartOcclusionJob(OcclusionJob &job, WorkerPool &pool, const D3DXMATRIX &viewProjection,
+                          const D3DXVECTOR3 &cameraPos);
+void    StartShaderCompile(ShaderCompile &shader, const char *pszFilename, WorkerPool &pool);
+void    StartTextureLoad(TextureLoad &load, const char *pszFilename, bool useCache,
+                         WorkerPool &ioPool, WorkerPool &decodePool);
+void    StopFramePipeline();
+void    SubmitRoomBatches(ID3DXEffect *pEffect, const RoomBatch *pBatches, int count,
+                          SubmissionCounters &counters);
+bool    TestOcclusionBox(const OcclusionBuffer &buffer, const float boundsMin[3], const float boundsMax[3]);
+bool    TestOcclusionSphere(const OcclusionBuffer &buffer, const float center[3], float radius);
+void    ToggleFullScreen();
+void    TouchVirtualSlot(VirtualTexture &texture, int slot);
+int     TraceRoom(const D3DXVECTOR3 &origin, const D3DXVECTOR3 &direction, float pos[3], float normal[3]);
+void    UnlinkOctreeItem(Octree &tree, int index);
+void    UnpackColor565(WORD color, int rgb[3]);
+void    UnpackVertices(const PackedVertex *pPacked, int count, const VertexQuantization &quantization,
+                       Vertex *pVertices);
+void    UpdateAllocationStats();
+void    UpdateCamera();
+void    UpdateCameraView(Camera &camera, float aspect);
+void    UpdateFrame(float elapsedTimeSec);
+void    UpdateFrameRate(float elapsedTimeSec);
+void    UpdateEffects(const FrameSnapshot &frame);
+int     UpdateIrradianceVolume(IrradianceVolume &volume, const PointLight *pLights, int count, WorkerPool &pool);
+int     UpdateLightLod(int lod, float projectedRadius);
+void    UpdateLightingCache(LightingCache &cache, const D3DXMATRIX &viewProjection, const float *pPositions,
+                            const float *pNormals, const float *pColors);
+void    UpdateLightmap(const FrameSnapshot &frame);
+void    UpdateLights(float elapsedTimeSec);
+void    UpdateShadowCache(ShadowCache &cache, const PointLight *pLights, const OccluderSet &casters,
+                          const D3DXPLANE *pViewPlanes, const D3DXVECTOR3 &cameraPos, int budget,
+                          WorkerPool &pool, ShadowStats &stats);
+int     UpdateSimulation(float elapsedTimeSec, int maxSteps);
+void    UpdateVirtualTexture(VirtualTexture &texture, int *pPages, int count);
+LRESULT CALLBACK WindowProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
+int     WriteBlockBC1(const DWORD *pPixels, WORD color0, WORD color1, BYTE *pBlock);
+void    WriteBlockBits(BYTE *pBlock, int &offset, DWORD value, int count);
+bool    WriteMeshCache(const char *pszFilename, ULONGLONG sourceSize, ULONGLONG sourceTime,
+                       const CookedMesh &mesh);
+bool    WriteTextureCache(const char *pszFilename, ULONGLONG sourceHash, const CompressedImage &image);
+bool    WriteTorusObj(const char *pszFilename, int rings, int sides);
+
+//-----------------------------------------------------------------------------
+// Global allocation tracking.
+//-----------------------------------------------------------------------------
+
+void *operator new(size_t size)
+{
+    void *pMemory = AllocateTracked(size, _ReturnAddress());
+
+    if (!pMemory)
+        throw std::bad_alloc();
+
+    return pMemory;
+}
+
+void *operator new[](size_t size)
+{
+    void *pMemory = AllocateTracked(size, _ReturnAddress());
+
+    if (!pMemory)
+        throw std::bad_alloc();
+
+    return pMemory;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) throw()
+{
+    return AllocateTracked(size, _ReturnAddress());
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) throw()
+{
+    return AllocateTracked(size, _ReturnAddress());
+}
+
+void operator delete(void *pMemory) throw()
+{
+    FreeTracked(pMemory);
+}
+
+void operator delete[](void *pMemory) throw()
+{
+    FreeTracked(pMemory);
+}
+
+void operator delete(void *pMemory, size_t) throw()
+{
+    FreeTracked(pMemory);
+}
+
+void operator delete[](void *pMemory, size_t) throw()
+{
+    FreeTracked(pMemory);
+}
+
+void operator delete(void *pMemory, const std::nothrow_t &) throw()
+{
+    FreeTracked(pMemory);
+}
+
+void operator delete[](void *pMemory, const std::nothrow_t &) throw()
+{
+    FreeTracked(pMemory);
+}
+
+AllocationZone::AllocationZone(const char *pszName)
+{
+    previousZone = g_currentAllocationZone;
+    g_currentAllocationZone = FindAllocationZone(pszName);
+}
+
+AllocationZone::~AllocationZone()
+{
+    g_currentAllocationZone = previousZone;
+}
+
+//-----------------------------------------------------------------------------
+// Functions.
+//-----------------------------------------------------------------------------
+
+int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nShowCmd)
+{
+#if defined(_DEBUG)
+    _CrtSetDbgFlag(_CRTDBG_LEAK_CHECK_DF | _CRTDBG_ALLOC_MEM_DF);
+    _CrtSetReportMode(_CRT_ASSERT, _CRTDBG_MODE_FILE);
+    _CrtSetReportFile(_CRT_ASSERT, _CRTDBG_FILE_STDERR);
+#endif
+
+    g_startupTime = GetTimeInSeconds();
+
+    MSG msg = {0};
+    WNDCLASSEX wcl = {0};
+
+    wcl.cbSize = sizeof(wcl);
+    wcl.style = CS_OWNDC | CS_HREDRAW | CS_VREDRAW;
+    wcl.lpfnWndProc = WindowProc;
+    wcl.cbClsExtra = 0;
+    wcl.cbWndExtra = 0;
+    wcl.hInstance = g_hInstance = hInstance;
+    wcl.hIcon = LoadIcon(0, IDI_APPLICATION);
+    wcl.hCursor = LoadCursor(0, IDC_ARROW);
+    wcl.hbrBackground = 0;
+    wcl.lpszMenuName = 0;
+    wcl.lpszClassName = "D3D9WindowClass";
+    wcl.hIconSm = 0;
+
+    ParseCommandLine(lpCmdLine);
+    InitSrgbTables();
+
+    // COM is only used for decoding images with WIC.
+
+    if (FAILED(CoInitializeEx(0, COINIT_MULTITHREADED)))
+        return 0;
+
+    if (g_runBenchmarks)
+    {
+        RunBenchmarks();
+        CoUninitialize();
+        return 0;
+    }
+
+    if (!RegisterClassEx(&wcl))
+    {
+        CoUninitialize();
+        return 0;
+    }
+
+    g_hWnd = CreateAppWindow(wcl, APP_TITLE);
+
+    if (g_hWnd)
+    {
+        SetProcessorAffinity();
+        InitializeCriticalSection(&g_frameInputLock);
+
+        if (Init())
+        {
+            ShowWindow(g_hWnd, nShowCmd);
+            UpdateWindow(g_hWnd);
+
+            if (!StartFramePipeline(g_pipelineDepth))
+                Log("Failed to start the simulation thread. Frames will be simulated serially.");
+
+            while (true)
+            {
+                while (PeekMessage(&msg, 0, 0, 0, PM_REMOVE))
+                {
+                    if (msg.message == WM_QUIT)
+                        break;
+
+                    TranslateMessage(&msg);
+                    DispatchMessage(&msg);
+                }
+
+                if (msg.message == WM_QUIT)
+                    break;
+
+                if (g_hasFocus)
+                {
+                    UpdateFrame(GetElapsedTimeInSeconds());
+
+                    if (DeviceIsValid())
+                        RenderFrame(g_renderFrame);
+                }
+                else
+                {
+                    WaitMessage();
+                }
+            }
+
+            StopFramePipeline();
+        }
+
+        Cleanup();
+        DeleteCriticalSection(&g_frameInputLock);
+        UnregisterClass(wcl.lpszClassName, hInstance);
+    }
+
+    CoUninitialize();
+
+    return static_cast<int>(msg.wParam);
+}
+
+LRESULT CALLBACK WindowProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+    switch (msg)
+    {
+    case WM_ACTIVATE:
+        switch (wParam)
+        {
+        default:
+            break;
+
+        case WA_ACTIVE:
+        case WA_CLICKACTIVE:
+            g_hasFocus = true;
+            break;
+
+        case WA_INACTIVE:
+            if (g_isFullScreen)
+                ShowWindow(hWnd, SW_MINIMIZE);
+            g_hasFocus = false;
+            break;
+        }
+        break;
+
+    case WM_CHAR:
+        switch (static_cast<int>(wParam))
+        {
+        case VK_ESCAPE:
+            PostMessage(hWnd, WM_CLOSE, 0, 0);
+            break;
+
+        case VK_SPACE:
+            g_animateLights = !g_animateLights;
+            break;
+
+        case '+':
+        case '=':
+            // The lights are owned by the simulation stage, which may be
+            // running on its own thread.
+
+            EnterCriticalSection(&g_frameInputLock);
+
+            for (int i = 0; i < sizeof(g_lights) / sizeof(g_lights[0]); ++i)
+            {
+                if ((g_lights[i].radius += 1.0f) > LIGHT_RADIUS_MAX)
+                    g_lights[i].radius = LIGHT_RADIUS_MAX;
+            }
+
+            LeaveCriticalSection(&g_frameInputLock);
+            break;
+
+        case '-':
+            EnterCriticalSection(&g_frameInputLock);
+
+            for (int i = 0; i < sizeof(g_lights) / sizeof(g_lights[0]); ++i)
+            {
+                if ((g_lights[i].radius -= 1.0f) < LIGHT_RADIUS_MIN)
+                    g_lights[i].radius = LIGHT_RADIUS_MIN;
+            }
+
+            LeaveCriticalSection(&g_frameInputLock);
+            break;
+
+        case 'a':
+        case 'A':
+            g_displayAllocations = !g_displayAllocations;
+            break;
+
+        case 'b':
+        case 'B':
+            g_useLightmap = !g_useLightmap;
+            break;
+
+        case 'c':
+        case 'C':
+            g_useSceneOctree = !g_useSceneOctree;
+            break;
+
+        case 'f':
+        case 'F':
+            g_useGlyphAtlasText = !g_useGlyphAtlasText;
+            break;
+
+        case 'h':
+        case 'H':
+            g_displayHelp = !g_displayHelp;
+            break;
+
+        case 'l':
+        case 'L':
+            g_renderLights = !g_renderLights;
+            break;
+
+        case 'm':
+        case 'M':
+            if (g_pBlinnPhongEffect == g_pBlinnPhongEffectSM20)
+                g_enableMultipassLighting = !g_enableMultipassLighting;
+            break;
+
+        case 'o':
+        case 'O':
+            g_useOcclusionCulling = !g_useOcclusionCulling;
+            break;
+
+        case 'p':
+        case 'P':
+            g_pipelineDepth = (g_framePipeline.depth + 1) % (PIPELINE_MAX_DEPTH + 1);
+            StopFramePipeline();
+
+            if (!StartFramePipeline(g_pipelineDepth))
+                g_pipelineDepth = 0;
+            break;
+
+        case 'r':
+        case 'R':
+            g_useRoomAtlas = !g_useRoomAtlas;
+            break;
+
+        case 'v':
+        case 'V':
+            g_usePackedVertices = !g_usePackedVertices;
+            break;
+
+        case 's':
+        case 'S':
+            if (g_supportsShaderModel30)
+            {
+                if (g_pBlinnPhongEffect == g_pBlinnPhongEffectSM20)
+                {
+                    g_pBlinnPhongEffect = g_pBlinnPhongEffectSM30;
+                    g_numLights = MAX_LIGHTS_SM30;
+                }
+                else
+                {
+                    g_pBlinnPhongEffect = g_pBlinnPhongEffectSM20;
+                    g_numLights = MAX_LIGHTS_SM20;
+                }
+            }
+            break;
+
+        case 'T':
+        case 't':
+            g_disableColorMapTexture = !g_disableColorMapTexture;
+            break;
+
+        default:
+            break;
+        }
+        break;
+
+    case WM_DESTROY:
+        PostQuitMessage(0);
+        return 0;
+
+    case WM_SIZE:
+        g_windowWidth = static_cast<int>(LOWORD(lParam));
+        g_windowHeight = static_cast<int>(HIWORD(lParam));
+        break;
+
+    case WM_SYSKEYDOWN:
+        if (wParam == VK_RETURN)
+            ToggleFullScreen();
+        break;
+
+    default:
+        ProcessMouseInput(hWnd, msg, wParam, lParam);
+        break;
+    }
+
+    return DefWindowProc(hWnd, msg, wParam, lParam);
+}
+
+bool AcquireFrame(FrameSnapshot &frame)
+{
+    // Takes the oldest snapshot published by the simulation thread and frees
+    // its slot so the simulation can start on another frame while this one
+    // is being rendered. Gives up after a short while so the message loop
+    // stays responsive. The caller then renders the previous frame again.
+
+    FramePipeline &pipeline = g_framePipeline;
+
+    if (WaitForSingleObject(pipeline.hFilledSlots, PIPELINE_WAIT_TIMEOUT_MS) != WAIT_OBJECT_0)
+        return false;
+
+    frame = pipeline.slots[pipeline.readIndex];
+    pipeline.readIndex = (pipeline.readIndex + 1) % pipeline.depth;
+
+    ReleaseSemaphore(pipeline.hFreeSlots, 1, 0);
+    return true;
+}
+
+void AddSceneQuad(Vertex *pVertices, int &count, const D3DXVECTOR3 &corner,
+                  const D3DXVECTOR3 &edgeU, const D3DXVECTOR3 &edgeV)
+{
+    // Adds the two triangles of the parallelogram with a corner at corner
+    // and sides edgeU and edgeV, front facing on the side edgeU x edgeV
+    // points to. The texture coordinates are the position along edgeU and
+    // edgeV in SCENE_TILE_SIZE units, so pieces of the same surface line
+    // up. When pVertices is 0 the vertices are only counted.
+
+    static const float corners[6][2] = {{0, 0}, {1, 0}, {1, 1}, {1, 1}, {0, 1}, {0, 0}};
+
+    if (pVertices)
+    {
+        D3DXVECTOR3 normal;
+        D3DXVECTOR3 axisU;
+        D3DXVECTOR3 axisV;
+
+        D3DXVec3Cross(&normal, &edgeU, &edgeV);
+        D3DXVec3Normalize(&normal, &normal);
+        D3DXVec3Normalize(&axisU, &edgeU);
+        D3DXVec3Normalize(&axisV, &edgeV);
+
+        for (int i = 0; i < 6; ++i)
+        {
+            D3DXVECTOR3 pos = corner + edgeU * corners[i][0] + edgeV * corners[i][1];
+            Vertex &vertex = pVertices[count + i];
+
+            vertex.pos[0] = pos.x;
+            vertex.pos[1] = pos.y;
+            vertex.pos[2] = pos.z;
+            vertex.texCoord[0] = D3DXVec3Dot(&pos, &axisU) / SCENE_TILE_SIZE;
+            vertex.texCoord[1] = D3DXVec3Dot(&pos, &axisV) / SCENE_TILE_SIZE;
+            vertex.normal[0] = normal.x;
+            vertex.normal[1] = normal.y;
+            vertex.normal[2] = normal.z;
+        }
+    }
+
+    count += 6;
+}
+
+void AddSceneWall(Vertex *pVertices, int &count, const D3DXVECTOR3 &center, const D3DXVECTOR3 &normal,
+                  float halfWidth, float halfHeight, float doorWidth, float doorHeight)
+{
+    // Adds a vertical wall centered on center and facing along normal. A
+    // door is an opening doorWidth wide and doorHeight high in the middle
+    // of the bottom edge. The wall is then up to 3 quads, either side of
+    // the door and above it, and pieces with no area are left out.
+
+    D3DXVECTOR3 down(0.0f, -1.0f, 0.0f);
+    D3DXVECTOR3 across;
+
+    D3DXVec3Cross(&across, &down, &normal);
+
+    D3DXVECTOR3 topLeft = center - across * halfWidth - down * halfHeight;
+
+    if (doorWidth <= 0.0f || doorHeight <= 0.0f)
+    {
+        AddSceneQuad(pVertices, count, topLeft, across * (halfWidth * 2.0f), down * (halfHeight * 2.0f));
+        return;
+    }
+
+    float side = halfWidth - doorWidth * 0.5f;
+    float lintel = halfHeight * 2.0f - doorHeight;
+
+    if (side > 0.0f)
+    {
+        AddSceneQuad(pVertices, count, topLeft, across * side, down * (halfHeight * 2.0f));
+        AddSceneQuad(pVertices, count, topLeft + across * (side + doorWidth), across * side, down * (halfHeight * 2.0f));
+    }
+
+    if (lintel > 0.0f)
+        AddSceneQuad(pVertices, count, topLeft + across * side, across * doorWidth, down * lintel);
+}
+
+int AllocateShadowTile(ShadowCache &cache, int face, ShadowStats &stats)
+{
+    // Gives the face a tile of the atlas, taking it from the face whose
+    // tile has gone unused longest when none is free. Returns -1 when
+    // every tile holds a face needed this frame.
+
+    int tile = -1;
+
+    if (!cache.freeTiles.empty())
+    {
+        tile = cache.freeTiles.back();
+        cache.freeTiles.pop_back();
+    }
+    else
+    {
+        for (int i = 0; i < cache.maxTiles; ++i)
+        {
+            if (cache.tileLastUsed[i] < cache.frame && (tile < 0 || cache.tileLastUsed[i] < cache.tileLastUsed[tile]))
+                tile = i;
+        }
+
+        if (tile < 0)
+            return -1;
+
+        int evicted = cache.tileFaces[tile];
+
+        cache.lights[evicted / SHADOW_CUBE_FACES].faces[evicted % SHADOW_CUBE_FACES].tile = -1;
+        ++stats.tilesEvicted;
+    }
+
+    cache.tileFaces[tile] = face;
+    cache.tileLastUsed[tile] = cache.frame;
+    cache.lights[face / SHADOW_CUBE_FACES].faces[face % SHADOW_CUBE_FACES].tile = tile;
+    return tile;
+}
+
+void *AllocateTracked(size_t size, void *pCaller)
+{
+    // Every heap block carries a small header recording its size and the
+    // zone it was allocated in so that operator delete can keep the live
+    // heap byte count up to date. This may run on any thread.
+
+    BYTE *pBlock = static_cast<BYTE*>(malloc(size + ALLOCATION_HEADER_SIZE));
+
+    if (!pBlock)
+        return 0;
+
+    AllocationHeader *pHeader = reinterpret_cast<AllocationHeader*>(pBlock);
+    int zone = g_currentAllocationZone;
+
+    pHeader->size = size;
+    pHeader->zone = zone;
+
+    InterlockedIncrement(&g_allocations.allocations);
+    InterlockedExchangeAdd64(&g_allocations.bytes, size);
+    InterlockedIncrement(&g_zoneAllocations[zone].allocations);
+    InterlockedExchangeAdd64(&g_zoneAllocations[zone].bytes, size);
+
+    LONGLONG liveBytes = InterlockedExchangeAdd64(&g_liveHeapBytes, size) + size;
+    LONGLONG peakBytes = g_peakHeapBytes;
+
+    while (liveBytes > peakBytes)
+    {
+        LONGLONG prevPeakBytes = InterlockedCompareExchange64(&g_peakHeapBytes, liveBytes, peakBytes);
+
+        if (prevPeakBytes == peakBytes)
+            break;
+
+        peakBytes = prevPeakBytes;
+    }
+
+    RecordAllocationSite(pCaller, zone, size);
+    return pBlock + ALLOCATION_HEADER_SIZE;
+}
+
+void AppendAllocationReport(char *pszText, int maxLength, int &length)
+{
+    const AllocationStats &stats = g_allocationStats;
+
+    AppendText(pszText, maxLength, length,
+        "Startup: %d allocations (%.1f KB)\n"
+        "Per frame: %g allocations (%g bytes), worst %d\n"
+        "Heap: %.1f KB live, %.1f KB peak\n",
+        static_cast<int>(stats.startupAllocations), stats.startupBytes / 1024.0,
+        stats.allocationsPerFrame, stats.bytesPerFrame, stats.maxAllocationsPerFrame,
+        g_liveHeapBytes / 1024.0, g_peakHeapBytes / 1024.0);
+
+    AppendText(pszText, maxLength, length,
+        "Frame arena: %.1f KB last frame, %.1f KB high water, %d overflows\n",
+        g_frameArena.lastFrameBytes / 1024.0, g_frameArena.highWaterMark / 1024.0,
+        g_frameArena.overflows);
+
+    AppendText(pszText, maxLength, length,
+        "Frame budget: %d allocations, exceeded in %d frames\n\nZones:\n",
+        g_allocationBudget, stats.budgetViolations);
+
+    for (int i = 0; i < g_numAllocationZones; ++i)
+    {
+        AppendText(pszText, maxLength, length, "    %s: %d allocations (%.1f KB)\n",
+            g_allocationZoneNames[i], static_cast<int>(g_zoneAllocations[i].allocations),
+            g_zoneAllocations[i].bytes / 1024.0);
+    }
+
+    // Select the top call sites by total bytes allocated. This is a simple
+    // repeated linear search so no memory needs to be allocated to sort.
+
+    int topSites[ALLOCATION_REPORT_TOP_SITES];
+    int numTopSites = 0;
+
+    for (int n = 0; n < ALLOCATION_REPORT_TOP_SITES; ++n)
+    {
+        int best = -1;
+
+        for (int i = 0; i < ALLOCATION_MAX_SITES; ++i)
+        {
+            if (!g_allocationSites[i].pAddress)
+                continue;
+
+            bool taken = false;
+
+            for (int j = 0; j < numTopSites; ++j)
+                taken = taken || (topSites[j] == i);
+
+            if (!taken && (best < 0 || g_allocationSites[i].bytes > g_allocationSites[best].bytes))
+                best = i;
+        }
+
+        if (best < 0)
+            break;
+
+        topSites[numTopSites++] = best;
+    }
+
+    AppendText(pszText, maxLength, length, "\nTop call sites:\n");
+
+    for (int i = 0; i < numTopSites; ++i)
+    {
+        const AllocationSite &site = g_allocationSites[topSites[i]];
+
+        AppendText(pszText, maxLength, length, "    0x%p [%s]: %d allocations (%.1f KB)\n",
+            site.pAddress, g_allocationZoneNames[site.zone],
+            static_cast<int>(site.allocations), site.bytes / 1024.0);
+    }
+}
+
+void AppendText(char *pszText, int maxLength, int &length, const char *pszFormat, ...)
+{
+    // printf style formatting appended to a fixed size text buffer. The text
+    // is silently truncated once the buffer is full.
+
+    if (length >= maxLength - 1)
+        return;
+
+    va_list args;
+
+    va_start(args, pszFormat);
+    int written = vsnprintf(&pszText[length], maxLength - length, pszFormat, args);
+    va_end(args);
+
+    if (written < 0 || written >= maxLength - length)
+        length = maxLength - 1;
+    else
+        length += written;
+
+    pszText[length] = '\0';
+}
+
+void BakeLightmapBand(void *pParam)
+{
+    // Bakes a band of lightmap rows with the same lighting as the room's
+    // pixel shader, but without the specular term, which depends on where
+    // the surface is seen from. Texels in a chart's border get the lighting
+    // at the nearest point of the surface, so that filtering doesn't bleed
+    // in the texels around the chart.
+
+    LightmapBakeBand &band = *static_cast<LightmapBakeBand*>(pParam);
+    LightmapBake &bake = *band.pBake;
+    Lightmap &lightmap = *bake.pLightmap;
+
+    band.raysTraced = 0;
+
+    for (int y = band.firstRow; y < band.firstRow + band.rowCount && !bake.cancel; ++y)
+    {
+        for (int x = 0; x < lightmap.width; ++x)
+        {
+            int index = y * lightmap.width + x;
+            int chartIndex = lightmap.texelCharts[index];
+
+            if (chartIndex < 0)
+                continue;
+
+            const LightmapChart &chart = lightmap.charts[chartIndex];
+            const Material &material = *bake.pMaterials[chart.surface];
+            float *pColor = &lightmap.texels[index * 4];
+            float pos[3];
+
+            GetLightmapTexelPosition(lightmap, chart, x, y, pos);
+            memset(pColor, 0, sizeof(float) * 4);
+
+            for (int i = 0; i < bake.numLights; ++i)
+            {
+                const PointLight &light = bake.lights[i];
+                bool visible = true;
+
+                if (bake.pOccluders)
+                {
+                    // Only lights that reach the surface cast shadows. The
+                    // ray starts just off the surface so as not to hit it.
+
+                    float toLight[3];
+                    float distanceSq = 0.0f;
+                    float facing = 0.0f;
+
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        toLight[c] = light.renderPos[c] - pos[c];
+                        distanceSq += toLight[c] * toLight[c];
+                        facing += toLight[c] * chart.normal[c];
+                    }
+
+                    if (facing > 0.0f && distanceSq < light.radius * light.radius)
+                    {
+                        float from[3];
+
+                        for (int c = 0; c < 3; ++c)
+                            from[c] = pos[c] + chart.normal[c] * LIGHTMAP_SHADOW_BIAS;
+
+                        visible = !IsSegmentBlocked(*bake.pOccluders, bake.pOccluderTriangles, from, light.renderPos);
+                        ++band.raysTraced;
+                    }
+                }
+
+                ShadePointLight(light, pos, chart.normal, 0, material, bake.ambient, visible, pColor);
+            }
+
+            pColor[3] = 1.0f;
+        }
+    }
+
+    band.endTime = GetTimeInSeconds();
+    InterlockedDecrement(&bake.remainingBands);
+}
+
+void BenchmarkAssetLoading()
+{
+    // Measures how long it takes to get the startup assets ready in system
+    // memory: the three color maps read, decoded and mipmapped, and the
+    // three effects compiled. This is the part of the time to first frame
+    // that doesn't need a device. The serial configuration does all of the
+    // work on this thread, the way InitApp() used to.
+
+    static const char *textures[] =
+    {
+        "Content/Textures/brick_color_map.jpg",
+        "Content/Textures/wood_color_map.jpg",
+        "Content/Textures/stone_color_map.jpg"
+    };
+
+    static const char *shaders[] =
+    {
+        "Content/Shaders/ambient.fx",
+        "Content/Shaders/blinn_phong_sm20.fx",
+        "Content/Shaders/blinn_phong_sm30.fx"
+    };
+
+    const int numTextures = sizeof(textures) / sizeof(textures[0]);
+    const int numShaders = sizeof(shaders) / sizeof(shaders[0]);
+    const int workerThreads = max(1, min(GetProcessorCount() - 1, WORKER_MAX_THREADS));
+
+    static const struct
+    {
+        const char *pszName;
+        int ioThreads;
+        int workerThreads;
+    }
+    configs[] =
+    {
+        { "warm up", 0, 0 },
+        { "serial", 0, 0 },
+        { "parallel", IO_THREADS, 1 }
+    };
+
+    double serialTimeMs = 0.0;
+
+    for (int c = 0; c < sizeof(configs) / sizeof(configs[0]); ++c)
+    {
+        int numWorkers = (configs[c].workerThreads > 0) ? workerThreads : 0;
+        double bestTimeMs = 0.0;
+        bool succeeded = true;
+        int pixels = 0;
+
+        for (int run = 0; run < 3; ++run)
+        {
+            WorkerPool ioPool;
+            WorkerPool decodePool;
+            TextureLoad loads[sizeof(textures) / sizeof(textures[0])];
+            ShaderCompile compiles[sizeof(shaders) / sizeof(shaders[0])];
+
+            if (!ioPool.create(configs[c].ioThreads) || !decodePool.create(numWorkers))
+            {
+                BenchmarkPrint("Failed to create worker threads\n");
+                return;
+            }
+
+            double startTime = GetTimeInSeconds();
+
+            for (int i = 0; i < numTextures; ++i)
+                StartTextureLoad(loads[i], textures[i], false, ioPool, decodePool);
+
+            for (int i = 0; i < numShaders; ++i)
+                StartShaderCompile(compiles[i], shaders[i], decodePool);
+
+            ioPool.wait();
+            decodePool.wait();
+
+            double timeMs = (GetTimeInSeconds() - startTime) * 1000.0;
+
+            if (run == 0 || timeMs < bestTimeMs)
+                bestTimeMs = timeMs;
+
+            pixels = 0;
+
+            for (int i = 0; i < numTextures; ++i)
+            {
+                succeeded = succeeded && loads[i].succeeded;
+                pixels += loads[i].image.width * loads[i].image.height;
+                DestroyImage(loads[i].image);
+            }
+
+            for (int i = 0; i < numShaders; ++i)
+            {
+                succeeded = succeeded && compiles[i].pEffectCode != 0;
+                SAFE_RELEASE(compiles[i].pEffectCode);
+                SAFE_RELEASE(compiles[i].pErrors);
+            }
+
+            ioPool.destroy();
+            decodePool.destroy();
+        }
+
+        if (c == 0)
+            continue;
+
+        if (c == 1)
+            serialTimeMs = bestTimeMs;
+
+        BenchmarkPrint("%-8s (%d I/O + %d worker threads): %.2f ms for %d textures (%.2f MP) and %d shaders%s, %.2fx\n",
+            configs[c].pszName, configs[c].ioThreads, numWorkers, bestTimeMs, numTextures,
+            pixels / 1000000.0, numShaders, succeeded ? "" : " [FAILED]",
+            (bestTimeMs > 0.0) ? serialTimeMs / bestTimeMs : 0.0);
+    }
+}
+
+void BenchmarkFrameArena()
+{
+    // Compares the frame arena against the general purpose heap for the
+    // kinds of transient allocations made every frame: per tile light index
+    // lists, sorted draw keys and formatted HUD strings.
+
+    const int FRAMES = 1000;
+    const int LISTS = 1024;
+    const int KEYS = 4096;
+    const int STRINGS = 64;
+    const int STRING_LENGTH = 128;
+
+    static int *pLists[LISTS];
+    static char *pStrings[STRINGS];
+
+    FrameArena arena;
+
+    if (!arena.create(FRAME_ARENA_SIZE, FRAME_ARENA_MAX_BUFFERS))
+    {
+        BenchmarkPrint("Failed to create the frame arena.\n");
+        return;
+    }
+
+    volatile int sink = 0;
+    unsigned int seed = 0;
+    double startTime = 0.0;
+    double heapTime = 0.0;
+    double arenaTime = 0.0;
+    int count = 0;
+
+    // Light index lists of 8 to 64 entries.
+
+    seed = 1;
+    startTime = GetTimeInSeconds();
+
+    for (int frame = 0; frame < FRAMES; ++frame)
+    {
+        for (int i = 0; i < LISTS; ++i)
+        {
+            count = 8 + NextRandom(seed) % 57;
+            pLists[i] = static_cast<int*>(malloc(count * sizeof(int)));
+
+            for (int j = 0; j < count; ++j)
+                pLists[i][j] = j;
+
+            sink += pLists[i][count - 1];
+        }
+
+        for (int i = 0; i < LISTS; ++i)
+            free(pLists[i]);
+    }
+
+    heapTime = GetTimeInSeconds() - startTime;
+    seed = 1;
+    startTime = GetTimeInSeconds();
+
+    for (int frame = 0; frame < FRAMES; ++frame)
+    {
+        arena.nextFrame();
+
+        for (int i = 0; i < LISTS; ++i)
+        {
+            count = 8 + NextRandom(seed) % 57;
+            pLists[i] = arena.allocateArray<int>(count);
+
+            for (int j = 0; j < count; ++j)
+                pLists[i][j] = j;
+
+            sink += pLists[i][count - 1];
+        }
+    }
+
+    arenaTime = GetTimeInSeconds() - startTime;
+
+    BenchmarkPrint("Light index lists: malloc %.4f ms/frame, arena %.4f ms/frame (%.1fx)\n",
+        heapTime * 1000.0 / FRAMES, arenaTime * 1000.0 / FRAMES, heapTime / arenaTime);
+
+    // Sorted draw keys built with push_back() and then sorted.
+
+    seed = 1;
+    startTime = GetTimeInSeconds();
+
+    for (int frame = 0; frame < FRAMES; ++frame)
+    {
+        std::vector<UINT64> keys;
+
+        for (int i = 0; i < KEYS; ++i)
+            keys.push_back((static_cast<UINT64>(NextRandom(seed)) << 32) | i);
+
+        std::sort(keys.begin(), keys.end());
+        sink += static_cast<int>(keys[0]);
+    }
+
+    heapTime = GetTimeInSeconds() - startTime;
+    seed = 1;
+    startTime = GetTimeInSeconds();
+
+    for (int frame = 0; frame < FRAMES; ++frame)
+    {
+        arena.nextFrame();
+
+        FrameAllocator<UINT64> allocator(arena);
+        std::vector<UINT64, FrameAllocator<UINT64> > keys(allocator);
+
+        for (int i = 0; i < KEYS; ++i)
+            keys.push_back((static_cast<UINT64>(NextRandom(seed)) << 32) | i);
+
+        std::sort(keys.begin(), keys.end());
+        sink += static_cast<int>(keys[0]);
+    }
+
+    arenaTime = GetTimeInSeconds() - startTime;
+
+    BenchmarkPrint("Sorted draw keys: std::allocator %.4f ms/frame, arena %.4f ms/frame (%.1fx)\n",
+        heapTime * 1000.0 / FRAMES, arenaTime * 1000.0 / FRAMES, heapTime / arenaTime);
+
+    // Formatted HUD strings.
+
+    startTime = GetTimeInSeconds();
+
+    for (int frame = 0; frame < FRAMES; ++frame)
+    {
+        for (int i = 0; i < STRINGS; ++i)
+        {
+            pStrings[i] = static_cast<char*>(malloc(STRING_LENGTH));
+            sink += snprintf(pStrings[i], STRING_LENGTH, "Light %d radius: %g", i, i * 1.5f);
+        }
+
+        for (int i = 0; i < STRINGS; ++i)
+            free(pStrings[i]);
+    }
+
+    heapTime = GetTimeInSeconds() - startTime;
+    startTime = GetTimeInSeconds();
+
+    for (int frame = 0; frame < FRAMES; ++frame)
+    {
+        arena.nextFrame();
+
+        for (int i = 0; i < STRINGS; ++i)
+        {
+            pStrings[i] = arena.allocateArray<char>(STRING_LENGTH);
+            sink += snprintf(pStrings[i], STRING_LENGTH, "Light %d radius: %g", i, i * 1.5f);
+        }
+    }
+
+    arenaTime = GetTimeInSeconds() - startTime;
+
+    BenchmarkPrint("HUD strings: malloc %.4f ms/frame, arena %.4f ms/frame (%.1fx)\n",
+        heapTime * 1000.0 / FRAMES, arenaTime * 1000.0 / FRAMES, heapTime / arenaTime);
+
+    BenchmarkPrint("Arena high water mark: %.1f KB, overflows: %d\n",
+        arena.highWaterMark / 1024.0, arena.overflows);
+
+    arena.destroy();
+}
+
+void BenchmarkLightLods()
+{
+    // Flies the camera from close to the middle of the room out past its
+    // far wall and back with a small shake, while 1000 light markers bounce
+    // around the room, and compares the triangles drawn each frame with LODs
+    // against always drawing the full sphere. Also counts LOD switches with
+    // and without hysteresis to show how much flickering it prevents.
+
+    const int numLights = 1000;
+    const int frames = 1200;
+    const int screenWidth = 1280;
+    const int screenHeight = 720;
+    const float frameTime = 1.0f / SIMULATION_RATE_HZ;
+
+    std::vector<PointLight> lights(numLights);
+    std::vector<int> lods(numLights, 0);
+    std::vector<int> lodsWithoutHysteresis(numLights, 0);
+    unsigned int seed = 1;
+    ULONGLONG totalTriangles = 0;
+    ULONGLONG lodFrames[LIGHT_LOD_COUNT] = {0};
+    int minTriangles = INT_MAX;
+    int maxTriangles = 0;
+    int switches = 0;
+    int switchesWithoutHysteresis = 0;
+    double selectTime = 0.0;
+    D3DXMATRIX view;
+    D3DXMATRIX projection;
+    D3DXMATRIX viewProjection;
+    D3DXVECTOR3 target(0.0f, 0.0f, 0.0f);
+    D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+
+    // PointLight::init() picks each light's velocity with rand(), so seed it
+    // as well for the lights to move the same way every run.
+
+    srand(seed);
+
+    for (int i = 0; i < numLights; ++i)
+    {
+        lights[i].pos[0] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * (ROOM_SIZE_X - LIGHT_OBJECT_RADIUS * 4.0f);
+        lights[i].pos[1] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * (ROOM_SIZE_Y - LIGHT_OBJECT_RADIUS * 4.0f);
+        lights[i].pos[2] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * (ROOM_SIZE_Z - LIGHT_OBJECT_RADIUS * 4.0f);
+        lights[i].init();
+    }
+
+    D3DXMatrixPerspectiveFovLH(&projection, CAMERA_FOVY,
+        static_cast<float>(screenWidth) / static_cast<float>(screenHeight),
+        CAMERA_ZNEAR, CAMERA_ZFAR);
+
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        float t = static_cast<float>(frame) / frames;
+        float distance = 16.0f + (DOLLY_MAX - 16.0f) * 0.5f * (1.0f - cosf(t * 2.0f * D3DX_PI));
+        D3DXVECTOR3 eye(0.0f, 0.0f, -distance * (1.0f + 0.02f * sinf(frame * 1.7f)));
+
+        D3DXMatrixLookAtLH(&view, &eye, &target, &up);
+        viewProjection = view * projection;
+
+        for (int i = 0; i < numLights; ++i)
+            lights[i].update(frameTime);
+
+        double startTime = GetTimeInSeconds();
+        int triangles = 0;
+
+        for (int i = 0; i < numLights; ++i)
+        {
+            float projectedRadius = GetProjectedRadius(viewProjection, lights[i].pos, LIGHT_OBJECT_RADIUS, screenHeight);
+            int lod = UpdateLightLod(lods[i], projectedRadius);
+            int lodWithoutHysteresis = GetLightLod(projectedRadius);
+
+            switches += (lod != lods[i]);
+            switchesWithoutHysteresis += (lodWithoutHysteresis != lodsWithoutHysteresis[i]);
+            lods[i] = lod;
+            lodsWithoutHysteresis[i] = lodWithoutHysteresis;
+            triangles += GetLightLodTriangles(lod);
+            ++lodFrames[lod];
+        }
+
+        selectTime += GetTimeInSeconds() - startTime;
+        totalTriangles += triangles;
+        minTriangles = min(minTriangles, triangles);
+        maxTriangles = max(maxTriangles, triangles);
+    }
+
+    int fixedTriangles = numLights * GetLightLodTriangles(0);
+    double averageTriangles = static_cast<double>(totalTriangles) / frames;
+
+    BenchmarkPrint("%d lights, %d frames, camera 16 to %g units from the middle of the room\n",
+        numLights, frames, DOLLY_MAX);
+    BenchmarkPrint("Fixed %d x %d sphere: %d triangles per frame\n",
+        LIGHT_OBJECT_SLICES, LIGHT_OBJECT_STACKS, fixedTriangles);
+    BenchmarkPrint("LODs: %.0f triangles per frame on average (%.1fx fewer), %d to %d\n",
+        averageTriangles, fixedTriangles / max(averageTriangles, 1.0), minTriangles, maxTriangles);
+
+    for (int lod = 0; lod < LIGHT_LOD_COUNT; ++lod)
+    {
+        if (lod == LIGHT_LOD_IMPOSTOR)
+        {
+            BenchmarkPrint("  Impostor: %4.1f%% of markers, %d triangles\n",
+                100.0 * lodFrames[lod] / (static_cast<double>(numLights) * frames), GetLightLodTriangles(lod));
+        }
+        else
+        {
+            BenchmarkPrint("  %2d x %2d:  %4.1f%% of markers, %d triangles\n", LIGHT_LOD_SEGMENTS[lod], LIGHT_LOD_SEGMENTS[lod],
+                100.0 * lodFrames[lod] / (static_cast<double>(numLights) * frames), GetLightLodTriangles(lod));
+        }
+    }
+
+    BenchmarkPrint("LOD switches: %.2f per frame with hysteresis, %.2f without\n",
+        static_cast<double>(switches) / frames, static_cast<double>(switchesWithoutHysteresis) / frames);
+    BenchmarkPrint("Selection: %.1f us per frame\n", selectTime * 1000000.0 / frames);
+}
+
+void BenchmarkLightingCache()
+{
+    // Draws a 320x180 view of the room on the CPU, lit by the demo's lights
+    // as they move and with them paused, while the camera follows a few
+    // scripted paths. Each frame is shaded in full and again through the
+    // lighting cache, which only shades the pixels it can't reproject.
+    // Reports the share of pixels shaded and how far the cached frames are
+    // from the full ones.
+
+    static const char *const pszPaths[] = {"still", "orbiting", "tracking", "dollying"};
+
+    const int width = 320;
+    const int height = 180;
+    const int frames = 120;
+    const float frameTime = 1.0f / 60.0f;
+    const int pixels = width * height;
+    float aspect = static_cast<float>(width) / static_cast<float>(height);
+    std::vector<float> positions(pixels * 3);
+    std::vector<float> normals(pixels * 3);
+    std::vector<float> viewDirs(pixels * 3);
+    std::vector<float> full(pixels * 4);
+    std::vector<float> cached(pixels * 4);
+    std::vector<int> surfaces(pixels);
+    std::vector<int> shade(pixels);
+    PointLight lights[MAX_LIGHTS_SM30];
+
+    for (int run = 0; run < sizeof(pszPaths) / sizeof(pszPaths[0]) * 2; ++run)
+    {
+        int path = run % (sizeof(pszPaths) / sizeof(pszPaths[0]));
+        bool animateLights = (run == path);
+        unsigned int seed = 1;
+        LightingCache cache;
+        Camera camera = g_camera;
+        ULONGLONG shaded = 0;
+        double times[2] = {0.0, 0.0};   // shading every pixel, shading through the cache
+        double squares[2] = {0.0, 0.0};   // of the error and of the full frames' lighting
+        double worstError = 0.0;
+
+        srand(seed);
+        memcpy(lights, g_lights, sizeof(lights));
+
+        for (int i = 0; i < MAX_LIGHTS_SM30; ++i)
+        {
+            lights[i].pos[0] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * (ROOM_SIZE_X - LIGHT_OBJECT_RADIUS * 4.0f);
+            lights[i].pos[1] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * (ROOM_SIZE_Y - LIGHT_OBJECT_RADIUS * 4.0f);
+            lights[i].pos[2] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * (ROOM_SIZE_Z - LIGHT_OBJECT_RADIUS * 4.0f);
+            lights[i].init();
+        }
+
+        CreateLightingCache(width, height, cache);
+
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            float t = frame * frameTime;
+            float yaw = 0.0f;
+
+            // Move the camera as the mouse would, from inside the room.
+
+            camera.target = D3DXVECTOR3(0.0f, 0.0f, 0.0f);
+            camera.offset = ROOM_SIZE_Z_HALF * 0.75f;
+
+            if (path == 1)
+                yaw = t * D3DXToRadian(45.0f);
+            else if (path == 2)
+                camera.target.x = ROOM_SIZE_X_HALF * 0.5f * sinf(t * D3DX_PI);
+            else if (path == 3)
+                camera.offset = ROOM_SIZE_Z_HALF * (0.5f + 0.25f * sinf(t * D3DX_PI));
+
+            D3DXQuaternionRotationYawPitchRoll(&camera.orientation, yaw, 0.1f, 0.0f);
+            UpdateCameraView(camera, aspect);
+
+            for (int i = 0; animateLights && i < MAX_LIGHTS_SM30; ++i)
+            {
+                lights[i].update(frameTime);
+                lights[i].interpolate(1.0f);
+            }
+
+            CastRoomView(camera.pos, camera.zAxis, camera.xAxis, camera.yAxis, width, height,
+                &positions[0], &normals[0], &viewDirs[0], &surfaces[0]);
+
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                float *pColors = (pass == 0) ? &full[0] : &cached[0];
+                double startTime = GetTimeInSeconds();
+                int count = pixels;
+
+                if (pass == 1)
+                    count = ReprojectLighting(cache, &positions[0], &normals[0], pColors, &shade[0]);
+
+                for (int k = 0; k < count; ++k)
+                {
+                    int pixel = (pass == 0) ? k : shade[k];
+                    const Material &material = GetRoomSurfaceMaterial(surfaces[pixel]);
+                    float *pColor = &pColors[pixel * 4];
+
+                    memset(pColor, 0, sizeof(float) * 4);
+
+                    for (int i = 0; i < MAX_LIGHTS_SM30; ++i)
+                    {
+                        ShadePointLight(lights[i], &positions[pixel * 3], &normals[pixel * 3], &viewDirs[pixel * 3],
+                            material, g_sceneAmbient, true, pColor);
+                    }
+                }
+
+                if (pass == 1)
+                {
+                    UpdateLightingCache(cache, camera.viewProjectionMatrix, &positions[0], &normals[0], pColors);
+                    shaded += count;
+                }
+
+                times[pass] += GetTimeInSeconds() - startTime;
+            }
+
+            worstError = max(worstError, GetRelativeError(&cached[0], &full[0], pixels, squares));
+        }
+
+        if (path == 0)
+            BenchmarkPrint("Lights %s\n", animateLights ? "moving" : "paused");
+
+        BenchmarkPrint("  %-8s: %4.1f%% of pixels shaded, %.2f ms a frame vs %.2f ms shading every pixel, "
+            "%.1f%% error, %.1f%% in the worst frame\n",
+            pszPaths[path], 100.0 * shaded / (static_cast<double>(frames) * pixels), times[1] * 1000.0 / frames,
+            times[0] * 1000.0 / frames, 100.0 * sqrt(squares[0] / max(squares[1], 1.0e-12)), 100.0 * worstError);
+    }
+}
+
+void BenchmarkLightmapBaking()
+{
+    // Bakes the room's lightmap for the lights where they start, on one
+    // thread and on the worker pool, without shadows and with shadows cast
+    // by props standing in the room. Then shades a 1080p frame's worth of
+    // points on the room's surfaces the way the pixel shader does, per
+    // pixel with every light and from the lightmap, and reports how much
+    // the diffuse lighting of the two differs.
+
+    const int roomTriangles = sizeof(g_room) / sizeof(g_room[0]) / 3;
+    const int numLights = MAX_LIGHTS_SM30;
+    const int props = 16;
+    const int samples = 1920 * 1080;
+
+    WorkerPool serialPool;
+    Lightmap lightmap;
+    int surfaces[roomTriangles];
+
+    if (!serialPool.create(0))
+        return;
+
+    GetRoomTriangleSurfaces(surfaces);
+
+    if (!CreateLightmap(g_room, surfaces, roomTriangles, LIGHTMAP_TEXEL_SIZE, lightmap))
+        return;
+
+    // Shadows are cast by the props of a generated room of the same size,
+    // moved to where the room is.
+
+    SceneDesc desc = {SCENE_LAYOUT_GRID, 1, props, 0, SCENE_DEFAULT_SEED};
+    Scene scene;
+    std::vector<D3DXVECTOR3> occluderTriangles;
+    Octree occluders;
+
+    if (!GenerateScene(desc, g_workerPool, scene))
+        return;
+
+    const SceneRoom &room = scene.rooms[0];
+
+    for (int i = room.firstChunk + room.chunkCount - room.propCount; i < room.firstChunk + room.chunkCount; ++i)
+    {
+        const SceneChunk &chunk = scene.chunks[i];
+
+        for (int j = chunk.firstVertex; j < chunk.firstVertex + chunk.vertexCount; ++j)
+        {
+            const Vertex &vertex = scene.vertices[j];
+
+            occluderTriangles.push_back(D3DXVECTOR3(vertex.pos[0] - room.center[0],
+                vertex.pos[1] - room.center[1], vertex.pos[2] - room.center[2]));
+        }
+    }
+
+    int occluderCount = static_cast<int>(occluderTriangles.size() / 3);
+
+    BuildTriangleOctree(&occluderTriangles[0], occluderCount, occluders);
+
+    PointLight lights[MAX_LIGHTS_SM30];
+    int usedTexels = 0;
+
+    memcpy(lights, g_lights, sizeof(lights));
+
+    for (int i = 0; i < numLights; ++i)
+        memcpy(lights[i].renderPos, lights[i].pos, sizeof(lights[i].pos));
+
+    for (size_t i = 0; i < lightmap.texelCharts.size(); ++i)
+        usedTexels += (lightmap.texelCharts[i] >= 0) ? 1 : 0;
+
+    BenchmarkPrint("%dx%d lightmap, %d texels covering the room at %g units per texel, %d lights, %d shadow casting triangles\n",
+        lightmap.width, lightmap.height, usedTexels, LIGHTMAP_TEXEL_SIZE, numLights, occluderCount);
+
+    std::vector<float> shadowless;
+
+    for (int shadows = 0; shadows < 2; ++shadows)
+    {
+        std::vector<float> serialTexels;
+        double times[2];
+        int raysTraced = 0;
+
+        for (int parallel = 0; parallel < 2; ++parallel)
+        {
+            LightmapBake bake = {};
+            WorkerPool &pool = parallel ? g_workerPool : serialPool;
+
+            bake.pLightmap = &lightmap;
+            bake.pMaterials[ROOM_SURFACE_WALLS] = &g_dullMaterial;
+            bake.pMaterials[ROOM_SURFACE_CEILING] = &g_shinyMaterial;
+            bake.pMaterials[ROOM_SURFACE_FLOOR] = &g_shinyMaterial;
+            bake.pOccluders = shadows ? &occluders : 0;
+            bake.pOccluderTriangles = &occluderTriangles[0];
+            memcpy(bake.ambient, g_sceneAmbient, sizeof(bake.ambient));
+
+            StartLightmapBake(bake, pool, lights, numLights, 0);
+            FinishLightmapBake(bake, pool);
+
+            times[parallel] = bake.bakeTimeMs / 1000.0;
+            raysTraced = bake.raysTraced;
+
+            if (!parallel)
+                serialTexels = lightmap.texels;
+        }
+
+        bool identical = serialTexels == lightmap.texels;
+
+        BenchmarkPrint("  %s: %.1f ms on 1 thread, %.1f ms on %d threads (%.1fx), %.2f M texels/s, %d shadow rays%s\n",
+            shadows ? "with shadows" : "no shadows", times[0] * 1000.0, times[1] * 1000.0, g_workerPool.numThreads + 1,
+            times[0] / times[1], usedTexels / times[1] / 1000000.0, raysTraced, identical ? "" : " [MISMATCH]");
+
+        if (!shadows)
+            shadowless = lightmap.texels;
+    }
+
+    // Shade points spread over the room's surfaces, seen from the middle
+    // of the room, using the shadowless lightmap.
+
+    lightmap.texels.swap(shadowless);
+
+    float uPlanes[LIGHTMAP_FACES][4];
+    float vPlanes[LIGHTMAP_FACES][4];
+    std::vector<D3DXVECTOR3> points(samples);
+    std::vector<int> pointCharts(samples);
+    unsigned int seed = 1;
+
+    GetLightmapPlanes(lightmap, uPlanes, vPlanes);
+
+    for (int i = 0; i < samples; ++i)
+    {
+        int texel = 0;
+
+        do
+            texel = NextRandom(seed) % (lightmap.width * lightmap.height);
+        while (lightmap.texelCharts[texel] < 0);
+
+        const LightmapChart &chart = lightmap.charts[lightmap.texelCharts[texel]];
+        float *pPos = points[i];
+
+        GetLightmapTexelPosition(lightmap, chart, texel % lightmap.width, texel / lightmap.width, pPos);
+        pPos[chart.uAxis] = min(max(pPos[chart.uAxis] + (NextRandomFloat(seed) - 0.5f) * lightmap.texelSize,
+            chart.origin[chart.uAxis]), chart.origin[chart.uAxis] + chart.size[0]);
+        pPos[chart.vAxis] = min(max(pPos[chart.vAxis] + (NextRandomFloat(seed) - 0.5f) * lightmap.texelSize,
+            chart.origin[chart.vAxis]), chart.origin[chart.vAxis] + chart.size[1]);
+        pointCharts[i] = lightmap.texelCharts[texel];
+    }
+
+    std::vector<float> colors[2];
+    double times[2];
+
+    for (int useLightmap = 0; useLightmap < 2; ++useLightmap)
+    {
+        double startTime = GetTimeInSeconds();
+
+        colors[useLightmap].resize(samples * 4);
+
+        for (int i = 0; i < samples; ++i)
+        {
+            const LightmapChart &chart = lightmap.charts[pointCharts[i]];
+            const float *pPos = points[i];
+            float *pColor = &colors[useLightmap][i * 4];
+
+            memset(pColor, 0, sizeof(float) * 4);
+
+            if (useLightmap)
+            {
+                int face = GetLightmapFace(chart.normal);
+                float coords[2] =
+                {
+                    pPos[0] * uPlanes[face][0] + pPos[1] * uPlanes[face][1] + pPos[2] * uPlanes[face][2] + uPlanes[face][3],
+                    pPos[0] * vPlanes[face][0] + pPos[1] * vPlanes[face][1] + pPos[2] * vPlanes[face][2] + vPlanes[face][3]
+                };
+
+                SampleLightmap(lightmap, coords, pColor);
+            }
+            else
+            {
+                const Material &material = GetRoomSurfaceMaterial(chart.surface);
+                D3DXVECTOR3 viewDir(-pPos[0], -pPos[1], -pPos[2]);
+
+                D3DXVec3Normalize(&viewDir, &viewDir);
+
+                for (int j = 0; j < numLights; ++j)
+                    ShadePointLight(lights[j], pPos, chart.normal, viewDir, material, g_sceneAmbient, true, pColor);
+            }
+        }
+
+        times[useLightmap] = GetTimeInSeconds() - startTime;
+    }
+
+    // The lightmap should match the per pixel lighting without its
+    // specular term.
+
+    double error = 0.0;
+    float maxError = 0.0f;
+
+    for (int i = 0; i < samples; ++i)
+    {
+        const LightmapChart &chart = lightmap.charts[pointCharts[i]];
+        const Material &material = GetRoomSurfaceMaterial(chart.surface);
+        float expected[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+        for (int j = 0; j < numLights; ++j)
+            ShadePointLight(lights[j], points[i], chart.normal, 0, material, g_sceneAmbient, true, expected);
+
+        for (int c = 0; c < 3; ++c)
+        {
+            float difference = fabsf(colors[1][i * 4 + c] - expected[c]);
+
+            error += difference;
+            maxError = max(maxError, difference);
+        }
+    }
+
+    BenchmarkPrint("  1080p frame of room pixels on 1 thread: %.1f ms lit per pixel by %d lights, %.1f ms from the lightmap (%.1fx)\n",
+        times[0] * 1000.0, numLights, times[1] * 1000.0, times[0] / times[1]);
+    BenchmarkPrint("  lightmap against per pixel diffuse lighting: %.4f mean, %.4f max difference per channel\n",
+        error / (samples * 3.0), maxError);
+
+    serialPool.destroy();
+}
+
+void BenchmarkManyLights()
+{
+    // Lights a 320x180 view of the room, cast on the CPU, with 1000 to
+    // 100000 lights that overlap heavily, scaled down so that together
+    // they are as bright as the demo's lights. Compares the cost of
+    // summing every light with estimating the sum from a few lights
+    // sampled per pixel, and the error of the estimates, alone, denoised
+    // and accumulated over frames, and with working it out from light
+    // cuts at a few error thresholds. Then takes the lights' ambient terms
+    // from an irradiance volume instead, which leaves the lights and the
+    // cuts only their direct lighting. The exact sum, the cuts and the
+    // volume are only worked out for every fourth pixel each way. Ends
+    // with the number of lights from which light cuts are the faster.
+
+    static const int lightCounts[] = {1000, 10000, 100000};
+    static const int sampleCounts[] = {1, LIGHT_SAMPLES_PER_PIXEL, 16};
+    static const float cutErrors[] = {0.005f, LIGHT_CUT_MAX_ERROR, 0.1f};
+
+    const int width = 320;
+    const int height = 180;
+    const int referenceStep = 4;
+    const int frames = 16;
+    const int pixels = width * height;
+
+    // Cast a ray through each pixel from near the -Z wall.
+
+    D3DXVECTOR3 eye(0.0f, 0.0f, -ROOM_SIZE_Z_HALF + 16.0f);
+    D3DXVECTOR3 forward(0.0f, -0.2f, 1.0f);
+    D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+    D3DXVECTOR3 right;
+    std::vector<float> positions(pixels * 3);
+    std::vector<float> normals(pixels * 3);
+    std::vector<float> viewDirs(pixels * 3);
+    std::vector<int> surfaces(pixels);
+
+    D3DXVec3Normalize(&forward, &forward);
+    D3DXVec3Cross(&right, &up, &forward);
+    D3DXVec3Normalize(&right, &right);
+    D3DXVec3Cross(&up, &forward, &right);
+    CastRoomView(eye, forward, right, up, width, height, &positions[0], &normals[0], &viewDirs[0], &surfaces[0]);
+
+    std::vector<int> referencePixels;
+
+    for (int y = referenceStep / 2; y < height; y += referenceStep)
+    {
+        for (int x = referenceStep / 2; x < width; x += referenceStep)
+            referencePixels.push_back(y * width + x);
+    }
+
+    int referenceCount = static_cast<int>(referencePixels.size());
+    double cutSpeedups[sizeof(lightCounts) / sizeof(lightCounts[0])];   // at LIGHT_CUT_MAX_ERROR
+
+    for (int i = 0; i < sizeof(lightCounts) / sizeof(lightCounts[0]); ++i)
+    {
+        int count = lightCounts[i];
+        float scale = static_cast<float>(MAX_LIGHTS_SM30) / count;
+        std::vector<PointLight> lights(count);
+        unsigned int seed = 1;
+
+        for (int j = 0; j < count; ++j)
+        {
+            PointLight &light = lights[j];
+            const float halfSizes[3] = {ROOM_SIZE_X_HALF, ROOM_SIZE_Y_HALF, ROOM_SIZE_Z_HALF};
+
+            light = g_lights[j % MAX_LIGHTS_SM30];
+
+            for (int c = 0; c < 3; ++c)
+            {
+                light.pos[c] = (NextRandomFloat(seed) * 2.0f - 1.0f) * (halfSizes[c] - LIGHT_OBJECT_RADIUS);
+                light.ambient[c] *= scale;
+                light.diffuse[c] *= scale;
+                light.specular[c] *= scale;
+            }
+
+            light.radius = ROOM_SIZE_Y * (0.5f + NextRandomFloat(seed));
+            memcpy(light.renderPos, light.pos, sizeof(light.pos));
+        }
+
+        LightTree tree;
+        double startTime = GetTimeInSeconds();
+
+        BuildLightTree(&lights[0], count, tree);
+
+        double buildTime = GetTimeInSeconds() - startTime;
+
+        // The exact sum, and how many lights reach each pixel.
+
+        std::vector<float> reference(referenceCount * 4, 0.0f);
+        static const float noAmbient[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        ULONGLONG reaching = 0;
+
+        startTime = GetTimeInSeconds();
+
+        for (int j = 0; j < referenceCount; ++j)
+        {
+            int pixel = referencePixels[j];
+            const Material &material = GetRoomSurfaceMaterial(surfaces[pixel]);
+
+            for (int k = 0; k < count; ++k)
+            {
+                ShadePointLight(lights[k], &positions[pixel * 3], &normals[pixel * 3], &viewDirs[pixel * 3],
+                    material, noAmbient, true, &reference[j * 4]);
+            }
+        }
+
+        double exactTime = (GetTimeInSeconds() - startTime) / referenceCount;
+
+        for (int j = 0; j < referenceCount; ++j)
+        {
+            int pixel = referencePixels[j];
+
+            for (int k = 0; k < count; ++k)
+            {
+                float distanceSq = 0.0f;
+
+                for (int c = 0; c < 3; ++c)
+                    distanceSq += (lights[k].pos[c] - positions[pixel * 3 + c]) * (lights[k].pos[c] - positions[pixel * 3 + c]);
+
+                reaching += (distanceSq < lights[k].radius * lights[k].radius) ? 1 : 0;
+            }
+        }
+
+        BenchmarkPrint("%d lights, %.0f reaching each pixel, light tree of %d nodes built in %.1f ms\n",
+            count, static_cast<double>(reaching) / referenceCount, static_cast<int>(tree.nodes.size()),
+            buildTime * 1000.0);
+        BenchmarkPrint("  every light: %.2f us per pixel\n", exactTime * 1000000.0);
+
+        // Estimates from a few lights per pixel, and how far they are from
+        // the exact sum, in proportion to its size.
+
+        std::vector<float> estimate(pixels * 4);
+        std::vector<float> history(pixels * 4);
+        std::vector<float> denoised(pixels * 4);
+        std::vector<float> gathered(referenceCount * 4);
+
+        for (int j = 0; j < sizeof(sampleCounts) / sizeof(sampleCounts[0]); ++j)
+        {
+            int samples = sampleCounts[j];
+            int accumulate = (samples == LIGHT_SAMPLES_PER_PIXEL) ? frames : 1;
+            double sampleTime = 0.0;
+            double denoiseTime = 0.0;
+            double errors[3] = {0.0, 0.0, 0.0};   // single frame, denoised, accumulated and denoised
+
+            for (int frame = 0; frame < accumulate; ++frame)
+            {
+                startTime = GetTimeInSeconds();
+
+                for (int pixel = 0; pixel < pixels; ++pixel)
+                {
+                    const Material &material = GetRoomSurfaceMaterial(surfaces[pixel]);
+
+                    memset(&estimate[pixel * 4], 0, sizeof(float) * 4);
+                    EstimateLighting(tree, &positions[pixel * 3], &normals[pixel * 3], &viewDirs[pixel * 3],
+                        material, samples, seed, &estimate[pixel * 4]);
+                }
+
+                sampleTime += GetTimeInSeconds() - startTime;
+                DenoiseLightingOverFrames(&estimate[0], pixels, frame == 0, &history[0]);
+            }
+
+            for (int pass = 0; pass < 3; ++pass)
+            {
+                const float *pColors = &estimate[0];
+
+                if (pass > 0)
+                {
+                    startTime = GetTimeInSeconds();
+                    DenoiseLighting((pass == 1) ? &estimate[0] : &history[0], &positions[0], &normals[0],
+                        width, height, &denoised[0]);
+                    denoiseTime = GetTimeInSeconds() - startTime;
+                    pColors = &denoised[0];
+                }
+
+                for (int k = 0; k < referenceCount; ++k)
+                    memcpy(&gathered[k * 4], &pColors[referencePixels[k] * 4], sizeof(float) * 4);
+
+                errors[pass] = 100.0 * GetRelativeError(&gathered[0], &reference[0], referenceCount, 0);
+            }
+
+            BenchmarkPrint("  %2d samples per pixel: %.2f us per pixel (%.0fx faster), %.1f%% error, %.1f%% denoised (%.2f us per pixel more)",
+                samples, sampleTime * 1000000.0 / (accumulate * pixels), exactTime * accumulate * pixels / sampleTime,
+                errors[0], errors[1], denoiseTime * 1000000.0 / pixels);
+
+            if (accumulate > 1)
+                BenchmarkPrint(", %.1f%% accumulated over %d frames and denoised", errors[2], accumulate);
+
+            BenchmarkPrint("\n");
+        }
+
+        // Light cuts need no denoising, as neighboring pixels' cuts tend to
+        // be alike and so are their errors.
+
+        for (int j = 0; j < sizeof(cutErrors) / sizeof(cutErrors[0]); ++j)
+        {
+            std::vector<float> cut(referenceCount * 4, 0.0f);
+            ULONGLONG cutSize = 0;
+
+            startTime = GetTimeInSeconds();
+
+            for (int k = 0; k < referenceCount; ++k)
+            {
+                int pixel = referencePixels[k];
+                const Material &material = GetRoomSurfaceMaterial(surfaces[pixel]);
+
+                cutSize += ShadeLightCut(tree, &positions[pixel * 3], &normals[pixel * 3], &viewDirs[pixel * 3],
+                    material, cutErrors[j], &cut[k * 4]);
+            }
+
+            double cutTime = (GetTimeInSeconds() - startTime) / referenceCount;
+
+            if (cutErrors[j] == LIGHT_CUT_MAX_ERROR)
+                cutSpeedups[i] = exactTime / cutTime;
+
+            BenchmarkPrint("  light cuts to %4.1f%%: %.2f us per pixel (%.1fx faster), %.0f clusters, %.1f%% error\n",
+                cutErrors[j] * 100.0f, cutTime * 1000000.0, exactTime / cutTime,
+                static_cast<double>(cutSize) / referenceCount,
+                100.0 * GetRelativeError(&cut[0], &reference[0], referenceCount, 0));
+        }
+
+        // The lights' ambient terms from an irradiance volume, updated once
+        // from scratch, then after a tenth of the lights move and again
+        // after they move back.
+
+        const float roomMin[3] = {-ROOM_SIZE_X_HALF, -ROOM_SIZE_Y_HALF, -ROOM_SIZE_Z_HALF};
+        const float roomMax[3] = {ROOM_SIZE_X_HALF, ROOM_SIZE_Y_HALF, ROOM_SIZE_Z_HALF};
+        std::vector<PointLight> movedLights(lights);
+        std::vector<PointLight> directLights(lights);
+        IrradianceVolume volume;
+        LightTree directTree;
+
+        CreateIrradianceVolume(roomMin, roomMax, IRRADIANCE_CELL_SIZE, volume);
+
+        startTime = GetTimeInSeconds();
+        UpdateIrradianceVolume(volume, &lights[0], count, g_workerPool);
+
+        double rebuildTime = GetTimeInSeconds() - startTime;
+
+        for (int j = 0; j < count; j += 10)
+        {
+            for (int c = 0; c < 3; ++c)
+                movedLights[j].renderPos[c] += (NextRandomFloat(seed) * 2.0f - 1.0f) * LIGHT_OBJECT_RADIUS;
+        }
+
+        startTime = GetTimeInSeconds();
+        UpdateIrradianceVolume(volume, &movedLights[0], count, g_workerPool);
+        UpdateIrradianceVolume(volume, &lights[0], count, g_workerPool);
+
+        double updateTime = (GetTimeInSeconds() - startTime) * 0.5;
+
+        for (int j = 0; j < count; ++j)
+            memset(directLights[j].ambient, 0, sizeof(directLights[j].ambient));
+
+        BuildLightTree(&directLights[0], count, directTree);
+        BenchmarkPrint("  irradiance volume of %dx%dx%d: built in %.2f ms, %.2f ms to move a tenth of the lights (%d threads)\n",
+            volume.corners[0], volume.corners[1], volume.corners[2], rebuildTime * 1000.0, updateTime * 1000.0,
+            g_workerPool.numThreads + 1);
+
+        for (int pass = 0; pass < 3; ++pass)
+        {
+            std::vector<float> shaded(referenceCount * 4, 0.0f);
+
+            startTime = GetTimeInSeconds();
+
+            for (int k = 0; k < referenceCount; ++k)
+            {
+                int pixel = referencePixels[k];
+                const Material &material = GetRoomSurfaceMaterial(surfaces[pixel]);
+                float ambient[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+                float *pColor = &shaded[k * 4];
+
+                SampleIrradianceVolume(volume, &positions[pixel * 3], ambient);
+
+                for (int c = 0; c < 4; ++c)
+                    pColor[c] += material.ambient[c] * ambient[c];
+
+                if (pass == 1)
+                {
+                    EstimateLighting(directTree, &positions[pixel * 3], &normals[pixel * 3], &viewDirs[pixel * 3],
+                        material, LIGHT_SAMPLES_PER_PIXEL, seed, pColor);
+                    continue;
+                }
+
+                if (pass == 2)
+                {
+                    ShadeLightCut(directTree, &positions[pixel * 3], &normals[pixel * 3], &viewDirs[pixel * 3],
+                        material, LIGHT_CUT_MAX_ERROR, pColor);
+                    continue;
+                }
+
+                for (int j = 0; j < count; ++j)
+                {
+                    ShadePointLight(directLights[j], &positions[pixel * 3], &normals[pixel * 3], &viewDirs[pixel * 3],
+                        material, noAmbient, true, pColor);
+                }
+            }
+
+            double shadeTime = (GetTimeInSeconds() - startTime) / referenceCount;
+            double error = 100.0 * GetRelativeError(&shaded[0], &reference[0], referenceCount, 0);
+
+            if (pass == 0)
+                BenchmarkPrint("  every light");
+            else if (pass == 1)
+                BenchmarkPrint("  %2d samples per pixel", LIGHT_SAMPLES_PER_PIXEL);
+            else
+                BenchmarkPrint("  light cuts to %4.1f%%", LIGHT_CUT_MAX_ERROR * 100.0f);
+
+            BenchmarkPrint(", ambient from the volume: %.2f us per pixel (%.1fx faster), %.1f%% error\n",
+                shadeTime * 1000000.0, exactTime / shadeTime, error);
+        }
+    }
+
+    // Where light cuts start to beat summing every light, interpolating the
+    // speedup between the light counts on a log-log scale.
+
+    int numCounts = sizeof(lightCounts) / sizeof(lightCounts[0]);
+
+    for (int i = 0; i < numCounts; ++i)
+    {
+        if (cutSpeedups[i] < 1.0)
+            continue;
+
+        if (i == 0)
+        {
+            BenchmarkPrint("light cuts to %.1f%% beat every light from %d lights or fewer\n",
+                LIGHT_CUT_MAX_ERROR * 100.0f, lightCounts[0]);
+        }
+        else
+        {
+            double t = -log(cutSpeedups[i - 1]) / (log(cutSpeedups[i]) - log(cutSpeedups[i - 1]));
+            double crossover = lightCounts[i - 1] * pow(static_cast<double>(lightCounts[i]) / lightCounts[i - 1], t);
+
+            BenchmarkPrint("light cuts to %.1f%% beat every light from about %.0f lights\n",
+                LIGHT_CUT_MAX_ERROR * 100.0f, crossover);
+        }
+
+        return;
+    }
+
+    BenchmarkPrint("light cuts to %.1f%% never beat every light up to %d lights\n",
+        LIGHT_CUT_MAX_ERROR * 100.0f, lightCounts[numCounts - 1]);
+}
+
+void BenchmarkMeshLoading()
+{
+    // Writes a torus of about 240 MB as an OBJ file and parses it on one
+    // thread and on the worker threads, then welds and optimizes it and
+    // cooks it into a mesh cache file. Loading the cooked mesh is timed cold,
+    // read unbuffered so that it comes from the disk rather than the file
+    // cache, and warm, mapped from the file cache with every page touched.
+    // The OBJ file has just been written, so both parses read it warm.
+
+    const int rings = 1200;
+    const int sides = 1200;
+
+    char szTempPath[MAX_PATH];
+    char szObjFilename[MAX_PATH];
+    char szCacheFilename[MAX_PATH];
+    WorkerPool serialPool;
+    std::vector<Vertex> serialTriangles;
+    std::vector<Vertex> triangles;
+    ULONGLONG sourceSize = 0;
+    ULONGLONG sourceTime = 0;
+
+    if (!GetTempPath(sizeof(szTempPath), szTempPath))
+        strcpy(szTempPath, ".\\");
+
+    snprintf(szObjFilename, sizeof(szObjFilename), "%smesh_benchmark.obj", szTempPath);
+    snprintf(szCacheFilename, sizeof(szCacheFilename), "%s%s", szObjFilename, MESH_CACHE_EXTENSION);
+
+    if (!serialPool.create(0))
+        return;
+
+    double startTime = GetTimeInSeconds();
+
+    if (!WriteTorusObj(szObjFilename, rings, sides) || !GetFileStamp(szObjFilename, sourceSize, sourceTime))
+    {
+        BenchmarkPrint("Failed to write %s\n", szObjFilename);
+        DeleteFile(szObjFilename);
+        serialPool.destroy();
+        return;
+    }
+
+    double megabytes = sourceSize / (1024.0 * 1024.0);
+
+    BenchmarkPrint("OBJ: %.1f MB, %d x %d quads, written in %.2f s\n", megabytes, rings, sides,
+        GetTimeInSeconds() - startTime);
+
+    // Parse.
+
+    startTime = GetTimeInSeconds();
+    bool parsed = ParseObjFile(szObjFilename, serialPool, serialTriangles);
+    double serialTime = GetTimeInSeconds() - startTime;
+
+    startTime = GetTimeInSeconds();
+    parsed = ParseObjFile(szObjFilename, g_workerPool, triangles) && parsed;
+    double parallelTime = GetTimeInSeconds() - startTime;
+
+    serialPool.destroy();
+    DeleteFile(szObjFilename);
+
+    if (!parsed || triangles.empty())
+    {
+        BenchmarkPrint("Failed to parse %s\n", szObjFilename);
+        return;
+    }
+
+    bool identical = serialTriangles.size() == triangles.size() &&
+                     memcmp(&serialTriangles[0], &triangles[0], sizeof(Vertex) * triangles.size()) == 0;
+
+    std::vector<Vertex>().swap(serialTriangles);
+
+    BenchmarkPrint("Parse, 1 thread: %.2f s, %.0f MB/s\n", serialTime, megabytes / max(serialTime, 1e-9));
+    BenchmarkPrint("Parse, %d threads: %.2f s, %.0f MB/s (%.1fx), %u triangles, %s\n",
+        g_workerPool.numThreads + 1, parallelTime, megabytes / max(parallelTime, 1e-9),
+        serialTime / max(parallelTime, 1e-9), static_cast<unsigned int>(triangles.size() / 3),
+        identical ? "same result" : "RESULTS DIFFER");
+
+    // Weld, optimize and cook.
+
+    Mesh mesh;
+    CookedMesh cooked = {};
+
+    startTime = GetTimeInSeconds();
+    CreateIndexedMesh(&triangles[0], static_cast<int>(triangles.size()), mesh);
+    std::vector<Vertex>().swap(triangles);
+
+    double weldTime = GetTimeInSeconds() - startTime;
+
+    startTime = GetTimeInSeconds();
+    OptimizeVertexCache(&mesh.indices[0], static_cast<int>(mesh.indices.size()), static_cast<int>(mesh.vertices.size()));
+    OptimizeVertexFetch(mesh);
+
+    double optimizeTime = GetTimeInSeconds() - startTime;
+
+    startTime = GetTimeInSeconds();
+
+    if (!CreateCookedMesh(mesh, cooked) || !WriteMeshCache(szCacheFilename, sourceSize, sourceTime, cooked))
+    {
+        BenchmarkPrint("Failed to write %s\n", szCacheFilename);
+        DestroyCookedMesh(cooked);
+        return;
+    }
+
+    double cookTime = GetTimeInSeconds() - startTime;
+    double cacheMegabytes = (sizeof(MeshCacheHeader) + cooked.dataSize) / (1024.0 * 1024.0);
+
+    BenchmarkPrint("Weld: %.2f s, %u vertices; optimize: %.2f s; cook: %.2f s, %.1f MB\n",
+        weldTime, cooked.vertexCount, optimizeTime, cookTime, cacheMegabytes);
+
+    // Cold load. Unbuffered reads have to be sector aligned in both the file
+    // and memory, so the whole file is read into page aligned memory.
+
+    size_t alignedSize = (sizeof(MeshCacheHeader) + cooked.dataSize + 65535) & ~static_cast<size_t>(65535);
+    BYTE *pBuffer = static_cast<BYTE*>(VirtualAlloc(0, alignedSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    HANDLE hFile = CreateFile(szCacheFilename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                    FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    size_t bytesRead = 0;
+
+    startTime = GetTimeInSeconds();
+
+    if (pBuffer && hFile != INVALID_HANDLE_VALUE)
+    {
+        DWORD readSize = 0;
+
+        do
+        {
+            DWORD requestSize = static_cast<DWORD>(min(alignedSize - bytesRead, static_cast<size_t>(16 * 1024 * 1024)));
+
+            if (requestSize == 0 || !ReadFile(hFile, pBuffer + bytesRead, requestSize, &readSize, 0))
+                break;
+
+            bytesRead += readSize;
+        }
+        while (readSize > 0);
+    }
+
+    double coldTime = GetTimeInSeconds() - startTime;
+    bool coldOk = bytesRead == sizeof(MeshCacheHeader) + cooked.dataSize &&
+                  memcmp(pBuffer + sizeof(MeshCacheHeader), cooked.pMemory, cooked.dataSize) == 0;
+
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+
+    if (pBuffer)
+        VirtualFree(pBuffer, 0, MEM_RELEASE);
+
+    // Warm load.
+
+    CookedMesh mapped = {};
+    volatile BYTE touch = 0;
+
+    startTime = GetTimeInSeconds();
+
+    bool mappedOk = MapMeshCache(szCacheFilename, sourceSize, sourceTime, mapped);
+
+    if (mappedOk)
+    {
+        const BYTE *pData = reinterpret_cast<const BYTE*>(mapped.pVertices);
+
+        for (size_t i = 0; i < mapped.dataSize; i += 4096)
+            touch ^= pData[i];
+    }
+
+    double warmTime = GetTimeInSeconds() - startTime;
+
+    mappedOk = mappedOk && mapped.dataSize == cooked.dataSize &&
+               memcmp(mapped.pVertices, cooked.pVertices, cooked.dataSize) == 0;
+
+    CookedMesh stale = {};
+    bool staleRejected = !MapMeshCache(szCacheFilename, sourceSize, sourceTime + 1, stale);
+
+    BenchmarkPrint("Cooked load, cold: %.1f ms, %.0f MB/s%s\n", coldTime * 1000.0,
+        cacheMegabytes / max(coldTime, 1e-9), coldOk ? "" : " (FAILED)");
+    BenchmarkPrint("Cooked load, warm: %.1f ms, %.0f MB/s%s; stale cache %s\n", warmTime * 1000.0,
+        cacheMegabytes / max(warmTime, 1e-9), mappedOk ? "" : " (FAILED)",
+        staleRejected ? "rejected" : "NOT REJECTED");
+    BenchmarkPrint("Warm cooked load is %.0fx faster than parsing, welding and optimizing\n",
+        (parallelTime + weldTime + optimizeTime) / max(warmTime, 1e-9));
+
+    DestroyCookedMesh(stale);
+    DestroyCookedMesh(mapped);
+    DestroyCookedMesh(cooked);
+    DeleteFile(szCacheFilename);
+}
+
+void BenchmarkMipGeneration()
+{
+    // Checks the accuracy of GenerateMipChain() against the double precision
+    // reference on each shipped color map, at its own size and resampled to
+    // an odd size, and then measures its throughput on the color maps
+    // upscaled to 8192 x 8192, with and without worker threads.
+
+    static const char *textures[] =
+    {
+        "Content/Textures/brick_color_map.jpg",
+        "Content/Textures/wood_color_map.jpg",
+        "Content/Textures/stone_color_map.jpg"
+    };
+
+    const int largeSize = 8192;
+    WorkerPool serialPool;
+
+    if (!serialPool.create(0))
+        return;
+
+    for (int t = 0; t < sizeof(textures) / sizeof(textures[0]); ++t)
+    {
+        std::vector<BYTE> fileData;
+        Image source = {0};
+
+        if (!ReadFileContents(textures[t], fileData) ||
+            !DecodeImage(&fileData[0], fileData.size(), source))
+        {
+            BenchmarkPrint("%s: failed to load\n", textures[t]);
+            continue;
+        }
+
+        // Accuracy.
+
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            Image test = {0};
+            Image reference = {0};
+            int width = (pass == 0) ? source.width : ((source.width * 3 / 4) | 1);
+            int height = (pass == 0) ? source.height : ((source.height * 3 / 4) | 1);
+
+            if (!ResizeImage(source, width, height, test) || !ResizeImage(source, width, height, reference))
+            {
+                DestroyImage(test);
+                continue;
+            }
+
+            GenerateMipChain(test, g_workerPool);
+
+            double startTime = GetTimeInSeconds();
+            GenerateMipChainReference(reference);
+            double referenceTime = GetTimeInSeconds() - startTime;
+
+            size_t totalValues = 0;
+            size_t mismatches = 0;
+            int maxError = 0;
+            const BYTE *pTest = reinterpret_cast<const BYTE*>(test.pPixels + test.levelOffsets[1]);
+            const BYTE *pReference = reinterpret_cast<const BYTE*>(reference.pPixels + reference.levelOffsets[1]);
+
+            for (int i = 1; i < test.levels; ++i)
+                totalValues += static_cast<size_t>(max(1, width >> i)) * max(1, height >> i) * 4;
+
+            for (size_t i = 0; i < totalValues; ++i)
+            {
+                int error = abs(pTest[i] - pReference[i]);
+
+                if (error != 0)
+                    ++mismatches;
+
+                if (error > maxError)
+                    maxError = error;
+            }
+
+            BenchmarkPrint("%s %dx%d: max error %d, %.4f%% of values differ from the reference (reference %.1f MP/s)\n",
+                textures[t], width, height, maxError, 100.0 * mismatches / max(totalValues, size_t(1)),
+                width * height / referenceTime / 1000000.0);
+
+            DestroyImage(test);
+            DestroyImage(reference);
+        }
+
+        // Throughput.
+
+        Image large = {0};
+
+        if (!ResizeImage(source, largeSize, largeSize, large))
+        {
+            BenchmarkPrint("%s: failed to allocate a %dx%d image\n", textures[t], largeSize, largeSize);
+            DestroyImage(source);
+            continue;
+        }
+
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            WorkerPool &pool = (pass == 0) ? serialPool : g_workerPool;
+            double bestTime = 0.0;
+
+            for (int run = 0; run < 3; ++run)
+            {
+                double startTime = GetTimeInSeconds();
+                GenerateMipChain(large, pool);
+                double time = GetTimeInSeconds() - startTime;
+
+                if (run == 0 || time < bestTime)
+                    bestTime = time;
+            }
+
+            BenchmarkPrint("%s %dx%d, %d threads: %.1f ms, %.1f MP/s\n", textures[t], largeSize, largeSize,
+                pool.numThreads + 1, bestTime * 1000.0, largeSize * static_cast<double>(largeSize) / bestTime / 1000000.0);
+        }
+
+        DestroyImage(large);
+        DestroyImage(source);
+    }
+
+    serialPool.destroy();
+}
+
+void BenchmarkOcclusionCulling()
+{
+    // Walks a camera through large generated scenes at 1920x1080 and culls
+    // each frame's chunks and lights with octrees and then the occlusion
+    // buffer. Reports how many of the chunks and lights in the frustum the
+    // walls hide, and how long rasterizing the walls and testing against
+    // them takes. Then times culling a frame with the walls rasterized
+    // before the frustum culling, and on a worker thread alongside it.
+
+    static const struct
+    {
+        const char *pszLayout;
+        int layout;
+        int rooms;
+        int props;
+        int lights;
+    }
+    scenes[] =
+    {
+        { "grid", SCENE_LAYOUT_GRID, 10000, 100000, 1000000 },
+        { "maze", SCENE_LAYOUT_MAZE, 10000, 20000, 100000 }
+    };
+
+    const int frames = 300;
+    const int screenWidth = 1920;
+    const int screenHeight = 1080;
+
+    OcclusionBuffer buffer;
+
+    if (!CreateOcclusionBuffer(OCCLUSION_BUFFER_WIDTH, OCCLUSION_BUFFER_HEIGHT, buffer))
+        return;
+
+    for (int i = 0; i < sizeof(scenes) / sizeof(scenes[0]); ++i)
+    {
+        SceneDesc desc = {scenes[i].layout, scenes[i].rooms, scenes[i].props, scenes[i].lights, SCENE_DEFAULT_SEED};
+        Scene scene;
+        Octree tree;
+        Octree lightTree;
+        OccluderSet occluders;
+
+        if (!GenerateScene(desc, g_workerPool, scene))
+            continue;
+
+        BuildSceneOctree(scene, g_workerPool, tree);
+        CreateSceneOccluders(scene, occluders);
+        InitOctree(lightTree, scene.boundsMin, scene.boundsMax);
+
+        for (int j = 0; j < desc.lights; ++j)
+        {
+            const PointLight &light = scene.lights[j];
+            float boundsMin[3];
+            float boundsMax[3];
+
+            for (int c = 0; c < 3; ++c)
+            {
+                boundsMin[c] = light.pos[c] - light.radius;
+                boundsMax[c] = light.pos[c] + light.radius;
+            }
+
+            InsertOctreeItem(lightTree, boundsMin, boundsMax, j);
+        }
+
+        BenchmarkPrint("%s, %d rooms, %d props, %d lights: %d occluders, %d occlusion buffer %dx%d\n",
+            scenes[i].pszLayout, desc.rooms, desc.props, desc.lights, static_cast<int>(occluders.occluders.size()),
+            buffer.levels, buffer.width, buffer.height);
+
+        std::vector<int> visible(scene.chunks.size());
+        std::vector<int> visibleLights(desc.lights);
+        ULONGLONG chunksInFrustum = 0;
+        ULONGLONG chunksOccluded = 0;
+        ULONGLONG lightsInFrustum = 0;
+        ULONGLONG lightsOccluded = 0;
+        ULONGLONG occludersDrawn = 0;
+        ULONGLONG trianglesDrawn = 0;
+        double rasterizeTime = 0.0;
+        double testTime = 0.0;
+        double serialTime = 0.0;
+        double overlappedTime = 0.0;
+        D3DXMATRIX view;
+        D3DXMATRIX projection;
+        D3DXMATRIX viewProjection;
+        D3DXPLANE planes[FRUSTUM_PLANES];
+        D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+
+        D3DXMatrixPerspectiveFovLH(&projection, CAMERA_FOVY,
+            static_cast<float>(screenWidth) / static_cast<float>(screenHeight), CAMERA_ZNEAR, CAMERA_ZFAR);
+
+        for (int overlapped = 0; overlapped < 2; ++overlapped)
+        {
+            OcclusionJob job = {};
+
+            job.pOccluders = &occluders;
+            job.pBuffer = &buffer;
+
+            for (int frame = 0; frame < frames; ++frame)
+            {
+                // The camera walks diagonally across the scene at eye
+                // height, turning from side to side.
+
+                float t = static_cast<float>(frame) / frames;
+                float heading = D3DX_PI * 0.25f + 0.75f * sinf(t * 6.0f * D3DX_PI);
+                D3DXVECTOR3 eye(
+                    scene.boundsMin[0] + (scene.boundsMax[0] - scene.boundsMin[0]) * (0.05f + 0.9f * t), 0.0f,
+                    scene.boundsMin[2] + (scene.boundsMax[2] - scene.boundsMin[2]) * (0.05f + 0.9f * t));
+                D3DXVECTOR3 target = eye + D3DXVECTOR3(cosf(heading), 0.0f, sinf(heading));
+
+                D3DXMatrixLookAtLH(&view, &eye, &target, &up);
+                viewProjection = view * projection;
+                GetFrustumPlanes(viewProjection, planes);
+
+                OcclusionStats stats = {};
+                OctreeCullStats cullStats;
+                double startTime = GetTimeInSeconds();
+                int count = 0;
+                int lightCount = 0;
+
+                if (overlapped)
+                {
+                    StartOcclusionJob(job, g_workerPool, viewProjection, eye);
+                    count = CullOctree(tree, planes, &visible[0], cullStats);
+                    lightCount = CullOctree(lightTree, planes, &visibleLights[0], cullStats);
+                    FinishOcclusionJob(job, g_workerPool);
+                    overlappedTime += GetTimeInSeconds() - startTime;
+                    continue;
+                }
+
+                RenderOccluders(occluders, viewProjection, eye, buffer, stats);
+                rasterizeTime += GetTimeInSeconds() - startTime;
+
+                count = CullOctree(tree, planes, &visible[0], cullStats);
+                lightCount = CullOctree(lightTree, planes, &visibleLights[0], cullStats);
+                serialTime += GetTimeInSeconds() - startTime;
+                startTime = GetTimeInSeconds();
+
+                for (int j = 0; j < count; ++j)
+                {
+                    const SceneChunk &chunk = scene.chunks[visible[j]];
+
+                    if (!TestOcclusionBox(buffer, chunk.boundsMin, chunk.boundsMax))
+                        ++chunksOccluded;
+                }
+
+                for (int j = 0; j < lightCount; ++j)
+                {
+                    const PointLight &light = scene.lights[visibleLights[j]];
+
+                    if (!TestOcclusionSphere(buffer, light.pos, light.radius))
+                        ++lightsOccluded;
+                }
+
+                testTime += GetTimeInSeconds() - startTime;
+                chunksInFrustum += count;
+                lightsInFrustum += lightCount;
+                occludersDrawn += stats.occluders;
+                trianglesDrawn += stats.triangles;
+            }
+        }
+
+        BenchmarkPrint("  %.0f occluders, %.0f triangles rasterized in %.2f ms per frame\n",
+            static_cast<double>(occludersDrawn) / frames, static_cast<double>(trianglesDrawn) / frames,
+            rasterizeTime * 1000.0 / frames);
+        BenchmarkPrint("  chunks: %.0f in frustum, %.1f%% occluded\n",
+            static_cast<double>(chunksInFrustum) / frames, 100.0 * chunksOccluded / max(1.0, static_cast<double>(chunksInFrustum)));
+        BenchmarkPrint("  lights: %.0f in frustum, %.1f%% occluded\n",
+            static_cast<double>(lightsInFrustum) / frames, 100.0 * lightsOccluded / max(1.0, static_cast<double>(lightsInFrustum)));
+        BenchmarkPrint("  occlusion tests: %.1f us per frame\n", testTime * 1000000.0 / frames);
+        BenchmarkPrint("  rasterizing and frustum culling: %.2f ms per frame one after the other, %.2f ms overlapped on %d threads\n",
+            serialTime * 1000.0 / frames, overlappedTime * 1000.0 / frames, g_workerPool.numThreads + 1);
+    }
+
+    DestroyOcclusionBuffer(buffer);
+}
+
+void BenchmarkPrint(const char *pszFormat, ...)
+{
+    char szText[1024];
+    va_list args;
+
+    va_start(args, pszFormat);
+    vsnprintf(szText, sizeof(szText), pszFormat, args);
+    va_end(args);
+
+    szText[sizeof(szText) - 1] = '\0';
+
+    if (g_pBenchmarkFile)
+    {
+        fputs(szText, g_pBenchmarkFile);
+        fflush(g_pBenchmarkFile);
+    }
+
+    OutputDebugString(szText);
+}
+
+void BenchmarkRoomSubmission()
+{
+    // Records what drawing the room submits with and without the texture
+    // atlas. Nothing is sent to a device: SubmitRoomBatches() only counts
+    // when it isn't given an effect.
+
+    SubmissionCounters counters[2] = {0};
+
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        RoomBatch batches[ROOM_MAX_BATCHES];
+        int count = BuildRoomBatches(mode == 1, batches);
+
+        SubmitRoomBatches(0, batches, count, counters[mode]);
+
+        BenchmarkPrint("%s: %d draw calls, %d effect rounds, %d parameter sets, %d texture binds\n",
+            (mode == 1) ? "Texture atlas" : "Separate textures", counters[mode].drawCalls,
+            counters[mode].effectRounds, counters[mode].parameterSets, counters[mode].textureBinds);
+    }
+
+    BenchmarkPrint("Reduction: %d -> %d draw calls, %d -> %d parameter sets per pass\n",
+        counters[0].drawCalls, counters[1].drawCalls,
+        counters[0].parameterSets, counters[1].parameterSets);
+}
+
+void BenchmarkSceneCulling()
+{
+    // Builds octrees over the chunks of large generated scenes on one thread
+    // and on the worker threads. Then moves a camera through each scene and
+    // compares culling with the octree against testing every chunk, both for
+    // a camera walking through the rooms and one circling high above them.
+    // Finally adds 100000 moving boxes to each octree, moves them every
+    // frame and removes them again.
+
+    static const struct
+    {
+        const char *pszLayout;
+        int layout;
+        int rooms;
+        int props;
+    }
+    scenes[] =
+    {
+        { "grid", SCENE_LAYOUT_GRID, 10000, 100000 },
+        { "maze", SCENE_LAYOUT_MAZE, 10000, 20000 }
+    };
+
+    const int frames = 600;
+    const int moveFrames = 120;
+    const int movingBoxes = 100000;
+    const float movingBoxSize = 4.0f;
+    const float movingBoxSpeed = 200.0f;
+    const int screenWidth = 1280;
+    const int screenHeight = 720;
+    const float frameTime = 1.0f / SIMULATION_RATE_HZ;
+
+    WorkerPool serialPool;
+
+    if (!serialPool.create(0))
+        return;
+
+    for (int i = 0; i < sizeof(scenes) / sizeof(scenes[0]); ++i)
+    {
+        SceneDesc desc = {scenes[i].layout, scenes[i].rooms, scenes[i].props, 0, SCENE_DEFAULT_SEED};
+        Scene scene;
+        Octree serialTree;
+        Octree tree;
+
+        if (!GenerateScene(desc, g_workerPool, scene))
+            continue;
+
+        double startTime = GetTimeInSeconds();
+
+        BuildSceneOctree(scene, serialPool, serialTree);
+
+        double serialTime = GetTimeInSeconds() - startTime;
+
+        startTime = GetTimeInSeconds();
+        BuildSceneOctree(scene, g_workerPool, tree);
+
+        double parallelTime = GetTimeInSeconds() - startTime;
+
+        bool identical = serialTree.nodes.size() == tree.nodes.size() &&
+                         memcmp(&serialTree.nodes[0], &tree.nodes[0], tree.nodes.size() * sizeof(OctreeNode)) == 0 &&
+                         memcmp(&serialTree.items[0], &tree.items[0], tree.items.size() * sizeof(OctreeItem)) == 0;
+
+        int chunkCount = static_cast<int>(scene.chunks.size());
+        int nodeCount = static_cast<int>(tree.nodes.size());
+
+        BenchmarkPrint("%s, %d rooms, %d props: %d chunks, %d octree nodes\n", scenes[i].pszLayout,
+            desc.rooms, desc.props, chunkCount, nodeCount);
+        BenchmarkPrint("  build: %.1f ms on 1 thread, %.1f ms on %d threads (%.2fx), %s\n",
+            serialTime * 1000.0, parallelTime * 1000.0, g_workerPool.numThreads + 1,
+            serialTime / parallelTime, identical ? "identical" : "DIFFERENT");
+
+        std::vector<int> visible(chunkCount);
+        std::vector<int> bruteForceVisible(chunkCount);
+        float extent = max(scene.boundsMax[0] - scene.boundsMin[0], scene.boundsMax[2] - scene.boundsMin[2]);
+        D3DXMATRIX view;
+        D3DXMATRIX projection;
+        D3DXMATRIX viewProjection;
+        D3DXPLANE planes[FRUSTUM_PLANES];
+        D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+
+        for (int overview = 0; overview < 2; ++overview)
+        {
+            ULONGLONG nodesVisited = 0;
+            ULONGLONG itemsTested = 0;
+            ULONGLONG itemsVisible = 0;
+            double octreeTime = 0.0;
+            double bruteForceTime = 0.0;
+            int mismatches = 0;
+
+            D3DXMatrixPerspectiveFovLH(&projection, CAMERA_FOVY,
+                static_cast<float>(screenWidth) / static_cast<float>(screenHeight),
+                CAMERA_ZNEAR, overview ? extent * 4.0f : CAMERA_ZFAR);
+
+            for (int frame = 0; frame < frames; ++frame)
+            {
+                float t = static_cast<float>(frame) / frames;
+                D3DXVECTOR3 eye;
+                D3DXVECTOR3 target;
+
+                if (overview)
+                {
+                    eye = D3DXVECTOR3(cosf(t * 2.0f * D3DX_PI) * extent * 0.5f, extent * 0.5f,
+                                      sinf(t * 2.0f * D3DX_PI) * extent * 0.5f);
+                    target = D3DXVECTOR3(0.0f, 0.0f, 0.0f);
+                }
+                else
+                {
+                    float heading = D3DX_PI * 0.25f + 0.75f * sinf(t * 6.0f * D3DX_PI);
+
+                    eye = D3DXVECTOR3(
+                        scene.boundsMin[0] + (scene.boundsMax[0] - scene.boundsMin[0]) * (0.05f + 0.9f * t), 0.0f,
+                        scene.boundsMin[2] + (scene.boundsMax[2] - scene.boundsMin[2]) * (0.05f + 0.9f * t));
+                    target = eye + D3DXVECTOR3(cosf(heading), 0.0f, sinf(heading));
+                }
+
+                D3DXMatrixLookAtLH(&view, &eye, &target, &up);
+                viewProjection = view * projection;
+                GetFrustumPlanes(viewProjection, planes);
+
+                OctreeCullStats stats;
+                OctreeCullStats bruteForceStats;
+
+                startTime = GetTimeInSeconds();
+
+                int count = CullOctree(tree, planes, &visible[0], stats);
+
+                octreeTime += GetTimeInSeconds() - startTime;
+                startTime = GetTimeInSeconds();
+
+                int bruteForceCount = CullSceneChunks(scene, planes, &bruteForceVisible[0], bruteForceStats);
+
+                bruteForceTime += GetTimeInSeconds() - startTime;
+
+                std::sort(visible.begin(), visible.begin() + count);
+
+                if (count != bruteForceCount || !std::equal(visible.begin(), visible.begin() + count, bruteForceVisible.begin()))
+                    ++mismatches;
+
+                nodesVisited += stats.nodesVisited;
+                itemsTested += stats.itemsTested;
+                itemsVisible += stats.itemsVisible;
+            }
+
+            double averageVisible = static_cast<double>(itemsVisible) / frames;
+
+            BenchmarkPrint("  %s: %.0f chunks visible, %.0f culled, %.0f nodes visited, %.0f chunks tested per frame\n",
+                overview ? "overview" : "walk", averageVisible, chunkCount - averageVisible,
+                static_cast<double>(nodesVisited) / frames, static_cast<double>(itemsTested) / frames);
+            BenchmarkPrint("    octree %.1f us, brute force %.1f us per frame (%.1fx), %s\n",
+                octreeTime * 1000000.0 / frames, bruteForceTime * 1000000.0 / frames,
+                bruteForceTime / octreeTime, mismatches ? "DIFFERENT" : "identical");
+        }
+
+        // Boxes bounce around inside the scene's bounds.
+
+        std::vector<D3DXVECTOR3> positions(movingBoxes);
+        std::vector<D3DXVECTOR3> velocities(movingBoxes);
+        std::vector<int> handles(movingBoxes);
+        unsigned int seed = 1;
+        float boundsMin[3];
+        float boundsMax[3];
+        int relinks = 0;
+
+        startTime = GetTimeInSeconds();
+
+        for (int j = 0; j < movingBoxes; ++j)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                positions[j][c] = scene.boundsMin[c] + (scene.boundsMax[c] - scene.boundsMin[c]) * NextRandomFloat(seed);
+                velocities[j][c] = (NextRandomFloat(seed) - 0.5f) * 2.0f * movingBoxSpeed;
+                boundsMin[c] = positions[j][c] - movingBoxSize * 0.5f;
+                boundsMax[c] = positions[j][c] + movingBoxSize * 0.5f;
+            }
+
+            handles[j] = InsertOctreeItem(tree, boundsMin, boundsMax, chunkCount + j);
+        }
+
+        double insertTime = GetTimeInSeconds() - startTime;
+
+        startTime = GetTimeInSeconds();
+
+        for (int frame = 0; frame < moveFrames; ++frame)
+        {
+            for (int j = 0; j < movingBoxes; ++j)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    positions[j][c] += velocities[j][c] * frameTime;
+
+                    if (positions[j][c] < scene.boundsMin[c] || positions[j][c] > scene.boundsMax[c])
+                    {
+                        velocities[j][c] = -velocities[j][c];
+                        positions[j][c] = max(scene.boundsMin[c], min(scene.boundsMax[c], positions[j][c]));
+                    }
+
+                    boundsMin[c] = positions[j][c] - movingBoxSize * 0.5f;
+                    boundsMax[c] = positions[j][c] + movingBoxSize * 0.5f;
+                }
+
+                if (MoveOctreeItem(tree, handles[j], boundsMin, boundsMax))
+                    ++relinks;
+            }
+        }
+
+        double moveTime = GetTimeInSeconds() - startTime;
+
+        startTime = GetTimeInSeconds();
+
+        for (int j = 0; j < movingBoxes; ++j)
+            RemoveOctreeItem(tree, handles[j]);
+
+        double removeTime = GetTimeInSeconds() - startTime;
+        int freeNodes = 0;
+
+        for (int node = tree.freeNode; node >= 0; node = tree.nodes[node].parent)
+            ++freeNodes;
+
+        bool restored = tree.nodes[0].itemCount == chunkCount &&
+                        static_cast<int>(tree.nodes.size()) - freeNodes == nodeCount;
+
+        BenchmarkPrint("  %d moving boxes: insert %.0f ns, move %.0f ns (%.2f%% change node), remove %.0f ns each, %s\n",
+            movingBoxes, insertTime * 1.0e9 / movingBoxes, moveTime * 1.0e9 / (static_cast<double>(movingBoxes) * moveFrames),
+            100.0 * relinks / (static_cast<double>(movingBoxes) * moveFrames), removeTime * 1.0e9 / movingBoxes,
+            restored ? "tree restored" : "TREE NOT RESTORED");
+    }
+
+    serialPool.destroy();
+}
+
+void BenchmarkSceneGeneration()
+{
+    // Generates grids of rooms and corridor mazes of increasing size on one
+    // thread and on the worker threads, checks that both give the same
+    // scene, and reports how long each took and how much memory each scene
+    // takes up.
+
+    static const struct
+    {
+        const char *pszLayout;
+        int layout;
+        int rooms;
+        int props;
+        int lights;
+    }
+    scenes[] =
+    {
+        { "grid", SCENE_LAYOUT_GRID, 16, 64, 128 },
+        { "grid", SCENE_LAYOUT_GRID, 1000, 10000, 100000 },
+        { "grid", SCENE_LAYOUT_GRID, 10000, 100000, 1000000 },
+        { "maze", SCENE_LAYOUT_MAZE, 1000, 2000, 10000 },
+        { "maze", SCENE_LAYOUT_MAZE, 10000, 20000, 1000000 }
+    };
+
+    WorkerPool serialPool;
+
+    if (!serialPool.create(0))
+        return;
+
+    for (int i = 0; i < sizeof(scenes) / sizeof(scenes[0]); ++i)
+    {
+        SceneDesc desc = {scenes[i].layout, scenes[i].rooms, scenes[i].props, scenes[i].lights, SCENE_DEFAULT_SEED};
+        Scene serial;
+        Scene parallel;
+
+        double startTime = GetTimeInSeconds();
+
+        if (!GenerateScene(desc, serialPool, serial))
+            continue;
+
+        double serialTime = GetTimeInSeconds() - startTime;
+
+        startTime = GetTimeInSeconds();
+        GenerateScene(desc, g_workerPool, parallel);
+
+        double parallelTime = GetTimeInSeconds() - startTime;
+
+        bool identical = serial.vertices.size() == parallel.vertices.size() &&
+                         serial.chunks.size() == parallel.chunks.size() &&
+                         memcmp(&serial.vertices[0], &parallel.vertices[0], serial.vertices.size() * sizeof(Vertex)) == 0 &&
+                         memcmp(&serial.chunks[0], &parallel.chunks[0], serial.chunks.size() * sizeof(SceneChunk)) == 0 &&
+                         memcmp(&serial.lights[0], &parallel.lights[0], serial.lights.size() * sizeof(PointLight)) == 0;
+
+        double vertexMegabytes = parallel.vertices.capacity() * sizeof(Vertex) / (1024.0 * 1024.0);
+        double chunkMegabytes = parallel.chunks.capacity() * sizeof(SceneChunk) / (1024.0 * 1024.0);
+        double roomMegabytes = parallel.rooms.capacity() * sizeof(SceneRoom) / (1024.0 * 1024.0);
+        double lightMegabytes = parallel.lights.capacity() * sizeof(PointLight) / (1024.0 * 1024.0);
+
+        BenchmarkPrint("%s, %d rooms, %d props, %d lights: %d triangles in %d chunks\n", scenes[i].pszLayout,
+            desc.rooms, desc.props, desc.lights, static_cast<int>(parallel.vertices.size() / 3),
+            static_cast<int>(parallel.chunks.size()));
+        BenchmarkPrint("  memory: %.1f MB (vertices %.1f, chunks %.1f, rooms %.2f, lights %.1f)\n",
+            vertexMegabytes + chunkMegabytes + roomMegabytes + lightMegabytes,
+            vertexMegabytes, chunkMegabytes, roomMegabytes, lightMegabytes);
+        BenchmarkPrint("  generated in %.1f ms on 1 thread, %.1f ms on %d threads (%.2fx), %s\n",
+            serialTime * 1000.0, parallelTime * 1000.0, g_workerPool.numThreads + 1,
+            serialTime / parallelTime, identical ? "identical" : "DIFFERENT");
+    }
+
+    serialPool.destroy();
+}
+
+void BenchmarkShadowMaps()
+{
+    // Walks a camera through generated scenes with 64 and 512 shadowed
+    // lights, an eighth of which move, while a prop is moved every few
+    // frames. Reports how many cube map faces the cache draws per frame
+    // within its budget, against six per light for redrawing every cube map
+    // every frame, and the memory each needs. Then checks shadow map
+    // lookups against rays traced from points in the lights' rooms.
+
+    static const int lightCounts[] = {64, 512};
+
+    const int frames = 300;
+    const int lightsPerRoom = 4;
+    const int movingLightStride = 8;
+    const int propMoveFrames = 10;
+    const int lookups = 100000;
+    const int screenWidth = 1920;
+    const int screenHeight = 1080;
+
+    for (int i = 0; i < sizeof(lightCounts) / sizeof(lightCounts[0]); ++i)
+    {
+        int rooms = lightCounts[i] / lightsPerRoom;
+        SceneDesc desc = {SCENE_LAYOUT_GRID, rooms, rooms * SCENE_PROPS_PER_ROOM, lightCounts[i], SCENE_DEFAULT_SEED};
+        Scene scene;
+        OccluderSet casters;
+        ShadowCache cache;
+
+        if (!GenerateScene(desc, g_workerPool, scene))
+            continue;
+
+        CreateShadowCasters(scene, casters);
+
+        if (!CreateShadowCache(desc.lights, SHADOW_TILE_SIZE, SHADOW_ATLAS_TILES, cache))
+            continue;
+
+        int firstProp = static_cast<int>(casters.occluders.size()) - desc.props;
+        std::vector<PointLight> lights(scene.lights);
+
+        BenchmarkPrint("%d shadowed lights in %d rooms, %d casters, %d atlas tiles of %dx%d, %d faces per frame at most\n",
+            desc.lights, desc.rooms, static_cast<int>(casters.occluders.size()), cache.maxTiles, cache.tileSize,
+            cache.tileSize, SHADOW_FACE_BUDGET);
+
+        D3DXMATRIX view;
+        D3DXMATRIX projection;
+        D3DXPLANE planes[FRUSTUM_PLANES];
+        D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+        ULONGLONG facesNeeded = 0;
+        ULONGLONG facesUpdated = 0;
+        ULONGLONG facesStale = 0;
+        ULONGLONG facesMissing = 0;
+        ULONGLONG tilesEvicted = 0;
+        int maxUpdates = 0;
+        double updateTime = 0.0;
+
+        D3DXMatrixPerspectiveFovLH(&projection, CAMERA_FOVY,
+            static_cast<float>(screenWidth) / static_cast<float>(screenHeight), CAMERA_ZNEAR, CAMERA_ZFAR);
+
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            // The camera walks diagonally across the scene at eye height,
+            // turning from side to side, as for occlusion culling.
+
+            float t = static_cast<float>(frame) / frames;
+            float heading = D3DX_PI * 0.25f + 0.75f * sinf(t * 6.0f * D3DX_PI);
+            D3DXVECTOR3 eye(
+                scene.boundsMin[0] + (scene.boundsMax[0] - scene.boundsMin[0]) * (0.05f + 0.9f * t), 0.0f,
+                scene.boundsMin[2] + (scene.boundsMax[2] - scene.boundsMin[2]) * (0.05f + 0.9f * t));
+            D3DXVECTOR3 target = eye + D3DXVECTOR3(cosf(heading), 0.0f, sinf(heading));
+
+            D3DXMatrixLookAtLH(&view, &eye, &target, &up);
+            GetFrustumPlanes(view * projection, planes);
+
+            for (int j = 0; j < desc.lights; j += movingLightStride)
+            {
+                float angle = t * 4.0f * D3DX_PI + j;
+
+                lights[j].pos[0] = scene.lights[j].pos[0] + cosf(angle) * LIGHT_OBJECT_RADIUS * 2.0f;
+                lights[j].pos[2] = scene.lights[j].pos[2] + sinf(angle) * LIGHT_OBJECT_RADIUS * 2.0f;
+            }
+
+            // A prop is nudged back and forth, which puts the faces that
+            // see it out of date where it was and where it now is.
+
+            if (frame % propMoveFrames == 0 && desc.props > 0)
+            {
+                Occluder &prop = casters.occluders[firstProp + (frame / propMoveFrames) % desc.props];
+                float offset = ((frame / propMoveFrames) & 1) ? -4.0f : 4.0f;
+
+                InvalidateShadowCasters(cache, prop.boundsMin, prop.boundsMax);
+                prop.boundsMin[0] += offset;
+                prop.boundsMax[0] += offset;
+
+                for (int j = prop.firstVertex; j < prop.firstVertex + prop.vertexCount; ++j)
+                    casters.positions[j].x += offset;
+
+                InvalidateShadowCasters(cache, prop.boundsMin, prop.boundsMax);
+            }
+
+            ShadowStats stats;
+
+            UpdateShadowCache(cache, &lights[0], casters, planes, eye, SHADOW_FACE_BUDGET, g_workerPool, stats);
+            facesNeeded += stats.facesNeeded;
+            facesUpdated += stats.facesUpdated;
+            facesStale += stats.facesStale;
+            facesMissing += stats.facesMissing;
+            tilesEvicted += stats.tilesEvicted;
+            maxUpdates = max(maxUpdates, stats.facesUpdated);
+            updateTime += stats.updateTimeMs;
+        }
+
+        // Drawing every face of every cube map costs about what drawing the
+        // faces the cache did costs per face.
+
+        double msPerFace = updateTime / max(1.0, static_cast<double>(facesUpdated));
+        double tileMB = sizeof(float) * cache.tileSize * cache.tileSize / (1024.0 * 1024.0);
+        size_t bookkeeping = sizeof(ShadowLight) * cache.lights.size() + sizeof(int) * 3 * cache.maxTiles;
+
+        BenchmarkPrint("  faces per frame: %.1f needed, %.1f drawn (at most %d), %.1f left out of date, %.1f not resident; %d when redrawing every cube map\n",
+            static_cast<double>(facesNeeded) / frames, static_cast<double>(facesUpdated) / frames, maxUpdates,
+            static_cast<double>(facesStale) / frames, static_cast<double>(facesMissing) / frames,
+            desc.lights * SHADOW_CUBE_FACES);
+        BenchmarkPrint("  %.2f ms per frame drawing faces on %d threads, about %.1f ms to redraw every cube map, %d tiles evicted\n",
+            updateTime / frames, g_workerPool.numThreads + 1, msPerFace * desc.lights * SHADOW_CUBE_FACES,
+            static_cast<int>(tilesEvicted));
+        BenchmarkPrint("  memory: %.1f MB atlas and %.1f KB bookkeeping, against %.1f MB for every light's cube map\n",
+            tileMB * cache.maxTiles, bookkeeping / 1024.0, tileMB * desc.lights * SHADOW_CUBE_FACES);
+
+        // Check lookups against rays traced to the light from points on the
+        // surfaces of its room, just off them. Faces left out of date still
+        // shadow with what they drew from where their light was, and are
+        // counted apart from those that are up to date.
+
+        std::vector<D3DXVECTOR3> triangles(casters.positions);
+        std::vector<int> lightRooms(desc.lights);
+        Octree tree;
+        unsigned int seed = 1;
+        int checked[2] = {0, 0};    // up to date faces, out of date faces
+        int agreed[2] = {0, 0};
+        int shadowed[2] = {0, 0};
+
+        BuildTriangleOctree(&triangles[0], static_cast<int>(triangles.size() / 3), tree);
+
+        for (int j = 0; j < desc.rooms; ++j)
+        {
+            for (int k = 0; k < scene.rooms[j].lightCount; ++k)
+                lightRooms[scene.rooms[j].firstLight + k] = j;
+        }
+
+        for (int j = 0; j < lookups; ++j)
+        {
+            int light = NextRandom(seed) % desc.lights;
+            const SceneRoom &room = scene.rooms[lightRooms[light]];
+            const Vertex *pTriangle = &scene.vertices[room.firstVertex + (NextRandom(seed) % (room.vertexCount / 3)) * 3];
+            float a = NextRandomFloat(seed);
+            float b = NextRandomFloat(seed);
+
+            if (a + b > 1.0f)
+            {
+                a = 1.0f - a;
+                b = 1.0f - b;
+            }
+
+            D3DXVECTOR3 p0(pTriangle[0].pos[0], pTriangle[0].pos[1], pTriangle[0].pos[2]);
+            D3DXVECTOR3 p1(pTriangle[1].pos[0], pTriangle[1].pos[1], pTriangle[1].pos[2]);
+            D3DXVECTOR3 p2(pTriangle[2].pos[0], pTriangle[2].pos[1], pTriangle[2].pos[2]);
+            D3DXVECTOR3 pos = p0 + (p1 - p0) * a + (p2 - p0) * b;
+            D3DXVECTOR3 toLight = D3DXVECTOR3(lights[light].pos[0], lights[light].pos[1], lights[light].pos[2]) - pos;
+            D3DXVECTOR3 normal(pTriangle[0].normal[0], pTriangle[0].normal[1], pTriangle[0].normal[2]);
+            float facing = D3DXVec3Dot(&normal, &toLight);
+            float direction[3] = {-toLight.x, -toLight.y, -toLight.z};
+            const ShadowFace &face = cache.lights[light].faces[GetLightmapFace(direction)];
+
+            // Surfaces facing away from the light aren't lit by it anyway.
+
+            if (facing <= 0.0f || D3DXVec3Dot(&toLight, &toLight) >= lights[light].radius * lights[light].radius ||
+                face.tile < 0)
+                continue;
+
+            D3DXVECTOR3 from = pos + normal * LIGHTMAP_SHADOW_BIAS;
+            bool lit = !IsSegmentBlocked(tree, &triangles[0], from, lights[light].pos);
+            int dirty = (face.dirtyFrame >= 0) ? 1 : 0;
+
+            ++checked[dirty];
+            agreed[dirty] += (SampleShadowMap(cache, light, pos, normal) == lit) ? 1 : 0;
+            shadowed[dirty] += lit ? 0 : 1;
+        }
+
+        BenchmarkPrint("  %d of %d lookups into up to date faces agree with traced rays (%.2f%%), %d of them in shadow\n",
+            agreed[0], checked[0], 100.0 * agreed[0] / max(1, checked[0]), shadowed[0]);
+        BenchmarkPrint("  %d of %d lookups into out of date faces agree with traced rays (%.2f%%), %d of them in shadow\n",
+            agreed[1], checked[1], 100.0 * agreed[1] / max(1, checked[1]), shadowed[1]);
+
+        DestroyShadowCache(cache);
+    }
+}
+
+void BenchmarkSimulation()
+{
+    // Runs the light simulation for the same number of fixed steps at
+    // several render rates, each with randomly jittered frame times, and
+    // verifies that the light trajectories come out bit for bit identical.
+
+    static const float renderRates[] = {30.0f, 60.0f, 144.0f, 240.0f, 1000.0f};
+
+    const int numLights = sizeof(g_lights) / sizeof(g_lights[0]);
+    const int targetSteps = static_cast<int>(60.0f / g_simulationTimestep);
+
+    PointLight savedLights[sizeof(g_lights) / sizeof(g_lights[0])];
+    unsigned int referenceHash = 0;
+    bool identical = true;
+
+    memcpy(savedLights, g_lights, sizeof(g_lights));
+
+    for (int r = 0; r < sizeof(renderRates) / sizeof(renderRates[0]); ++r)
+    {
+        unsigned int jitterSeed = 1;
+        int frames = 0;
+        double startTime = GetTimeInSeconds();
+
+        memcpy(g_lights, savedLights, sizeof(g_lights));
+        srand(1);
+
+        for (int i = 0; i < numLights; ++i)
+            g_lights[i].init();
+
+        g_simulationAccumulator = 0.0;
+        g_simulationSteps = 0;
+
+        while (g_simulationSteps < targetSteps)
+        {
+            float jitter = 0.5f + static_cast<float>(NextRandom(jitterSeed) % 1000) / 1000.0f;
+            int maxSteps = targetSteps - g_simulationSteps;
+
+            if (maxSteps > SIMULATION_MAX_STEPS_PER_FRAME)
+                maxSteps = SIMULATION_MAX_STEPS_PER_FRAME;
+
+            UpdateSimulation(jitter / renderRates[r], maxSteps);
+            ++frames;
+        }
+
+        double elapsedTime = GetTimeInSeconds() - startTime;
+
+        // FNV-1a hash of the final simulation state.
+
+        unsigned int hash = 2166136261U;
+
+        for (int i = 0; i < numLights; ++i)
+        {
+            const BYTE *pBytes = reinterpret_cast<const BYTE*>(g_lights[i].pos);
+
+            for (int j = 0; j < sizeof(g_lights[i].pos); ++j)
+                hash = (hash ^ pBytes[j]) * 16777619U;
+        }
+
+        if (r == 0)
+            referenceHash = hash;
+        else if (hash != referenceHash)
+            identical = false;
+
+        BenchmarkPrint("Render %g Hz, simulate %g Hz: %d frames, %d steps, state hash %08x, %.3f us/step\n",
+            renderRates[r], 1.0f / g_simulationTimestep, frames, g_simulationSteps, hash,
+            elapsedTime * 1000000.0 / g_simulationSteps);
+    }
+
+    BenchmarkPrint("Light trajectories are %s across render rates\n",
+        identical ? "identical" : "DIFFERENT");
+
+    memcpy(g_lights, savedLights, sizeof(g_lights));
+    g_simulationAccumulator = 0.0;
+    g_simulationSteps = 0;
+}
+
+void BenchmarkTextRendering()
+{
+    // Lays out a HUD like the one RenderText() shows and draws it into an
+    // X8R8G8B8 buffer with DrawTextLayoutToBuffer(), the software path for
+    // the glyph atlas text. Checks the result against the same text drawn
+    // by GDI, which catches mistakes in the layout and in the quads'
+    // mapping to the atlas as well as in the blending. Reports the cost of
+    // laying the text out and of drawing it, and whether the two match.
+
+    const int width = 640;
+    const int height = 480;
+    const int iterations = 1000;
+    const D3DCOLOR color = D3DCOLOR_XRGB(255, 255, 0);
+    const D3DCOLOR background = D3DCOLOR_XRGB(32, 64, 96);
+    const int tolerance = 32;           // levels a channel may be off by, where GDI blends overlapping glyphs differently
+    const double maxWrongShare = 0.01;  // of the pixels either draws that may be off by more
+    GlyphAtlas atlas;
+
+    if (!CreateGlyphAtlas("Arial", 10, atlas))
+    {
+        BenchmarkPrint("Failed to create the glyph atlas\n");
+        return;
+    }
+
+    char szText[HUD_TEXT_MAX_CHARS];
+    int length = 0;
+
+    szText[0] = '\0';
+    AppendText(szText, HUD_TEXT_MAX_CHARS, length, "FPS: %d\n", 1234);
+    AppendText(szText, HUD_TEXT_MAX_CHARS, length, "Anisotropic filtering: %dx\n", 16);
+    AppendText(szText, HUD_TEXT_MAX_CHARS, length, "Shader Model 3.0\nTechnique: Single pass lighting\n");
+    AppendText(szText, HUD_TEXT_MAX_CHARS, length, "Room: %d draw calls, %d effect rounds, %d parameter sets [%s]\n",
+        3, 1, 4, "texture atlas");
+    AppendText(szText, HUD_TEXT_MAX_CHARS, length, "Light radius: %g\n", 100.0f);
+    AppendText(szText, HUD_TEXT_MAX_CHARS, length, "Simulation: %g Hz fixed timestep\n", 60.0f);
+    AppendText(szText, HUD_TEXT_MAX_CHARS, length, "Text:\t%.3f ms\n", 0.012f);
+
+    // The layout is too big for the stack.
+
+    std::vector<TextLayout> layouts(1);
+    TextLayout &layout = layouts[0];
+    double startTime = GetTimeInSeconds();
+
+    for (int i = 0; i < iterations; ++i)
+        LayoutText(atlas, szText, 4, 2, color, layout);
+
+    double layoutTime = (GetTimeInSeconds() - startTime) / iterations;
+    std::vector<DWORD> pixels(width * height);
+    double drawTime = 0.0;
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::fill(pixels.begin(), pixels.end(), background);
+        startTime = GetTimeInSeconds();
+        DrawTextLayoutToBuffer(atlas, layout, &pixels[0], width, height, width * sizeof(DWORD));
+        drawTime += GetTimeInSeconds() - startTime;
+    }
+
+    drawTime /= iterations;
+
+    // Each pixel should blend the text color over the background by GDI's
+    // coverage there.
+
+    std::vector<BYTE> coverage(width * height);
+    bool drawn = DrawTextWithGdi("Arial", 10, szText, 4, 2, width, height, &coverage[0]);
+    int inked = 0;
+    int wrong = 0;
+
+    for (int i = 0; drawn && i < width * height; ++i)
+    {
+        int worst = 0;
+
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            int from = (background >> shift) & 0xff;
+            int expected = from + (static_cast<int>((color >> shift) & 0xff) - from) * coverage[i] / 255;
+
+            worst = max(worst, abs(static_cast<int>((pixels[i] >> shift) & 0xff) - expected));
+        }
+
+        if (coverage[i] > 0 || pixels[i] != background)
+        {
+            ++inked;
+            wrong += (worst > tolerance) ? 1 : 0;
+        }
+    }
+
+    bool matches = drawn && inked > 0 && wrong <= inked * maxWrongShare;
+
+    BenchmarkPrint("%d characters as %d quads from a %dx%d glyph atlas\n", static_cast<int>(strlen(szText)),
+        layout.numQuads, atlas.width, atlas.height);
+    BenchmarkPrint("  layout: %.2f us, drawing into a %dx%d buffer: %.2f us\n", layoutTime * 1000000.0,
+        width, height, drawTime * 1000000.0);
+
+    if (drawn)
+    {
+        BenchmarkPrint("  against GDI: %d of %d inked pixels off by more than %d levels, %s\n", wrong, inked,
+            tolerance, matches ? "matches" : "DOES NOT MATCH");
+    }
+    else
+    {
+        BenchmarkPrint("  against GDI: failed to draw the reference (FAILED)\n");
+    }
+
+    DestroyGlyphAtlas(atlas);
+}
+
+void BenchmarkTextureCache()
+{
+    // Compares getting the shipped color maps ready for upload from the
+    // JPEG files (read, decode and generate mips) against mapping their
+    // texture cache files (read and hash the source, map the cache). Also
+    // reports how long cooking takes and how much memory each path keeps
+    // resident, and checks that a stale cache is rejected.
+
+    static const char *textures[] =
+    {
+        "Content/Textures/brick_color_map.jpg",
+        "Content/Textures/wood_color_map.jpg",
+        "Content/Textures/stone_color_map.jpg"
+    };
+
+    WorkerPool serialPool;
+    double totalJpegTime = 0.0;
+    double totalCacheTime = 0.0;
+    size_t totalJpegBytes = 0;
+    size_t totalCacheBytes = 0;
+
+    if (!serialPool.create(0))
+        return;
+
+    for (int t = 0; t < sizeof(textures) / sizeof(textures[0]); ++t)
+    {
+        char szCacheFilename[MAX_PATH];
+        std::vector<BYTE> fileData;
+        Image image = {0};
+        CompressedImage compressed = {};
+        CompressedImage mapped = {};
+
+        snprintf(szCacheFilename, sizeof(szCacheFilename), "%s%s", textures[t], TEXTURE_CACHE_EXTENSION);
+
+        // JPEG path.
+
+        double startTime = GetTimeInSeconds();
+
+        if (!ReadFileContents(textures[t], fileData) ||
+            !DecodeImage(&fileData[0], fileData.size(), image))
+        {
+            BenchmarkPrint("%s: failed to load\n", textures[t]);
+            continue;
+        }
+
+        GenerateMipChain(image, serialPool);
+
+        double jpegTime = GetTimeInSeconds() - startTime;
+        size_t jpegBytes = (image.levelOffsets[image.levels - 1] + 1) * sizeof(DWORD);
+
+        // Cook.
+
+        ULONGLONG sourceHash = HashBytes(&fileData[0], fileData.size());
+
+        startTime = GetTimeInSeconds();
+
+        bool cooked = CompressImage(image, D3DFMT_DXT1, TEXTURE_CACHE_QUALITY, compressed, g_workerPool) &&
+                      WriteTextureCache(szCacheFilename, sourceHash, compressed);
+
+        double cookTime = GetTimeInSeconds() - startTime;
+
+        DestroyImage(image);
+        DestroyCompressedImage(compressed);
+
+        if (!cooked)
+        {
+            BenchmarkPrint("%s: failed to write %s\n", textures[t], szCacheFilename);
+            continue;
+        }
+
+        // Cache path. Every page of the mapping is touched so that the
+        // working set reflects what rendering from it would keep resident.
+
+        PROCESS_MEMORY_COUNTERS before = {sizeof(before)};
+        PROCESS_MEMORY_COUNTERS after = {sizeof(after)};
+
+        GetProcessMemoryInfo(GetCurrentProcess(), &before, sizeof(before));
+        startTime = GetTimeInSeconds();
+
+        bool mappedOk = ReadFileContents(textures[t], fileData) &&
+                        MapTextureCache(szCacheFilename, HashBytes(&fileData[0], fileData.size()), mapped);
+
+        double cacheTime = GetTimeInSeconds() - startTime;
+
+        if (!mappedOk)
+        {
+            BenchmarkPrint("%s: failed to map %s\n", textures[t], szCacheFilename);
+            continue;
+        }
+
+        volatile BYTE touch = 0;
+
+        for (DWORD i = 0; i < mapped.dataSize; i += 4096)
+            touch ^= mapped.pData[i];
+
+        GetProcessMemoryInfo(GetCurrentProcess(), &after, sizeof(after));
+
+        CompressedImage stale = {};
+        bool staleRejected = !MapTextureCache(szCacheFilename, sourceHash ^ 1, stale);
+
+        DestroyCompressedImage(stale);
+
+        BenchmarkPrint("%s: JPEG %.2f ms, %u KB resident; cache %.2f ms, %u KB mapped (working set +%d KB); cook %.2f ms; stale cache %s\n",
+            textures[t], jpegTime * 1000.0, static_cast<unsigned int>(jpegBytes / 1024),
+            cacheTime * 1000.0, static_cast<unsigned int>(mapped.dataSize / 1024),
+            static_cast<int>((static_cast<LONGLONG>(after.WorkingSetSize) - static_cast<LONGLONG>(before.WorkingSetSize)) / 1024),
+            cookTime * 1000.0, staleRejected ? "rejected" : "NOT REJECTED");
+
+        totalJpegTime += jpegTime;
+        totalCacheTime += cacheTime;
+        totalJpegBytes += jpegBytes;
+        totalCacheBytes += mapped.dataSize;
+
+        DestroyCompressedImage(mapped);
+    }
+
+    BenchmarkPrint("Total: JPEG %.2f ms, %u KB; cache %.2f ms, %u KB (%.1fx faster, %.1fx smaller)\n",
+        totalJpegTime * 1000.0, static_cast<unsigned int>(totalJpegBytes / 1024),
+        totalCacheTime * 1000.0, static_cast<unsigned int>(totalCacheBytes / 1024),
+        (totalCacheTime > 0.0) ? totalJpegTime / totalCacheTime : 0.0,
+        (totalCacheBytes > 0) ? static_cast<double>(totalJpegBytes) / totalCacheBytes : 0.0);
+
+    serialPool.destroy();
+}
+
+void BenchmarkTextureEncoder()
+{
+    // Measures the BC1 and BC7 encoders at each quality setting on the
+    // shipped color maps and their mip chains, on one thread and on the
+    // worker pool, and reports the PSNR of the top level against the source.
+
+    static const char *textures[] =
+    {
+        "Content/Textures/brick_color_map.jpg",
+        "Content/Textures/wood_color_map.jpg",
+        "Content/Textures/stone_color_map.jpg"
+    };
+
+    static const char *qualityNames[] = {"fast", "normal", "high"};
+    static const D3DFORMAT formats[] = {D3DFMT_DXT1, FORMAT_BC7};
+    static const char *formatNames[] = {"BC1", "BC7"};
+
+    WorkerPool serialPool;
+
+    if (!serialPool.create(0))
+        return;
+
+    for (int t = 0; t < sizeof(textures) / sizeof(textures[0]); ++t)
+    {
+        std::vector<BYTE> fileData;
+        Image image = {0};
+
+        if (!ReadFileContents(textures[t], fileData) ||
+            !DecodeImage(&fileData[0], fileData.size(), image))
+        {
+            BenchmarkPrint("%s: failed to load\n", textures[t]);
+            continue;
+        }
+
+        GenerateMipChain(image, g_workerPool);
+
+        double megapixels = 0.0;
+
+        for (int i = 0; i < image.levels; ++i)
+            megapixels += max(1, image.width >> i) * static_cast<double>(max(1, image.height >> i)) / 1000000.0;
+
+        for (int f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f)
+        {
+            for (int quality = COMPRESS_QUALITY_FAST; quality <= COMPRESS_QUALITY_HIGH; ++quality)
+            {
+                double rates[2] = {0.0, 0.0};
+                double psnr = 0.0;
+
+                for (int pass = 0; pass < 2; ++pass)
+                {
+                    WorkerPool &pool = (pass == 0) ? serialPool : g_workerPool;
+                    int runs = (quality == COMPRESS_QUALITY_FAST) ? 3 : 1;
+                    double bestTime = 0.0;
+
+                    for (int run = 0; run < runs; ++run)
+                    {
+                        CompressedImage compressed = {};
+                        double startTime = GetTimeInSeconds();
+                        bool compressedOk = CompressImage(image, formats[f], quality, compressed, pool);
+                        double time = GetTimeInSeconds() - startTime;
+
+                        if (compressedOk && pass == 1 && run == 0)
+                            psnr = GetCompressedImagePSNR(image, compressed);
+
+                        DestroyCompressedImage(compressed);
+
+                        if (run == 0 || time < bestTime)
+                            bestTime = time;
+                    }
+
+                    rates[pass] = megapixels / max(bestTime, 1e-9);
+                }
+
+                BenchmarkPrint("%s %s %s: 1 thread %.1f MP/s, %d threads %.1f MP/s, PSNR %.2f dB\n",
+                    textures[t], formatNames[f], qualityNames[quality], rates[0],
+                    g_workerPool.numThreads + 1, rates[1], psnr);
+            }
+        }
+
+        DestroyImage(image);
+    }
+
+    serialPool.destroy();
+}
+
+void BenchmarkTextureSampler()
+{
+    // Samples the brick color map across a 256 x 256 grid of pixels with the
+    // texture coordinates rotated by 30 degrees, at several texel to pixel
+    // ratios, for each filter, from a linear and a Morton ordered copy of
+    // the texture. Both copies must give the same result.
+
+    static const struct
+    {
+        const char *pszName;
+        float texelsPerPixelU;
+        float texelsPerPixelV;
+    }
+    gradients[] =
+    {
+        { "0.5 texels/pixel", 0.5f, 0.5f },
+        { "1 texel/pixel", 1.0f, 1.0f },
+        { "4 texels/pixel", 4.0f, 4.0f },
+        { "16 texels/pixel", 16.0f, 16.0f },
+        { "1 x 8 texels/pixel", 1.0f, 8.0f }
+    };
+
+    static const char *filterNames[] = {"bilinear", "trilinear", "anisotropic 16x"};
+    const int gridSize = 256;
+    const float angle = D3DXToRadian(30.0f);
+
+    std::vector<BYTE> fileData;
+    Image image = {0};
+    SoftwareTexture textures[2] = {0};
+
+    if (!ReadFileContents("Content/Textures/brick_color_map.jpg", fileData) ||
+        !DecodeImage(&fileData[0], fileData.size(), image))
+    {
+        BenchmarkPrint("Failed to load Content/Textures/brick_color_map.jpg\n");
+        return;
+    }
+
+    GenerateMipChain(image, g_workerPool);
+
+    if (!CreateSoftwareTexture(image, TEXTURE_LAYOUT_LINEAR, textures[0]) ||
+        !CreateSoftwareTexture(image, TEXTURE_LAYOUT_MORTON, textures[1]))
+    {
+        BenchmarkPrint("Failed to create the software textures\n");
+        DestroySoftwareTexture(textures[0]);
+        DestroyImage(image);
+        return;
+    }
+
+    for (int g = 0; g < sizeof(gradients) / sizeof(gradients[0]); ++g)
+    {
+        // d(u, v)/dx and d(u, v)/dy of the rotated mapping.
+
+        float scaleU = gradients[g].texelsPerPixelU / image.width;
+        float scaleV = gradients[g].texelsPerPixelV / image.height;
+        float gradient[4] =
+        {
+            cosf(angle) * scaleU, sinf(angle) * scaleV,
+            -sinf(angle) * scaleU, cosf(angle) * scaleV
+        };
+
+        for (int filter = TEXTURE_FILTER_BILINEAR; filter <= TEXTURE_FILTER_ANISOTROPIC; ++filter)
+        {
+            double rates[2] = {0.0, 0.0};
+            float checksums[2] = {0.0f, 0.0f};
+
+            for (int layout = 0; layout < 2; ++layout)
+            {
+                double bestTime = 0.0;
+
+                for (int run = 0; run < 3; ++run)
+                {
+                    __m128 sum = _mm_setzero_ps();
+                    double startTime = GetTimeInSeconds();
+
+                    for (int y = 0; y < gridSize; ++y)
+                    {
+                        for (int x = 0; x < gridSize; x += 4)
+                        {
+                            float u[4];
+                            float v[4];
+                            __m128 colors[4];
+
+                            for (int i = 0; i < 4; ++i)
+                            {
+                                u[i] = (x + i) * gradient[0] + y * gradient[2];
+                                v[i] = (x + i) * gradient[1] + y * gradient[3];
+                            }
+
+                            SampleTexture4(textures[layout], filter, SAMPLER_MAX_ANISOTROPY, u, v, gradient, colors);
+                            sum = _mm_add_ps(sum, _mm_add_ps(_mm_add_ps(colors[0], colors[1]), _mm_add_ps(colors[2], colors[3])));
+                        }
+                    }
+
+                    double time = GetTimeInSeconds() - startTime;
+                    float sums[4];
+
+                    _mm_storeu_ps(sums, sum);
+                    checksums[layout] = sums[0] + sums[1] + sums[2] + sums[3];
+
+                    if (run == 0 || time < bestTime)
+                        bestTime = time;
+                }
+
+                rates[layout] = gridSize * gridSize / max(bestTime, 1e-9) / 1000000.0;
+            }
+
+            BenchmarkPrint("%s, %s: linear %.1f M samples/s, Morton %.1f M samples/s (%.2fx)%s\n",
+                gradients[g].pszName, filterNames[filter], rates[0], rates[1], rates[1] / max(rates[0], 1e-9),
+                (checksums[0] == checksums[1]) ? "" : " RESULTS DIFFER");
+        }
+    }
+
+    DestroySoftwareTexture(textures[0]);
+    DestroySoftwareTexture(textures[1]);
+    DestroyImage(image);
+}
+
+void BenchmarkVertexCache()
+{
+    // Reports the average cache miss ratio (ACMR, vertices transformed per
+    // triangle) and average transform to vertex ratio (ATVR, vertices
+    // transformed per vertex) of FIFO post-transform vertex caches of 16
+    // and 32 entries, before and after the triangles are reordered by
+    // OptimizeVertexCache(). The meshes are the room and grids of up to 2
+    // million triangles, as triangle soups welded by CreateIndexedMesh().
+    // The grids are drawn in row order, and with their triangles shuffled
+    // the way a careless exporter might write them.
+
+    static const struct
+    {
+        int size;
+        bool shuffle;
+    }
+    grids[] =
+    {
+        { 32, false },
+        { 32, true },
+        { 256, false },
+        { 256, true },
+        { 1024, false },
+        { 1024, true }
+    };
+
+    static const int cacheSizes[] = {16, 32};
+    double acmr[2];
+    double atvr[2];
+
+    // The room: drawn without indices every vertex is transformed, so the
+    // ACMR is 3 whatever the cache.
+
+    Mesh room;
+
+    CreateIndexedMesh(g_room, sizeof(g_room) / sizeof(g_room[0]), room);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        GetVertexCacheStats(&room.indices[0], static_cast<int>(room.indices.size()),
+            static_cast<int>(room.vertices.size()), cacheSizes[i], acmr[i], atvr[i]);
+    }
+
+    BenchmarkPrint("room: %d triangles, %d -> %d vertices. Non-indexed ACMR 3.00, welded ACMR %.2f/%.2f ATVR %.2f/%.2f",
+        static_cast<int>(room.indices.size() / 3), static_cast<int>(sizeof(g_room) / sizeof(g_room[0])),
+        static_cast<int>(room.vertices.size()), acmr[0], acmr[1], atvr[0], atvr[1]);
+
+    CreateRoomMesh(room);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        GetVertexCacheStats(&room.indices[0], static_cast<int>(room.indices.size()),
+            static_cast<int>(room.vertices.size()), cacheSizes[i], acmr[i], atvr[i]);
+    }
+
+    BenchmarkPrint(", optimized ACMR %.2f/%.2f ATVR %.2f/%.2f (16/32 entries)\n", acmr[0], acmr[1], atvr[0], atvr[1]);
+
+    for (int g = 0; g < sizeof(grids) / sizeof(grids[0]); ++g)
+    {
+        std::vector<Vertex> triangles;
+        Mesh mesh;
+
+        CreateGridTriangles(grids[g].size, grids[g].size, grids[g].shuffle, 1, triangles);
+
+        double startTime = GetTimeInSeconds();
+
+        CreateIndexedMesh(&triangles[0], static_cast<int>(triangles.size()), mesh);
+
+        double weldTime = GetTimeInSeconds() - startTime;
+        int indexCount = static_cast<int>(mesh.indices.size());
+        int vertexCount = static_cast<int>(mesh.vertices.size());
+
+        std::vector<Vertex>().swap(triangles);
+
+        for (int i = 0; i < 2; ++i)
+            GetVertexCacheStats(&mesh.indices[0], indexCount, vertexCount, cacheSizes[i], acmr[i], atvr[i]);
+
+        BenchmarkPrint("%dx%d grid%s: %d triangles, %d -> %d vertices (welded in %.1f ms)\n",
+            grids[g].size, grids[g].size, grids[g].shuffle ? ", shuffled" : "", indexCount / 3,
+            indexCount, vertexCount, weldTime * 1000.0);
+        BenchmarkPrint("  before: ACMR %.3f/%.3f ATVR %.3f/%.3f\n", acmr[0], acmr[1], atvr[0], atvr[1]);
+
+        startTime = GetTimeInSeconds();
+        OptimizeVertexCache(&mesh.indices[0], indexCount, vertexCount);
+
+        double optimizeTime = GetTimeInSeconds() - startTime;
+
+        startTime = GetTimeInSeconds();
+        OptimizeVertexFetch(mesh);
+
+        double fetchTime = GetTimeInSeconds() - startTime;
+
+        for (int i = 0; i < 2; ++i)
+            GetVertexCacheStats(&mesh.indices[0], indexCount, vertexCount, cacheSizes[i], acmr[i], atvr[i]);
+
+        BenchmarkPrint("  after:  ACMR %.3f/%.3f ATVR %.3f/%.3f (16/32 entries), "
+            "triangles reordered in %.1f ms (%.1f M/s), vertices in %.1f ms\n",
+            acmr[0], acmr[1], atvr[0], atvr[1], optimizeTime * 1000.0,
+            indexCount / 3 / max(optimizeTime, 1e-9) / 1000000.0, fetchTime * 1000.0);
+    }
+}
+
+void BenchmarkVertexFormat()
+{
+    // Packs a million random vertices spanning the room, with texture
+    // coordinates tiled up to 4 times and normals spread over the sphere,
+    // and reports the worst error of each attribute after unpacking against
+    // its bound. Then compares how fast the CPU can stream through full
+    // precision vertices and decode packed ones.
+
+    const int count = 1 << 20;
+    const int passes = 8;
+    const int chunkSize = 1024;
+    unsigned int seed = 1;
+    std::vector<Vertex> vertices(count);
+    std::vector<PackedVertex> packed(count);
+    std::vector<Vertex> unpacked(count);
+    VertexQuantization quantization;
+
+    for (int i = 0; i < count; ++i)
+    {
+        Vertex &vertex = vertices[i];
+        float z = (NextRandom(seed) & 0xffff) / 32767.5f - 1.0f;
+        float angle = (NextRandom(seed) & 0xffff) / 65536.0f * 2.0f * D3DX_PI;
+        float r = sqrtf(max(0.0f, 1.0f - z * z));
+
+        vertex.pos[0] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * ROOM_SIZE_X;
+        vertex.pos[1] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * ROOM_SIZE_Y;
+        vertex.pos[2] = ((NextRandom(seed) & 0xffff) / 65535.0f - 0.5f) * ROOM_SIZE_Z;
+        vertex.texCoord[0] = (NextRandom(seed) & 0xffff) / 65535.0f * ROOM_WALL_TILE_U;
+        vertex.texCoord[1] = (NextRandom(seed) & 0xffff) / 65535.0f * ROOM_WALL_TILE_U;
+        vertex.normal[0] = r * cosf(angle);
+        vertex.normal[1] = r * sinf(angle);
+        vertex.normal[2] = z;
+    }
+
+    double startTime = GetTimeInSeconds();
+
+    GetVertexQuantization(&vertices[0], count, quantization);
+    PackVertices(&vertices[0], count, quantization, &packed[0]);
+
+    double packTime = GetTimeInSeconds() - startTime;
+
+    UnpackVertices(&packed[0], count, quantization, &unpacked[0]);
+
+    double positionError = 0.0;
+    double positionBound = 0.0;
+    double texCoordError = 0.0;
+    double normalError = 0.0;
+
+    for (int c = 0; c < 3; ++c)
+        positionBound = max(positionBound, quantization.halfExtent[c] / 32767.0 * 0.5);
+
+    for (int i = 0; i < count; ++i)
+    {
+        double dot = 0.0;
+
+        for (int c = 0; c < 3; ++c)
+        {
+            positionError = max(positionError, fabs(static_cast<double>(vertices[i].pos[c]) - unpacked[i].pos[c]));
+            dot += static_cast<double>(vertices[i].normal[c]) * unpacked[i].normal[c];
+        }
+
+        for (int c = 0; c < 2; ++c)
+            texCoordError = max(texCoordError, fabs(static_cast<double>(vertices[i].texCoord[c]) - unpacked[i].texCoord[c]));
+
+        normalError = max(normalError, acos(min(dot, 1.0)));
+    }
+
+    // Half floats have 10 fraction bits, so between 2 and 4 they are
+    // 2^-9 apart and round to within half that.
+
+    BenchmarkPrint("%d bytes per vertex -> %d bytes per vertex, packed at %.1f M vertices/s\n",
+        static_cast<int>(sizeof(Vertex)), static_cast<int>(sizeof(PackedVertex)),
+        count / max(packTime, 1e-9) / 1000000.0);
+    BenchmarkPrint("Position: max error %.5f (bound %.5f) in a %gx%gx%g box\n", positionError, positionBound,
+        ROOM_SIZE_X, ROOM_SIZE_Y, ROOM_SIZE_Z);
+    BenchmarkPrint("Texture coordinate: max error %.6f (bound %.6f) up to %g\n", texCoordError,
+        ldexp(1.0, -10), ROOM_WALL_TILE_U);
+    BenchmarkPrint("Normal: max error %.4f degrees\n", D3DXToDegree(static_cast<float>(normalError)));
+
+    // Streaming: sum every attribute so that nothing is optimized away.
+    // Packed vertices are decoded a chunk at a time into a buffer that stays
+    // in the cache, the way a CPU skinning or culling pass would use them.
+
+    double bestTimes[2] = {0.0, 0.0};
+    float sums[2] = {0.0f, 0.0f};
+    Vertex chunk[chunkSize];
+
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        for (int format = 0; format < 2; ++format)
+        {
+            float sum = 0.0f;
+
+            startTime = GetTimeInSeconds();
+
+            for (int first = 0; first < count; first += chunkSize)
+            {
+                const Vertex *pVertices = &vertices[first];
+
+                if (format == 1)
+                {
+                    UnpackVertices(&packed[first], chunkSize, quantization, chunk);
+                    pVertices = chunk;
+                }
+
+                for (int i = 0; i < chunkSize; ++i)
+                {
+                    const Vertex &vertex = pVertices[i];
+
+                    sum += vertex.pos[0] + vertex.pos[1] + vertex.pos[2] +
+                           vertex.texCoord[0] + vertex.texCoord[1] +
+                           vertex.normal[0] + vertex.normal[1] + vertex.normal[2];
+                }
+            }
+
+            double time = GetTimeInSeconds() - startTime;
+
+            if (pass == 0 || time < bestTimes[format])
+                bestTimes[format] = time;
+
+            sums[format] = sum;
+        }
+    }
+
+    for (int format = 0; format < 2; ++format)
+    {
+        int stride = (format == 0) ? static_cast<int>(sizeof(Vertex)) : static_cast<int>(sizeof(PackedVertex));
+
+        BenchmarkPrint("%s: %.1f MB read at %.1f M vertices/s, %.2f GB/s (checksum %g)\n",
+            (format == 0) ? "Full precision" : "Packed, decoded on the CPU",
+            static_cast<double>(count) * stride / (1024.0 * 1024.0),
+            count / max(bestTimes[format], 1e-9) / 1000000.0,
+            static_cast<double>(count) * stride / max(bestTimes[format], 1e-9) / (1024.0 * 1024.0 * 1024.0),
+            sums[format]);
+    }
+}
+
+void BenchmarkVirtualTexture()
+{
+    // Streams a VIRTUAL_WALL_TEXTURE_SIZE square virtual texture for the
+    // room walls, cooked by repeating the brick color map, along a camera
+    // path that sweeps around the room and dollies up to the walls and
+    // back. Each frame the walls are ray cast at 1/VIRTUAL_FEEDBACK_SCALE
+    // resolution to find the pages they need, those pages are requested,
+    // and the feedback pixels are sampled to see how many got the mip level
+    // they wanted. Frames are paced at SIMULATION_RATE_HZ so that page
+    // loads complete between frames as they would in the demo.
+
+    const int frames = 600;
+    const int warmupFrames = 60;
+    const int screenWidth = 1280;
+    const int screenHeight = 720;
+    const double frameTime = 1.0 / SIMULATION_RATE_HZ;
+
+    char szTempPath[MAX_PATH];
+    char szFilename[MAX_PATH];
+    std::vector<BYTE> fileData;
+    Image image = {0};
+    WorkerPool loadPool;
+    VirtualTexture texture;
+
+    if (!GetTempPath(sizeof(szTempPath), szTempPath))
+        strcpy(szTempPath, ".\\");
+
+    snprintf(szFilename, sizeof(szFilename), "%sroom_walls.vtex", szTempPath);
+
+    if (!ReadFileContents("Content/Textures/brick_color_map.jpg", fileData) ||
+        !DecodeImage(&fileData[0], fileData.size(), image))
+    {
+        BenchmarkPrint("Failed to load Content/Textures/brick_color_map.jpg\n");
+        return;
+    }
+
+    GenerateMipChain(image, g_workerPool);
+
+    double startTime = GetTimeInSeconds();
+    bool cooked = CookVirtualTexture(szFilename, image, VIRTUAL_WALL_TEXTURE_SIZE, VIRTUAL_WALL_TEXTURE_SIZE, g_workerPool);
+    double cookTime = GetTimeInSeconds() - startTime;
+
+    DestroyImage(image);
+
+    if (!cooked)
+    {
+        BenchmarkPrint("Failed to write %s\n", szFilename);
+        return;
+    }
+
+    if (!loadPool.create(IO_THREADS) || !OpenVirtualTexture(szFilename, loadPool, texture))
+    {
+        BenchmarkPrint("Failed to open %s\n", szFilename);
+        loadPool.destroy();
+        DeleteFile(szFilename);
+        return;
+    }
+
+    ULONGLONG fullBytes = 0;
+
+    for (int i = 0; i < texture.header.levels; ++i)
+        fullBytes += static_cast<ULONGLONG>(max(1, texture.header.width >> i)) * max(1, texture.header.height >> i) * sizeof(DWORD);
+
+    BenchmarkPrint("%dx%d, %d levels, %d pages of %d texels: cooked in %.2f s, %.1f MB on disk\n",
+        texture.header.width, texture.header.height, texture.header.levels, texture.pageCount,
+        VIRTUAL_PAGE_SIZE, cookTime,
+        (sizeof(VirtualTextureHeader) + static_cast<double>(texture.pageCount) * texture.header.pageBytes) / (1024.0 * 1024.0));
+    BenchmarkPrint("Physical cache: %d pages, %.1f MB resident (the whole texture would be %.1f MB)\n",
+        VIRTUAL_PHYSICAL_PAGES,
+        VIRTUAL_PHYSICAL_PAGES * VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE * sizeof(DWORD) / (1024.0 * 1024.0),
+        fullBytes / (1024.0 * 1024.0));
+
+    std::vector<VirtualFeedbackSample> samples;
+    std::vector<int> pages;
+    VirtualTextureStats warmStats = {0};
+    ULONGLONG peakFrameBytes = 0;
+    double updateTime = 0.0;
+    ULONGLONG totalSamples = 0;
+    ULONGLONG exactSamples = 0;
+    ULONGLONG levelsShort = 0;
+    D3DXMATRIX view;
+    D3DXMATRIX projection;
+    D3DXMATRIX viewProjection;
+    D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+
+    D3DXMatrixPerspectiveFovLH(&projection, CAMERA_FOVY,
+        static_cast<float>(screenWidth) / static_cast<float>(screenHeight),
+        CAMERA_ZNEAR, CAMERA_ZFAR);
+
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        double frameStart = GetTimeInSeconds();
+        float t = static_cast<float>(frame) / frames;
+        float angle = t * D3DX_PI * 3.0f;
+        float distance = ROOM_SIZE_X_HALF * (0.5f + 0.45f * sinf(t * D3DX_PI * 8.0f));
+        D3DXVECTOR3 eye(cosf(angle) * distance, sinf(t * D3DX_PI * 6.0f) * ROOM_SIZE_Y_HALF * 0.5f, sinf(angle) * distance);
+        D3DXVECTOR3 target(eye.x + cosf(angle + 0.3f), eye.y - 0.1f, eye.z + sinf(angle + 0.3f));
+
+        D3DXMatrixLookAtLH(&view, &eye, &target, &up);
+        viewProjection = view * projection;
+
+        ULONGLONG bytesBefore = texture.stats.bytesStreamed;
+
+        GatherRoomWallFeedback(texture, viewProjection, screenWidth, screenHeight, samples);
+        GetVirtualPagesFromFeedback(texture, samples, pages);
+        UpdateVirtualTexture(texture, pages.empty() ? 0 : &pages[0], static_cast<int>(pages.size()));
+
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            int residentLevel = 0;
+
+            SampleVirtualTexture(texture, samples[i].u, samples[i].v, samples[i].level, residentLevel);
+
+            if (residentLevel == samples[i].level)
+                ++exactSamples;
+
+            levelsShort += residentLevel - samples[i].level;
+        }
+
+        totalSamples += samples.size();
+        updateTime += GetTimeInSeconds() - frameStart;
+        peakFrameBytes = max(peakFrameBytes, texture.stats.bytesStreamed - bytesBefore);
+
+        if (frame == warmupFrames - 1)
+            warmStats = texture.stats;
+
+        while (GetTimeInSeconds() - frameStart < frameTime)
+            Sleep(1);
+    }
+
+    const VirtualTextureStats &stats = texture.stats;
+
+    BenchmarkPrint("%d frames: %.1f pages requested/frame, hit rate %.1f%% (%.1f%% after the first %d frames)\n",
+        frames, static_cast<double>(stats.pagesRequested) / frames,
+        100.0 * stats.pageHits / max(stats.pagesRequested, 1),
+        100.0 * (stats.pageHits - warmStats.pageHits) / max(stats.pagesRequested - warmStats.pagesRequested, 1),
+        warmupFrames);
+    BenchmarkPrint("Streamed %.1f MB: %.1f KB/frame on average, %.1f KB peak\n",
+        stats.bytesStreamed / (1024.0 * 1024.0), stats.bytesStreamed / 1024.0 / frames, peakFrameBytes / 1024.0);
+    BenchmarkPrint("Pages: %d loaded, %d evicted, %d loads deferred\n",
+        stats.pagesLoaded, stats.pagesEvicted, stats.loadsDeferred);
+    BenchmarkPrint("Samples at the wanted level: %.1f%%, %.2f levels too coarse on average\n",
+        100.0 * exactSamples / max(totalSamples, 1ULL), static_cast<double>(levelsShort) / max(totalSamples, 1ULL));
+    BenchmarkPrint("Feedback, update and sampling: %.2f ms/frame\n", updateTime * 1000.0 / frames);
+
+    CloseVirtualTexture(texture);
+    loadPool.destroy();
+    DeleteFile(szFilename);
+}
+
+__m128 BlendTexels(DWORD texel00, DWORD texel10, DWORD texel01, DWORD texel11, float fracX, float fracY)
+{
+    // Bilinearly weights 4 BGRA texels, given as top left, top right,
+    // bottom left and bottom right. The texels are unpacked together and
+    // weighted as one SSE vector each. Returns BGRA in the range 0 to 255.
+
+    __m128i texels = _mm_set_epi32(texel11, texel01, texel10, texel00);
+    __m128i zero = _mm_setzero_si128();
+    __m128i top = _mm_unpacklo_epi8(texels, zero);
+    __m128i bottom = _mm_unpackhi_epi8(texels, zero);
+    __m128 t00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(top, zero));
+    __m128 t10 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(top, zero));
+    __m128 t01 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bottom, zero));
+    __m128 t11 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(bottom, zero));
+    __m128 weightX = _mm_set1_ps(fracX);
+    __m128 weightY = _mm_set1_ps(fracY);
+    __m128 upper = _mm_add_ps(t00, _mm_mul_ps(_mm_sub_ps(t10, t00), weightX));
+    __m128 lower = _mm_add_ps(t01, _mm_mul_ps(_mm_sub_ps(t11, t01), weightX));
+
+    return _mm_add_ps(upper, _mm_mul_ps(_mm_sub_ps(lower, upper), weightY));
+}
+
+void BuildLightTree(const PointLight *pLights, int count, LightTree &tree)
+{
+    // Builds the light tree over count lights, clustering them by their
+    // render positions. The tree keeps pointing at the lights, so it must
+    // be rebuilt once they move and must not outlive them. Builds start
+    // from the same seed, so the same lights give the same tree.
+
+    tree.pLights = pLights;
+    tree.nodes.clear();
+    tree.clusterLights.clear();
+    tree.order.resize(count);
+    tree.seed = 1;
+
+    if (count == 0)
+        return;
+
+    for (int i = 0; i < count; ++i)
+        tree.order[i] = std::make_pair(0.0f, i);
+
+    tree.nodes.reserve(count * 2 - 1);
+    tree.clusterLights.reserve(count * 2 - 1);
+    BuildLightTreeNode(tree, 0, count);
+}
+
+int BuildLightTreeNode(LightTree &tree, int begin, int end)
+{
+    // Builds the node clustering lights order[begin, end) and returns its
+    // index. Its children split the lights at the median along the longest
+    // axis of their box.
+
+    int index = static_cast<int>(tree.nodes.size());
+    LightTreeNode node;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        node.boundsMin[c] = FLT_MAX;
+        node.boundsMax[c] = -FLT_MAX;
+    }
+
+    node.radius = 0.0f;
+    node.ambientPower = 0.0f;
+    node.diffusePower = 0.0f;
+    node.specularPower = 0.0f;
+    node.children[0] = -1;
+    node.children[1] = -1;
+    node.light = (end - begin == 1) ? tree.order[begin].second : -1;
+
+    for (int i = begin; i < end; ++i)
+    {
+        const PointLight &light = tree.pLights[tree.order[i].second];
+
+        for (int c = 0; c < 3; ++c)
+        {
+            node.boundsMin[c] = min(node.boundsMin[c], light.renderPos[c]);
+            node.boundsMax[c] = max(node.boundsMax[c], light.renderPos[c]);
+        }
+
+        node.radius = max(node.radius, light.radius);
+
+        for (int c = 0; c < 3; ++c)
+        {
+            node.ambientPower += light.ambient[c];
+            node.diffusePower += light.diffuse[c];
+            node.specularPower += light.specular[c];
+        }
+    }
+
+    tree.nodes.push_back(node);
+    tree.clusterLights.push_back(tree.pLights[tree.order[begin].second]);
+
+    if (end - begin == 1)
+        return index;
+
+    int axis = 0;
+
+    for (int c = 1; c < 3; ++c)
+    {
+        if (node.boundsMax[c] - node.boundsMin[c] > node.boundsMax[axis] - node.boundsMin[axis])
+            axis = c;
+    }
+
+    int middle = (begin + end) / 2;
+
+    for (int i = begin; i < end; ++i)
+        tree.order[i].first = tree.pLights[tree.order[i].second].renderPos[axis];
+
+    std::nth_element(tree.order.begin() + begin, tree.order.begin() + middle, tree.order.begin() + end);
+
+    int left = BuildLightTreeNode(tree, begin, middle);
+    int right = BuildLightTreeNode(tree, middle, end);
+
+    tree.nodes[index].children[0] = left;
+    tree.nodes[index].children[1] = right;
+
+    // The cluster's light is one of its children's, picked in proportion
+    // to their power, so that on average it is where their power is.
+
+    const LightTreeNode &leftNode = tree.nodes[left];
+    const LightTreeNode &rightNode = tree.nodes[right];
+    float leftPower = leftNode.ambientPower + leftNode.diffusePower + leftNode.specularPower;
+    float rightPower = rightNode.ambientPower + rightNode.diffusePower + rightNode.specularPower;
+    PointLight &clusterLight = tree.clusterLights[index];
+
+    clusterLight = tree.clusterLights[(NextRandomFloat(tree.seed) * (leftPower + rightPower) < leftPower) ? left : right];
+
+    for (int c = 0; c < 4; ++c)
+    {
+        clusterLight.ambient[c] = tree.clusterLights[left].ambient[c] + tree.clusterLights[right].ambient[c];
+        clusterLight.diffuse[c] = tree.clusterLights[left].diffuse[c] + tree.clusterLights[right].diffuse[c];
+        clusterLight.specular[c] = tree.clusterLights[left].specular[c] + tree.clusterLights[right].specular[c];
+    }
+
+    return index;
+}
+
+void BuildOcclusionPyramid(OcclusionBuffer &buffer)
+{
+    // Reduces each level to the next, keeping the farthest depth, the
+    // smallest 1 / w, of each 2x2 block. Texels past the edge of an odd
+    // sized level repeat the last row or column. Whole groups of 4 output
+    // texels are done with SSE.
+
+    for (int level = 1; level < buffer.levels; ++level)
+    {
+        const float *pSrc = buffer.pDepth + buffer.levelOffsets[level - 1];
+        float *pDst = buffer.pDepth + buffer.levelOffsets[level];
+        int srcWidth = buffer.levelWidths[level - 1];
+        int srcHeight = buffer.levelHeights[level - 1];
+        int width = buffer.levelWidths[level];
+        int height = buffer.levelHeights[level];
+
+        for (int y = 0; y < height; ++y)
+        {
+            const float *pRow0 = pSrc + y * 2 * srcWidth;
+            const float *pRow1 = pSrc + min(y * 2 + 1, srcHeight - 1) * srcWidth;
+            float *pOut = pDst + y * width;
+            int x = 0;
+
+            for (; (x + 4) * 2 <= srcWidth; x += 4)
+            {
+                __m128 a = _mm_min_ps(_mm_loadu_ps(pRow0 + x * 2), _mm_loadu_ps(pRow1 + x * 2));
+                __m128 b = _mm_min_ps(_mm_loadu_ps(pRow0 + x * 2 + 4), _mm_loadu_ps(pRow1 + x * 2 + 4));
+
+                _mm_storeu_ps(pOut + x, _mm_min_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                                                   _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+            }
+
+            for (; x < width; ++x)
+            {
+                int x0 = x * 2;
+                int x1 = min(x * 2 + 1, srcWidth - 1);
+
+                pOut[x] = min(min(pRow0[x0], pRow0[x1]), min(pRow1[x0], pRow1[x1]));
+            }
+        }
+    }
+}
+
+void BuildOctreeOctants(void *pParam, int begin, int end)
+{
+    // Builds the subtrees below the root's children [begin, end) from the
+    // cells found by PlaceOctreeItems(). Items are added to the front of
+    // their node's list in reverse chunk order, which leaves each list in
+    // chunk order.
+
+    OctreeBuildJob &job = *static_cast<OctreeBuildJob*>(pParam);
+    Octree &tree = *job.pTree;
+
+    for (int octant = begin; octant < end; ++octant)
+    {
+        std::vector<OctreeNode> &nodes = job.octantNodes[octant];
+        const std::vector<int> &octantItems = job.octantItems[octant];
+
+        if (octantItems.empty())
+            continue;
+
+        int octantCell[3] = {octant & 1, (octant >> 1) & 1, (octant >> 2) & 1};
+
+        nodes.resize(1);
+        InitOctreeNode(tree, 1, octantCell, -1, nodes[0]);
+
+        for (size_t i = 0; i < octantItems.size(); ++i)
+        {
+            int index = octantItems[i];
+            int depth = job.depths[index];
+            const int *pCell = &job.cells[index * 3];
+            int node = 0;
+
+            ++nodes[0].itemCount;
+
+            for (int level = 2; level <= depth; ++level)
+            {
+                int shift = depth - level;
+                int child = ((pCell[0] >> shift) & 1) | (((pCell[1] >> shift) & 1) << 1) | (((pCell[2] >> shift) & 1) << 2);
+
+                if (nodes[node].children[child] < 0)
+                {
+                    int childCell[3] = {pCell[0] >> shift, pCell[1] >> shift, pCell[2] >> shift};
+                    OctreeNode childNode;
+
+                    InitOctreeNode(tree, level, childCell, node, childNode);
+                    nodes[node].children[child] = static_cast<int>(nodes.size());
+                    nodes.push_back(childNode);
+                }
+
+                node = nodes[node].children[child];
+                ++nodes[node].itemCount;
+            }
+
+            OctreeItem &item = tree.items[index];
+
+            item.node = node;
+            item.prev = -1;
+            item.next = nodes[node].firstItem;
+
+            if (item.next >= 0)
+                tree.items[item.next].prev = index;
+
+            nodes[node].firstItem = index;
+        }
+    }
+}
+
+int BuildRoomBatches(bool useAtlas, RoomBatch *pBatches)
+{
+    // Splits the room into effect rounds and returns how many there are.
+    // Without the atlas each surface needs its own color map, and the walls
+    // use a different material from the ceiling and floor. With the atlas
+    // the vertices select both, so the whole room is one round.
+
+    IDirect3DTexture9 *const *ppNullTexture = g_disableColorMapTexture ? &g_pNullTexture : 0;
+
+    if (useAtlas)
+    {
+        RoomBatch room = {0, 12, 0, ppNullTexture ? ppNullTexture : &g_pRoomAtlasTexture, "atlasTexture"};
+
+        pBatches[0] = room;
+        return 1;
+    }
+
+    RoomBatch walls = {0, 8, &g_dullMaterial, ppNullTexture ? ppNullTexture : &g_pWallColorTexture, "colorMapTexture"};
+    RoomBatch ceiling = {24, 2, &g_shinyMaterial, ppNullTexture ? ppNullTexture : &g_pCeilingColorTexture, "colorMapTexture"};
+    RoomBatch floor = {30, 2, &g_shinyMaterial, ppNullTexture ? ppNullTexture : &g_pFloorColorTexture, "colorMapTexture"};
+
+    pBatches[ROOM_SURFACE_WALLS] = walls;
+    pBatches[ROOM_SURFACE_CEILING] = ceiling;
+    pBatches[ROOM_SURFACE_FLOOR] = floor;
+    return ROOM_SURFACE_COUNT;
+}
+
+void BuildSceneOctree(const Scene &scene, WorkerPool &pool, Octree &tree)
+{
+    // Builds a loose octree over the scene's chunks. Item i is chunk i, and
+    // so is its value. Finding every chunk's cell and building the
+    // subtree below each of the root's children are done on the pool's
+    // threads, after which the subtrees are copied into the tree one after
+    // another. The same scene always gives the same tree.
+
+    int count = static_cast<int>(scene.chunks.size());
+
+    InitOctree(tree, scene.boundsMin, scene.boundsMax);
+    tree.items.resize(count);
+
+    OctreeBuildJob job;
+
+    job.pTree = &tree;
+    job.pScene = &scene;
+    job.depths.resize(count);
+    job.cells.resize(count * 3);
+    ParallelFor(pool, count, PlaceOctreeItems, &job);
+
+    // Items too big for the root's children stay in the root. The others
+    // are shared out between the children whose cells hold their centers.
+
+    OctreeNode &root = tree.nodes[0];
+
+    for (int i = count - 1; i >= 0; --i)
+    {
+        if (job.depths[i] == 0)
+        {
+            OctreeItem &item = tree.items[i];
+
+            item.node = 0;
+            item.prev = -1;
+            item.next = root.firstItem;
+
+            if (item.next >= 0)
+                tree.items[item.next].prev = i;
+
+            root.firstItem = i;
+        }
+        else
+        {
+            int shift = job.depths[i] - 1;
+            const int *pCell = &job.cells[i * 3];
+            int octant = ((pCell[0] >> shift) & 1) | (((pCell[1] >> shift) & 1) << 1) | (((pCell[2] >> shift) & 1) << 2);
+
+            job.octantItems[octant].push_back(i);
+        }
+    }
+
+    root.itemCount = count;
+    ParallelFor(pool, 8, BuildOctreeOctants, &job);
+
+    int nodeCount = 1;
+
+    for (int i = 0; i < 8; ++i)
+    {
+        job.octantFirstNode[i] = nodeCount;
+        root.children[i] = job.octantNodes[i].empty() ? -1 : nodeCount;
+        nodeCount += static_cast<int>(job.octantNodes[i].size());
+    }
+
+    tree.nodes.resize(nodeCount);
+    ParallelFor(pool, 8, CopyOctreeOctants, &job);
+}
+
+void CastRoomView(const D3DXVECTOR3 &eye, const D3DXVECTOR3 &forward, const D3DXVECTOR3 &right,
+                  const D3DXVECTOR3 &up, int width, int height, float *pPositions, float *pNormals,
+                  float *pViewDirs, int *pSurfaces)
+{
+    // Casts a ray from the eye through each pixel of a width by height view
+    // of the room with the camera's field of view, and gives the position,
+    // normal, direction back to the eye and ROOM_SURFACE_* each ray meets.
+
+    float tanHalfFov = tanf(CAMERA_FOVY * 0.5f);
+    float aspect = static_cast<float>(width) / static_cast<float>(height);
+
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            int i = y * width + x;
+            float ndcX = (2.0f * (x + 0.5f) / width - 1.0f) * tanHalfFov * aspect;
+            float ndcY = (1.0f - 2.0f * (y + 0.5f) / height) * tanHalfFov;
+            D3DXVECTOR3 direction = forward + right * ndcX + up * ndcY;
+            float *pPos = &pPositions[i * 3];
+
+            pSurfaces[i] = TraceRoom(eye, direction, pPos, &pNormals[i * 3]);
+
+            D3DXVECTOR3 viewDir(eye.x - pPos[0], eye.y - pPos[1], eye.z - pPos[2]);
+
+            D3DXVec3Normalize(&viewDir, &viewDir);
+            memcpy(&pViewDirs[i * 3], &viewDir, sizeof(float) * 3);
+        }
+    }
+}
+
+void ChooseBestMSAAMode(D3DFORMAT backBufferFmt, D3DFORMAT depthStencilFmt,
+                        BOOL windowed, D3DMULTISAMPLE_TYPE &type,
+                        DWORD &qualityLevels, DWORD &samplesPerPixel)
+{
+    bool supported = false;
+
+    struct MSAAMode
+    {
+        D3DMULTISAMPLE_TYPE type;
+        DWORD samples;
+    }
+    multsamplingTypes[15] =
+    {
+        { D3DMULTISAMPLE_16_SAMPLES,  16 },
+        { D3DMULTISAMPLE_15_SAMPLES,  15 },
+        { D3DMULTISAMPLE_14_SAMPLES,  14 },
+        { D3DMULTISAMPLE_13_SAMPLES,  13 },
+        { D3DMULTISAMPLE_12_SAMPLES,  12 },
+        { D3DMULTISAMPLE_11_SAMPLES,  11 },
+        { D3DMULTISAMPLE_10_SAMPLES,  10 },
+        { D3DMULTISAMPLE_9_SAMPLES,   9  },
+        { D3DMULTISAMPLE_8_SAMPLES,   8  },
+        { D3DMULTISAMPLE_7_SAMPLES,   7  },
+        { D3DMULTISAMPLE_6_SAMPLES,   6  },
+        { D3DMULTISAMPLE_5_SAMPLES,   5  },
+        { D3DMULTISAMPLE_4_SAMPLES,   4  },
+        { D3DMULTISAMPLE_3_SAMPLES,   3  },
+        { D3DMULTISAMPLE_2_SAMPLES,   2  }
+    };
+
+    for (int i = 0; i < 15; ++i)
+    {
+        type = multsamplingTypes[i].type;
+
+        supported = MSAAModeSupported(type, backBufferFmt, depthStencilFmt,
+                        windowed, qualityLevels);
+
+        if (supported)
+        {
+            samplesPerPixel = multsamplingTypes[i].samples;
+            return;
+        }
+    }
+
+    type = D3DMULTISAMPLE_NONE;
+    qualityLevels = 0;
+    samplesPerPixel = 1;
+}
+
+void BuildTriangleOctree(const D3DXVECTOR3 *pTriangles, int count, Octree &tree)
+{
+    // Builds an octree whose item i is the triangle with vertices
+    // pTriangles[i * 3] to pTriangles[i * 3 + 2].
+
+    float boundsMin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float boundsMax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    for (int i = 0; i < count * 3; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            boundsMin[c] = min(boundsMin[c], pTriangles[i][c]);
+            boundsMax[c] = max(boundsMax[c], pTriangles[i][c]);
+        }
+    }
+
+    if (count == 0)
+    {
+        memset(boundsMin, 0, sizeof(boundsMin));
+        memset(boundsMax, 0, sizeof(boundsMax));
+    }
+
+    InitOctree(tree, boundsMin, boundsMax);
+    tree.items.reserve(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        const D3DXVECTOR3 *pTriangle = &pTriangles[i * 3];
+        float triangleMin[3];
+        float triangleMax[3];
+
+        for (int c = 0; c < 3; ++c)
+        {
+            triangleMin[c] = min(min(pTriangle[0][c], pTriangle[1][c]), pTriangle[2][c]);
+            triangleMax[c] = max(max(pTriangle[0][c], pTriangle[1][c]), pTriangle[2][c]);
+        }
+
+        InsertOctreeItem(tree, triangleMin, triangleMax, i);
+    }
+}
+
+void Cleanup()
+{
+    CleanupApp();
+
+    SAFE_RELEASE(g_pNullTexture);
+    SAFE_RELEASE(g_pGlyphAtlasTexture);
+    SAFE_RELEASE(g_pFont);
+
+    DestroyGlyphAtlas(g_glyphAtlas);
+    SAFE_RELEASE(g_pDevice);
+    SAFE_RELEASE(g_pDirect3D);
+}
+
+void CleanupApp()
+{
+    SAFE_RELEASE(g_pAmbientEffect);
+    SAFE_RELEASE(g_pBlinnPhongEffectSM20);
+    SAFE_RELEASE(g_pBlinnPhongEffectSM30);
+    SAFE_RELEASE(g_pWallColorTexture);
+    SAFE_RELEASE(g_pCeilingColorTexture);
+    SAFE_RELEASE(g_pFloorColorTexture);
+    SAFE_RELEASE(g_pRoomIndexBuffer);
+    SAFE_RELEASE(g_pRoomPackedVertexBuffer);
+    SAFE_RELEASE(g_pModelVertexBuffer);
+    SAFE_RELEASE(g_pModelIndexBuffer);
+    SAFE_RELEASE(g_pSceneVertexBuffer);
+    SAFE_RELEASE(g_pRoomPackedVertexDecl);
+    SAFE_RELEASE(g_pRoomPackedAtlasVertexDecl);
+    SAFE_RELEASE(g_pRoomVertexBuffer);
+    SAFE_RELEASE(g_pRoomVertexDecl);
+    SAFE_RELEASE(g_pRoomAtlasTexture);
+    SAFE_RELEASE(g_pRoomAtlasVertexBuffer);
+    SAFE_RELEASE(g_pRoomAtlasVertexDecl);
+    SAFE_RELEASE(g_pLightImpostorVertexBuffer);
+    SAFE_RELEASE(g_pLightImpostorVertexDecl);
+
+    for (int i = 0; i < LIGHT_LOD_SPHERES; ++i)
+        SAFE_RELEASE(g_pLightMeshes[i]);
+
+    FinishOcclusionJob(g_occlusionJob, g_workerPool);
+    DestroyOcclusionBuffer(g_occlusionBuffer);
+
+    InterlockedExchange(&g_lightmapBake.cancel, 1);
+    FinishLightmapBake(g_lightmapBake, g_workerPool);
+    SAFE_RELEASE(g_pLightmapTexture);
+
+    g_ioPool.destroy();
+    g_workerPool.destroy();
+    g_frameArena.destroy();
+}
+
+void CloseVirtualTexture(VirtualTexture &texture)
+{
+    // Waits for page loads still in flight, which write into the texture.
+    // The load pool may be shared, so this waits for all of its jobs.
+
+    if (texture.pLoadPool)
+        texture.pLoadPool->wait();
+
+    for (int i = 0; i < VIRTUAL_MAX_PAGE_LOADS; ++i)
+        free(texture.loads[i].pTexels);
+
+    if (texture.hFile)
+        CloseHandle(texture.hFile);
+
+    free(texture.pPageTable);
+    free(texture.pPageLoading);
+    free(texture.pPageRequested);
+    _aligned_free(texture.pPhysical);
+    memset(&texture, 0, sizeof(texture));
+}
+
+void CompileShaderJob(void *pParam)
+{
+    ShaderCompile &shader = *static_cast<ShaderCompile*>(pParam);
+    ID3DXEffectCompiler *pCompiler = 0;
+    DWORD dwShaderFlags = D3DXSHADER_NO_PRESHADER;
+
+    // Both vertex and pixel shaders can be debugged. To enable shader
+    // debugging add the following flag to the dwShaderFlags variable:
+    //      dwShaderFlags |= D3DXSHADER_DEBUG;
+    //
+    // Vertex shaders can be debugged with either the REF device or a device
+    // created for software vertex processing (i.e., the IDirect3DDevice9
+    // object must be created with the D3DCREATE_SOFTWARE_VERTEXPROCESSING
+    // behavior). Pixel shaders can be debugged only using the REF device.
+    //
+    // To enable vertex shader debugging add the following flag to the
+    // dwShaderFlags variable:
+    //     dwShaderFlags |= D3DXSHADER_FORCE_VS_SOFTWARE_NOOPT;
+    //
+    // To enable pixel shader debugging add the following flag to the
+    // dwShaderFlags variable:
+    //     dwShaderFlags |= D3DXSHADER_FORCE_PS_SOFTWARE_NOOPT;
+
+    AllocationZone zone("CompileShader");
+
+    if (SUCCEEDED(D3DXCreateEffectCompilerFromFile(shader.pszFilename, 0, 0,
+            dwShaderFlags, &pCompiler, &shader.pErrors)))
+    {
+        SAFE_RELEASE(shader.pErrors);
+        pCompiler->CompileEffect(dwShaderFlags, &shader.pEffectCode, &shader.pErrors);
+        pCompiler->Release();
+    }
+}
+
+void CompressBlockBC1ClusterFit(const DWORD *pPixels, int iterations, BYTE *pBlock)
+{
+    // Tries to improve on the DXT1 color block already in pBlock using
+    // cluster fit. The pixels are sorted along an axis and every way of
+    // splitting them into 4 runs, one per palette entry, is tried. Each
+    // split gets the least squares end points for those assignments. The
+    // first axis joins the end points of the existing block, and each later
+    // iteration uses the axis of the best end points found so far. The block
+    // is only replaced if the result has a lower error.
+
+    float colors[16][3];
+    float total[3] = {0.0f, 0.0f, 0.0f};
+    DWORD decoded[16];
+    int bestError = 0;
+
+    DecompressBlockBC1(pBlock, false, decoded);
+
+    for (int i = 0; i < 16; ++i)
+    {
+        colors[i][0] = static_cast<float>((pPixels[i] >> 16) & 0xff);
+        colors[i][1] = static_cast<float>((pPixels[i] >> 8) & 0xff);
+        colors[i][2] = static_cast<float>(pPixels[i] & 0xff);
+
+        for (int c = 0; c < 3; ++c)
+        {
+            int error = ((pPixels[i] >> (16 - c * 8)) & 0xff) - ((decoded[i] >> (16 - c * 8)) & 0xff);
+
+            total[c] += colors[i][c];
+            bestError += error * error;
+        }
+    }
+
+    if (bestError == 0)
+        return;
+
+    int endPoint0[3];
+    int endPoint1[3];
+    float axis[3];
+
+    UnpackColor565(static_cast<WORD>(pBlock[0] | (pBlock[1] << 8)), endPoint0);
+    UnpackColor565(static_cast<WORD>(pBlock[2] | (pBlock[3] << 8)), endPoint1);
+
+    for (int c = 0; c < 3; ++c)
+        axis[c] = static_cast<float>(endPoint0[c] - endPoint1[c]);
+
+    if (axis[0] == 0.0f && axis[1] == 0.0f && axis[2] == 0.0f)
+        axis[0] = axis[1] = axis[2] = 1.0f;
+
+    for (int iteration = 0; iteration < iterations; ++iteration)
+    {
+        // Sort the pixels along the axis and build prefix sums of the
+        // sorted colors.
+
+        int order[16];
+        float dots[16];
+        float prefix[17][3];
+
+        for (int i = 0; i < 16; ++i)
+        {
+            float dot = colors[i][0] * axis[0] + colors[i][1] * axis[1] + colors[i][2] * axis[2];
+            int j = i;
+
+            for (; j > 0 && dots[j - 1] > dot; --j)
+            {
+                dots[j] = dots[j - 1];
+                order[j] = order[j - 1];
+            }
+
+            dots[j] = dot;
+            order[j] = i;
+        }
+
+        prefix[0][0] = prefix[0][1] = prefix[0][2] = 0.0f;
+
+        for (int i = 0; i < 16; ++i)
+        {
+            for (int c = 0; c < 3; ++c)
+                prefix[i + 1][c] = prefix[i][c] + colors[order[i]][c];
+        }
+
+        // Pixels [0, i) use color0, [i, j) the 2/3 color0 entry, [j, k) the
+        // 1/3 color0 entry and [k, 16) color1.
+
+        float bestClusterError = FLT_MAX;
+        float bestA[3];
+        float bestB[3];
+
+        for (int i = 0; i <= 16; ++i)
+        {
+            for (int j = i; j <= 16; ++j)
+            {
+                for (int k = j; k <= 16; ++k)
+                {
+                    float n0 = static_cast<float>(i);
+                    float n2 = static_cast<float>(j - i);
+                    float n3 = static_cast<float>(k - j);
+                    float n1 = static_cast<float>(16 - k);
+                    float alpha2 = n0 + n2 * (4.0f / 9.0f) + n3 * (1.0f / 9.0f);
+                    float beta2 = n1 + n2 * (1.0f / 9.0f) + n3 * (4.0f / 9.0f);
+                    float alphaBeta = (n2 + n3) * (2.0f / 9.0f);
+                    float det = alpha2 * beta2 - alphaBeta * alphaBeta;
+
+                    if (fabsf(det) < 1e-6f)
+                        continue;
+
+                    float a[3];
+                    float b[3];
+                    float alphaX[3];
+                    float betaX[3];
+
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        float s0 = prefix[i][c];
+                        float s2 = prefix[j][c] - prefix[i][c];
+                        float s3 = prefix[k][c] - prefix[j][c];
+                        float s1 = total[c] - prefix[k][c];
+
+                        alphaX[c] = s0 + s2 * (2.0f / 3.0f) + s3 * (1.0f / 3.0f);
+                        betaX[c] = s1 + s2 * (1.0f / 3.0f) + s3 * (2.0f / 3.0f);
+                        a[c] = (alphaX[c] * beta2 - betaX[c] * alphaBeta) / det;
+                        b[c] = (betaX[c] * alpha2 - alphaX[c] * alphaBeta) / det;
+                    }
+
+                    // The squared error of the least squares fit is the sum
+                    // of the squared colors, which is the same for every
+                    // split, minus a.alphaX + b.betaX.
+
+                    float error = 0.0f;
+
+                    for (int c = 0; c < 3; ++c)
+                        error -= a[c] * alphaX[c] + b[c] * betaX[c];
+
+                    if (error < bestClusterError)
+                    {
+                        bestClusterError = error;
+                        memcpy(bestA, a, sizeof(bestA));
+                        memcpy(bestB, b, sizeof(bestB));
+                    }
+                }
+            }
+        }
+
+        if (bestClusterError == FLT_MAX)
+            break;
+
+        // Quantize the best end points to 5:6:5.
+
+        int quantized[2][3];
+
+        for (int c = 0; c < 3; ++c)
+        {
+            float levels = (c == 1) ? 63.0f : 31.0f;
+
+            quantized[0][c] = static_cast<int>(min(max(bestA[c], 0.0f), 255.0f) * levels / 255.0f + 0.5f);
+            quantized[1][c] = static_cast<int>(min(max(bestB[c], 0.0f), 255.0f) * levels / 255.0f + 0.5f);
+        }
+
+        WORD bestColor0 = static_cast<WORD>((quantized[0][0] << 11) | (quantized[0][1] << 5) | quantized[0][2]);
+        WORD bestColor1 = static_cast<WORD>((quantized[1][0] << 11) | (quantized[1][1] << 5) | quantized[1][2]);
+        BYTE block[8];
+        int error = WriteBlockBC1(pPixels, bestColor0, bestColor1, block);
+
+        if (error >= bestError)
+            break;
+
+        bestError = error;
+        memcpy(pBlock, block, sizeof(block));
+
+        UnpackColor565(bestColor0, endPoint0);
+        UnpackColor565(bestColor1, endPoint1);
+
+        for (int c = 0; c < 3; ++c)
+            axis[c] = static_cast<float>(endPoint0[c] - endPoint1[c]);
+
+        if (axis[0] == 0.0f && axis[1] == 0.0f && axis[2] == 0.0f)
+            break;
+    }
+}
+
+void CompressBlockBC3Alpha(const DWORD *pPixels, BYTE *pBlock)
+{
+    // Encodes the alpha of a 4x4 block of BGRA pixels as a DXT5 alpha block
+    // using the 8 value mode between the smallest and largest alpha.
+
+    int minAlpha = 255;
+    int maxAlpha = 0;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        int alpha = pPixels[i] >> 24;
+
+        minAlpha = min(minAlpha, alpha);
+        maxAlpha = max(maxAlpha, alpha);
+    }
+
+    ULONGLONG indices = 0;
+
+    if (maxAlpha != minAlpha)
+    {
+        int palette[8];
+
+        palette[0] = maxAlpha;
+        palette[1] = minAlpha;
+
+        for (int j = 1; j < 7; ++j)
+            palette[j + 1] = ((7 - j) * maxAlpha + j * minAlpha) / 7;
+
+        for (int i = 0; i < 16; ++i)
+        {
+            int alpha = pPixels[i] >> 24;
+            int bestIndex = 0;
+
+            for (int j = 1; j < 8; ++j)
+            {
+                if (abs(alpha - palette[j]) < abs(alpha - palette[bestIndex]))
+                    bestIndex = j;
+            }
+
+            indices |= static_cast<ULONGLONG>(bestIndex) << (i * 3);
+        }
+    }
+
+    pBlock[0] = static_cast<BYTE>(maxAlpha);
+    pBlock[1] = static_cast<BYTE>(minAlpha);
+
+    for (int i = 0; i < 6; ++i)
+        pBlock[2 + i] = static_cast<BYTE>(indices >> (i * 8));
+}
+
+void CompressBlockBC7(const DWORD *pPixels, int quality, BYTE *pBlock)
+{
+    // Encodes a 4x4 block of BGRA pixels as a BC7 mode 6 block: a single
+    // subset with 7.7.7.7 end points, one p-bit per end point, and 4-bit
+    // indices. The end points start as the extremes along the principal axis
+    // of the colors (range fit). COMPRESS_QUALITY_NORMAL and above then
+    // alternate between choosing indices and solving for the least squares
+    // end points. COMPRESS_QUALITY_HIGH also tries every pair of p-bits
+    // instead of the nearest one for each end point.
+
+    float colors[16][4];
+    float mean[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+    for (int i = 0; i < 16; ++i)
+    {
+        colors[i][0] = static_cast<float>((pPixels[i] >> 16) & 0xff);
+        colors[i][1] = static_cast<float>((pPixels[i] >> 8) & 0xff);
+        colors[i][2] = static_cast<float>(pPixels[i] & 0xff);
+        colors[i][3] = static_cast<float>(pPixels[i] >> 24);
+
+        for (int c = 0; c < 4; ++c)
+            mean[c] += colors[i][c] * (1.0f / 16.0f);
+    }
+
+    float cov[4][4] = {0};
+
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            for (int d = c; d < 4; ++d)
+                cov[c][d] += (colors[i][c] - mean[c]) * (colors[i][d] - mean[d]);
+        }
+    }
+
+    for (int c = 1; c < 4; ++c)
+    {
+        for (int d = 0; d < c; ++d)
+            cov[c][d] = cov[d][c];
+    }
+
+    float axis[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+
+    for (int iteration = 0; iteration < 4; ++iteration)
+    {
+        float next[4];
+        float length = 0.0f;
+
+        for (int c = 0; c < 4; ++c)
+        {
+            next[c] = cov[c][0] * axis[0] + cov[c][1] * axis[1] + cov[c][2] * axis[2] + cov[c][3] * axis[3];
+            length = max(length, fabsf(next[c]));
+        }
+
+        if (length < 1e-6f)
+            break;
+
+        for (int c = 0; c < 4; ++c)
+            axis[c] = next[c] / length;
+    }
+
+    float endPoints[2][4];
+    float minDot = FLT_MAX;
+    float maxDot = -FLT_MAX;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        float dot = colors[i][0] * axis[0] + colors[i][1] * axis[1] + colors[i][2] * axis[2] + colors[i][3] * axis[3];
+
+        if (dot < minDot)
+        {
+            minDot = dot;
+            memcpy(endPoints[0], colors[i], sizeof(endPoints[0]));
+        }
+
+        if (dot > maxDot)
+        {
+            maxDot = dot;
+            memcpy(endPoints[1], colors[i], sizeof(endPoints[1]));
+        }
+    }
+
+    int refinements = (quality >= COMPRESS_QUALITY_HIGH) ? 4 : ((quality >= COMPRESS_QUALITY_NORMAL) ? 2 : 0);
+    int bestError = INT_MAX;
+    int bestQuantized[2][4] = {0};
+    int bestPBits[2] = {0};
+    int bestIndices[16] = {0};
+
+    for (int refinement = 0; ; ++refinement)
+    {
+        // Quantize the end points. Each stored value is 7 bits followed by
+        // the end point's p-bit.
+
+        for (int pBitPair = 0; pBitPair < 4; ++pBitPair)
+        {
+            int quantized[2][4];
+            int pBits[2];
+
+            for (int e = 0; e < 2; ++e)
+            {
+                int bestPBitError = INT_MAX;
+
+                for (int pBit = 0; pBit < 2; ++pBit)
+                {
+                    if (quality >= COMPRESS_QUALITY_HIGH && pBit != ((pBitPair >> e) & 1))
+                        continue;
+
+                    int values[4];
+                    int error = 0;
+
+                    for (int c = 0; c < 4; ++c)
+                    {
+                        values[c] = min(max(static_cast<int>((endPoints[e][c] - pBit) * 0.5f + 0.5f), 0), 127);
+
+                        int difference = ((values[c] << 1) | pBit) - static_cast<int>(endPoints[e][c] + 0.5f);
+                        error += difference * difference;
+                    }
+
+                    if (error < bestPBitError)
+                    {
+                        bestPBitError = error;
+                        pBits[e] = pBit;
+                        memcpy(quantized[e], values, sizeof(values));
+                    }
+                }
+            }
+
+            // Pick the nearest palette entry for each pixel.
+
+            int palette[16][4];
+            int indices[16];
+            int error = 0;
+
+            for (int j = 0; j < 16; ++j)
+            {
+                for (int c = 0; c < 4; ++c)
+                {
+                    int e0 = (quantized[0][c] << 1) | pBits[0];
+                    int e1 = (quantized[1][c] << 1) | pBits[1];
+
+                    palette[j][c] = ((64 - BC7_INDEX_WEIGHTS[j]) * e0 + BC7_INDEX_WEIGHTS[j] * e1 + 32) >> 6;
+                }
+            }
+
+            for (int i = 0; i < 16; ++i)
+            {
+                int bestPixelError = INT_MAX;
+
+                for (int j = 0; j < 16; ++j)
+                {
+                    int pixelError = 0;
+
+                    for (int c = 0; c < 4; ++c)
+                    {
+                        int difference = static_cast<int>(colors[i][c]) - palette[j][c];
+                        pixelError += difference * difference;
+                    }
+
+                    if (pixelError < bestPixelError)
+                    {
+                        bestPixelError = pixelError;
+                        indices[i] = j;
+                    }
+                }
+
+                error += bestPixelError;
+            }
+
+            if (error < bestError)
+            {
+                bestError = error;
+                memcpy(bestQuantized, quantized, sizeof(bestQuantized));
+                memcpy(bestPBits, pBits, sizeof(bestPBits));
+                memcpy(bestIndices, indices, sizeof(bestIndices));
+            }
+
+            if (quality < COMPRESS_QUALITY_HIGH)
+                break;
+        }
+
+        if (refinement == refinements || bestError == 0)
+            break;
+
+        // Solve for the end points that best fit the current indices.
+
+        float alpha2 = 0.0f;
+        float beta2 = 0.0f;
+        float alphaBeta = 0.0f;
+        float alphaX[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        float betaX[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+        for (int i = 0; i < 16; ++i)
+        {
+            float beta = BC7_INDEX_WEIGHTS[bestIndices[i]] / 64.0f;
+            float alpha = 1.0f - beta;
+
+            alpha2 += alpha * alpha;
+            beta2 += beta * beta;
+            alphaBeta += alpha * beta;
+
+            for (int c = 0; c < 4; ++c)
+            {
+                alphaX[c] += alpha * colors[i][c];
+                betaX[c] += beta * colors[i][c];
+            }
+        }
+
+        float det = alpha2 * beta2 - alphaBeta * alphaBeta;
+
+        if (fabsf(det) < 1e-6f)
+            break;
+
+        for (int c = 0; c < 4; ++c)
+        {
+            endPoints[0][c] = min(max((alphaX[c] * beta2 - betaX[c] * alphaBeta) / det, 0.0f), 255.0f);
+            endPoints[1][c] = min(max((betaX[c] * alpha2 - alphaX[c] * alphaBeta) / det, 0.0f), 255.0f);
+        }
+    }
+
+    // The most significant bit of the first index isn't stored, so swap the
+    // end points if it would be set.
+
+    if (bestIndices[0] & 8)
+    {
+        for (int c = 0; c < 4; ++c)
+            std::swap(bestQuantized[0][c], bestQuantized[1][c]);
+
+        std::swap(bestPBits[0], bestPBits[1]);
+
+        for (int i = 0; i < 16; ++i)
+            bestIndices[i] = 15 - bestIndices[i];
+    }
+
+    int offset = 0;
+
+    memset(pBlock, 0, 16);
+    WriteBlockBits(pBlock, offset, 1 << 6, 7);
+
+    for (int c = 0; c < 4; ++c)
+    {
+        WriteBlockBits(pBlock, offset, bestQuantized[0][c], 7);
+        WriteBlockBits(pBlock, offset, bestQuantized[1][c], 7);
+    }
+
+    WriteBlockBits(pBlock, offset, bestPBits[0], 1);
+    WriteBlockBits(pBlock, offset, bestPBits[1], 1);
+
+    for (int i = 0; i < 16; ++i)
+        WriteBlockBits(pBlock, offset, bestIndices[i], (i == 0) ? 3 : 4);
+}
+
+void CompressBlockRows(void *pParam, int begin, int end)
+{
+    // Compresses block rows [begin, end) of one level. Blocks that hang
+    // over the edge of a level smaller than 4x4 repeat its edge pixels.
+    // DXT1/DXT5 color blocks are range fit 4 at a time, one per SSE lane.
+
+    const CompressJob &job = *static_cast<const CompressJob*>(pParam);
+    const Image &image = *job.pImage;
+    const CompressedImage &compressed = *job.pCompressed;
+    int width = max(1, image.width >> job.level);
+    int height = max(1, image.height >> job.level);
+    int blocksWide = (width + 3) / 4;
+    int blockSize = (compressed.format == D3DFMT_DXT1) ? 8 : 16;
+    const DWORD *pSrc = image.pPixels + image.levelOffsets[job.level];
+    BYTE *pDst = const_cast<BYTE*>(compressed.pData) + compressed.levelOffsets[job.level];
+    DWORD pixels[4][16];
+    const DWORD *pBlockPixels[4] = {pixels[0], pixels[1], pixels[2], pixels[3]};
+    BYTE *pColorBlocks[4];
+
+    for (int by = begin; by < end; ++by)
+    {
+        for (int bx = 0; bx < blocksWide; bx += 4)
+        {
+            // Lanes past the end of the row repeat its last block and
+            // aren't written.
+
+            int count = min(4, blocksWide - bx);
+
+            for (int n = 0; n < 4; ++n)
+            {
+                int column = bx + min(n, count - 1);
+
+                for (int y = 0; y < 4; ++y)
+                {
+                    for (int x = 0; x < 4; ++x)
+                        pixels[n][y * 4 + x] = pSrc[min(by * 4 + y, height - 1) * width + min(column * 4 + x, width - 1)];
+                }
+
+                pColorBlocks[n] = (n < count) ? pDst + (by * blocksWide + column) * blockSize : 0;
+            }
+
+            if (compressed.format == FORMAT_BC7)
+            {
+                for (int n = 0; n < count; ++n)
+                    CompressBlockBC7(pixels[n], job.quality, pColorBlocks[n]);
+
+                continue;
+            }
+
+            if (compressed.format == D3DFMT_DXT5)
+            {
+                for (int n = 0; n < count; ++n)
+                {
+                    CompressBlockBC3Alpha(pixels[n], pColorBlocks[n]);
+                    pColorBlocks[n] += 8;
+                }
+            }
+
+            CompressBlocksBC1(pBlockPixels, pColorBlocks);
+
+            if (job.quality >= COMPRESS_QUALITY_NORMAL)
+            {
+                int iterations = (job.quality >= COMPRESS_QUALITY_HIGH) ? 4 : 1;
+
+                for (int n = 0; n < count; ++n)
+                    CompressBlockBC1ClusterFit(pixels[n], iterations, pColorBlocks[n]);
+            }
+        }
+    }
+}
+
+void CompressBlocksBC1(const DWORD *pPixels[4], BYTE *pBlocks[4])
+{
+    // Encodes four 4x4 blocks of BGRA pixels as DXT1 color blocks, one block
+    // per SSE lane. The end points are the extremes of each block's colors
+    // projected onto their principal axis (range fit). The blocks always use
+    // the 4 color mode. Blocks with a null pointer in pBlocks aren't written.
+
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    __m128 r[16];
+    __m128 g[16];
+    __m128 b[16];
+    __m128 meanR = _mm_setzero_ps();
+    __m128 meanG = _mm_setzero_ps();
+    __m128 meanB = _mm_setzero_ps();
+
+    for (int i = 0; i < 16; ++i)
+    {
+        __m128i pixel = _mm_set_epi32(pPixels[3][i], pPixels[2][i], pPixels[1][i], pPixels[0][i]);
+
+        r[i] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel, 16), byteMask));
+        g[i] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixel, 8), byteMask));
+        b[i] = _mm_cvtepi32_ps(_mm_and_si128(pixel, byteMask));
+
+        meanR = _mm_add_ps(meanR, r[i]);
+        meanG = _mm_add_ps(meanG, g[i]);
+        meanB = _mm_add_ps(meanB, b[i]);
+    }
+
+    meanR = _mm_mul_ps(meanR, _mm_set1_ps(1.0f / 16.0f));
+    meanG = _mm_mul_ps(meanG, _mm_set1_ps(1.0f / 16.0f));
+    meanB = _mm_mul_ps(meanB, _mm_set1_ps(1.0f / 16.0f));
+
+    // Principal axis of the covariance matrix by power iteration.
+
+    __m128 covRR = _mm_setzero_ps();
+    __m128 covRG = _mm_setzero_ps();
+    __m128 covRB = _mm_setzero_ps();
+    __m128 covGG = _mm_setzero_ps();
+    __m128 covGB = _mm_setzero_ps();
+    __m128 covBB = _mm_setzero_ps();
+
+    for (int i = 0; i < 16; ++i)
+    {
+        __m128 dr = _mm_sub_ps(r[i], meanR);
+        __m128 dg = _mm_sub_ps(g[i], meanG);
+        __m128 db = _mm_sub_ps(b[i], meanB);
+
+        covRR = _mm_add_ps(covRR, _mm_mul_ps(dr, dr));
+        covRG = _mm_add_ps(covRG, _mm_mul_ps(dr, dg));
+        covRB = _mm_add_ps(covRB, _mm_mul_ps(dr, db));
+        covGG = _mm_add_ps(covGG, _mm_mul_ps(dg, dg));
+        covGB = _mm_add_ps(covGB, _mm_mul_ps(dg, db));
+        covBB = _mm_add_ps(covBB, _mm_mul_ps(db, db));
+    }
+
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 minLength = _mm_set1_ps(1e-6f);
+    __m128 axisR = _mm_set1_ps(1.0f);
+    __m128 axisG = _mm_set1_ps(1.0f);
+    __m128 axisB = _mm_set1_ps(1.0f);
+
+    for (int iteration = 0; iteration < 4; ++iteration)
+    {
+        __m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(covRR, axisR), _mm_mul_ps(covRG, axisG)), _mm_mul_ps(covRB, axisB));
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(covRG, axisR), _mm_mul_ps(covGG, axisG)), _mm_mul_ps(covGB, axisB));
+        __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(covRB, axisR), _mm_mul_ps(covGB, axisG)), _mm_mul_ps(covBB, axisB));
+        __m128 length = _mm_max_ps(_mm_max_ps(_mm_and_ps(x, absMask), _mm_and_ps(y, absMask)), _mm_and_ps(z, absMask));
+        __m128 valid = _mm_cmpge_ps(length, minLength);
+        __m128 scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(length, minLength));
+
+        axisR = SelectPS(valid, _mm_mul_ps(x, scale), axisR);
+        axisG = SelectPS(valid, _mm_mul_ps(y, scale), axisG);
+        axisB = SelectPS(valid, _mm_mul_ps(z, scale), axisB);
+    }
+
+    __m128 minDot = _mm_set1_ps(FLT_MAX);
+    __m128 maxDot = _mm_set1_ps(-FLT_MAX);
+    __m128 minR = _mm_setzero_ps();
+    __m128 minG = _mm_setzero_ps();
+    __m128 minB = _mm_setzero_ps();
+    __m128 maxR = _mm_setzero_ps();
+    __m128 maxG = _mm_setzero_ps();
+    __m128 maxB = _mm_setzero_ps();
+
+    for (int i = 0; i < 16; ++i)
+    {
+        __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r[i], axisR), _mm_mul_ps(g[i], axisG)), _mm_mul_ps(b[i], axisB));
+        __m128 less = _mm_cmplt_ps(dot, minDot);
+        __m128 greater = _mm_cmpgt_ps(dot, maxDot);
+
+        minDot = SelectPS(less, dot, minDot);
+        minR = SelectPS(less, r[i], minR);
+        minG = SelectPS(less, g[i], minG);
+        minB = SelectPS(less, b[i], minB);
+        maxDot = SelectPS(greater, dot, maxDot);
+        maxR = SelectPS(greater, r[i], maxR);
+        maxG = SelectPS(greater, g[i], maxG);
+        maxB = SelectPS(greater, b[i], maxB);
+    }
+
+    // Quantize the end points to 5:6:5 and make color0 > color1.
+
+    const __m128 scale5 = _mm_set1_ps(31.0f / 255.0f);
+    const __m128 scale6 = _mm_set1_ps(63.0f / 255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    __m128i color0 = _mm_or_si128(_mm_or_si128(
+        _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(maxR, scale5), half)), 11),
+        _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(maxG, scale6), half)), 5)),
+        _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(maxB, scale5), half)));
+    __m128i color1 = _mm_or_si128(_mm_or_si128(
+        _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(minR, scale5), half)), 11),
+        _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(minG, scale6), half)), 5)),
+        _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(minB, scale5), half)));
+    __m128i swap = _mm_cmplt_epi32(color0, color1);
+    __m128i high = SelectEpi32(swap, color1, color0);
+    __m128i low = SelectEpi32(swap, color0, color1);
+
+    // Build the palettes the same way the hardware expands them.
+
+    __m128 paletteR[4];
+    __m128 paletteG[4];
+    __m128 paletteB[4];
+
+    for (int e = 0; e < 2; ++e)
+    {
+        __m128i color = (e == 0) ? high : low;
+
+        paletteR[e] = _mm_cvtepi32_ps(_mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(color, 11), 3),
+                                                   _mm_srli_epi32(color, 13)));
+        paletteG[e] = _mm_cvtepi32_ps(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(color, 5), _mm_set1_epi32(0x3f)), 2),
+                                                   _mm_and_si128(_mm_srli_epi32(color, 9), _mm_set1_epi32(0x03))));
+        paletteB[e] = _mm_cvtepi32_ps(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(color, _mm_set1_epi32(0x1f)), 3),
+                                                   _mm_and_si128(_mm_srli_epi32(color, 2), _mm_set1_epi32(0x07))));
+    }
+
+    // (2 * a + b) / 3 with integer division. Adding a half before the
+    // multiply keeps exact multiples of 3 from rounding down.
+
+    const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+    __m128 *pPalettes[3] = {paletteR, paletteG, paletteB};
+
+    for (int c = 0; c < 3; ++c)
+    {
+        __m128 *pPalette = pPalettes[c];
+        __m128 twice0 = _mm_add_ps(pPalette[0], pPalette[0]);
+        __m128 twice1 = _mm_add_ps(pPalette[1], pPalette[1]);
+
+        pPalette[2] = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_add_ps(twice0, pPalette[1]), half), third)));
+        pPalette[3] = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_add_ps(pPalette[0], twice1), half), third)));
+    }
+
+    __m128i indices = _mm_setzero_si128();
+
+    for (int i = 0; i < 16; ++i)
+    {
+        __m128i bestIndex = _mm_setzero_si128();
+        __m128 bestError = _mm_set1_ps(FLT_MAX);
+
+        for (int j = 0; j < 4; ++j)
+        {
+            __m128 dr = _mm_sub_ps(r[i], paletteR[j]);
+            __m128 dg = _mm_sub_ps(g[i], paletteG[j]);
+            __m128 db = _mm_sub_ps(b[i], paletteB[j]);
+            __m128 error = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+            __m128 better = _mm_cmplt_ps(error, bestError);
+
+            bestError = SelectPS(better, error, bestError);
+            bestIndex = SelectEpi32(_mm_castps_si128(better), _mm_set1_epi32(j), bestIndex);
+        }
+
+        indices = _mm_or_si128(indices, _mm_sll_epi32(bestIndex, _mm_cvtsi32_si128(i * 2)));
+    }
+
+    // A solid block has color0 == color1, which would select the 3 color
+    // mode. Index 0 decodes to color0 in either mode.
+
+    indices = _mm_andnot_si128(_mm_cmpeq_epi32(high, low), indices);
+
+    int color0Values[4];
+    int color1Values[4];
+    DWORD indexValues[4];
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(color0Values), high);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(color1Values), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(indexValues), indices);
+
+    for (int n = 0; n < 4; ++n)
+    {
+        BYTE *pBlock = pBlocks[n];
+
+        if (!pBlock)
+            continue;
+
+        pBlock[0] = static_cast<BYTE>(color0Values[n]);
+        pBlock[1] = static_cast<BYTE>(color0Values[n] >> 8);
+        pBlock[2] = static_cast<BYTE>(color1Values[n]);
+        pBlock[3] = static_cast<BYTE>(color1Values[n] >> 8);
+        memcpy(pBlock + 4, &indexValues[n], sizeof(indexValues[n]));
+    }
+}
+
+bool CompressImage(const Image &image, D3DFORMAT format, int quality,
+                   CompressedImage &compressed, WorkerPool &pool)
+{
+    // Block compresses every level of an image into a new CompressedImage
+    // that owns its memory. The format must be D3DFMT_DXT1, D3DFMT_DXT5 or
+    // FORMAT_BC7. The quality is one of the COMPRESS_QUALITY_* values.
+    // Direct3D 9 can't create BC7 textures, so those are only useful for
+    // comparing the encoders.
+
+    memset(&compressed, 0, sizeof(compressed));
+
+    if (format != D3DFMT_DXT1 && format != D3DFMT_DXT5 && format != FORMAT_BC7)
+        return false;
+
+    compressed.format = format;
+    compressed.width = image.width;
+    compressed.height = image.height;
+    compressed.levels = image.levels;
+
+    for (int i = 0; i < image.levels; ++i)
+    {
+        compressed.levelOffsets[i] = compressed.dataSize;
+        compressed.levelSizes[i] = GetCompressedLevelSize(format,
+            max(1, image.width >> i), max(1, image.height >> i));
+        compressed.dataSize += compressed.levelSizes[i];
+    }
+
+    if (!(compressed.pMemory = static_cast<BYTE*>(malloc(compressed.dataSize))))
+        return false;
+
+    compressed.pData = compressed.pMemory;
+
+    for (int i = 0; i < image.levels; ++i)
+    {
+        CompressJob job = {&image, &compressed, i, quality};
+
+        ParallelFor(pool, (max(1, image.height >> i) + 3) / 4, CompressBlockRows, &job);
+    }
+
+    return true;
+}
+
+void CookVirtualPages(void *pParam, int begin, int end)
+{
+    // Builds and compresses pages [begin, end) of one page row. A page is
+    // its VIRTUAL_PAGE_SIZE texels plus a border of VIRTUAL_PAGE_BORDER
+    // texels on each side, so bilinear and trilinear filtering inside a
+    // page never need its neighbors.
+
+    const VirtualCookJob &job = *static_cast<const VirtualCookJob*>(pParam);
+    const Image &source = *job.pSource;
+    int sourceLevel = min(job.level, source.levels - 1);
+    int sourceWidth = max(1, source.width >> sourceLevel);
+    int sourceHeight = max(1, source.height >> sourceLevel);
+    const DWORD *pSrc = source.pPixels + source.levelOffsets[sourceLevel];
+    Image page = {0};
+    CompressedImage compressed = {};
+
+    if (!(page.pPixels = static_cast<DWORD*>(malloc(VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE * sizeof(DWORD)))))
+        return;
+
+    page.width = page.height = VIRTUAL_PAGE_STRIDE;
+    page.levels = 1;
+    compressed.format = D3DFMT_DXT1;
+    compressed.width = compressed.height = VIRTUAL_PAGE_STRIDE;
+    compressed.levels = 1;
+
+    for (int pageX = begin; pageX < end; ++pageX)
+    {
+        // The source's sides divide the level's, so wrapping into the
+        // source also wraps around the level.
+
+        for (int y = 0; y < VIRTUAL_PAGE_STRIDE; ++y)
+        {
+            int sourceY = (job.pageY * VIRTUAL_PAGE_SIZE - VIRTUAL_PAGE_BORDER + y) & (sourceHeight - 1);
+
+            for (int x = 0; x < VIRTUAL_PAGE_STRIDE; ++x)
+            {
+                int sourceX = (pageX * VIRTUAL_PAGE_SIZE - VIRTUAL_PAGE_BORDER + x) & (sourceWidth - 1);
+
+                page.pPixels[y * VIRTUAL_PAGE_STRIDE + x] = pSrc[sourceY * sourceWidth + sourceX];
+            }
+        }
+
+        CompressJob compressJob = {&page, &compressed, 0, COMPRESS_QUALITY_FAST};
+
+        compressed.pData = job.pPages + pageX * job.pageBytes;
+        CompressBlockRows(&compressJob, 0, VIRTUAL_PAGE_STRIDE / 4);
+    }
+
+    free(page.pPixels);
+}
+
+bool CookVirtualTexture(const char *pszFilename, const Image &source, int width, int height,
+                        WorkerPool &pool)
+{
+    // Writes the page file of a virtual texture made by repeating source
+    // across width x height texels. All sides must be powers of 2, and the
+    // source's must divide the virtual texture's. Level n of the virtual
+    // texture repeats level n of the source, down to the source's last
+    // level, which is repeated for the rest of the chain. Pages are DXT1
+    // compressed a row at a time across the pool and written in order, so
+    // the virtual texture is never in memory all at once.
+
+    if (width <= 0 || height <= 0 || (width & (width - 1)) || (height & (height - 1)) ||
+        (source.width & (source.width - 1)) || (source.height & (source.height - 1)) ||
+        width % source.width || height % source.height)
+    {
+        return false;
+    }
+
+    VirtualTextureHeader header = {0};
+
+    header.magic = VIRTUAL_TEXTURE_MAGIC;
+    header.version = VIRTUAL_TEXTURE_VERSION;
+    header.format = D3DFMT_DXT1;
+    header.width = width;
+    header.height = height;
+    header.pageSize = VIRTUAL_PAGE_SIZE;
+    header.pageBorder = VIRTUAL_PAGE_BORDER;
+    header.pageBytes = GetCompressedLevelSize(D3DFMT_DXT1, VIRTUAL_PAGE_STRIDE, VIRTUAL_PAGE_STRIDE);
+
+    for (int size = max(width, height); size > 0; size >>= 1)
+        ++header.levels;
+
+    if (header.levels > IMAGE_MAX_LEVELS)
+        return false;
+
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_WRITE, 0, 0, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL, 0);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD bytesWritten = 0;
+    bool succeeded = WriteFile(hFile, &header, sizeof(header), &bytesWritten, 0) &&
+                     bytesWritten == sizeof(header);
+    std::vector<BYTE> row;
+
+    for (int level = 0; succeeded && level < header.levels; ++level)
+    {
+        int pagesWide = (max(1, width >> level) + VIRTUAL_PAGE_SIZE - 1) / VIRTUAL_PAGE_SIZE;
+        int pagesHigh = (max(1, height >> level) + VIRTUAL_PAGE_SIZE - 1) / VIRTUAL_PAGE_SIZE;
+        DWORD rowBytes = pagesWide * header.pageBytes;
+
+        row.resize(rowBytes);
+
+        for (int pageY = 0; succeeded && pageY < pagesHigh; ++pageY)
+        {
+            VirtualCookJob job = {&source, width, height, level, pageY, header.pageBytes, &row[0]};
+
+            ParallelFor(pool, pagesWide, CookVirtualPages, &job);
+            succeeded = WriteFile(hFile, &row[0], rowBytes, &bytesWritten, 0) &&
+                        bytesWritten == rowBytes;
+        }
+    }
+
+    CloseHandle(hFile);
+
+    if (!succeeded)
+        DeleteFile(pszFilename);
+
+    return succeeded;
+}
+
+bool CopyLightmapToTexture(const Lightmap &lightmap, IDirect3DTexture9 *pTexture)
+{
+    // Converts the lightmap's texels to the texture's 16-bit floats, which
+    // keep light brighter than 1.
+
+    D3DLOCKED_RECT locked;
+
+    if (FAILED(pTexture->LockRect(0, &locked, 0, 0)))
+        return false;
+
+    for (int y = 0; y < lightmap.height; ++y)
+    {
+        D3DXFLOAT16 *pRow = reinterpret_cast<D3DXFLOAT16*>(static_cast<BYTE*>(locked.pBits) + y * locked.Pitch);
+
+        D3DXFloat32To16Array(pRow, &lightmap.texels[y * lightmap.width * 4], lightmap.width * 4);
+    }
+
+    pTexture->UnlockRect(0);
+    return true;
+}
+
+void CopyOctreeOctants(void *pParam, int begin, int end)
+{
+    // Copies the subtrees built by BuildOctreeOctants() into the tree and
+    // turns their node indices into the tree's.
+
+    OctreeBuildJob &job = *static_cast<OctreeBuildJob*>(pParam);
+    Octree &tree = *job.pTree;
+
+    for (int octant = begin; octant < end; ++octant)
+    {
+        const std::vector<OctreeNode> &nodes = job.octantNodes[octant];
+        int first = job.octantFirstNode[octant];
+
+        for (int i = 0; i < static_cast<int>(nodes.size()); ++i)
+        {
+            OctreeNode &node = tree.nodes[first + i];
+
+            node = nodes[i];
+            node.parent = (i == 0) ? 0 : node.parent + first;
+
+            for (int c = 0; c < 8; ++c)
+            {
+                if (node.children[c] >= 0)
+                    node.children[c] += first;
+            }
+
+            for (int item = node.firstItem; item >= 0; item = tree.items[item].next)
+                tree.items[item].node = first + i;
+        }
+    }
+}
+
+HWND CreateAppWindow(const WNDCLASSEX &wcl, const char *pszTitle)
+{
+    // Create a window that is centered on the desktop. It's exactly 1/4 the
+    // size of the desktop. Don't allow it to be resized.
+
+    DWORD wndExStyle = WS_EX_OVERLAPPEDWINDOW;
+    DWORD wndStyle = WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU |
+                     WS_MINIMIZEBOX | WS_CLIPCHILDREN | WS_CLIPSIBLINGS;
+
+    HWND hWnd = CreateWindowEx(wndExStyle, wcl.lpszClassName, pszTitle,
+                    wndStyle, 0, 0, 0, 0, 0, 0, wcl.hInstance, 0);
+
+    if (hWnd)
+    {
+        int screenWidth = GetSystemMetrics(SM_CXSCREEN);
+        int screenHeight = GetSystemMetrics(SM_CYSCREEN);
+        int halfScreenWidth = screenWidth / 2;
+        int halfScreenHeight = screenHeight / 2;
+        int left = (screenWidth - halfScreenWidth) / 2;
+        int top = (screenHeight - halfScreenHeight) / 2;
+        RECT rc = {0};
+
+        SetRect(&rc, left, top, left + halfScreenWidth, top + halfScreenHeight);
+        AdjustWindowRectEx(&rc, wndStyle, FALSE, wndExStyle);
+        MoveWindow(hWnd, rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top, TRUE);
+
+        GetClientRect(hWnd, &rc);
+        g_windowWidth = rc.right - rc.left;
+        g_windowHeight = rc.bottom - rc.top;
+    }
+
+    return hWnd;
+}
+
+bool CreateCookedMesh(const Mesh &mesh, CookedMesh &cooked)
+{
+    // Copies a mesh into heap memory laid out like a mesh cache file.
+
+    memset(&cooked, 0, sizeof(cooked));
+
+    cooked.vertexCount = static_cast<DWORD>(mesh.vertices.size());
+    cooked.indexCount = static_cast<DWORD>(mesh.indices.size());
+    cooked.dataSize = sizeof(Vertex) * mesh.vertices.size() + sizeof(DWORD) * mesh.indices.size();
+
+    if (!(cooked.pMemory = static_cast<BYTE*>(malloc(max(cooked.dataSize, static_cast<size_t>(1))))))
+        return false;
+
+    if (!mesh.vertices.empty())
+        memcpy(cooked.pMemory, &mesh.vertices[0], sizeof(Vertex) * mesh.vertices.size());
+
+    if (!mesh.indices.empty())
+        memcpy(cooked.pMemory + sizeof(Vertex) * mesh.vertices.size(), &mesh.indices[0], sizeof(DWORD) * mesh.indices.size());
+
+    cooked.pVertices = reinterpret_cast<const Vertex*>(cooked.pMemory);
+    cooked.pIndices = reinterpret_cast<const DWORD*>(cooked.pMemory + sizeof(Vertex) * mesh.vertices.size());
+
+    for (int c = 0; c < 3; ++c)
+    {
+        cooked.boundsMin[c] = mesh.vertices.empty() ? 0.0f : FLT_MAX;
+        cooked.boundsMax[c] = mesh.vertices.empty() ? 0.0f : -FLT_MAX;
+    }
+
+    for (size_t i = 0; i < mesh.vertices.size(); ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            cooked.boundsMin[c] = min(cooked.boundsMin[c], mesh.vertices[i].pos[c]);
+            cooked.boundsMax[c] = max(cooked.boundsMax[c], mesh.vertices[i].pos[c]);
+        }
+    }
+
+    return true;
+}
+
+bool CreateGlyphAtlas(const char *pszFont, int ptSize, GlyphAtlas &atlas)
+{
+    // Rasterize the printable ASCII characters once into an 8-bit coverage
+    // atlas using GDI. Each glyph gets its own padded cell so neighbouring
+    // glyphs never bleed into each other. The atlas is then used to draw all
+    // of the HUD text as a single batch of textured quads.
+
+    HDC hDC = CreateCompatibleDC(0);
+
+    if (!hDC)
+        return false;
+
+    HFONT hFont = CreateGlyphFont(hDC, pszFont, ptSize);
+
+    if (!hFont)
+    {
+        DeleteDC(hDC);
+        return false;
+    }
+
+    HGDIOBJ hOldFont = SelectObject(hDC, hFont);
+    TEXTMETRIC tm = {0};
+
+    GetTextMetrics(hDC, &tm);
+    atlas.lineHeight = tm.tmHeight;
+
+    // Measure each glyph and pack the cells into rows.
+
+    int cellHeight = atlas.lineHeight + GLYPH_PADDING * 2;
+    int cellWidth = 0;
+    int x = 0;
+    int y = 0;
+    char ch = 0;
+    SIZE extent = {0};
+
+    for (int i = 0; i < GLYPH_COUNT; ++i)
+    {
+        ch = static_cast<char>(GLYPH_FIRST_CHAR + i);
+        GetTextExtentPoint32(hDC, &ch, 1, &extent);
+        cellWidth = extent.cx + GLYPH_PADDING * 2;
+
+        if (x + cellWidth > GLYPH_ATLAS_WIDTH)
+        {
+            x = 0;
+            y += cellHeight;
+        }
+
+        atlas.glyphs[i].x = x;
+        atlas.glyphs[i].y = y;
+        atlas.glyphs[i].width = extent.cx;
+        x += cellWidth;
+    }
+
+    atlas.width = GLYPH_ATLAS_WIDTH;
+    atlas.height = 1;
+
+    while (atlas.height < y + cellHeight)
+        atlas.height <<= 1;
+
+    // Render the glyphs white on black into a top-down 32-bit DIB section.
+
+    BITMAPINFO bmi = {0};
+    void *pBits = 0;
+
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = atlas.width;
+    bmi.bmiHeader.biHeight = -atlas.height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    HBITMAP hBitmap = CreateDIBSection(hDC, &bmi, DIB_RGB_COLORS, &pBits, 0, 0);
+
+    if (!hBitmap)
+    {
+        SelectObject(hDC, hOldFont);
+        DeleteObject(hFont);
+        DeleteDC(hDC);
+        return false;
+    }
+
+    HGDIOBJ hOldBitmap = SelectObject(hDC, hBitmap);
+
+    memset(pBits, 0, atlas.width * atlas.height * 4);
+    SetTextColor(hDC, RGB(255, 255, 255));
+    SetBkMode(hDC, TRANSPARENT);
+
+    for (int i = 0; i < GLYPH_COUNT; ++i)
+    {
+        const Glyph &glyph = atlas.glyphs[i];
+
+        ch = static_cast<char>(GLYPH_FIRST_CHAR + i);
+        TextOut(hDC, glyph.x + GLYPH_PADDING, glyph.y + GLYPH_PADDING, &ch, 1);
+    }
+
+    GdiFlush();
+
+    // Anti-aliased (non-ClearType) text is grey scale so any color channel
+    // holds the coverage.
+
+    const DWORD *pPixels = static_cast<const DWORD*>(pBits);
+
+    atlas.pCoverage = new BYTE[atlas.width * atlas.height];
+
+    for (int i = 0; i < atlas.width * atlas.height; ++i)
+        atlas.pCoverage[i] = static_cast<BYTE>((pPixels[i] >> 8) & 0xff);
+
+    for (int i = 0; i < GLYPH_COUNT; ++i)
+    {
+        Glyph &glyph = atlas.glyphs[i];
+
+        glyph.texCoord[0] = static_cast<float>(glyph.x) / atlas.width;
+        glyph.texCoord[1] = static_cast<float>(glyph.y) / atlas.height;
+        glyph.texCoord[2] = static_cast<float>(glyph.x + glyph.width + GLYPH_PADDING * 2) / atlas.width;
+        glyph.texCoord[3] = static_cast<float>(glyph.y + cellHeight) / atlas.height;
+    }
+
+    SelectObject(hDC, hOldBitmap);
+    SelectObject(hDC, hOldFont);
+    DeleteObject(hBitmap);
+    DeleteObject(hFont);
+    DeleteDC(hDC);
+
+    return true;
+}
+
+bool CreateGlyphAtlasTexture(const GlyphAtlas &atlas, LPDIRECT3DTEXTURE9 &pTexture)
+{
+    // The atlas texture is white with the glyph coverage stored in alpha.
+    // The vertex color then supplies the actual text color.
+
+    HRESULT hr = D3DXCreateTexture(g_pDevice, atlas.width, atlas.height, 1, 0,
+                    D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &pTexture);
+
+    if (FAILED(hr))
+        return false;
+
+    D3DLOCKED_RECT rcLock = {0};
+
+    if (FAILED(pTexture->LockRect(0, &rcLock, 0, 0)))
+    {
+        pTexture->Release();
+        pTexture = 0;
+        return false;
+    }
+
+    for (int y = 0; y < atlas.height; ++y)
+    {
+        DWORD *pRow = reinterpret_cast<DWORD*>(static_cast<BYTE*>(rcLock.pBits) + y * rcLock.Pitch);
+        const BYTE *pCoverage = &atlas.pCoverage[y * atlas.width];
+
+        for (int x = 0; x < atlas.width; ++x)
+            pRow[x] = (static_cast<DWORD>(pCoverage[x]) << 24) | 0x00ffffff;
+    }
+
+    pTexture->UnlockRect(0);
+    return true;
+}
+
+HFONT CreateGlyphFont(HDC hDC, const char *pszFont, int ptSize)
+{
+    // The bold, grey scale anti-aliased font the glyph atlas is drawn with.
+
+    int fontCharHeight = -ptSize * GetDeviceCaps(hDC, LOGPIXELSY) / 72;
+
+    return CreateFont(fontCharHeight, 0, 0, 0, FW_BOLD, FALSE, FALSE,
+                FALSE, DEFAULT_CHARSET, OUT_DEFAULT_PRECIS,
+                CLIP_DEFAULT_PRECIS, ANTIALIASED_QUALITY,
+                DEFAULT_PITCH | FF_DONTCARE, pszFont);
+}
+
+void CreateGridTriangles(int columns, int rows, bool shuffle, unsigned int seed,
+                         std::vector<Vertex> &triangles)
+{
+    // Builds a flat grid of columns x rows quads as a triangle soup, 6
+    // vertices per quad, for testing mesh processing. The triangles are in
+    // row order, or shuffled.
+
+    triangles.resize(static_cast<size_t>(columns) * rows * 6);
+
+    for (int y = 0; y < rows; ++y)
+    {
+        for (int x = 0; x < columns; ++x)
+        {
+            static const int corners[6][2] = {{0, 0}, {1, 0}, {1, 1}, {1, 1}, {0, 1}, {0, 0}};
+            Vertex *pQuad = &triangles[(static_cast<size_t>(y) * columns + x) * 6];
+
+            for (int i = 0; i < 6; ++i)
+            {
+                Vertex vertex =
+                {
+                    static_cast<float>(x + corners[i][0]), 0.0f, static_cast<float>(y + corners[i][1]),
+                    static_cast<float>(x + corners[i][0]) / columns, static_cast<float>(y + corners[i][1]) / rows,
+                    0.0f, 1.0f, 0.0f
+                };
+
+                pQuad[i] = vertex;
+            }
+        }
+    }
+
+    if (!shuffle)
+        return;
+
+    for (size_t i = triangles.size() / 3 - 1; i > 0; --i)
+    {
+        size_t j = NextRandom(seed) % (i + 1);
+
+        std::swap_ranges(&triangles[i * 3], &triangles[i * 3] + 3, &triangles[j * 3]);
+    }
+}
+
+bool CreateImage(int width, int height, int levels, Image &image)
+{
+    memset(&image, 0, sizeof(image));
+
+    if (width < 1 || height < 1 || levels < 1 || levels > IMAGE_MAX_LEVELS)
+        return false;
+
+    size_t totalPixels = 0;
+
+    for (int i = 0; i < levels; ++i)
+    {
+        image.levelOffsets[i] = totalPixels;
+        totalPixels += static_cast<size_t>(max(1, width >> i)) * max(1, height >> i);
+    }
+
+    if (!(image.pPixels = static_cast<DWORD*>(_aligned_malloc(totalPixels * sizeof(DWORD), 16))))
+        return false;
+
+    image.width = width;
+    image.height = height;
+    image.levels = levels;
+    return true;
+}
+
+bool CreateImageFromTexture(LPDIRECT3DTEXTURE9 pTexture, Image &image)
+{
+    // Copies the top level of a 32-bit or DXT1/DXT5 texture into a new
+    // single level image.
+
+    D3DSURFACE_DESC desc;
+    D3DLOCKED_RECT rcLock = {0};
+
+    memset(&image, 0, sizeof(image));
+
+    if (FAILED(pTexture->GetLevelDesc(0, &desc)))
+        return false;
+
+    if (desc.Format != D3DFMT_X8R8G8B8 && desc.Format != D3DFMT_A8R8G8B8 &&
+        desc.Format != D3DFMT_DXT1 && desc.Format != D3DFMT_DXT5)
+        return false;
+
+    if (!CreateImage(desc.Width, desc.Height, 1, image))
+        return false;
+
+    if (FAILED(pTexture->LockRect(0, &rcLock, 0, D3DLOCK_READONLY)))
+    {
+        DestroyImage(image);
+        return false;
+    }
+
+    if (desc.Format == D3DFMT_X8R8G8B8 || desc.Format == D3DFMT_A8R8G8B8)
+    {
+        DWORD alpha = (desc.Format == D3DFMT_X8R8G8B8) ? 0xff000000 : 0;
+
+        for (int y = 0; y < image.height; ++y)
+        {
+            const DWORD *pSrc = reinterpret_cast<const DWORD*>(static_cast<const BYTE*>(rcLock.pBits) + y * rcLock.Pitch);
+
+            for (int x = 0; x < image.width; ++x)
+                image.pPixels[y * image.width + x] = pSrc[x] | alpha;
+        }
+    }
+    else
+    {
+        int blockSize = (desc.Format == D3DFMT_DXT1) ? 8 : 16;
+        DWORD pixels[16];
+
+        for (int by = 0; by < (image.height + 3) / 4; ++by)
+        {
+            const BYTE *pRow = static_cast<const BYTE*>(rcLock.pBits) + by * rcLock.Pitch;
+
+            for (int bx = 0; bx < (image.width + 3) / 4; ++bx)
+            {
+                const BYTE *pBlock = pRow + bx * blockSize;
+
+                DecompressBlockBC1(pBlock + blockSize - 8, desc.Format == D3DFMT_DXT5, pixels);
+
+                if (desc.Format == D3DFMT_DXT5)
+                    DecompressBlockBC3Alpha(pBlock, pixels);
+
+                for (int y = 0; y < 4 && by * 4 + y < image.height; ++y)
+                {
+                    for (int x = 0; x < 4 && bx * 4 + x < image.width; ++x)
+                        image.pPixels[(by * 4 + y) * image.width + bx * 4 + x] = pixels[y * 4 + x];
+                }
+            }
+        }
+    }
+
+    pTexture->UnlockRect(0);
+    return true;
+}
+
+bool CreateIrradianceVolume(const float boundsMin[3], const float boundsMax[3], float cellSize,
+                            IrradianceVolume &volume)
+{
+    // Covers the bounds with cells of the given size, rounding up. Lights
+    // are splatted by the first UpdateIrradianceVolume().
+
+    if (cellSize <= 0.0f)
+        return false;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        volume.origin[c] = boundsMin[c];
+        volume.corners[c] = max(1, static_cast<int>(ceilf((boundsMax[c] - boundsMin[c]) / cellSize))) + 1;
+    }
+
+    volume.cellSize = cellSize;
+    volume.colors.assign(volume.corners[0] * volume.corners[1] * volume.corners[2] * 4, 0.0f);
+    volume.splatted.clear();
+    volume.changed.clear();
+    volume.bandColors.clear();
+    volume.pLights = 0;
+    volume.bandSize = 0;
+    volume.updates = 0;
+    volume.rebuild = false;
+    return true;
+}
+
+void CreateIndexedMesh(const Vertex *pVertices, int count, Mesh &mesh)
+{
+    // Welds a triangle soup into an indexed triangle list. Vertices are
+    // looked up by value in an open addressing hash table, and identical
+    // ones share an index. The unique vertices keep their first use order.
+
+    size_t tableSize = 1;
+
+    while (tableSize < static_cast<size_t>(count) * 2)
+        tableSize <<= 1;
+
+    std::vector<DWORD> table(tableSize, 0xffffffff);
+
+    mesh.vertices.clear();
+    mesh.indices.resize(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        size_t slot = static_cast<size_t>(HashBytes(&pVertices[i], sizeof(Vertex))) & (tableSize - 1);
+
+        while (table[slot] != 0xffffffff &&
+               memcmp(&mesh.vertices[table[slot]], &pVertices[i], sizeof(Vertex)) != 0)
+        {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+
+        if (table[slot] == 0xffffffff)
+        {
+            table[slot] = static_cast<DWORD>(mesh.vertices.size());
+            mesh.vertices.push_back(pVertices[i]);
+        }
+
+        mesh.indices[i] = table[slot];
+    }
+}
+
+bool CreateLightingCache(int width, int height, LightingCache &cache)
+{
+    // The cache starts out with no last frame, so every pixel of the first
+    // is shaded.
+
+    if (width < 1 || height < 1)
+        return false;
+
+    cache.width = width;
+    cache.height = height;
+    cache.frame = 0;
+    cache.valid = false;
+    D3DXMatrixIdentity(&cache.viewProjection);
+    cache.colors.assign(width * height * 4, 0.0f);
+    cache.positions.assign(width * height * 3, 0.0f);
+    cache.normals.assign(width * height * 3, 0.0f);
+    cache.ages.assign(width * height, 0);
+    cache.nextAges.assign(width * height, 0);
+    return true;
+}
+
+bool CreateLightmap(const Vertex *pTriangles, const int *pSurfaces, int count, float texelSize, Lightmap &lightmap)
+{
+    // Lays out a lightmap for a mesh whose surfaces face along the axes,
+    // such as the room. The triangles facing each way make up one chart,
+    // so they must lie in the same plane. Charts are packed in rows,
+    // tallest first, into the narrowest power of 2 width that holds the
+    // widest of them and is about the square root of their total area.
+
+    float boundsMin[LIGHTMAP_FACES][3];
+    float boundsMax[LIGHTMAP_FACES][3];
+
+    lightmap.width = 0;
+    lightmap.height = 0;
+    lightmap.texelSize = texelSize;
+    memset(lightmap.charts, 0, sizeof(lightmap.charts));
+
+    for (int i = 0; i < LIGHTMAP_FACES; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            boundsMin[i][c] = FLT_MAX;
+            boundsMax[i][c] = -FLT_MAX;
+        }
+    }
+
+    for (int i = 0; i < count * 3; ++i)
+    {
+        const Vertex &vertex = pTriangles[i];
+        int face = GetLightmapFace(vertex.normal);
+
+        lightmap.charts[face].used = true;
+        lightmap.charts[face].surface = pSurfaces[i / 3];
+
+        for (int c = 0; c < 3; ++c)
+        {
+            boundsMin[face][c] = min(boundsMin[face][c], vertex.pos[c]);
+            boundsMax[face][c] = max(boundsMax[face][c], vertex.pos[c]);
+        }
+    }
+
+    // Walls lay out their texels along X or Z and then Y, the ceiling and
+    // floor along X and then Z.
+
+    static const int uAxes[LIGHTMAP_FACES] = {2, 2, 0, 0, 0, 0};
+    static const int vAxes[LIGHTMAP_FACES] = {1, 1, 2, 2, 1, 1};
+
+    int order[LIGHTMAP_FACES];
+    int numCharts = 0;
+    int area = 0;
+    int widest = 0;
+
+    for (int i = 0; i < LIGHTMAP_FACES; ++i)
+    {
+        LightmapChart &chart = lightmap.charts[i];
+
+        if (!chart.used)
+            continue;
+
+        memcpy(chart.origin, boundsMin[i], sizeof(chart.origin));
+        chart.normal[i / 2] = (i % 2) ? -1.0f : 1.0f;
+        chart.uAxis = uAxes[i];
+        chart.vAxis = vAxes[i];
+        chart.size[0] = boundsMax[i][chart.uAxis] - boundsMin[i][chart.uAxis];
+        chart.size[1] = boundsMax[i][chart.vAxis] - boundsMin[i][chart.vAxis];
+        chart.width = static_cast<int>(ceilf(chart.size[0] / texelSize)) + LIGHTMAP_PADDING * 2;
+        chart.height = static_cast<int>(ceilf(chart.size[1] / texelSize)) + LIGHTMAP_PADDING * 2;
+
+        area += chart.width * chart.height;
+        widest = max(widest, chart.width);
+
+        int j = numCharts++;
+
+        for (; j > 0 && lightmap.charts[order[j - 1]].height < chart.height; --j)
+            order[j] = order[j - 1];
+
+        order[j] = i;
+    }
+
+    if (numCharts == 0)
+        return false;
+
+    int width = 1;
+    int x = 0;
+    int y = 0;
+    int rowHeight = 0;
+
+    while (width < widest || width * width < area)
+        width *= 2;
+
+    for (int i = 0; i < numCharts; ++i)
+    {
+        LightmapChart &chart = lightmap.charts[order[i]];
+
+        if (x + chart.width > width)
+        {
+            x = 0;
+            y += rowHeight;
+            rowHeight = 0;
+        }
+
+        chart.x = x;
+        chart.y = y;
+        x += chart.width;
+        rowHeight = max(rowHeight, chart.height);
+    }
+
+    lightmap.width = width;
+    lightmap.height = 1;
+
+    while (lightmap.height < y + rowHeight)
+        lightmap.height *= 2;
+
+    if (lightmap.width > LIGHTMAP_MAX_SIZE || lightmap.height > LIGHTMAP_MAX_SIZE)
+        return false;
+
+    lightmap.texelCharts.assign(lightmap.width * lightmap.height, -1);
+    lightmap.texels.assign(lightmap.width * lightmap.height * 4, 0.0f);
+
+    for (int i = 0; i < LIGHTMAP_FACES; ++i)
+    {
+        const LightmapChart &chart = lightmap.charts[i];
+
+        if (!chart.used)
+            continue;
+
+        for (int row = chart.y; row < chart.y + chart.height; ++row)
+        {
+            for (int column = chart.x; column < chart.x + chart.width; ++column)
+                lightmap.texelCharts[row * lightmap.width + column] = i;
+        }
+    }
+
+    return true;
+}
+
+bool CreateNullTexture(int width, int height, LPDIRECT3DTEXTURE9 &pTexture)
+{
+    // Create an empty white texture. This texture is applied to geometry
+    // that doesn't have any texture maps. This trick allows the same shader to
+    // be used to draw the geometry with and without textures applied.
+
+    HRESULT hr = D3DXCreateTexture(g_pDevice, width, height, 0, 0,
+                    D3DFMT_X8R8G8B8, D3DPOOL_MANAGED, &pTexture);
+
+    if (FAILED(hr))
+        return false;
+
+    LPDIRECT3DSURFACE9 pSurface = 0;
+
+    if (SUCCEEDED(pTexture->GetSurfaceLevel(0, &pSurface)))
+    {
+        D3DLOCKED_RECT rcLock = {0};
+
+        if (SUCCEEDED(pSurface->LockRect(&rcLock, 0, 0)))
+        {
+            BYTE *pPixels = static_cast<BYTE*>(rcLock.pBits);
+            int widthInBytes = width * 4;
+
+            if (widthInBytes == rcLock.Pitch)
+            {
+                memset(pPixels, 0xff, widthInBytes * height);
+            }
+            else
+            {
+                for (int y = 0; y < height; ++y)
+                    memset(&pPixels[y * rcLock.Pitch], 0xff, rcLock.Pitch);
+            }
+
+            pSurface->UnlockRect();
+            pSurface->Release();
+            return true;
+        }
+
+        pSurface->Release();
+    }
+
+    pTexture->Release();
+    return false;
+}
+
+bool CreateOcclusionBuffer(int width, int height, OcclusionBuffer &buffer)
+{
+    // Level 0 is widened to a multiple of 4 pixels so the rasterizer can
+    // always work on 4 pixels at a time. Levels are added until the
+    // pyramid reaches a single texel.
+
+    memset(&buffer, 0, sizeof(buffer));
+
+    if (width < 1 || height < 1)
+        return false;
+
+    size_t totalTexels = 0;
+
+    buffer.width = (width + 3) & ~3;
+    buffer.height = height;
+
+    for (int level = 0; level < OCCLUSION_MAX_LEVELS; ++level)
+    {
+        buffer.levelWidths[level] = (level == 0) ? buffer.width : (buffer.levelWidths[level - 1] + 1) / 2;
+        buffer.levelHeights[level] = (level == 0) ? buffer.height : (buffer.levelHeights[level - 1] + 1) / 2;
+        buffer.levelOffsets[level] = totalTexels;
+        totalTexels += static_cast<size_t>(buffer.levelWidths[level]) * buffer.levelHeights[level];
+        buffer.levels = level + 1;
+
+        if (buffer.levelWidths[level] == 1 && buffer.levelHeights[level] == 1)
+            break;
+    }
+
+    if (!(buffer.pDepth = static_cast<float*>(_aligned_malloc(totalTexels * sizeof(float), 16))))
+        return false;
+
+    memset(buffer.pDepth, 0, totalTexels * sizeof(float));
+    return true;
+}
+
+bool CreateRoomAtlasImage(const Image *pTiles, WorkerPool &pool, Image &atlas,
+                          float rects[][4])
+{
+    // Packs the top levels of ROOM_SURFACE_COUNT tiling images into a grid of
+    // cells in a new image with ROOM_ATLAS_LEVELS mip levels. Each cell holds
+    // its image resized to ROOM_ATLAS_TILE_SIZE and surrounded by
+    // ROOM_ATLAS_PADDING texels that carry on as if the image repeated, so
+    // filtering near the edge of a tile sees what wrap addressing would.
+    // The cells are multiples of 2^(ROOM_ATLAS_LEVELS - 1) texels, so no mip
+    // texel mixes two cells. rects receives the offset and scale of each
+    // tile in atlas texture coordinates.
+
+    const int cellSize = ROOM_ATLAS_TILE_SIZE + ROOM_ATLAS_PADDING * 2;
+    const int rows = (ROOM_SURFACE_COUNT + ROOM_ATLAS_COLUMNS - 1) / ROOM_ATLAS_COLUMNS;
+
+    if (!CreateImage(cellSize * ROOM_ATLAS_COLUMNS, cellSize * rows, ROOM_ATLAS_LEVELS, atlas))
+        return false;
+
+    memset(atlas.pPixels, 0, atlas.width * atlas.height * sizeof(DWORD));
+
+    for (int i = 0; i < ROOM_SURFACE_COUNT; ++i)
+    {
+        Image resized = {0};
+        const Image *pTile = &pTiles[i];
+
+        if (pTile->width != ROOM_ATLAS_TILE_SIZE || pTile->height != ROOM_ATLAS_TILE_SIZE)
+        {
+            if (!ResizeImage(*pTile, ROOM_ATLAS_TILE_SIZE, ROOM_ATLAS_TILE_SIZE, resized))
+            {
+                DestroyImage(atlas);
+                return false;
+            }
+
+            pTile = &resized;
+        }
+
+        int cellX = (i % ROOM_ATLAS_COLUMNS) * cellSize;
+        int cellY = (i / ROOM_ATLAS_COLUMNS) * cellSize;
+
+        for (int y = 0; y < cellSize; ++y)
+        {
+            const DWORD *pSrc = pTile->pPixels + ((y - ROOM_ATLAS_PADDING + ROOM_ATLAS_TILE_SIZE) % ROOM_ATLAS_TILE_SIZE) * ROOM_ATLAS_TILE_SIZE;
+            DWORD *pDst = atlas.pPixels + (cellY + y) * atlas.width + cellX;
+
+            for (int x = 0; x < cellSize; ++x)
+                pDst[x] = pSrc[(x - ROOM_ATLAS_PADDING + ROOM_ATLAS_TILE_SIZE) % ROOM_ATLAS_TILE_SIZE];
+        }
+
+        rects[i][0] = static_cast<float>(cellX + ROOM_ATLAS_PADDING) / atlas.width;
+        rects[i][1] = static_cast<float>(cellY + ROOM_ATLAS_PADDING) / atlas.height;
+        rects[i][2] = static_cast<float>(ROOM_ATLAS_TILE_SIZE) / atlas.width;
+        rects[i][3] = static_cast<float>(ROOM_ATLAS_TILE_SIZE) / atlas.height;
+
+        DestroyImage(resized);
+    }
+
+    GenerateMipChain(atlas, pool);
+    return true;
+}
+
+void CreateRoomMesh(Mesh &mesh)
+{
+    // Welds g_room's vertices and orders the triangles of each surface for
+    // the vertex cache. Each surface is optimized on its own so that it
+    // keeps the index range BuildRoomBatches() gives it.
+
+    static const int surfaceFirstIndex[ROOM_SURFACE_COUNT + 1] = {0, 24, 30, 36};
+
+    CreateIndexedMesh(g_room, sizeof(g_room) / sizeof(g_room[0]), mesh);
+
+    for (int i = 0; i < ROOM_SURFACE_COUNT; ++i)
+    {
+        OptimizeVertexCache(&mesh.indices[surfaceFirstIndex[i]],
+            surfaceFirstIndex[i + 1] - surfaceFirstIndex[i], static_cast<int>(mesh.vertices.size()));
+    }
+
+    OptimizeVertexFetch(mesh);
+}
+
+void CreateSceneOccluders(const Scene &scene, OccluderSet &occluders)
+{
+    // Makes each room's walls an occluder. Props are too small to hide
+    // much, and floors and ceilings would only hide what is above or below
+    // the rooms, which is nothing. Corridor cells open on all sides have no
+    // walls, and their first chunk is their ceiling.
+
+    occluders.occluders.clear();
+    occluders.positions.clear();
+
+    for (size_t i = 0; i < scene.rooms.size(); ++i)
+    {
+        const SceneRoom &room = scene.rooms[i];
+
+        if (room.chunkCount == 0 || scene.chunks[room.firstChunk].surface != ROOM_SURFACE_WALLS)
+            continue;
+
+        const SceneChunk &chunk = scene.chunks[room.firstChunk];
+        Occluder occluder;
+
+        memcpy(occluder.boundsMin, chunk.boundsMin, sizeof(occluder.boundsMin));
+        memcpy(occluder.boundsMax, chunk.boundsMax, sizeof(occluder.boundsMax));
+        occluder.firstVertex = static_cast<int>(occluders.positions.size());
+        occluder.vertexCount = chunk.vertexCount;
+
+        for (int j = chunk.firstVertex; j < chunk.firstVertex + chunk.vertexCount; ++j)
+        {
+            const Vertex &vertex = scene.vertices[j];
+
+            occluders.positions.push_back(D3DXVECTOR3(vertex.pos[0], vertex.pos[1], vertex.pos[2]));
+        }
+
+        occluders.occluders.push_back(occluder);
+    }
+}
+
+bool CreateShadowCache(int lightCount, int tileSize, int maxTiles, ShadowCache &cache)
+{
+    // Every light starts out with no faces resident. Lights are placed by
+    // the first UpdateShadowCache().
+
+    cache.tileSize = tileSize;
+    cache.maxTiles = maxTiles;
+    cache.pCasters = 0;
+    cache.frame = 0;
+
+    if (tileSize < 4 || (tileSize & 3) || maxTiles < 1 ||
+        !(cache.pTexels = static_cast<float*>(_aligned_malloc(sizeof(float) * tileSize * tileSize * maxTiles, 16))))
+    {
+        cache.pTexels = 0;
+        return false;
+    }
+
+    cache.tileFaces.assign(maxTiles, -1);
+    cache.tileLastUsed.assign(maxTiles, -1);
+    cache.freeTiles.resize(maxTiles);
+
+    for (int i = 0; i < maxTiles; ++i)
+        cache.freeTiles[i] = maxTiles - 1 - i;
+
+    ShadowLight light;
+
+    memset(&light, 0, sizeof(light));
+    light.radius = -1.0f;
+
+    for (int i = 0; i < SHADOW_CUBE_FACES; ++i)
+    {
+        light.faces[i].tile = -1;
+        light.faces[i].dirtyFrame = -1;
+    }
+
+    cache.lights.assign(lightCount, light);
+    return true;
+}
+
+void CreateShadowCasters(const Scene &scene, OccluderSet &casters)
+{
+    // Makes each room's walls, as for occlusion culling, and then each of
+    // its props a shadow caster. Floors and ceilings only bound the rooms
+    // and shadow nothing the lights can reach.
+
+    CreateSceneOccluders(scene, casters);
+
+    for (size_t i = 0; i < scene.rooms.size(); ++i)
+    {
+        const SceneRoom &room = scene.rooms[i];
+
+        for (int j = room.firstChunk + room.chunkCount - room.propCount; j < room.firstChunk + room.chunkCount; ++j)
+        {
+            const SceneChunk &chunk = scene.chunks[j];
+            Occluder caster;
+
+            memcpy(caster.boundsMin, chunk.boundsMin, sizeof(caster.boundsMin));
+            memcpy(caster.boundsMax, chunk.boundsMax, sizeof(caster.boundsMax));
+            caster.firstVertex = static_cast<int>(casters.positions.size());
+            caster.vertexCount = chunk.vertexCount;
+
+            for (int k = chunk.firstVertex; k < chunk.firstVertex + chunk.vertexCount; ++k)
+            {
+                const Vertex &vertex = scene.vertices[k];
+
+                casters.positions.push_back(D3DXVECTOR3(vertex.pos[0], vertex.pos[1], vertex.pos[2]));
+            }
+
+            casters.occluders.push_back(caster);
+        }
+    }
+}
+
+bool CreateSoftwareTexture(const Image &image, int layout, SoftwareTexture &texture)
+{
+    // Copies every level of a power of 2 image into a new software texture
+    // with the given TEXTURE_LAYOUT_* texel layout.
+
+    memset(&texture, 0, sizeof(texture));
+
+    if ((image.width & (image.width - 1)) != 0 || (image.height & (image.height - 1)) != 0)
+        return false;
+
+    texture.width = image.width;
+    texture.height = image.height;
+    texture.levels = image.levels;
+    texture.layout = layout;
+
+    while ((1 << texture.widthLog2) < image.width)
+        ++texture.widthLog2;
+
+    while ((1 << texture.heightLog2) < image.height)
+        ++texture.heightLog2;
+
+    size_t totalTexels = 0;
+
+    for (int i = 0; i < image.levels; ++i)
+    {
+        texture.levelOffsets[i] = totalTexels;
+        totalTexels += static_cast<size_t>(max(1, image.width >> i)) * max(1, image.height >> i);
+    }
+
+    if (!(texture.pTexels = static_cast<DWORD*>(_aligned_malloc(totalTexels * sizeof(DWORD), 16))))
+        return false;
+
+    for (int i = 0; i < image.levels; ++i)
+    {
+        int width = max(1, image.width >> i);
+        int height = max(1, image.height >> i);
+        const DWORD *pSrc = image.pPixels + image.levelOffsets[i];
+
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+                texture.pTexels[GetTexelIndex(texture, i, x, y)] = pSrc[y * width + x];
+        }
+    }
+
+    return true;
+}
+
+bool CreateTextureFromCompressedImage(const CompressedImage &image, LPDIRECT3DTEXTURE9 &pTexture)
+{
+    // Copies the blocks of every level straight from the compressed image,
+    // which is usually a mapped cache file, into a new managed texture.
+
+    if (FAILED(g_pDevice->CreateTexture(image.width, image.height, image.levels,
+            0, image.format, D3DPOOL_MANAGED, &pTexture, 0)))
+        return false;
+
+    int blockSize = (image.format == D3DFMT_DXT5) ? 16 : 8;
+
+    for (int i = 0; i < image.levels; ++i)
+    {
+        D3DLOCKED_RECT rcLock = {0};
+        int blocksWide = (max(1, image.width >> i) + 3) / 4;
+        int blocksHigh = (max(1, image.height >> i) + 3) / 4;
+        const BYTE *pSrc = image.pData + image.levelOffsets[i];
+
+        if (FAILED(pTexture->LockRect(i, &rcLock, 0, 0)))
+        {
+            SAFE_RELEASE(pTexture);
+            return false;
+        }
+
+        for (int y = 0; y < blocksHigh; ++y)
+        {
+            memcpy(static_cast<BYTE*>(rcLock.pBits) + y * rcLock.Pitch,
+                pSrc + y * blocksWide * blockSize, blocksWide * blockSize);
+        }
+
+        pTexture->UnlockRect(i);
+    }
+
+    return true;
+}
+
+bool CreateTextureFromImage(const Image &image, LPDIRECT3DTEXTURE9 &pTexture)
+{
+    // Copies an image and all of its mip levels into a new managed texture.
+    // This is the only part of loading a texture that has to happen on the
+    // thread that owns the device.
+
+    if (FAILED(g_pDevice->CreateTexture(image.width, image.height, image.levels,
+            0, D3DFMT_X8R8G8B8, D3DPOOL_MANAGED, &pTexture, 0)))
+        return false;
+
+    for (int i = 0; i < image.levels; ++i)
+    {
+        D3DLOCKED_RECT rcLock = {0};
+        int width = max(1, image.width >> i);
+        int height = max(1, image.height >> i);
+        const DWORD *pSrc = image.pPixels + image.levelOffsets[i];
+
+        if (FAILED(pTexture->LockRect(i, &rcLock, 0, 0)))
+        {
+            SAFE_RELEASE(pTexture);
+            return false;
+        }
+
+        for (int y = 0; y < height; ++y)
+        {
+            memcpy(static_cast<BYTE*>(rcLock.pBits) + y * rcLock.Pitch,
+                pSrc + y * width, width * sizeof(DWORD));
+        }
+
+        pTexture->UnlockRect(i);
+    }
+
+    return true;
+}
+
+bool CullBox(const D3DXPLANE *pPlanes, const float boundsMin[3], const float boundsMax[3],
+             int &planeMask, int &lastCulledPlane)
+{
+    // Returns false when the box is entirely outside one of the frustum
+    // planes in planeMask, and remembers that plane in lastCulledPlane.
+    // Otherwise clears the planes the box is entirely inside from planeMask
+    // and returns true. lastCulledPlane is tested first, since a box culled
+    // by a plane in one frame is likely to be culled by it in the next.
+
+    float center[3];
+    float extent[3];
+
+    for (int c = 0; c < 3; ++c)
+    {
+        center[c] = (boundsMin[c] + boundsMax[c]) * 0.5f;
+        extent[c] = (boundsMax[c] - boundsMin[c]) * 0.5f;
+    }
+
+    for (int i = 0; i < FRUSTUM_PLANES; ++i)
+    {
+        // Plane lastCulledPlane swaps places with plane 0.
+
+        int plane = (i == 0) ? lastCulledPlane : ((i == lastCulledPlane) ? 0 : i);
+
+        if (!(planeMask & (1 << plane)))
+            continue;
+
+        const D3DXPLANE &p = pPlanes[plane];
+        float distance = p.a * center[0] + p.b * center[1] + p.c * center[2] + p.d;
+        float radius = fabsf(p.a) * extent[0] + fabsf(p.b) * extent[1] + fabsf(p.c) * extent[2];
+
+        if (distance < -radius)
+        {
+            lastCulledPlane = plane;
+            return false;
+        }
+
+        if (distance >= radius)
+            planeMask &= ~(1 << plane);
+    }
+
+    return true;
+}
+
+int CullOctree(Octree &tree, const D3DXPLANE *pPlanes, int *pVisible, OctreeCullStats &stats)
+{
+    // Writes the values of the items that may be inside the frustum to
+    // pVisible and returns how many there are. A node whose loose cube is
+    // outside the frustum is skipped along with everything below it, and
+    // the planes a node is entirely inside aren't tested again below it.
+
+    int count = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    CullOctreeNode(tree, 0, pPlanes, FRUSTUM_ALL_PLANES, pVisible, count, stats);
+
+    stats.itemsVisible = count;
+    stats.itemsCulled = tree.nodes[0].itemCount - count;
+    return count;
+}
+
+void CullOctreeNode(Octree &tree, int index, const D3DXPLANE *pPlanes, int planeMask,
+                    int *pVisible, int &count, OctreeCullStats &stats)
+{
+    OctreeNode &node = tree.nodes[index];
+
+    ++stats.nodesVisited;
+
+    // Items whose centers are outside the root's cell are kept in the root,
+    // so the root itself is never culled.
+
+    if (node.parent >= 0 && planeMask != 0)
+    {
+        float looseMin[3];
+        float looseMax[3];
+
+        for (int c = 0; c < 3; ++c)
+        {
+            looseMin[c] = node.center[c] - node.halfSize * 2.0f;
+            looseMax[c] = node.center[c] + node.halfSize * 2.0f;
+        }
+
+        if (!CullBox(pPlanes, looseMin, looseMax, planeMask, node.lastCulledPlane))
+        {
+            ++stats.nodesCulled;
+            return;
+        }
+    }
+
+    for (int i = node.firstItem; i >= 0; i = tree.items[i].next)
+    {
+        OctreeItem &item = tree.items[i];
+
+        if (planeMask != 0)
+        {
+            int itemPlaneMask = planeMask;
+
+            ++stats.itemsTested;
+
+            if (!CullBox(pPlanes, item.boundsMin, item.boundsMax, itemPlaneMask, item.lastCulledPlane))
+                continue;
+        }
+
+        pVisible[count++] = item.value;
+    }
+
+    for (int c = 0; c < 8; ++c)
+    {
+        if (node.children[c] >= 0)
+            CullOctreeNode(tree, node.children[c], pPlanes, planeMask, pVisible, count, stats);
+    }
+}
+
+int CullSceneChunks(const Scene &scene, const D3DXPLANE *pPlanes, int *pVisible, OctreeCullStats &stats)
+{
+    // Tests every chunk of the scene against the frustum, in order. Gives
+    // the same chunks as culling the scene's octree, only more slowly.
+
+    int chunkCount = static_cast<int>(scene.chunks.size());
+    int count = 0;
+
+    for (int i = 0; i < chunkCount; ++i)
+    {
+        int planeMask = FRUSTUM_ALL_PLANES;
+        int lastCulledPlane = 0;
+
+        if (CullBox(pPlanes, scene.chunks[i].boundsMin, scene.chunks[i].boundsMax, planeMask, lastCulledPlane))
+            pVisible[count++] = i;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    stats.itemsTested = chunkCount;
+    stats.itemsVisible = count;
+    stats.itemsCulled = chunkCount - count;
+    return count;
+}
+
+bool DecodeImage(const BYTE *pData, size_t size, Image &image)
+{
+    // Decodes an image file held in memory into a 32-bit BGRA image with
+    // room for a full mip chain. Uses WIC, which unlike D3DX doesn't need a
+    // device and so can run on any thread that has initialized COM.
+
+    IWICImagingFactory *pFactory = 0;
+    IWICStream *pStream = 0;
+    IWICBitmapDecoder *pDecoder = 0;
+    IWICBitmapFrameDecode *pFrame = 0;
+    IWICFormatConverter *pConverter = 0;
+    UINT width = 0;
+    UINT height = 0;
+
+    HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, 0,
+                    CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&pFactory));
+
+    if (SUCCEEDED(hr))
+        hr = pFactory->CreateStream(&pStream);
+
+    if (SUCCEEDED(hr))
+        hr = pStream->InitializeFromMemory(const_cast<BYTE*>(pData), static_cast<DWORD>(size));
+
+    if (SUCCEEDED(hr))
+        hr = pFactory->CreateDecoderFromStream(pStream, 0, WICDecodeMetadataCacheOnDemand, &pDecoder);
+
+    if (SUCCEEDED(hr))
+        hr = pDecoder->GetFrame(0, &pFrame);
+
+    if (SUCCEEDED(hr))
+        hr = pFactory->CreateFormatConverter(&pConverter);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pConverter->Initialize(pFrame, GUID_WICPixelFormat32bppBGRA,
+                WICBitmapDitherTypeNone, 0, 0.0, WICBitmapPaletteTypeCustom);
+    }
+
+    if (SUCCEEDED(hr))
+        hr = pConverter->GetSize(&width, &height);
+
+    if (SUCCEEDED(hr))
+    {
+        int levels = 1;
+
+        while (((width | height) >> levels) != 0 && levels < IMAGE_MAX_LEVELS)
+            ++levels;
+
+        if (!CreateImage(width, height, levels, image))
+            hr = E_OUTOFMEMORY;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pConverter->CopyPixels(0, width * sizeof(DWORD), width * height * sizeof(DWORD),
+                reinterpret_cast<BYTE*>(image.pPixels));
+
+        if (FAILED(hr))
+            DestroyImage(image);
+    }
+
+    SAFE_RELEASE(pConverter);
+    SAFE_RELEASE(pFrame);
+    SAFE_RELEASE(pDecoder);
+    SAFE_RELEASE(pStream);
+    SAFE_RELEASE(pFactory);
+
+    return SUCCEEDED(hr);
+}
+
+void DecodeOctahedralNormal(const SHORT encoded[2], float normal[3])
+{
+    // Unfolds a normal from the octahedron. The lower half was folded over
+    // the diagonals, which moving x and y towards the axes by the depth
+    // below the equator undoes. Matches DecodeOctahedralNormal() in the
+    // Blinn-Phong effects.
+
+    float x = Snorm16ToFloat(encoded[0]);
+    float y = Snorm16ToFloat(encoded[1]);
+    float z = 1.0f - fabsf(x) - fabsf(y);
+    float t = max(-z, 0.0f);
+
+    x += (x >= 0.0f) ? -t : t;
+    y += (y >= 0.0f) ? -t : t;
+
+    float scale = 1.0f / sqrtf(x * x + y * y + z * z);
+
+    normal[0] = x * scale;
+    normal[1] = y * scale;
+    normal[2] = z * scale;
+}
+
+void DecodeTextureJob(void *pParam)
+{
+    TextureLoad &load = *static_cast<TextureLoad*>(pParam);
+
+    AllocationZone zone("DecodeTexture");
+
+    if (DecodeImage(&load.fileData[0], load.fileData.size(), load.image))
+    {
+        GenerateMipChain(load.image, *load.pDecodePool);
+        load.succeeded = true;
+
+        // Cook a new cache file. Only the top level has to be a multiple of
+        // 4 in size for a Direct3D 9 block compressed texture.
+
+        if (load.useCache && (load.image.width % 4) == 0 && (load.image.height % 4) == 0)
+        {
+            D3DFORMAT format = D3DFMT_DXT1;
+            const DWORD *pPixels = load.image.pPixels;
+
+            for (int i = 0; i < load.image.width * load.image.height; ++i)
+            {
+                if ((pPixels[i] >> 24) != 0xff)
+                {
+                    format = D3DFMT_DXT5;
+                    break;
+                }
+            }
+
+            if (CompressImage(load.image, format, TEXTURE_CACHE_QUALITY, load.compressed, *load.pDecodePool))
+            {
+                WriteTextureCache(load.szCacheFilename, load.sourceHash, load.compressed);
+                DestroyImage(load.image);
+            }
+        }
+    }
+
+    std::vector<BYTE>().swap(load.fileData);
+}
+
+void DecompressBlockBC1(const BYTE *pBlock, bool fourColorOnly, DWORD *pPixels)
+{
+    // Decodes a DXT1 color block to 16 BGRA pixels. A DXT1 block whose first
+    // end point isn't greater than its second uses 3 colors and transparent
+    // black. The color half of a DXT5 block always uses 4 colors, whatever
+    // the order of its end points, so pass fourColorOnly for those.
+
+    WORD color0 = static_cast<WORD>(pBlock[0] | (pBlock[1] << 8));
+    WORD color1 = static_cast<WORD>(pBlock[2] | (pBlock[3] << 8));
+    DWORD indices = pBlock[4] | (pBlock[5] << 8) | (pBlock[6] << 16) | (static_cast<DWORD>(pBlock[7]) << 24);
+    DWORD palette[4];
+    int rgb[4][3];
+    bool fourColor = fourColorOnly || color0 > color1;
+
+    UnpackColor565(color0, rgb[0]);
+    UnpackColor565(color1, rgb[1]);
+
+    for (int c = 0; c < 3; ++c)
+    {
+        if (fourColor)
+        {
+            rgb[2][c] = (2 * rgb[0][c] + rgb[1][c]) / 3;
+            rgb[3][c] = (rgb[0][c] + 2 * rgb[1][c]) / 3;
+        }
+        else
+        {
+            rgb[2][c] = (rgb[0][c] + rgb[1][c]) / 2;
+            rgb[3][c] = 0;
+        }
+    }
+
+    for (int j = 0; j < 4; ++j)
+    {
+        DWORD alpha = (j == 3 && !fourColor) ? 0 : 0xff000000;
+
+        palette[j] = alpha | (rgb[j][0] << 16) | (rgb[j][1] << 8) | rgb[j][2];
+    }
+
+    for (int i = 0; i < 16; ++i)
+        pPixels[i] = palette[(indices >> (i * 2)) & 3];
+}
+
+void DecompressBlockBC3Alpha(const BYTE *pBlock, DWORD *pPixels)
+{
+    // Replaces the alpha of 16 decoded pixels with a DXT5 alpha block.
+
+    int palette[8];
+
+    palette[0] = pBlock[0];
+    palette[1] = pBlock[1];
+
+    for (int j = 1; j < 7; ++j)
+    {
+        if (palette[0] > palette[1])
+            palette[j + 1] = ((7 - j) * palette[0] + j * palette[1]) / 7;
+        else if (j < 5)
+            palette[j + 1] = ((5 - j) * palette[0] + j * palette[1]) / 5;
+        else
+            palette[j + 1] = (j == 5) ? 0 : 255;
+    }
+
+    ULONGLONG indices = 0;
+
+    for (int i = 0; i < 6; ++i)
+        indices |= static_cast<ULONGLONG>(pBlock[2 + i]) << (i * 8);
+
+    for (int i = 0; i < 16; ++i)
+        pPixels[i] = (pPixels[i] & 0x00ffffff) | (palette[(indices >> (i * 3)) & 7] << 24);
+}
+
+void DecompressBlockBC7(const BYTE *pBlock, DWORD *pPixels)
+{
+    // Decodes a BC7 block to 16 BGRA pixels. Only mode 6, the only mode
+    // CompressBlockBC7() writes, is supported. Other modes decode to
+    // transparent black.
+
+    if ((pBlock[0] & 0x7f) != 0x40)
+    {
+        memset(pPixels, 0, 16 * sizeof(DWORD));
+        return;
+    }
+
+    int offset = 7;
+    int endPoints[2][4];
+
+    for (int c = 0; c < 4; ++c)
+    {
+        endPoints[0][c] = ReadBlockBits(pBlock, offset, 7) << 1;
+        endPoints[1][c] = ReadBlockBits(pBlock, offset, 7) << 1;
+    }
+
+    DWORD pBit0 = ReadBlockBits(pBlock, offset, 1);
+    DWORD pBit1 = ReadBlockBits(pBlock, offset, 1);
+
+    for (int c = 0; c < 4; ++c)
+    {
+        endPoints[0][c] |= pBit0;
+        endPoints[1][c] |= pBit1;
+    }
+
+    for (int i = 0; i < 16; ++i)
+    {
+        int weight = BC7_INDEX_WEIGHTS[ReadBlockBits(pBlock, offset, (i == 0) ? 3 : 4)];
+        int values[4];
+
+        for (int c = 0; c < 4; ++c)
+            values[c] = ((64 - weight) * endPoints[0][c] + weight * endPoints[1][c] + 32) >> 6;
+
+        pPixels[i] = (values[3] << 24) | (values[0] << 16) | (values[1] << 8) | values[2];
+    }
+}
+
+void DenoiseLighting(const float *pColors, const float *pPositions, const float *pNormals, int width, int height,
+                     float *pResult)
+{
+    // Averages each pixel's lighting with that of the pixels around it that
+    // see the same surface nearby, weighting them down with the distance
+    // between the points they see. Pixels facing other ways, such as across
+    // the edge between a wall and the floor, are left out, so edges stay
+    // sharp while the noise of sampled lighting is smoothed over.
+
+    const float falloff = 1.0f / (2.0f * LIGHT_DENOISE_DISTANCE * LIGHT_DENOISE_DISTANCE);
+
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            const float *pPos = pPositions + (y * width + x) * 3;
+            const float *pNormal = pNormals + (y * width + x) * 3;
+            float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+            float totalWeight = 0.0f;
+
+            for (int j = max(0, y - LIGHT_DENOISE_RADIUS); j <= min(height - 1, y + LIGHT_DENOISE_RADIUS); ++j)
+            {
+                for (int i = max(0, x - LIGHT_DENOISE_RADIUS); i <= min(width - 1, x + LIGHT_DENOISE_RADIUS); ++i)
+                {
+                    const float *pOtherPos = pPositions + (j * width + i) * 3;
+                    const float *pOtherNormal = pNormals + (j * width + i) * 3;
+                    const float *pOtherColor = pColors + (j * width + i) * 4;
+                    float distanceSq = 0.0f;
+                    float facing = 0.0f;
+
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        distanceSq += (pOtherPos[c] - pPos[c]) * (pOtherPos[c] - pPos[c]);
+                        facing += pOtherNormal[c] * pNormal[c];
+                    }
+
+                    if (facing < 0.99f)
+                        continue;
+
+                    float weight = expf(-distanceSq * falloff);
+
+                    for (int c = 0; c < 4; ++c)
+                        sum[c] += pOtherColor[c] * weight;
+
+                    totalWeight += weight;
+                }
+            }
+
+            for (int c = 0; c < 4; ++c)
+                pResult[(y * width + x) * 4 + c] = sum[c] / totalWeight;
+        }
+    }
+}
+
+void DenoiseLightingOverFrames(const float *pColors, int count, bool first, float *pHistory)
+{
+    // Blends a frame's lighting of count pixels into the history, where
+    // each new frame counts for LIGHT_HISTORY_WEIGHT, so the noise of
+    // sampled lighting averages out over frames. The first frame replaces
+    // the history. Pixels are blended with the same pixel of the history,
+    // which suits a still camera; ReprojectLighting() finds a moving
+    // camera's history.
+
+    if (first)
+    {
+        memcpy(pHistory, pColors, sizeof(float) * 4 * count);
+        return;
+    }
+
+    for (int i = 0; i < count * 4; ++i)
+        pHistory[i] += (pColors[i] - pHistory[i]) * LIGHT_HISTORY_WEIGHT;
+}
+
+void DestroyCompressedImage(CompressedImage &image)
+{
+    if (image.pView)
+        UnmapViewOfFile(image.pView);
+
+    if (image.hMapping)
+        CloseHandle(image.hMapping);
+
+    if (image.hFile)
+        CloseHandle(image.hFile);
+
+    free(image.pMemory);
+    memset(&image, 0, sizeof(image));
+}
+
+void DestroyCookedMesh(CookedMesh &mesh)
+{
+    if (mesh.pView)
+        UnmapViewOfFile(mesh.pView);
+
+    if (mesh.hMapping)
+        CloseHandle(mesh.hMapping);
+
+    if (mesh.hFile)
+        CloseHandle(mesh.hFile);
+
+    free(mesh.pMemory);
+    memset(&mesh, 0, sizeof(mesh));
+}
+
+void DestroyGlyphAtlas(GlyphAtlas &atlas)
+{
+    delete[] atlas.pCoverage;
+    atlas.pCoverage = 0;
+}
+
+void DestroyImage(Image &image)
+{
+    _aligned_free(image.pPixels);
+    memset(&image, 0, sizeof(image));
+}
+
+void DestroyOcclusionBuffer(OcclusionBuffer &buffer)
+{
+    _aligned_free(buffer.pDepth);
+    memset(&buffer, 0, sizeof(buffer));
+}
+
+void DestroyShadowCache(ShadowCache &cache)
+{
+    _aligned_free(cache.pTexels);
+    cache.pTexels = 0;
+    cache.tileFaces.clear();
+    cache.tileLastUsed.clear();
+    cache.freeTiles.clear();
+    cache.lights.clear();
+}
+
+void DestroySoftwareTexture(SoftwareTexture &texture)
+{
+    _aligned_free(texture.pTexels);
+    memset(&texture, 0, sizeof(texture));
+}
+
+bool DeviceIsValid()
+{
+    HRESULT hr = g_pDevice->TestCooperativeLevel();
+
+    if (FAILED(hr))
+    {
+        if (hr == D3DERR_DEVICENOTRESET)
+            return ResetDevice();
+    }
+
+    return true;
+}
+
+void DrawTextLayout(const TextLayout &layout)
+{
+    // Draw all of the laid out quads with a single DrawPrimitiveUP() call
+    // using the fixed function pipeline.
+
+    if (layout.numQuads == 0)
+        return;
+
+    g_pDevice->SetVertexShader(0);
+    g_pDevice->SetPixelShader(0);
+    g_pDevice->SetFVF(D3DFVF_XYZRHW | D3DFVF_DIFFUSE | D3DFVF_TEX1);
+    g_pDevice->SetTexture(0, g_pGlyphAtlasTexture);
+
+    g_pDevice->SetRenderState(D3DRS_ZENABLE, D3DZB_FALSE);
+    g_pDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
+    g_pDevice->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+    g_pDevice->SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+
+    g_pDevice->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
+    g_pDevice->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+    g_pDevice->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+    g_pDevice->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_MODULATE);
+    g_pDevice->SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+    g_pDevice->SetTextureStageState(0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
+
+    g_pDevice->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_POINT);
+    g_pDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
+    g_pDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+
+    g_pDevice->DrawPrimitiveUP(D3DPT_TRIANGLELIST, layout.numQuads * 2,
+        layout.vertices, sizeof(TextVertex));
+
+    g_pDevice->SetTexture(0, 0);
+    g_pDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+    g_pDevice->SetRenderState(D3DRS_ZENABLE, D3DZB_TRUE);
+}
+
+void DrawTextLayoutToBuffer(const GlyphAtlas &atlas, const TextLayout &layout,
+                            DWORD *pPixels, int width, int height, int pitch)
+{
+    // Software version of DrawTextLayout() for the CPU/headless path. The
+    // quads are screen aligned and map atlas texels 1:1 to pixels, so each
+    // quad is simply a clipped coverage blit blended over the X8R8G8B8 target.
+    // The pitch is in bytes.
+
+    for (int i = 0; i < layout.numQuads; ++i)
+    {
+        const TextVertex *pQuad = &layout.vertices[i * 6];
+        const D3DCOLOR color = pQuad->color;
+
+        int dstX = static_cast<int>(pQuad[0].pos[0] + 0.5f);
+        int dstY = static_cast<int>(pQuad[0].pos[1] + 0.5f);
+        int srcX = static_cast<int>(pQuad[0].texCoord[0] * atlas.width + 0.5f);
+        int srcY = static_cast<int>(pQuad[0].texCoord[1] * atlas.height + 0.5f);
+        int quadWidth = static_cast<int>(pQuad[1].pos[0] - pQuad[0].pos[0] + 0.5f);
+        int quadHeight = static_cast<int>(pQuad[2].pos[1] - pQuad[1].pos[1] + 0.5f);
+
+        int colorA = (color >> 24) & 0xff;
+        int colorR = (color >> 16) & 0xff;
+        int colorG = (color >> 8) & 0xff;
+        int colorB = color & 0xff;
+
+        for (int y = 0; y < quadHeight; ++y)
+        {
+            if (dstY + y < 0 || dstY + y >= height)
+                continue;
+
+            DWORD *pRow = reinterpret_cast<DWORD*>(reinterpret_cast<BYTE*>(pPixels) + (dstY + y) * pitch);
+            const BYTE *pCoverage = &atlas.pCoverage[(srcY + y) * atlas.width + srcX];
+
+            for (int x = 0; x < quadWidth; ++x)
+            {
+                if (dstX + x < 0 || dstX + x >= width)
+                    continue;
+
+                int alpha = pCoverage[x] * colorA / 255;
+
+                if (alpha == 0)
+                    continue;
+
+                DWORD dst = pRow[dstX + x];
+                int r = (dst >> 16) & 0xff;
+                int g = (dst >> 8) & 0xff;
+                int b = dst & 0xff;
+
+                r += (colorR - r) * alpha / 255;
+                g += (colorG - g) * alpha / 255;
+                b += (colorB - b) * alpha / 255;
+
+                pRow[dstX + x] = D3DCOLOR_XRGB(r, g, b);
+            }
+        }
+    }
+}
+
+bool DrawTextWithGdi(const char *pszFont, int ptSize, const char *pszText, int x, int y,
+                     int width, int height, BYTE *pCoverage)
+{
+    // Draws text with GDI the way LayoutText() lays it out, line by line
+    // with tab stops every GLYPH_TAB_SPACES spaces, white on black into a
+    // width by height DIB section, and gives each pixel's coverage. It
+    // shares only the font with the glyph atlas, so it serves as a
+    // reference for the atlas text.
+
+    HDC hDC = CreateCompatibleDC(0);
+
+    if (!hDC)
+        return false;
+
+    HFONT hFont = CreateGlyphFont(hDC, pszFont, ptSize);
+    BITMAPINFO bmi = {0};
+    void *pBits = 0;
+
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    HBITMAP hBitmap = hFont ? CreateDIBSection(hDC, &bmi, DIB_RGB_COLORS, &pBits, 0, 0) : 0;
+
+    if (!hBitmap)
+    {
+        if (hFont)
+            DeleteObject(hFont);
+
+        DeleteDC(hDC);
+        return false;
+    }
+
+    HGDIOBJ hOldFont = SelectObject(hDC, hFont);
+    HGDIOBJ hOldBitmap = SelectObject(hDC, hBitmap);
+    TEXTMETRIC tm = {0};
+    SIZE space = {0};
+
+    GetTextMetrics(hDC, &tm);
+    GetTextExtentPoint32(hDC, " ", 1, &space);
+
+    int tabWidth = space.cx * GLYPH_TAB_SPACES;
+
+    memset(pBits, 0, width * height * 4);
+    SetTextColor(hDC, RGB(255, 255, 255));
+    SetBkMode(hDC, TRANSPARENT);
+
+    for (const char *pLine = pszText; *pLine; y += tm.tmHeight)
+    {
+        const char *pEnd = strchr(pLine, '\n');
+        int length = pEnd ? static_cast<int>(pEnd - pLine) : static_cast<int>(strlen(pLine));
+
+        TabbedTextOut(hDC, x, y, pLine, length, 1, &tabWidth, x);
+        pLine += length + (pEnd ? 1 : 0);
+    }
+
+    GdiFlush();
+
+    const DWORD *pPixels = static_cast<const DWORD*>(pBits);
+
+    for (int i = 0; i < width * height; ++i)
+        pCoverage[i] = static_cast<BYTE>((pPixels[i] >> 8) & 0xff);
+
+    SelectObject(hDC, hOldBitmap);
+    SelectObject(hDC, hOldFont);
+    DeleteObject(hBitmap);
+    DeleteObject(hFont);
+    DeleteDC(hDC);
+
+    return true;
+}
+
+void EncodeOctahedralNormal(const float normal[3], SHORT encoded[2])
+{
+    // Projects a unit normal onto the octahedron |x| + |y| + |z| = 1 and
+    // folds the lower half over the diagonals so that it fits in a square.
+    // Of the 4 ways of rounding the result to 16 bits, the one that decodes
+    // closest to the normal is kept.
+
+    float length = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+    float x = normal[0] / length;
+    float y = normal[1] / length;
+
+    if (normal[2] < 0.0f)
+    {
+        float foldedX = (1.0f - fabsf(y)) * ((x >= 0.0f) ? 1.0f : -1.0f);
+        float foldedY = (1.0f - fabsf(x)) * ((y >= 0.0f) ? 1.0f : -1.0f);
+
+        x = foldedX;
+        y = foldedY;
+    }
+
+    float bestDot = -2.0f;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        SHORT candidate[2] =
+        {
+            static_cast<SHORT>(min(max((i & 1) ? ceilf(x * 32767.0f) : floorf(x * 32767.0f), -32767.0f), 32767.0f)),
+            static_cast<SHORT>(min(max((i & 2) ? ceilf(y * 32767.0f) : floorf(y * 32767.0f), -32767.0f), 32767.0f))
+        };
+        float decoded[3];
+
+        DecodeOctahedralNormal(candidate, decoded);
+
+        float dot = decoded[0] * normal[0] + decoded[1] * normal[1] + decoded[2] * normal[2];
+
+        if (dot > bestDot)
+        {
+            bestDot = dot;
+            encoded[0] = candidate[0];
+            encoded[1] = candidate[1];
+        }
+    }
+}
+
+void EstimateLighting(const LightTree &tree, const float pos[3], const float normal[3], const float *pViewDir,
+                      const Material &material, int samples, unsigned int &seed, float color[4])
+{
+    // Estimates the lighting ShadePointLight() sums over every light of
+    // the tree, without the global ambient term, from a few lights picked
+    // at random. Each is picked by walking down the tree, going to a child
+    // with a probability in proportion to its importance, and its lighting
+    // is divided by the probability of picking it. The estimate is then
+    // right on average, and costs the same whatever the number of lights
+    // but for the depth of the tree. Lights that can't reach the point are
+    // never picked.
+
+    static const float noAmbient[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+    if (tree.nodes.empty())
+        return;
+
+    for (int i = 0; i < samples; ++i)
+    {
+        const LightTreeNode *pNode = &tree.nodes[0];
+        float probability = 1.0f;
+
+        while (pNode->light < 0)
+        {
+            const LightTreeNode &left = tree.nodes[pNode->children[0]];
+            const LightTreeNode &right = tree.nodes[pNode->children[1]];
+            float leftImportance = GetLightClusterImportance(left, pos, normal, 0);
+            float rightImportance = GetLightClusterImportance(right, pos, normal, 0);
+            float total = leftImportance + rightImportance;
+
+            if (total <= 0.0f)
+                break;
+
+            if (NextRandomFloat(seed) * total < leftImportance)
+            {
+                probability *= leftImportance / total;
+                pNode = &left;
+            }
+            else
+            {
+                probability *= rightImportance / total;
+                pNode = &right;
+            }
+        }
+
+        if (pNode->light < 0 || GetLightClusterImportance(*pNode, pos, normal, 0) <= 0.0f)
+            continue;
+
+        float lighting[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+        ShadePointLight(tree.pLights[pNode->light], pos, normal, pViewDir, material, noAmbient, true, lighting);
+
+        for (int c = 0; c < 4; ++c)
+            color[c] += lighting[c] / (probability * samples);
+    }
+}
+
+void FillOcclusionTriangle(OcclusionBuffer &buffer, const float *v0, const float *v1, const float *v2)
+{
+    // Rasterizes a triangle given in pixels and 1 / w into level 0 of the
+    // buffer, keeping the nearer depth, the larger 1 / w, at each pixel
+    // whose center it covers. Occluders are seen from both sides, so either
+    // winding is drawn. Edge functions and depth are evaluated 4 pixels at
+    // a time.
+
+    float area = (v1[0] - v0[0]) * (v2[1] - v0[1]) - (v2[0] - v0[0]) * (v1[1] - v0[1]);
+
+    if (fabsf(area) < 1.0e-6f)
+        return;
+
+    if (area < 0.0f)
+    {
+        std::swap(v1, v2);
+        area = -area;
+    }
+
+    int left = max(0, static_cast<int>(floorf(min(min(v0[0], v1[0]), v2[0]))));
+    int right = min(buffer.width - 1, static_cast<int>(floorf(max(max(v0[0], v1[0]), v2[0]))));
+    int top = max(0, static_cast<int>(floorf(min(min(v0[1], v1[1]), v2[1]))));
+    int bottom = min(buffer.height - 1, static_cast<int>(floorf(max(max(v0[1], v1[1]), v2[1]))));
+
+    if (left > right || top > bottom)
+        return;
+
+    // Edge i is opposite vertex i and is positive on the triangle's side:
+    // e(x, y) = a * x + b * y + c. Dividing the edge functions by the area
+    // gives the barycentric weights, which interpolate the depth.
+
+    const float *vertices[3] = {v0, v1, v2};
+    float a[3];
+    float b[3];
+    float c[3];
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const float *p = vertices[(i + 1) % 3];
+        const float *q = vertices[(i + 2) % 3];
+
+        a[i] = p[1] - q[1];
+        b[i] = q[0] - p[0];
+        c[i] = -a[i] * p[0] - b[i] * p[1];
+    }
+
+    float depthA = (a[0] * v0[2] + a[1] * v1[2] + a[2] * v2[2]) / area;
+    float depthB = (b[0] * v0[2] + b[1] * v1[2] + b[2] * v2[2]) / area;
+    float depthC = (c[0] * v0[2] + c[1] * v1[2] + c[2] * v2[2]) / area;
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 edgeA0 = _mm_set1_ps(a[0]);
+    __m128 edgeA1 = _mm_set1_ps(a[1]);
+    __m128 edgeA2 = _mm_set1_ps(a[2]);
+    __m128 slope = _mm_set1_ps(depthA);
+
+    for (int y = top; y <= bottom; ++y)
+    {
+        float centerY = y + 0.5f;
+        __m128 rowEdge0 = _mm_set1_ps(b[0] * centerY + c[0]);
+        __m128 rowEdge1 = _mm_set1_ps(b[1] * centerY + c[1]);
+        __m128 rowEdge2 = _mm_set1_ps(b[2] * centerY + c[2]);
+        __m128 rowDepth = _mm_set1_ps(depthB * centerY + depthC);
+        float *pRow = buffer.pDepth + y * buffer.width;
+
+        for (int x = left & ~3; x <= right; x += 4)
+        {
+            __m128 centerX = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), offsets);
+            __m128 edge0 = _mm_add_ps(_mm_mul_ps(edgeA0, centerX), rowEdge0);
+            __m128 edge1 = _mm_add_ps(_mm_mul_ps(edgeA1, centerX), rowEdge1);
+            __m128 edge2 = _mm_add_ps(_mm_mul_ps(edgeA2, centerX), rowEdge2);
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(edge0, zero), _mm_cmpge_ps(edge1, zero)),
+                                       _mm_cmpge_ps(edge2, zero));
+
+            if (_mm_movemask_ps(inside) == 0)
+                continue;
+
+            __m128 depth = _mm_add_ps(_mm_mul_ps(slope, centerX), rowDepth);
+            __m128 old = _mm_load_ps(pRow + x);
+
+            _mm_store_ps(pRow + x, SelectPS(inside, _mm_max_ps(old, depth), old));
+        }
+    }
+}
+
+int FindAllocationZone(const char *pszName)
+{
+    // Zones are registered on first use. Lookups are lock free because
+    // names are only ever appended and published before the count is.
+
+    int numZones = g_numAllocationZones;
+
+    for (int i = 0; i < numZones; ++i)
+    {
+        if (g_allocationZoneNames[i] == pszName || strcmp(g_allocationZoneNames[i], pszName) == 0)
+            return i;
+    }
+
+    while (InterlockedCompareExchange(&g_allocationZoneLock, 1, 0) != 0)
+        Sleep(0);
+
+    int zone = 0;
+
+    for (zone = g_numAllocationZones - 1; zone > 0; --zone)
+    {
+        if (strcmp(g_allocationZoneNames[zone], pszName) == 0)
+            break;
+    }
+
+    if (zone == 0 && g_numAllocationZones < ALLOCATION_MAX_ZONES)
+    {
+        zone = g_numAllocationZones;
+        g_allocationZoneNames[zone] = pszName;
+        InterlockedIncrement(&g_numAllocationZones);
+    }
+
+    InterlockedExchange(&g_allocationZoneLock, 0);
+    return zone;
+}
+
+SHORT FloatToSnorm16(float value)
+{
+    // The inverse of D3DDECLTYPE_SHORT2N/SHORT4N, rounding to nearest.
+
+    return static_cast<SHORT>(floorf(min(max(value, -1.0f), 1.0f) * 32767.0f + 0.5f));
+}
+
+bool FinishLightmapBake(LightmapBake &bake, WorkerPool &pool)
+{
+    // Waits for a started bake, running queued jobs in the meantime.
+    // Returns whether a bake finished without being cancelled.
+
+    if (!bake.pending)
+        return false;
+
+    while (bake.remainingBands > 0)
+    {
+        if (!pool.runOne())
+            WaitForSingleObject(pool.hJobDone, 1);
+    }
+
+    double endTime = bake.startTime;
+
+    bake.raysTraced = 0;
+
+    for (size_t i = 0; i < bake.bands.size(); ++i)
+    {
+        endTime = max(endTime, bake.bands[i].endTime);
+        bake.raysTraced += bake.bands[i].raysTraced;
+    }
+
+    bake.bakeTimeMs = static_cast<float>((endTime - bake.startTime) * 1000.0);
+    bake.pending = false;
+
+    return !bake.cancel;
+}
+
+void FinishOcclusionJob(OcclusionJob &job, WorkerPool &pool)
+{
+    // Waits for a started job, running queued jobs in the meantime.
+
+    if (!job.pending)
+        return;
+
+    while (!job.done)
+    {
+        if (!pool.runOne())
+            WaitForSingleObject(pool.hJobDone, 1);
+    }
+
+    job.pending = false;
+}
+
+void FreeTracked(void *pMemory)
+{
+    if (!pMemory)
+        return;
+
+    BYTE *pBlock = static_cast<BYTE*>(pMemory) - ALLOCATION_HEADER_SIZE;
+    const AllocationHeader *pHeader = reinterpret_cast<const AllocationHeader*>(pBlock);
+
+    InterlockedExchangeAdd64(&g_liveHeapBytes, -static_cast<LONGLONG>(pHeader->size));
+    free(pBlock);
+}
+
+void GatherRoomWallFeedback(const VirtualTexture &texture, const D3DXMATRIX &viewProjection,
+                            int screenWidth, int screenHeight,
+                            std::vector<VirtualFeedbackSample> &samples)
+{
+    // The CPU version of a feedback pass: ray casts one pixel in every
+    // VIRTUAL_FEEDBACK_SCALE x VIRTUAL_FEEDBACK_SCALE block of the screen
+    // against the room and records the wall texture coordinate and mip
+    // level there. The gradients come from casting through the neighboring
+    // screen pixels, so the level is the one a full resolution frame would
+    // use. Pixels whose neighbors land on another surface are skipped.
+
+    D3DXMATRIX inverse;
+
+    samples.clear();
+
+    if (!D3DXMatrixInverse(&inverse, 0, &viewProjection))
+        return;
+
+    for (int y = VIRTUAL_FEEDBACK_SCALE / 2; y < screenHeight; y += VIRTUAL_FEEDBACK_SCALE)
+    {
+        for (int x = VIRTUAL_FEEDBACK_SCALE / 2; x < screenWidth; x += VIRTUAL_FEEDBACK_SCALE)
+        {
+            float coords[3][2];
+            int walls[3];
+
+            for (int i = 0; i < 3; ++i)
+            {
+                float ndcX = (x + (i == 1) + 0.5f) / screenWidth * 2.0f - 1.0f;
+                float ndcY = 1.0f - (y + (i == 2) + 0.5f) / screenHeight * 2.0f;
+                D3DXVECTOR3 nearPoint(ndcX, ndcY, 0.0f);
+                D3DXVECTOR3 farPoint(ndcX, ndcY, 1.0f);
+
+                D3DXVec3TransformCoord(&nearPoint, &nearPoint, &inverse);
+                D3DXVec3TransformCoord(&farPoint, &farPoint, &inverse);
+                walls[i] = GetRoomWallCoords(nearPoint, farPoint - nearPoint, coords[i][0], coords[i][1]);
+            }
+
+            if (walls[0] < 0 || walls[1] != walls[0] || walls[2] != walls[0])
+                continue;
+
+            // Gradients in level 0 texels.
+
+            float dudx = (coords[1][0] - coords[0][0]) * texture.header.width;
+            float dvdx = (coords[1][1] - coords[0][1]) * texture.header.height;
+            float dudy = (coords[2][0] - coords[0][0]) * texture.header.width;
+            float dvdy = (coords[2][1] - coords[0][1]) * texture.header.height;
+            float lengthX = sqrtf(dudx * dudx + dvdx * dvdx);
+            float lengthY = sqrtf(dudy * dudy + dvdy * dvdy);
+            float size = max(lengthX, lengthY);
+            VirtualFeedbackSample sample;
+
+            sample.u = coords[0][0];
+            sample.v = coords[0][1];
+            sample.level = min((size > 1.0f) ? static_cast<int>(log2f(size)) : 0, texture.header.levels - 1);
+            samples.push_back(sample);
+        }
+    }
+}
+
+void GenerateMipChain(Image &image, WorkerPool &pool)
+{
+    // Fills in mip levels 1 and up, each one filtered from the level above
+    // it. Filtering happens in linear space so that the smaller levels don't
+    // darken. Large levels are split into bands of rows that are filtered in
+    // parallel on the given pool.
+
+    for (int i = 1; i < image.levels; ++i)
+    {
+        MipLevelJob job;
+
+        job.pSrc = image.pPixels + image.levelOffsets[i - 1];
+        job.srcWidth = max(1, image.width >> (i - 1));
+        job.srcHeight = max(1, image.height >> (i - 1));
+        job.pDst = image.pPixels + image.levelOffsets[i];
+        job.dstWidth = max(1, image.width >> i);
+        job.dstHeight = max(1, image.height >> i);
+
+        if (job.dstWidth * job.dstHeight < MIP_PARALLEL_MIN_PIXELS)
+            GenerateMipRows(&job, 0, job.dstHeight);
+        else
+            ParallelFor(pool, job.dstHeight, GenerateMipRows, &job);
+    }
+}
+
+void GenerateMipChainReference(Image &image)
+{
+    // Straightforward double precision version of GenerateMipChain() using
+    // the exact sRGB transfer functions. Used to check its accuracy.
+
+    for (int i = 1; i < image.levels; ++i)
+    {
+        int srcWidth = max(1, image.width >> (i - 1));
+        int srcHeight = max(1, image.height >> (i - 1));
+        int dstWidth = max(1, image.width >> i);
+        int dstHeight = max(1, image.height >> i);
+        const BYTE *pSrc = reinterpret_cast<const BYTE*>(image.pPixels + image.levelOffsets[i - 1]);
+        BYTE *pDst = reinterpret_cast<BYTE*>(image.pPixels + image.levelOffsets[i]);
+
+        for (int y = 0; y < dstHeight; ++y)
+        {
+            double weightsY[3];
+            int firstY = GetMipFilterTaps(y, srcHeight, dstHeight, weightsY);
+            int tapsY = (srcHeight == 1) ? 1 : ((srcHeight & 1) ? 3 : 2);
+
+            for (int x = 0; x < dstWidth; ++x)
+            {
+                double weightsX[3];
+                int firstX = GetMipFilterTaps(x, srcWidth, dstWidth, weightsX);
+                int tapsX = (srcWidth == 1) ? 1 : ((srcWidth & 1) ? 3 : 2);
+                double sum[4] = {0.0, 0.0, 0.0, 0.0};
+
+                for (int ty = 0; ty < tapsY; ++ty)
+                {
+                    for (int tx = 0; tx < tapsX; ++tx)
+                    {
+                        const BYTE *pPixel = pSrc + ((firstY + ty) * srcWidth + firstX + tx) * 4;
+                        double weight = weightsY[ty] * weightsX[tx];
+
+                        for (int c = 0; c < 3; ++c)
+                        {
+                            double value = pPixel[c] / 255.0;
+
+                            value = (value <= 0.04045) ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+                            sum[c] += value * weight;
+                        }
+
+                        sum[3] += (pPixel[3] / 255.0) * weight;
+                    }
+                }
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    double value = (std::min)((std::max)(sum[c], 0.0), 1.0);
+
+                    value = (value <= 0.0031308) ? value * 12.92 : 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+                    *pDst++ = static_cast<BYTE>(floor(value * 255.0 + 0.5));
+                }
+
+                *pDst++ = static_cast<BYTE>(floor((std::min)((std::max)(sum[3], 0.0), 1.0) * 255.0 + 0.5));
+            }
+        }
+    }
+}
+
+void GenerateMipRows(void *pParam, int begin, int end)
+{
+    // Generates destination rows [begin, end) of one mip level. Each output
+    // row is built in two passes. The two or three source rows it covers are
+    // converted to linear space and blended into a float scanline, which is
+    // then filtered horizontally. Each pixel is a single SSE vector.
+
+    const MipLevelJob &job = *static_cast<const MipLevelJob*>(pParam);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 encodeScale = _mm_setr_ps(SRGB_ENCODE_TABLE_SIZE - 1.0f,
+        SRGB_ENCODE_TABLE_SIZE - 1.0f, SRGB_ENCODE_TABLE_SIZE - 1.0f, 255.0f);
+
+    __m128 *pScanline = static_cast<__m128*>(_aligned_malloc(job.srcWidth * sizeof(__m128), 16));
+
+    if (!pScanline)
+        return;
+
+    for (int y = begin; y < end; ++y)
+    {
+        double weights[3];
+        int first = GetMipFilterTaps(y, job.srcHeight, job.dstHeight, weights);
+        int taps = (job.srcHeight == 1) ? 1 : ((job.srcHeight & 1) ? 3 : 2);
+
+        // Vertical pass.
+
+        for (int x = 0; x < job.srcWidth; ++x)
+            pScanline[x] = zero;
+
+        for (int t = 0; t < taps; ++t)
+        {
+            const BYTE *pRow = reinterpret_cast<const BYTE*>(job.pSrc + (first + t) * job.srcWidth);
+            __m128 weight = _mm_set1_ps(static_cast<float>(weights[t]));
+
+            for (int x = 0; x < job.srcWidth; ++x, pRow += 4)
+            {
+                __m128 linear = _mm_setr_ps(g_srgbToLinear[pRow[0]], g_srgbToLinear[pRow[1]],
+                                    g_srgbToLinear[pRow[2]], pRow[3] * (1.0f / 255.0f));
+
+                pScanline[x] = _mm_add_ps(pScanline[x], _mm_mul_ps(linear, weight));
+            }
+        }
+
+        // Horizontal pass. The taps and weights only depend on the width, so
+        // the common even case gets its own loop.
+
+        DWORD *pDst = job.pDst + y * job.dstWidth;
+
+        for (int x = 0; x < job.dstWidth; ++x)
+        {
+            __m128 sum;
+
+            if (job.srcWidth == 1)
+            {
+                sum = pScanline[0];
+            }
+            else if ((job.srcWidth & 1) == 0)
+            {
+                sum = _mm_mul_ps(_mm_add_ps(pScanline[x * 2], pScanline[x * 2 + 1]), _mm_set1_ps(0.5f));
+            }
+            else
+            {
+                double weightsX[3];
+                int firstX = GetMipFilterTaps(x, job.srcWidth, job.dstWidth, weightsX);
+
+                sum = _mm_add_ps(_mm_add_ps(
+                        _mm_mul_ps(pScanline[firstX], _mm_set1_ps(static_cast<float>(weightsX[0]))),
+                        _mm_mul_ps(pScanline[firstX + 1], _mm_set1_ps(static_cast<float>(weightsX[1])))),
+                        _mm_mul_ps(pScanline[firstX + 2], _mm_set1_ps(static_cast<float>(weightsX[2]))));
+            }
+
+            // Back to sRGB through the encoding table. Alpha is linear and
+            // is simply rounded.
+
+            sum = _mm_min_ps(_mm_max_ps(sum, zero), one);
+            __m128i index = _mm_cvtps_epi32(_mm_mul_ps(sum, encodeScale));
+
+            pDst[x] = g_linearToSrgb[_mm_extract_epi16(index, 0)]
+                    | (g_linearToSrgb[_mm_extract_epi16(index, 2)] << 8)
+                    | (g_linearToSrgb[_mm_extract_epi16(index, 4)] << 16)
+                    | (static_cast<DWORD>(_mm_extract_epi16(index, 6)) << 24);
+        }
+    }
+
+    _aligned_free(pScanline);
+}
+
+bool GenerateScene(const SceneDesc &desc, WorkerPool &pool, Scene &scene)
+{
+    // Builds desc.rooms rooms on a square grid, centered on the origin. Each
+    // room gets its share of the props and lights. The rooms are generated
+    // on the pool's threads in two passes: the first counts each room's
+    // vertices and chunks so that every room knows where its part of the
+    // scene's arrays starts, and the second fills them in. Every random
+    // choice is seeded from desc.seed and the room's index, so the same
+    // description gives the same scene on any number of threads.
+
+    if (desc.rooms <= 0 || desc.props < 0 || desc.lights < 0)
+        return false;
+
+    scene.desc = desc;
+
+    if (desc.layout == SCENE_LAYOUT_MAZE)
+    {
+        scene.cellSize[0] = SCENE_CORRIDOR_WIDTH;
+        scene.cellSize[1] = SCENE_CORRIDOR_HEIGHT;
+        scene.cellSize[2] = SCENE_CORRIDOR_WIDTH;
+        scene.doorSize[0] = SCENE_CORRIDOR_WIDTH;
+        scene.doorSize[1] = SCENE_CORRIDOR_HEIGHT;
+    }
+    else
+    {
+        scene.cellSize[0] = ROOM_SIZE_X;
+        scene.cellSize[1] = ROOM_SIZE_Y;
+        scene.cellSize[2] = ROOM_SIZE_Z;
+        scene.doorSize[0] = SCENE_DOOR_WIDTH;
+        scene.doorSize[1] = SCENE_DOOR_HEIGHT;
+    }
+
+    scene.roomsWide = static_cast<int>(ceil(sqrt(static_cast<double>(desc.rooms))));
+
+    int roomsDeep = (desc.rooms + scene.roomsWide - 1) / scene.roomsWide;
+
+    scene.boundsMin[0] = -scene.roomsWide * scene.cellSize[0] * 0.5f;
+    scene.boundsMin[1] = -scene.cellSize[1] * 0.5f;
+    scene.boundsMin[2] = -roomsDeep * scene.cellSize[2] * 0.5f;
+    scene.boundsMax[0] = -scene.boundsMin[0];
+    scene.boundsMax[1] = -scene.boundsMin[1];
+    scene.boundsMax[2] = -scene.boundsMin[2];
+
+    scene.rooms.resize(desc.rooms);
+    ParallelFor(pool, desc.rooms, GenerateSceneCells, &scene);
+
+    SceneJob job = {&scene, false};
+    int vertexCount = 0;
+    int chunkCount = 0;
+
+    ParallelFor(pool, desc.rooms, GenerateSceneRooms, &job);
+
+    for (int i = 0; i < desc.rooms; ++i)
+    {
+        scene.rooms[i].firstVertex = vertexCount;
+        scene.rooms[i].firstChunk = chunkCount;
+        vertexCount += scene.rooms[i].vertexCount;
+        chunkCount += scene.rooms[i].chunkCount;
+    }
+
+    scene.vertices.resize(vertexCount);
+    scene.chunks.resize(chunkCount);
+    scene.lights.resize(desc.lights);
+
+    job.write = true;
+    ParallelFor(pool, desc.rooms, GenerateSceneRooms, &job);
+    return true;
+}
+
+void GenerateSceneCells(void *pParam, int begin, int end)
+{
+    // Places rooms [begin, end) and works out their doors and their shares
+    // of the props and lights.
+
+    Scene &scene = *static_cast<Scene*>(pParam);
+    const SceneDesc &desc = scene.desc;
+    int roomsDeep = (desc.rooms + scene.roomsWide - 1) / scene.roomsWide;
+
+    for (int i = begin; i < end; ++i)
+    {
+        SceneRoom &room = scene.rooms[i];
+        int x = i % scene.roomsWide;
+        int z = i / scene.roomsWide;
+
+        room.center[0] = (x - (scene.roomsWide - 1) * 0.5f) * scene.cellSize[0];
+        room.center[1] = 0.0f;
+        room.center[2] = (z - (roomsDeep - 1) * 0.5f) * scene.cellSize[2];
+
+        // A room has its own openings toward its -X and -Z neighbors, and
+        // those its +X and +Z neighbors have toward it.
+
+        room.doors = GetSceneOpenings(scene, i);
+
+        if (x + 1 < scene.roomsWide && i + 1 < desc.rooms && (GetSceneOpenings(scene, i + 1) & SCENE_DOOR_NEG_X))
+            room.doors |= SCENE_DOOR_POS_X;
+
+        if (i + scene.roomsWide < desc.rooms && (GetSceneOpenings(scene, i + scene.roomsWide) & SCENE_DOOR_NEG_Z))
+            room.doors |= SCENE_DOOR_POS_Z;
+
+        int firstProp = static_cast<int>(static_cast<LONGLONG>(desc.props) * i / desc.rooms);
+        int lastProp = static_cast<int>(static_cast<LONGLONG>(desc.props) * (i + 1) / desc.rooms);
+
+        room.propCount = lastProp - firstProp;
+        room.firstLight = static_cast<int>(static_cast<LONGLONG>(desc.lights) * i / desc.rooms);
+        room.lightCount = static_cast<int>(static_cast<LONGLONG>(desc.lights) * (i + 1) / desc.rooms) - room.firstLight;
+    }
+}
+
+void GenerateSceneRoom(Scene &scene, int index, bool write)
+{
+    // Generates a room's walls, ceiling, floor, props and lights. When write
+    // is false only the room's vertex and chunk counts are set. Otherwise
+    // the room's part of the scene's arrays is filled in; both passes make
+    // the same random choices.
+
+    SceneRoom &room = scene.rooms[index];
+    unsigned int seed = GetSceneSeed(scene.desc, index, 0);
+    Vertex *pVertices = write ? &scene.vertices[room.firstVertex] : 0;
+    D3DXVECTOR3 center(room.center[0], room.center[1], room.center[2]);
+    float halfSize[3] = {scene.cellSize[0] * 0.5f, scene.cellSize[1] * 0.5f, scene.cellSize[2] * 0.5f};
+    int count = 0;
+    int chunks = 0;
+    int start = 0;
+
+    // The walls face into the room. Wall i has the door bit 1 << i.
+
+    static const float wallNormals[4][3] = {{1.0f, 0.0f, 0.0f}, {-1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f}, {0.0f, 0.0f, -1.0f}};
+
+    for (int i = 0; i < 4; ++i)
+    {
+        D3DXVECTOR3 normal(wallNormals[i][0], wallNormals[i][1], wallNormals[i][2]);
+        float halfDepth = (i < 2) ? halfSize[0] : halfSize[2];
+        float halfWidth = (i < 2) ? halfSize[2] : halfSize[0];
+        bool door = (room.doors & (1 << i)) != 0;
+
+        AddSceneWall(pVertices, count, center - normal * halfDepth, normal, halfWidth, halfSize[1],
+                     door ? scene.doorSize[0] : 0.0f, door ? scene.doorSize[1] : 0.0f);
+    }
+
+    // A corridor open on all 4 sides has no walls at all.
+
+    if (count > start)
+    {
+        if (write)
+            InitSceneChunk(scene, room.firstChunk + chunks, room.firstVertex + start, count - start, ROOM_SURFACE_WALLS, index);
+
+        ++chunks;
+    }
+
+    start = count;
+    AddSceneQuad(pVertices, count, D3DXVECTOR3(center.x - halfSize[0], center.y + halfSize[1], center.z - halfSize[2]),
+                 D3DXVECTOR3(halfSize[0] * 2.0f, 0.0f, 0.0f), D3DXVECTOR3(0.0f, 0.0f, halfSize[2] * 2.0f));
+
+    if (write)
+        InitSceneChunk(scene, room.firstChunk + chunks, room.firstVertex + start, count - start, ROOM_SURFACE_CEILING, index);
+
+    ++chunks;
+
+    start = count;
+    AddSceneQuad(pVertices, count, D3DXVECTOR3(center.x - halfSize[0], center.y - halfSize[1], center.z + halfSize[2]),
+                 D3DXVECTOR3(halfSize[0] * 2.0f, 0.0f, 0.0f), D3DXVECTOR3(0.0f, 0.0f, -halfSize[2] * 2.0f));
+
+    if (write)
+        InitSceneChunk(scene, room.firstChunk + chunks, room.firstVertex + start, count - start, ROOM_SURFACE_FLOOR, index);
+
+    ++chunks;
+
+    // Props are boxes standing on the floor. Their bottoms can't be seen,
+    // so they are left out.
+
+    float maxPropSize = min(SCENE_PROP_SIZE_MAX, min(halfSize[0], halfSize[2]));
+
+    for (int i = 0; i < room.propCount; ++i)
+    {
+        float propHalfSize[3];
+
+        propHalfSize[0] = (SCENE_PROP_SIZE_MIN + (maxPropSize - SCENE_PROP_SIZE_MIN) * NextRandomFloat(seed)) * 0.5f;
+        propHalfSize[1] = (SCENE_PROP_SIZE_MIN + (maxPropSize - SCENE_PROP_SIZE_MIN) * NextRandomFloat(seed)) * 0.5f;
+        propHalfSize[2] = (SCENE_PROP_SIZE_MIN + (maxPropSize - SCENE_PROP_SIZE_MIN) * NextRandomFloat(seed)) * 0.5f;
+
+        D3DXVECTOR3 propCenter(
+            center.x + (NextRandomFloat(seed) - 0.5f) * 2.0f * (halfSize[0] - propHalfSize[0]),
+            center.y - halfSize[1] + propHalfSize[1],
+            center.z + (NextRandomFloat(seed) - 0.5f) * 2.0f * (halfSize[2] - propHalfSize[2]));
+
+        start = count;
+
+        for (int j = 0; j < 4; ++j)
+        {
+            D3DXVECTOR3 normal(-wallNormals[j][0], -wallNormals[j][1], -wallNormals[j][2]);
+            float halfDepth = (j < 2) ? propHalfSize[0] : propHalfSize[2];
+            float halfWidth = (j < 2) ? propHalfSize[2] : propHalfSize[0];
+
+            AddSceneWall(pVertices, count, propCenter + normal * halfDepth, normal, halfWidth, propHalfSize[1], 0.0f, 0.0f);
+        }
+
+        AddSceneQuad(pVertices, count,
+                     D3DXVECTOR3(propCenter.x - propHalfSize[0], propCenter.y + propHalfSize[1], propCenter.z + propHalfSize[2]),
+                     D3DXVECTOR3(propHalfSize[0] * 2.0f, 0.0f, 0.0f), D3DXVECTOR3(0.0f, 0.0f, -propHalfSize[2] * 2.0f));
+
+        if (write)
+            InitSceneChunk(scene, room.firstChunk + chunks, room.firstVertex + start, count - start, ROOM_SURFACE_WALLS, index);
+
+        ++chunks;
+    }
+
+    if (!write)
+    {
+        room.vertexCount = count;
+        room.chunkCount = chunks;
+        return;
+    }
+
+    // Lights take the colors of the demo's lights, and stay still.
+
+    const int numColors = sizeof(g_lights) / sizeof(g_lights[0]);
+    float maxRadius = max(max(scene.cellSize[0], scene.cellSize[1]), scene.cellSize[2]) * 0.5f;
+
+    for (int i = 0; i < room.lightCount; ++i)
+    {
+        PointLight &light = scene.lights[room.firstLight + i];
+
+        light = g_lights[NextRandom(seed) % numColors];
+
+        for (int j = 0; j < 3; ++j)
+            light.pos[j] = room.center[j] + (NextRandomFloat(seed) - 0.5f) * (scene.cellSize[j] - LIGHT_OBJECT_RADIUS * 4.0f);
+
+        light.radius = maxRadius * (0.5f + 0.5f * NextRandomFloat(seed));
+        light.velocity = D3DXVECTOR3(0.0f, 0.0f, 0.0f);
+        memcpy(light.prevPos, light.pos, sizeof(light.pos));
+        memcpy(light.renderPos, light.pos, sizeof(light.pos));
+    }
+}
+
+void GenerateSceneRooms(void *pParam, int begin, int end)
+{
+    const SceneJob &job = *static_cast<const SceneJob*>(pParam);
+
+    for (int i = begin; i < end; ++i)
+        GenerateSceneRoom(*job.pScene, i, job.write);
+}
+
+D3DXHANDLE GetBlinnPhongTechnique(bool useAtlas)
+{
+    if (g_pBlinnPhongEffect == g_pBlinnPhongEffectSM30)
+    {
+        if (useAtlas)
+            return g_pBlinnPhongEffect->GetTechniqueByName("PerPixelPointLightingAtlas");
+        else
+            return g_pBlinnPhongEffect->GetTechniqueByName("PerPixelPointLighting");
+    }
+    else
+    {
+        if (g_enableMultipassLighting)
+            return g_pBlinnPhongEffect->GetTechniqueByName("PerPixelPointLightingMultiPass");
+        else
+            return g_pBlinnPhongEffect->GetTechniqueByName("PerPixelPointLightingSinglePass");
+    }
+}
+
+float GetElapsedTimeInSeconds()
+{
+    // Returns the elapsed time (in seconds) since the last time this function
+    // was called. This elaborate setup is to guard against large spikes in
+    // the time returned by QueryPerformanceCounter().
+
+    static const int MAX_SAMPLE_COUNT = 50;
+
+    static float frameTimes[MAX_SAMPLE_COUNT];
+    static float timeScale = 0.0f;
+    static float actualElapsedTimeSec = 0.0f;
+    static INT64 freq = 0;
+    static INT64 lastTime = 0;
+    static int sampleCount = 0;
+    static bool initialized = false;
+
+    INT64 time = 0;
+    float elapsedTimeSec = 0.0f;
+
+    if (!initialized)
+    {
+        initialized = true;
+        QueryPerformanceFrequency(reinterpret_cast<LARGE_INTEGER*>(&freq));
+        QueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&lastTime));
+        timeScale = 1.0f / freq;
+    }
+
+    QueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&time));
+    elapsedTimeSec = (time - lastTime) * timeScale;
+    lastTime = time;
+
+    if (fabsf(elapsedTimeSec - actualElapsedTimeSec) < 1.0f)
+    {
+        memmove(&frameTimes[1], frameTimes, sizeof(frameTimes) - sizeof(frameTimes[0]));
+        frameTimes[0] = elapsedTimeSec;
+
+        if (sampleCount < MAX_SAMPLE_COUNT)
+            ++sampleCount;
+    }
+
+    actualElapsedTimeSec = 0.0f;
+
+    for (int i = 0; i < sampleCount; ++i)
+        actualElapsedTimeSec += frameTimes[i];
+
+    if (sampleCount > 0)
+        actualElapsedTimeSec /= sampleCount;
+
+    return actualElapsedTimeSec;
+}
+
+double GetCompressedImagePSNR(const Image &image, const CompressedImage &compressed)
+{
+    // Peak signal to noise ratio of the top level of a compressed image
+    // against the top level of its source, over the red, green and blue
+    // channels.
+
+    DWORD decoded[16];
+    double squaredError = 0.0;
+    int blocksWide = (compressed.width + 3) / 4;
+    int blocksHigh = (compressed.height + 3) / 4;
+    int blockSize = (compressed.format == D3DFMT_DXT1) ? 8 : 16;
+
+    for (int by = 0; by < blocksHigh; ++by)
+    {
+        for (int bx = 0; bx < blocksWide; ++bx)
+        {
+            const BYTE *pBlock = compressed.pData + (by * blocksWide + bx) * blockSize;
+
+            if (compressed.format == FORMAT_BC7)
+                DecompressBlockBC7(pBlock, decoded);
+            else
+                DecompressBlockBC1(pBlock + blockSize - 8, compressed.format == D3DFMT_DXT5, decoded);
+
+            for (int y = 0; y < 4 && by * 4 + y < image.height; ++y)
+            {
+                for (int x = 0; x < 4 && bx * 4 + x < image.width; ++x)
+                {
+                    DWORD source = image.pPixels[(by * 4 + y) * image.width + bx * 4 + x];
+
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        int error = static_cast<int>((source >> (c * 8)) & 0xff) -
+                                    static_cast<int>((decoded[y * 4 + x] >> (c * 8)) & 0xff);
+
+                        squaredError += error * error;
+                    }
+                }
+            }
+        }
+    }
+
+    double meanSquaredError = squaredError / (3.0 * image.width * image.height);
+
+    if (meanSquaredError == 0.0)
+        return 99.99;
+
+    return 10.0 * log10(255.0 * 255.0 / meanSquaredError);
+}
+
+DWORD GetCompressedLevelSize(D3DFORMAT format, int width, int height)
+{
+    DWORD blocks = static_cast<DWORD>((width + 3) / 4) * ((height + 3) / 4);
+
+    return blocks * ((format == D3DFMT_DXT1) ? 8 : 16);
+}
+
+bool GetFileStamp(const char *pszFilename, ULONGLONG &size, ULONGLONG &time)
+{
+    // Gets a file's size and last write time without opening it.
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+
+    if (!GetFileAttributesEx(pszFilename, GetFileExInfoStandard, &data))
+        return false;
+
+    size = (static_cast<ULONGLONG>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    time = (static_cast<ULONGLONG>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+void GetFrustumPlanes(const D3DXMATRIX &viewProjection, D3DXPLANE *pPlanes)
+{
+    // Extracts the left, right, bottom, top, near and far planes of the view
+    // frustum from the view-projection matrix (Gribb and Hartmann). The
+    // planes are normalized and face into the frustum.
+
+    const D3DXMATRIX &m = viewProjection;
+
+    pPlanes[0] = D3DXPLANE(m._14 + m._11, m._24 + m._21, m._34 + m._31, m._44 + m._41);
+    pPlanes[1] = D3DXPLANE(m._14 - m._11, m._24 - m._21, m._34 - m._31, m._44 - m._41);
+    pPlanes[2] = D3DXPLANE(m._14 + m._12, m._24 + m._22, m._34 + m._32, m._44 + m._42);
+    pPlanes[3] = D3DXPLANE(m._14 - m._12, m._24 - m._22, m._34 - m._32, m._44 - m._42);
+    pPlanes[4] = D3DXPLANE(m._13, m._23, m._33, m._43);
+    pPlanes[5] = D3DXPLANE(m._14 - m._13, m._24 - m._23, m._34 - m._33, m._44 - m._43);
+
+    for (int i = 0; i < FRUSTUM_PLANES; ++i)
+        D3DXPlaneNormalize(&pPlanes[i], &pPlanes[i]);
+}
+
+float GetLightClusterImportance(const LightTreeNode &node, const float pos[3], const float normal[3],
+                                const float *pReflectances)
+{
+    // Bounds how much the cluster's lights can add to the point from the
+    // nearest point of their box: no more than their powers attenuated as
+    // if they were all there with the largest radius. Lights below the
+    // point's surface only add their ambient term, and the diffuse cosine
+    // is no more than the farthest the box reaches above the surface over
+    // its nearest distance. The specular term isn't scaled by the cosine,
+    // only cut off below the surface, so a highlight from a light at a
+    // grazing angle counts in full. Given a material's largest ambient,
+    // diffuse and specular reflectances, each term is scaled by its own,
+    // which makes the bound one on the sum of the lighting's color
+    // channels.
+
+    float distanceSq = 0.0f;
+    float facing = 0.0f;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        float gap = max(0.0f, max(node.boundsMin[c] - pos[c], pos[c] - node.boundsMax[c]));
+        float center = (node.boundsMin[c] + node.boundsMax[c]) * 0.5f - pos[c];
+
+        distanceSq += gap * gap;
+        facing += normal[c] * center + fabsf(normal[c]) * (node.boundsMax[c] - node.boundsMin[c]) * 0.5f;
+    }
+
+    if (distanceSq >= node.radius * node.radius)
+        return 0.0f;
+
+    float atten = 1.0f - distanceSq / (node.radius * node.radius);
+    float cosine = 0.0f;
+    float above = (facing > 0.0f) ? 1.0f : 0.0f;
+
+    if (facing > 0.0f)
+        cosine = (distanceSq > 0.0f) ? min(facing / sqrtf(distanceSq), 1.0f) : 1.0f;
+
+    static const float unweighted[3] = {1.0f, 1.0f, 1.0f};
+    const float *pWeights = pReflectances ? pReflectances : unweighted;
+
+    return atten * (node.ambientPower * pWeights[0] + cosine * node.diffusePower * pWeights[1] +
+                    above * node.specularPower * pWeights[2]);
+}
+
+int GetLightLod(float projectedRadius)
+{
+    // A sphere of n slices and stacks cuts up to r * (1 - cos(pi / n)) into
+    // its outline between segments.
+
+    if (projectedRadius < LIGHT_LOD_IMPOSTOR_RADIUS)
+        return LIGHT_LOD_IMPOSTOR;
+
+    for (int lod = LIGHT_LOD_SPHERES - 1; lod > 0; --lod)
+    {
+        if (projectedRadius * (1.0f - cosf(D3DX_PI / LIGHT_LOD_SEGMENTS[lod])) <= LIGHT_LOD_MAX_ERROR)
+            return lod;
+    }
+
+    return 0;
+}
+
+int GetLightLodTriangles(int lod)
+{
+    // D3DXCreateSphere() caps each pole with a fan and joins the stacks in
+    // between with quads.
+
+    if (lod == LIGHT_LOD_IMPOSTOR)
+        return 2;
+
+    return 2 * LIGHT_LOD_SEGMENTS[lod] * (LIGHT_LOD_SEGMENTS[lod] - 1);
+}
+
+int GetLightmapFace(const float normal[3])
+{
+    // Returns which of the directions +X, -X, +Y, -Y, +Z and -Z the normal
+    // is nearest, the same way the room's vertex shader does.
+
+    float x = fabsf(normal[0]);
+    float y = fabsf(normal[1]);
+    float z = fabsf(normal[2]);
+
+    if (x >= y && x >= z)
+        return (normal[0] > 0.0f) ? 0 : 1;
+    else if (y >= z)
+        return (normal[1] > 0.0f) ? 2 : 3;
+    else
+        return (normal[2] > 0.0f) ? 4 : 5;
+}
+
+void GetLightmapPlanes(const Lightmap &lightmap, float uPlanes[LIGHTMAP_FACES][4], float vPlanes[LIGHTMAP_FACES][4])
+{
+    // Gives the planes mapping a point on each chart's surface to its
+    // texture coordinates in the lightmap: u = dot(p, uPlane.xyz) + uPlane.w.
+
+    memset(uPlanes, 0, sizeof(float) * LIGHTMAP_FACES * 4);
+    memset(vPlanes, 0, sizeof(float) * LIGHTMAP_FACES * 4);
+
+    for (int i = 0; i < LIGHTMAP_FACES; ++i)
+    {
+        const LightmapChart &chart = lightmap.charts[i];
+
+        if (!chart.used)
+            continue;
+
+        uPlanes[i][chart.uAxis] = 1.0f / (lightmap.texelSize * lightmap.width);
+        uPlanes[i][3] = (chart.x + LIGHTMAP_PADDING - chart.origin[chart.uAxis] / lightmap.texelSize) / lightmap.width;
+        vPlanes[i][chart.vAxis] = 1.0f / (lightmap.texelSize * lightmap.height);
+        vPlanes[i][3] = (chart.y + LIGHTMAP_PADDING - chart.origin[chart.vAxis] / lightmap.texelSize) / lightmap.height;
+    }
+}
+
+void GetLightmapTexelPosition(const Lightmap &lightmap, const LightmapChart &chart, int x, int y, float pos[3])
+{
+    // Returns the point on the chart's surface under the texel's center,
+    // or the nearest point on the surface to it for texels in the border.
+
+    float u = (x - chart.x - LIGHTMAP_PADDING + 0.5f) * lightmap.texelSize;
+    float v = (y - chart.y - LIGHTMAP_PADDING + 0.5f) * lightmap.texelSize;
+
+    memcpy(pos, chart.origin, sizeof(float) * 3);
+    pos[chart.uAxis] += min(max(u, 0.0f), chart.size[0]);
+    pos[chart.vAxis] += min(max(v, 0.0f), chart.size[1]);
+}
+
+int GetMipFilterTaps(int dst, int srcSize, int dstSize, double weights[3])
+{
+    // Returns the first source texel covered by texel dst of the next mip
+    // level along one axis, and the weights of the texels it covers. Even
+    // sizes use a 2 tap box filter. Odd sizes 2n + 1 use a 3 tap polyphase
+    // box filter with weights (n - dst, n, dst + 1) / (2n + 1), so that every
+    // source texel contributes equally to the level below.
+
+    if (srcSize == 1)
+    {
+        weights[0] = 1.0;
+        weights[1] = weights[2] = 0.0;
+        return 0;
+    }
+
+    if ((srcSize & 1) == 0)
+    {
+        weights[0] = weights[1] = 0.5;
+        weights[2] = 0.0;
+        return dst * 2;
+    }
+
+    double scale = 1.0 / srcSize;
+
+    weights[0] = (dstSize - dst) * scale;
+    weights[1] = dstSize * scale;
+    weights[2] = (dst + 1) * scale;
+    return dst * 2;
+}
+
+int GetOctreeCell(const Octree &tree, const float boundsMin[3], const float boundsMax[3], int cell[3])
+{
+    // Returns the depth of the node an item with these bounds is stored in
+    // and sets cell to the node's cell at that depth. That is the deepest
+    // cell that is at least as big as the item and contains its center.
+    // Items whose centers are outside the root's cell are stored in the
+    // root.
+
+    float center[3];
+    float halfExtent = 0.0f;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        center[c] = (boundsMin[c] + boundsMax[c]) * 0.5f;
+        halfExtent = max(halfExtent, (boundsMax[c] - boundsMin[c]) * 0.5f);
+        cell[c] = 0;
+    }
+
+    for (int c = 0; c < 3; ++c)
+    {
+        if (!(fabsf(center[c] - tree.center[c]) <= tree.halfSize))
+            return 0;
+    }
+
+    int depth = 0;
+    float halfSize = tree.halfSize;
+
+    while (depth < OCTREE_MAX_DEPTH && halfSize * 0.5f >= halfExtent)
+    {
+        halfSize *= 0.5f;
+        ++depth;
+    }
+
+    int cells = 1 << depth;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        int i = static_cast<int>((center[c] - (tree.center[c] - tree.halfSize)) / (halfSize * 2.0f));
+
+        cell[c] = max(0, min(cells - 1, i));
+    }
+
+    return depth;
+}
+
+int GetProcessorCount()
+{
+    SYSTEM_INFO info = {0};
+
+    GetSystemInfo(&info);
+    return max(1, static_cast<int>(info.dwNumberOfProcessors));
+}
+
+float GetProjectedRadius(const D3DXMATRIX &viewProjection, const float pos[3], float radius,
+                         int viewportHeight)
+{
+    // Returns the radius in pixels of a sphere on screen. The view matrix
+    // only rotates and translates, so the length of the view-projection
+    // matrix's second column is the projection's y scale, and its fourth
+    // column gives the depth. A sphere the camera is in gets an infinite
+    // radius, and one entirely behind the camera a radius of 0.
+
+    float yScale = sqrtf(viewProjection._12 * viewProjection._12 +
+                         viewProjection._22 * viewProjection._22 +
+                         viewProjection._32 * viewProjection._32);
+    float depth = pos[0] * viewProjection._14 + pos[1] * viewProjection._24 +
+                  pos[2] * viewProjection._34 + viewProjection._44;
+
+    if (depth <= -radius)
+        return 0.0f;
+
+    if (depth <= radius)
+        return FLT_MAX;
+
+    return radius * yScale * 0.5f * viewportHeight / depth;
+}
+
+double GetRelativeError(const float *pColors, const float *pReference, int count, double *pSquares)
+{
+    // Returns how far count RGBA colors are from the reference ones, as
+    // the root of the sum of the squared differences over that of the
+    // squared reference, leaving out alpha. If pSquares is given, both
+    // sums are added to it, for the error over several calls.
+
+    double errorSq = 0.0;
+    double referenceSq = 0.0;
+
+    for (int i = 0; i < count * 4; ++i)
+    {
+        if ((i & 3) != 3)
+        {
+            errorSq += (pColors[i] - pReference[i]) * (pColors[i] - pReference[i]);
+            referenceSq += pReference[i] * pReference[i];
+        }
+    }
+
+    if (pSquares)
+    {
+        pSquares[0] += errorSq;
+        pSquares[1] += referenceSq;
+    }
+
+    return sqrt(errorSq / max(referenceSq, 1.0e-12));
+}
+
+const Material &GetRoomSurfaceMaterial(int surface)
+{
+    // The walls are dull; the ceiling and the floor have a specular
+    // highlight, as drawn by DrawRoom().
+
+    return (surface == ROOM_SURFACE_WALLS) ? g_dullMaterial : g_shinyMaterial;
+}
+
+void GetRoomTriangleSurfaces(int *pSurfaces)
+{
+    // Gives the ROOM_SURFACE_* of each of g_room's triangles. The surfaces
+    // keep g_room's triangle ranges in the room's index buffer.
+
+    RoomBatch batches[ROOM_MAX_BATCHES];
+
+    BuildRoomBatches(false, batches);
+
+    for (int surface = 0; surface < ROOM_SURFACE_COUNT; ++surface)
+    {
+        const RoomBatch &batch = batches[surface];
+
+        for (int i = 0; i < batch.primitiveCount; ++i)
+            pSurfaces[batch.firstIndex / 3 + i] = surface;
+    }
+}
+
+int GetRoomWallCoords(const D3DXVECTOR3 &origin, const D3DXVECTOR3 &direction, float &u, float &v)
+{
+    // Finds where a ray starting inside the room leaves it. If that is
+    // through a wall, returns which one (0 to 3) and the texture coordinate
+    // of a virtual texture spanning the wall: u runs along the wall and v
+    // down it, scaled by the same amount so that texels are square.
+    // Returns -1 for the ceiling and floor.
+
+    const float halfSizes[3] = {ROOM_SIZE_X_HALF, ROOM_SIZE_Y_HALF, ROOM_SIZE_Z_HALF};
+    float nearest = FLT_MAX;
+    int axis = -1;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if (direction[i] == 0.0f)
+            continue;
+
+        float t = ((direction[i] > 0.0f ? halfSizes[i] : -halfSizes[i]) - origin[i]) / direction[i];
+
+        if (t > 0.0f && t < nearest)
+        {
+            nearest = t;
+            axis = i;
+        }
+    }
+
+    if (axis < 0 || axis == 1)
+        return -1;
+
+    D3DXVECTOR3 point = origin + direction * nearest;
+    float width = (axis == 0) ? ROOM_SIZE_Z : ROOM_SIZE_X;
+
+    u = ((axis == 0) ? point.z + ROOM_SIZE_Z_HALF : point.x + ROOM_SIZE_X_HALF) / width;
+    v = (ROOM_SIZE_Y_HALF - point.y) / width;
+    return axis + ((direction[axis] > 0.0f) ? 2 : 0);
+}
+
+void GetSampleFootprint(const SoftwareTexture &texture, int filter, int maxAnisotropy,
+                        const float gradients[4], SampleFootprint &footprint)
+{
+    // Works out the mip levels and taps for a sample from the gradients
+    // du/dx, dv/dx, du/dy and dv/dy, the way Direct3D hardware does. The
+    // level of detail comes from the longer of the two pixel axes in texels,
+    // or for anisotropic filtering from the shorter one. In that case taps
+    // are spread along the longer axis, one per ratio of the two lengths, up
+    // to maxAnisotropy.
+
+    float lengthX = sqrtf(gradients[0] * gradients[0] * texture.width * texture.width +
+                          gradients[1] * gradients[1] * texture.height * texture.height);
+    float lengthY = sqrtf(gradients[2] * gradients[2] * texture.width * texture.width +
+                          gradients[3] * gradients[3] * texture.height * texture.height);
+    float major = max(lengthX, lengthY);
+    float minor = min(lengthX, lengthY);
+    float size = major;
+
+    footprint.taps = 1;
+    footprint.stepU = 0.0f;
+    footprint.stepV = 0.0f;
+
+    if (filter == TEXTURE_FILTER_ANISOTROPIC && major > 0.0f)
+    {
+        float ratio = (minor > 0.0f) ? major / minor : static_cast<float>(maxAnisotropy);
+
+        footprint.taps = min(max(static_cast<int>(ceilf(ratio - 0.01f)), 1), maxAnisotropy);
+        size = major / footprint.taps;
+
+        const float *pAxis = (lengthX >= lengthY) ? &gradients[0] : &gradients[2];
+
+        footprint.stepU = pAxis[0] / footprint.taps;
+        footprint.stepV = pAxis[1] / footprint.taps;
+    }
+
+    float lod = (size > 1.0f) ? log2f(size) : 0.0f;
+
+    lod = min(lod, static_cast<float>(texture.levels - 1));
+
+    if (filter == TEXTURE_FILTER_BILINEAR)
+    {
+        footprint.level0 = footprint.level1 = static_cast<int>(lod + 0.5f);
+        footprint.levelWeight = 0.0f;
+    }
+    else
+    {
+        footprint.level0 = static_cast<int>(lod);
+        footprint.level1 = min(footprint.level0 + 1, texture.levels - 1);
+        footprint.levelWeight = lod - footprint.level0;
+    }
+}
+
+int GetSceneOpenings(const Scene &scene, int index)
+{
+    // Returns the SCENE_DOOR_* bits of the openings a room makes toward its
+    // -X and -Z neighbors. In a grid every room opens toward both. In a maze
+    // each cell but the first opens toward just one, chosen at random,
+    // which makes a binary tree maze: every cell leads back to the first
+    // along exactly one path.
+
+    int openings = 0;
+
+    if (index % scene.roomsWide > 0)
+        openings |= SCENE_DOOR_NEG_X;
+
+    if (index >= scene.roomsWide)
+        openings |= SCENE_DOOR_NEG_Z;
+
+    if (scene.desc.layout == SCENE_LAYOUT_MAZE && openings == (SCENE_DOOR_NEG_X | SCENE_DOOR_NEG_Z))
+        openings = (GetSceneSeed(scene.desc, index, 1) & 0x10000) ? SCENE_DOOR_NEG_X : SCENE_DOOR_NEG_Z;
+
+    return openings;
+}
+
+unsigned int GetSceneSeed(const SceneDesc &desc, int index, int stream)
+{
+    // Returns a seed for one room's random choices. Hashing keeps the
+    // sequences of neighboring rooms unrelated.
+
+    unsigned int key[3] = {desc.seed, static_cast<unsigned int>(index), static_cast<unsigned int>(stream)};
+
+    return static_cast<unsigned int>(HashBytes(key, sizeof(key)));
+}
+
+void GetShadowFaceBounds(const ShadowLight &light, int face, float boundsMin[3], float boundsMax[3])
+{
+    // Bounds the part of the light's sphere a face of its cube map sees:
+    // the half of the sphere's box on the face's side of the light.
+
+    int axis = face / 2;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        boundsMin[c] = light.pos[c] - light.radius;
+        boundsMax[c] = light.pos[c] + light.radius;
+    }
+
+    if (face & 1)
+        boundsMax[axis] = light.pos[axis];
+    else
+        boundsMin[axis] = light.pos[axis];
+}
+
+size_t GetTexelIndex(const SoftwareTexture &texture, int level, int x, int y)
+{
+    // Index of texel (x, y) of a level, relative to pTexels.
+
+    int widthLog2 = max(0, texture.widthLog2 - level);
+
+    if (texture.layout == TEXTURE_LAYOUT_MORTON)
+        return texture.levelOffsets[level] + MortonIndex(x, y, widthLog2, max(0, texture.heightLog2 - level));
+
+    return texture.levelOffsets[level] + (static_cast<size_t>(y) << widthLog2) + x;
+}
+
+double GetTimeInSeconds()
+{
+    // Returns the current value of the high resolution performance counter
+    // in seconds. Used to measure the cost of individual parts of a frame.
+
+    static double timeScale = 0.0;
+
+    INT64 time = 0;
+
+    if (timeScale == 0.0)
+    {
+        INT64 freq = 0;
+
+        QueryPerformanceFrequency(reinterpret_cast<LARGE_INTEGER*>(&freq));
+        timeScale = 1.0 / freq;
+    }
+
+    QueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&time));
+    return time * timeScale;
+}
+
+float GetVertexCacheScore(int cachePosition, int remainingTriangles)
+{
+    // Tom Forsyth's vertex score. Vertices recently used score higher the
+    // closer they are to the front of the cache, except that the last
+    // triangle's 3 get a fixed score so strips aren't favored too strongly.
+    // Vertices with few triangles left score higher so that they are
+    // finished off rather than left behind. A vertex with no triangles left
+    // doesn't matter.
+
+    if (remainingTriangles == 0)
+        return -1.0f;
+
+    float score = 0.0f;
+
+    if (cachePosition >= 0)
+    {
+        if (cachePosition < 3)
+            score = 0.75f;
+        else
+            score = powf(1.0f - (cachePosition - 3) / static_cast<float>(VERTEX_CACHE_SCORE_SIZE - 3), 1.5f);
+    }
+
+    return score + 2.0f * powf(static_cast<float>(remainingTriangles), -0.5f);
+}
+
+void GetVertexCacheStats(const DWORD *pIndices, int indexCount, int vertexCount, int cacheSize,
+                         double &acmr, double &atvr)
+{
+    // Runs the indices through a FIFO post-transform cache of cacheSize
+    // entries, the kind most Direct3D 9 era hardware has. A vertex is in
+    // the cache if fewer than cacheSize misses have happened since it was
+    // last transformed.
+
+    std::vector<int> transformedAt(vertexCount, -cacheSize - 1);
+    int misses = 0;
+
+    for (int i = 0; i < indexCount; ++i)
+    {
+        int &time = transformedAt[pIndices[i]];
+
+        if (misses - time > cacheSize)
+            time = misses++;
+    }
+
+    acmr = misses / static_cast<double>(max(indexCount / 3, 1));
+    atvr = misses / static_cast<double>(max(vertexCount, 1));
+}
+
+void GetVertexQuantization(const Vertex *pVertices, int count, VertexQuantization &quantization)
+{
+    // Fits the packed position range to the vertices' bounding box. A flat
+    // axis keeps a unit scale so that packing doesn't divide by 0.
+
+    float minimum[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float maximum[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    for (int i = 0; i < count; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            minimum[c] = min(minimum[c], pVertices[i].pos[c]);
+            maximum[c] = max(maximum[c], pVertices[i].pos[c]);
+        }
+    }
+
+    for (int c = 0; c < 3; ++c)
+    {
+        if (count == 0)
+            minimum[c] = maximum[c] = 0.0f;
+
+        quantization.center[c] = (minimum[c] + maximum[c]) * 0.5f;
+        quantization.halfExtent[c] = (maximum[c] - minimum[c]) * 0.5f;
+
+        if (quantization.halfExtent[c] == 0.0f)
+            quantization.halfExtent[c] = 1.0f;
+    }
+}
+
+int GetVirtualPageIndex(const VirtualTexture &texture, int level, int x, int y)
+{
+    return texture.levelFirstPage[level] + y * texture.levelPagesWide[level] + x;
+}
+
+void GetVirtualPagesFromFeedback(VirtualTexture &texture, const std::vector<VirtualFeedbackSample> &samples,
+                                 std::vector<int> &pages)
+{
+    // Turns feedback samples into the list of distinct pages they need.
+
+    pages.clear();
+
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const VirtualFeedbackSample &sample = samples[i];
+        int width = max(1, texture.header.width >> sample.level);
+        int height = max(1, texture.header.height >> sample.level);
+        int pageX = min(static_cast<int>((sample.u - floorf(sample.u)) * width) / VIRTUAL_PAGE_SIZE,
+                        texture.levelPagesWide[sample.level] - 1);
+        int pageY = min(static_cast<int>((sample.v - floorf(sample.v)) * height) / VIRTUAL_PAGE_SIZE,
+                        texture.levelPagesHigh[sample.level] - 1);
+        int page = GetVirtualPageIndex(texture, sample.level, pageX, pageY);
+
+        if (!texture.pPageRequested[page])
+        {
+            texture.pPageRequested[page] = true;
+            pages.push_back(page);
+        }
+    }
+
+    for (size_t i = 0; i < pages.size(); ++i)
+        texture.pPageRequested[pages[i]] = false;
+}
+
+ULONGLONG HashBytes(const void *pData, size_t size)
+{
+    // 64-bit FNV-1a.
+
+    const BYTE *pBytes = static_cast<const BYTE*>(pData);
+    ULONGLONG hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ pBytes[i]) * 1099511628211ULL;
+
+    return hash;
+}
+
+bool Init()
+{
+    if (!InitD3D())
+    {
+        Log("Direct3D initialization failed!");
+        return false;
+    }
+
+    try
+    {
+        InitApp();
+        return true;
+    }
+    catch (const std::exception &e)
+    {
+        std::ostringstream msg;
+
+        msg << "Application initialization failed!" << std::endl << std::endl;
+        msg << e.what();
+
+        Log(msg.str().c_str());
+        return false;
+    }
+}
+
+void InitApp()
+{
+    AllocationZone zone("InitApp");
+
+    if (!g_frameArena.create(FRAME_ARENA_SIZE, FRAME_ARENA_MAX_BUFFERS))
+        throw std::runtime_error("Failed to create the frame arena.");
+
+    // The main thread helps out whenever it waits for the workers, so one
+    // worker per remaining processor keeps every processor busy.
+
+    int workerThreads = min(GetProcessorCount() - 1, WORKER_MAX_THREADS);
+
+    if (!g_ioPool.create(g_serialLoading ? 0 : IO_THREADS) ||
+        !g_workerPool.create(g_serialLoading ? 0 : max(1, workerThreads)))
+        throw std::runtime_error("Failed to create worker threads.");
+
+    // Verify that shader model 2.0 or higher is supported.
+
+    DWORD dwVSVersion = g_caps.VertexShaderVersion;
+    DWORD dwPSVersion = g_caps.PixelShaderVersion;
+
+    if (dwVSVersion >= D3DVS_VERSION(3,0) && dwPSVersion >= D3DPS_VERSION(3,0))
+        g_supportsShaderModel30 = true;
+    else if (dwVSVersion >= D3DVS_VERSION(2,0) && dwPSVersion >= D3DPS_VERSION(2,0))
+        g_supportsShaderModel30 = false;
+    else
+        throw std::runtime_error("Shader model 2.0 or higher is required.");
+
+    // Start reading, decoding and mipmapping the textures, and compiling the
+    // shaders, in the background. The rest of the initialization below runs
+    // on this thread in the meantime.
+
+    static const char *textures[] =
+    {
+        "Content/Textures/brick_color_map.jpg",
+        "Content/Textures/wood_color_map.jpg",
+        "Content/Textures/stone_color_map.jpg"
+    };
+
+    static const char *shaders[] =
+    {
+        "Content/Shaders/ambient.fx",
+        "Content/Shaders/blinn_phong_sm20.fx",
+        "Content/Shaders/blinn_phong_sm30.fx"
+    };
+
+    // The jobs write into these arrays, so they must outlive an exception
+    // thrown below. CleanupApp() waits for any jobs still running.
+
+    static TextureLoad loads[sizeof(textures) / sizeof(textures[0])];
+    static ShaderCompile compiles[sizeof(shaders) / sizeof(shaders[0])];
+
+    const int numTextures = sizeof(textures) / sizeof(textures[0]);
+    const int numShaders = g_supportsShaderModel30 ? 3 : 2;
+    double loadStartTime = GetTimeInSeconds();
+
+    // The texture cache holds DXT1/DXT5 textures, which nearly all shader
+    // model 2.0 hardware supports.
+
+    if (FAILED(g_pDirect3D->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL,
+            g_params.BackBufferFormat, 0, D3DRTYPE_TEXTURE, D3DFMT_DXT1)) ||
+        FAILED(g_pDirect3D->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL,
+            g_params.BackBufferFormat, 0, D3DRTYPE_TEXTURE, D3DFMT_DXT5)))
+        g_useTextureCache = false;
+
+    for (int i = 0; i < numTextures; ++i)
+        StartTextureLoad(loads[i], textures[i], g_useTextureCache, g_ioPool, g_workerPool);
+
+    for (int i = 0; i < numShaders; ++i)
+        StartShaderCompile(compiles[i], shaders[i], g_workerPool);
+
+    // Setup fonts.
+
+    if (!InitFont("Arial", 10, g_pFont))
+        throw std::runtime_error("Failed to create font.");
+
+    if (!CreateGlyphAtlas("Arial", 10, g_glyphAtlas))
+        throw std::runtime_error("Failed to create glyph atlas.");
+
+    if (!CreateGlyphAtlasTexture(g_glyphAtlas, g_pGlyphAtlasTexture))
+        throw std::runtime_error("Failed to create glyph atlas texture.");
+
+    if (!CreateNullTexture(2, 2, g_pNullTexture))
+        throw std::runtime_error("Failed to create null texture.");
+
+    // Create geometry for the room.
+
+    InitRoom();
+    InitRoomPackedVertices();
+    InitModel();
+    InitScene();
+
+    // Create geometry for the light.
+
+    InitLightMeshes();
+
+    // Wait for the background work to finish. Reads have to be waited for
+    // first because each one goes on to queue a decode job.
+
+    g_ioPool.wait();
+    g_workerPool.wait();
+
+    // Load shaders.
+
+    if (!LoadShader(compiles[0], g_pAmbientEffect))
+        throw std::runtime_error("Failed to load shader: ambient.fx.");
+
+    if (!LoadShader(compiles[1], g_pBlinnPhongEffectSM20))
+        throw std::runtime_error("Failed to load shader: blinn_phong_sm20.fx.");
+
+    if (g_supportsShaderModel30)
+    {
+        if (!LoadShader(compiles[2], g_pBlinnPhongEffectSM30))
+            throw std::runtime_error("Failed to load shader: blinn_phong_sm30.fx.");
+
+        g_pBlinnPhongEffect = g_pBlinnPhongEffectSM30;
+        g_numLights = MAX_LIGHTS_SM30;
+    }
+    else
+    {
+        g_pBlinnPhongEffect = g_pBlinnPhongEffectSM20;
+        g_numLights = MAX_LIGHTS_SM20;
+    }
+    
+    // Upload the textures.
+
+    LPDIRECT3DTEXTURE9 *ppTextures[] =
+    {
+        &g_pWallColorTexture, &g_pCeilingColorTexture, &g_pFloorColorTexture
+    };
+
+    g_texturesFromCache = 0;
+
+    for (int i = 0; i < numTextures; ++i)
+    {
+        bool uploaded = false;
+
+        if (loads[i].succeeded)
+        {
+            if (loads[i].compressed.levels > 0)
+                uploaded = CreateTextureFromCompressedImage(loads[i].compressed, *ppTextures[i]);
+            else
+                uploaded = CreateTextureFromImage(loads[i].image, *ppTextures[i]);
+        }
+
+        if (loads[i].fromCache)
+            ++g_texturesFromCache;
+
+        DestroyImage(loads[i].image);
+        DestroyCompressedImage(loads[i].compressed);
+
+        if (!uploaded)
+            throw std::runtime_error(std::string("Failed to load texture: ") + textures[i]);
+    }
+
+    InitRoomAtlas();
+    InitLightmap();
+
+    g_assetLoadTimeMs = static_cast<float>((GetTimeInSeconds() - loadStartTime) * 1000.0);
+
+    // Seed the random number generator. A fixed seed given on the command
+    // line makes the light trajectories identical between runs.
+
+    if (!g_fixedRandomSeed)
+        g_randomSeed = GetTickCount();
+
+    srand(g_randomSeed);
+
+    // Initialize the point lights in the scene.
+
+    for (int i = 0; i < g_numLights; ++i)
+        g_lights[i].init();
+}
+
+bool InitD3D()
+{
+    HRESULT hr = 0;
+    D3DDISPLAYMODE desktop = {0};
+
+    g_pDirect3D = Direct3DCreate9(D3D_SDK_VERSION);
+
+    if (!g_pDirect3D)
+        return false;
+
+    // Just use the current desktop display mode.
+    hr = g_pDirect3D->GetAdapterDisplayMode(D3DADAPTER_DEFAULT, &desktop);
+
+    if (FAILED(hr))
+    {
+        g_pDirect3D->Release();
+        g_pDirect3D = 0;
+        return false;
+    }
+
+    // Setup Direct3D for windowed rendering.
+    g_params.BackBufferWidth = 0;
+    g_params.BackBufferHeight = 0;
+    g_params.BackBufferFormat = desktop.Format;
+    g_params.BackBufferCount = 1;
+    g_params.hDeviceWindow = g_hWnd;
+    g_params.Windowed = TRUE;
+    g_params.EnableAutoDepthStencil = TRUE;
+    g_params.AutoDepthStencilFormat = D3DFMT_D24S8;
+    g_params.Flags = D3DPRESENTFLAG_DISCARD_DEPTHSTENCIL;
+    g_params.FullScreen_RefreshRateInHz = 0;
+
+    if (g_enableVerticalSync)
+        g_params.PresentationInterval = D3DPRESENT_INTERVAL_DEFAULT;
+    else
+        g_params.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
+
+    // Swap effect must be D3DSWAPEFFECT_DISCARD for multi-sampling support.
+    g_params.SwapEffect = D3DSWAPEFFECT_DISCARD;
+
+    // Select the highest quality multi-sample anti-aliasing (MSAA) mode.
+    ChooseBestMSAAMode(g_params.BackBufferFormat, g_params.AutoDepthStencilFormat,
+        g_params.Windowed, g_params.MultiSampleType, g_params.MultiSampleQuality,
+        g_msaaSamples);
+
+    // Most modern video cards should have no problems creating pure devices.
+    // Note that by creating a pure device we lose the ability to debug vertex
+    // and pixel shaders.
+    hr = g_pDirect3D->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, g_hWnd,
+            D3DCREATE_HARDWARE_VERTEXPROCESSING | D3DCREATE_PUREDEVICE,
+            &g_params, &g_pDevice);
+
+    if (FAILED(hr))
+    {
+        // Fall back to software vertex processing for less capable hardware.
+        // Note that in order to debug vertex shaders we must use a software
+        // vertex processing device.
+        hr = g_pDirect3D->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, g_hWnd,
+                D3DCREATE_SOFTWARE_VERTEXPROCESSING, &g_params, &g_pDevice);
+    }
+
+    if (FAILED(hr))
+    {
+        g_pDirect3D->Release();
+        g_pDirect3D = 0;
+        return false;
+    }   
+
+    if (SUCCEEDED(g_pDevice->GetDeviceCaps(&g_caps)))
+    {
+        // Prefer anisotropic texture filtering if it's supported.
+        if (g_caps.RasterCaps & D3DPRASTERCAPS_ANISOTROPY)
+            g_maxAnisotrophy = g_caps.MaxAnisotropy;
+        else
+            g_maxAnisotrophy = 1;
+    }
+
+    return true;
+}
+
+bool InitFont(const char *pszFont, int ptSize, LPD3DXFONT &pFont)
+{
+    static DWORD dwQuality = 0;
+
+    // Prefer ClearType font quality if available.
+
+    if (!dwQuality)
+    {
+        DWORD dwVersion = GetVersion();
+        DWORD dwMajorVersion = static_cast<DWORD>((LOBYTE(LOWORD(dwVersion))));
+        DWORD dwMinorVersion = static_cast<DWORD>((HIBYTE(LOWORD(dwVersion))));
+
+        // Windows XP and higher will support ClearType quality fonts.
+        if (dwMajorVersion >= 6 || (dwMajorVersion == 5 && dwMinorVersion == 1))
+            dwQuality = CLEARTYPE_QUALITY;
+        else
+            dwQuality = ANTIALIASED_QUALITY;
+    }
+
+    int logPixelsY = 0;
+
+    // Convert from font point size to pixel size.
+
+    if (HDC hDC = GetDC((0)))
+    {
+        logPixelsY = GetDeviceCaps(hDC, LOGPIXELSY);
+        ReleaseDC(0, hDC);
+    }
+
+    int fontCharHeight = -ptSize * logPixelsY / 72;
+
+    // Now create the font. Prefer anti-aliased text.
+
+    HRESULT hr = D3DXCreateFont(
+        g_pDevice,
+        fontCharHeight,                 // height
+        0,                              // width
+        FW_BOLD,                        // weight
+        1,                              // mipmap levels
+        FALSE,                          // italic
+        DEFAULT_CHARSET,                // char set
+        OUT_DEFAULT_PRECIS,             // output precision
+        dwQuality,                      // quality
+        DEFAULT_PITCH | FF_DONTCARE,    // pitch and family
+        pszFont,                        // font name
+        &pFont);
+
+    return SUCCEEDED(hr) ? true : false;
+}
+
+void InitLightMeshes()
+{
+    static const float corners[4][2] =
+    {
+        {-1.0f, -1.0f}, {-1.0f, 1.0f}, {1.0f, -1.0f}, {1.0f, 1.0f}
+    };
+
+    for (int i = 0; i < LIGHT_LOD_SPHERES; ++i)
+    {
+        if (FAILED(D3DXCreateSphere(g_pDevice, LIGHT_OBJECT_RADIUS,
+                LIGHT_LOD_SEGMENTS[i], LIGHT_LOD_SEGMENTS[i], &g_pLightMeshes[i], 0)))
+            throw std::runtime_error("Failed to create the point light mesh.");
+    }
+
+    // The impostor is a quad from (-1, -1) to (1, 1) that the vertex shader
+    // turns to face the camera.
+
+    void *pVertices = 0;
+
+    if (FAILED(g_pDevice->CreateVertexDeclaration(g_lightImpostorVertexElements, &g_pLightImpostorVertexDecl)) ||
+        FAILED(g_pDevice->CreateVertexBuffer(sizeof(corners), D3DUSAGE_WRITEONLY, 0,
+            D3DPOOL_MANAGED, &g_pLightImpostorVertexBuffer, 0)) ||
+        FAILED(g_pLightImpostorVertexBuffer->Lock(0, 0, &pVertices, 0)))
+        throw std::runtime_error("Failed to create the point light impostor.");
+
+    memcpy(pVertices, corners, sizeof(corners));
+    g_pLightImpostorVertexBuffer->Unlock();
+}
+
+void InitLightmap()
+{
+    // Lays out the room's lightmap, creates the texture it is copied to and
+    // points the shader model 3.0 effect at both. The lightmap is baked
+    // once the lights stop moving, see UpdateLightmap(). The model, if
+    // there is one, casts shadows into it. Needs 16-bit float textures that
+    // can be filtered.
+
+    if (!g_pBlinnPhongEffectSM30 ||
+        FAILED(g_pDirect3D->CheckDeviceFormat(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, g_params.BackBufferFormat,
+            D3DUSAGE_QUERY_FILTER, D3DRTYPE_TEXTURE, D3DFMT_A16B16G16R16F)))
+        return;
+
+    const int roomTriangles = sizeof(g_room) / sizeof(g_room[0]) / 3;
+    int surfaces[roomTriangles];
+
+    GetRoomTriangleSurfaces(surfaces);
+
+    if (!CreateLightmap(g_room, surfaces, roomTriangles, LIGHTMAP_TEXEL_SIZE, g_lightmap))
+        throw std::runtime_error("Failed to lay out room lightmap.");
+
+    if (FAILED(g_pDevice->CreateTexture(g_lightmap.width, g_lightmap.height, 1, 0, D3DFMT_A16B16G16R16F,
+            D3DPOOL_MANAGED, &g_pLightmapTexture, 0)))
+        throw std::runtime_error("Failed to create room lightmap texture.");
+
+    float uPlanes[LIGHTMAP_FACES][4];
+    float vPlanes[LIGHTMAP_FACES][4];
+
+    GetLightmapPlanes(g_lightmap, uPlanes, vPlanes);
+    g_pBlinnPhongEffectSM30->SetVectorArray("lightmapU", reinterpret_cast<const D3DXVECTOR4*>(uPlanes), LIGHTMAP_FACES);
+    g_pBlinnPhongEffectSM30->SetVectorArray("lightmapV", reinterpret_cast<const D3DXVECTOR4*>(vPlanes), LIGHTMAP_FACES);
+    g_pBlinnPhongEffectSM30->SetTexture("lightmapTexture", g_pLightmapTexture);
+
+    RoomBatch batches[ROOM_MAX_BATCHES];
+
+    BuildRoomBatches(false, batches);
+
+    for (int i = 0; i < ROOM_SURFACE_COUNT; ++i)
+        g_lightmapBake.pMaterials[i] = batches[i].pMaterial;
+
+    g_lightmapBake.pLightmap = &g_lightmap;
+    memcpy(g_lightmapBake.ambient, g_sceneAmbient, sizeof(g_lightmapBake.ambient));
+
+    if (!g_modelTriangles.empty())
+    {
+        g_lightmapBake.pOccluders = &g_modelOctree;
+        g_lightmapBake.pOccluderTriangles = &g_modelTriangles[0];
+    }
+}
+
+void InitModel()
+{
+    // Loads the model given on the command line, if any, scales it so that
+    // its largest extent is MODEL_FIT_SIZE and stands it on the middle of the
+    // floor. Models with more than 64K vertices need 32-bit indices.
+
+    if (g_modelFilename.empty())
+        return;
+
+    CookedMesh mesh = {};
+    double startTime = GetTimeInSeconds();
+
+    if (!LoadModel(g_modelFilename.c_str(), g_workerPool, g_useTextureCache, mesh, g_modelFromCache) ||
+        mesh.indexCount == 0)
+    {
+        DestroyCookedMesh(mesh);
+        throw std::runtime_error("Failed to load model: " + g_modelFilename + ".");
+    }
+
+    bool use32BitIndices = mesh.vertexCount > 0x10000;
+
+    if ((use32BitIndices && g_caps.MaxVertexIndex <= 0xffff) || mesh.indexCount / 3 > g_caps.MaxPrimitiveCount)
+    {
+        DestroyCookedMesh(mesh);
+        throw std::runtime_error("Model is too large for this device: " + g_modelFilename + ".");
+    }
+
+    float extent = 0.0f;
+
+    for (int c = 0; c < 3; ++c)
+        extent = max(extent, mesh.boundsMax[c] - mesh.boundsMin[c]);
+
+    float scale = (extent > 0.0f) ? MODEL_FIT_SIZE / extent : 1.0f;
+    float offset[3] =
+    {
+        -(mesh.boundsMin[0] + mesh.boundsMax[0]) * 0.5f * scale,
+        -mesh.boundsMin[1] * scale - ROOM_SIZE_Y_HALF,
+        -(mesh.boundsMin[2] + mesh.boundsMax[2]) * 0.5f * scale
+    };
+
+    Vertex *pVertices = 0;
+    void *pIndices = 0;
+    bool succeeded =
+        SUCCEEDED(g_pDevice->CreateVertexBuffer(sizeof(Vertex) * mesh.vertexCount, D3DUSAGE_WRITEONLY, 0,
+            D3DPOOL_MANAGED, &g_pModelVertexBuffer, 0)) &&
+        SUCCEEDED(g_pDevice->CreateIndexBuffer((use32BitIndices ? sizeof(DWORD) : sizeof(WORD)) * mesh.indexCount,
+            D3DUSAGE_WRITEONLY, use32BitIndices ? D3DFMT_INDEX32 : D3DFMT_INDEX16,
+            D3DPOOL_MANAGED, &g_pModelIndexBuffer, 0)) &&
+        SUCCEEDED(g_pModelVertexBuffer->Lock(0, 0, reinterpret_cast<void**>(&pVertices), 0));
+
+    if (succeeded)
+    {
+        for (DWORD i = 0; i < mesh.vertexCount; ++i)
+        {
+            pVertices[i] = mesh.pVertices[i];
+
+            for (int c = 0; c < 3; ++c)
+                pVertices[i].pos[c] = mesh.pVertices[i].pos[c] * scale + offset[c];
+        }
+
+        g_pModelVertexBuffer->Unlock();
+        succeeded = SUCCEEDED(g_pModelIndexBuffer->Lock(0, 0, &pIndices, 0));
+    }
+
+    if (succeeded)
+    {
+        if (use32BitIndices)
+        {
+            memcpy(pIndices, mesh.pIndices, sizeof(DWORD) * mesh.indexCount);
+        }
+        else
+        {
+            for (DWORD i = 0; i < mesh.indexCount; ++i)
+                static_cast<WORD*>(pIndices)[i] = static_cast<WORD>(mesh.pIndices[i]);
+        }
+
+        g_pModelIndexBuffer->Unlock();
+
+        // The model's triangles are kept in an octree so that the lightmap
+        // bake can trace shadow rays against them.
+
+        g_modelTriangles.resize(mesh.indexCount);
+
+        for (DWORD i = 0; i < mesh.indexCount; ++i)
+        {
+            const Vertex &vertex = mesh.pVertices[mesh.pIndices[i]];
+
+            for (int c = 0; c < 3; ++c)
+                g_modelTriangles[i][c] = vertex.pos[c] * scale + offset[c];
+        }
+
+        BuildTriangleOctree(&g_modelTriangles[0], mesh.indexCount / 3, g_modelOctree);
+    }
+
+    g_modelVertexCount = mesh.vertexCount;
+    g_modelTriangleCount = mesh.indexCount / 3;
+    g_modelLoadTimeMs = static_cast<float>((GetTimeInSeconds() - startTime) * 1000.0);
+    DestroyCookedMesh(mesh);
+
+    if (!succeeded)
+        throw std::runtime_error("Failed to create vertex and index buffers for model.");
+}
+
+void InitOctree(Octree &tree, const float boundsMin[3], const float boundsMax[3])
+{
+    // Empties the tree and makes its root the cube around the bounds.
+
+    int rootCell[3] = {0, 0, 0};
+    float extent = 0.0f;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        tree.center[c] = (boundsMin[c] + boundsMax[c]) * 0.5f;
+        extent = max(extent, boundsMax[c] - boundsMin[c]);
+    }
+
+    tree.halfSize = max(extent * 0.5f, 1.0f);
+    tree.freeNode = -1;
+    tree.freeItem = -1;
+    tree.items.clear();
+    tree.nodes.resize(1);
+    InitOctreeNode(tree, 0, rootCell, -1, tree.nodes[0]);
+}
+
+void InitOctreeNode(const Octree &tree, int depth, const int cell[3], int parent, OctreeNode &node)
+{
+    float size = tree.halfSize * 2.0f / (1 << depth);
+
+    for (int c = 0; c < 3; ++c)
+    {
+        node.center[c] = tree.center[c] - tree.halfSize + (cell[c] + 0.5f) * size;
+        node.cell[c] = cell[c];
+    }
+
+    for (int c = 0; c < 8; ++c)
+        node.children[c] = -1;
+
+    node.halfSize = size * 0.5f;
+    node.depth = depth;
+    node.parent = parent;
+    node.firstItem = -1;
+    node.itemCount = 0;
+    node.lastCulledPlane = 0;
+}
+
+void InitRoom()
+{
+    CreateRoomMesh(g_roomMesh);
+
+    UINT vertexCount = static_cast<UINT>(g_roomMesh.vertices.size());
+    UINT indexCount = static_cast<UINT>(g_roomMesh.indices.size());
+
+    if (FAILED(g_pDevice->CreateVertexDeclaration(g_roomVertexElements, &g_pRoomVertexDecl)))
+        throw std::runtime_error("Failed to create vertex declaration for room.");
+
+    if (FAILED(g_pDevice->CreateVertexBuffer(sizeof(Vertex) * vertexCount, 0, 0,
+            D3DPOOL_MANAGED, &g_pRoomVertexBuffer, 0)))
+        throw std::runtime_error("Failed to create vertex buffer for room.");
+
+    if (FAILED(g_pDevice->CreateIndexBuffer(sizeof(WORD) * indexCount, 0, D3DFMT_INDEX16,
+            D3DPOOL_MANAGED, &g_pRoomIndexBuffer, 0)))
+        throw std::runtime_error("Failed to create index buffer for room.");
+
+    Vertex *pVertices = 0;
+    WORD *pIndices = 0;
+
+    if (FAILED(g_pRoomVertexBuffer->Lock(0, 0, reinterpret_cast<void**>(&pVertices), 0)))
+        throw std::runtime_error("Failed to lock room vertex buffer.");
+
+    memcpy(pVertices, &g_roomMesh.vertices[0], sizeof(Vertex) * vertexCount);
+    g_pRoomVertexBuffer->Unlock();
+
+    if (FAILED(g_pRoomIndexBuffer->Lock(0, 0, reinterpret_cast<void**>(&pIndices), 0)))
+        throw std::runtime_error("Failed to lock room index buffer.");
+
+    for (UINT i = 0; i < indexCount; ++i)
+        pIndices[i] = static_cast<WORD>(g_roomMesh.indices[i]);
+
+    g_pRoomIndexBuffer->Unlock();
+}
+
+void InitRoomAtlas()
+{
+    // Packs the wall, ceiling and floor color maps into one atlas so that
+    // the room can be drawn in one call. The atlas technique needs shader
+    // model 3.0 for tex2Dgrad() and the material table lookup, and the
+    // atlas isn't a power of 2 in size. If any of that is missing, or the
+    // atlas can't be built, the room is drawn one surface at a time.
+
+    if (!g_supportsShaderModel30 || (g_caps.TextureCaps & D3DPTEXTURECAPS_POW2))
+        return;
+
+    IDirect3DTexture9 *pTextures[ROOM_SURFACE_COUNT];
+    Image tiles[ROOM_SURFACE_COUNT] = {};
+    Image atlas = {0};
+    bool succeeded = true;
+
+    pTextures[ROOM_SURFACE_WALLS] = g_pWallColorTexture;
+    pTextures[ROOM_SURFACE_CEILING] = g_pCeilingColorTexture;
+    pTextures[ROOM_SURFACE_FLOOR] = g_pFloorColorTexture;
+
+    for (int i = 0; i < ROOM_SURFACE_COUNT && succeeded; ++i)
+        succeeded = CreateImageFromTexture(pTextures[i], tiles[i]);
+
+    if (succeeded)
+    {
+        succeeded = CreateRoomAtlasImage(tiles, g_workerPool, atlas, g_roomAtlasRects) &&
+                    CreateTextureFromImage(atlas, g_pRoomAtlasTexture);
+    }
+
+    for (int i = 0; i < ROOM_SURFACE_COUNT; ++i)
+        DestroyImage(tiles[i]);
+
+    DestroyImage(atlas);
+
+    if (!succeeded)
+        return;
+
+    // Second vertex stream: the walls use the dull material (0) and the
+    // ceiling and floor the shiny one (1).
+
+    RoomAtlasVertex *pVertices = 0;
+
+    if (FAILED(g_pDevice->CreateVertexDeclaration(g_roomAtlasVertexElements, &g_pRoomAtlasVertexDecl)) ||
+        FAILED(g_pDevice->CreateVertexBuffer(sizeof(RoomAtlasVertex) * static_cast<UINT>(g_roomMesh.vertices.size()), 0, 0,
+            D3DPOOL_MANAGED, &g_pRoomAtlasVertexBuffer, 0)) ||
+        FAILED(g_pRoomAtlasVertexBuffer->Lock(0, 0, reinterpret_cast<void**>(&pVertices), 0)))
+    {
+        SAFE_RELEASE(g_pRoomAtlasTexture);
+        SAFE_RELEASE(g_pRoomAtlasVertexBuffer);
+        SAFE_RELEASE(g_pRoomAtlasVertexDecl);
+        return;
+    }
+
+    // The surfaces don't share vertices, so each vertex takes the values of
+    // the surface whose index range refers to it.
+
+    for (size_t i = 0; i < g_roomMesh.indices.size(); ++i)
+    {
+        int surface = (i < 24) ? ROOM_SURFACE_WALLS : ((i < 30) ? ROOM_SURFACE_CEILING : ROOM_SURFACE_FLOOR);
+        RoomAtlasVertex &vertex = pVertices[g_roomMesh.indices[i]];
+
+        memcpy(vertex.atlasRect, g_roomAtlasRects[surface], sizeof(vertex.atlasRect));
+        vertex.material = (surface == ROOM_SURFACE_WALLS) ? 0.0f : 1.0f;
+    }
+
+    g_pRoomAtlasVertexBuffer->Unlock();
+
+    // The material table doesn't change, so it's only set once.
+
+    const Material *pMaterials[] = {&g_dullMaterial, &g_shinyMaterial};
+    D3DXHANDLE hMaterials = g_pBlinnPhongEffectSM30->GetParameterByName(0, "materials");
+
+    for (int i = 0; i < sizeof(pMaterials) / sizeof(pMaterials[0]); ++i)
+    {
+        D3DXHANDLE hMaterial = g_pBlinnPhongEffectSM30->GetParameterElement(hMaterials, i);
+        const Material &material = *pMaterials[i];
+
+        g_pBlinnPhongEffectSM30->SetValue(g_pBlinnPhongEffectSM30->GetParameterByName(hMaterial, "ambient"), material.ambient, sizeof(material.ambient));
+        g_pBlinnPhongEffectSM30->SetValue(g_pBlinnPhongEffectSM30->GetParameterByName(hMaterial, "diffuse"), material.diffuse, sizeof(material.diffuse));
+        g_pBlinnPhongEffectSM30->SetValue(g_pBlinnPhongEffectSM30->GetParameterByName(hMaterial, "emissive"), material.emissive, sizeof(material.emissive));
+        g_pBlinnPhongEffectSM30->SetValue(g_pBlinnPhongEffectSM30->GetParameterByName(hMaterial, "specular"), material.specular, sizeof(material.specular));
+        g_pBlinnPhongEffectSM30->SetFloat(g_pBlinnPhongEffectSM30->GetParameterByName(hMaterial, "shininess"), material.shininess);
+    }
+}
+
+void InitRoomPackedVertices()
+{
+    // Creates a second, packed copy of the room's vertex buffer. It needs
+    // D3DDECLTYPE_SHORT2N, SHORT4N and FLOAT16_2 support; without it, or if
+    // anything fails, the room is always drawn from full precision vertices.
+
+    const DWORD declTypes = D3DDTCAPS_SHORT2N | D3DDTCAPS_SHORT4N | D3DDTCAPS_FLOAT16_2;
+
+    if ((g_caps.DeclTypes & declTypes) != declTypes)
+        return;
+
+    UINT vertexCount = static_cast<UINT>(g_roomMesh.vertices.size());
+    PackedVertex *pVertices = 0;
+
+    GetVertexQuantization(&g_roomMesh.vertices[0], vertexCount, g_roomQuantization);
+
+    if (FAILED(g_pDevice->CreateVertexDeclaration(g_roomPackedVertexElements, &g_pRoomPackedVertexDecl)) ||
+        FAILED(g_pDevice->CreateVertexDeclaration(g_roomPackedAtlasVertexElements, &g_pRoomPackedAtlasVertexDecl)) ||
+        FAILED(g_pDevice->CreateVertexBuffer(sizeof(PackedVertex) * vertexCount, 0, 0,
+            D3DPOOL_MANAGED, &g_pRoomPackedVertexBuffer, 0)) ||
+        FAILED(g_pRoomPackedVertexBuffer->Lock(0, 0, reinterpret_cast<void**>(&pVertices), 0)))
+    {
+        SAFE_RELEASE(g_pRoomPackedVertexBuffer);
+        SAFE_RELEASE(g_pRoomPackedAtlasVertexDecl);
+        SAFE_RELEASE(g_pRoomPackedVertexDecl);
+        return;
+    }
+
+    PackVertices(&g_roomMesh.vertices[0], vertexCount, g_roomQuantization, pVertices);
+    g_pRoomPackedVertexBuffer->Unlock();
+}
+
+void InitScene()
+{
+    // Generates the scene given on the command line, if any, builds an
+    // octree over its chunks, copies its walls out as occluders and uploads
+    // its vertices. The scene is then drawn instead of the room. Only the
+    // chunks and occluders are needed to cull it, so the scene's copy of
+    // the vertices is freed.
+
+    if (g_sceneDesc.rooms <= 0)
+        return;
+
+    if (!GenerateScene(g_sceneDesc, g_workerPool, g_scene))
+        throw std::runtime_error("Failed to generate scene.");
+
+    BuildSceneOctree(g_scene, g_workerPool, g_sceneOctree);
+    CreateSceneOccluders(g_scene, g_sceneOccluders);
+
+    if (!CreateOcclusionBuffer(OCCLUSION_BUFFER_WIDTH, OCCLUSION_BUFFER_HEIGHT, g_occlusionBuffer))
+        throw std::runtime_error("Failed to create occlusion buffer.");
+
+    g_occlusionJob.pOccluders = &g_sceneOccluders;
+    g_occlusionJob.pBuffer = &g_occlusionBuffer;
+
+    UINT vertexCount = static_cast<UINT>(g_scene.vertices.size());
+    Vertex *pVertices = 0;
+
+    if (FAILED(g_pDevice->CreateVertexBuffer(sizeof(Vertex) * vertexCount, D3DUSAGE_WRITEONLY, 0,
+            D3DPOOL_MANAGED, &g_pSceneVertexBuffer, 0)))
+        throw std::runtime_error("Failed to create vertex buffer for scene.");
+
+    if (FAILED(g_pSceneVertexBuffer->Lock(0, 0, reinterpret_cast<void**>(&pVertices), 0)))
+        throw std::runtime_error("Failed to lock scene vertex buffer.");
+
+    memcpy(pVertices, &g_scene.vertices[0], sizeof(Vertex) * vertexCount);
+    g_pSceneVertexBuffer->Unlock();
+
+    std::vector<Vertex>().swap(g_scene.vertices);
+}
+
+void InitSceneChunk(Scene &scene, int chunk, int firstVertex, int vertexCount, int surface, int room)
+{
+    SceneChunk &sceneChunk = scene.chunks[chunk];
+
+    sceneChunk.firstVertex = firstVertex;
+    sceneChunk.vertexCount = vertexCount;
+    sceneChunk.surface = surface;
+    sceneChunk.room = room;
+
+    for (int j = 0; j < 3; ++j)
+    {
+        sceneChunk.boundsMin[j] = FLT_MAX;
+        sceneChunk.boundsMax[j] = -FLT_MAX;
+    }
+
+    for (int i = firstVertex; i < firstVertex + vertexCount; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            sceneChunk.boundsMin[j] = min(sceneChunk.boundsMin[j], scene.vertices[i].pos[j]);
+            sceneChunk.boundsMax[j] = max(sceneChunk.boundsMax[j], scene.vertices[i].pos[j]);
+        }
+    }
+}
+
+void InitSrgbTables()
+{
+    // Tables used to convert 8-bit sRGB color values to linear floats and
+    // back again when filtering images.
+
+    for (int i = 0; i < 256; ++i)
+    {
+        double value = i / 255.0;
+
+        value = (value <= 0.04045) ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+        g_srgbToLinear[i] = static_cast<float>(value);
+    }
+
+    for (int i = 0; i < SRGB_ENCODE_TABLE_SIZE; ++i)
+    {
+        double value = i / static_cast<double>(SRGB_ENCODE_TABLE_SIZE - 1);
+
+        value = (value <= 0.0031308) ? value * 12.92 : 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+        g_linearToSrgb[i] = static_cast<BYTE>(floor(value * 255.0 + 0.5));
+    }
+}
+
+int InsertOctreeItem(Octree &tree, const float boundsMin[3], const float boundsMax[3], int value)
+{
+    // Adds an item to the tree and returns its index, which stays the same
+    // until the item is removed.
+
+    int index = tree.freeItem;
+
+    if (index >= 0)
+    {
+        tree.freeItem = tree.items[index].next;
+    }
+    else
+    {
+        index = static_cast<int>(tree.items.size());
+        tree.items.push_back(OctreeItem());
+    }
+
+    OctreeItem &item = tree.items[index];
+
+    memcpy(item.boundsMin, boundsMin, sizeof(item.boundsMin));
+    memcpy(item.boundsMax, boundsMax, sizeof(item.boundsMax));
+    item.value = value;
+    item.lastCulledPlane = 0;
+
+    LinkOctreeItem(tree, index);
+    return index;
+}
+
+bool IntersectSegmentBox(const float from[3], const float delta[3], const float boundsMin[3], const float boundsMax[3])
+{
+    // Returns whether the segment from + t * delta, 0 <= t <= 1, touches
+    // the box, by clipping it to the box's slabs.
+
+    float tMin = 0.0f;
+    float tMax = 1.0f;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        if (fabsf(delta[c]) < 1.0e-12f)
+        {
+            if (from[c] < boundsMin[c] || from[c] > boundsMax[c])
+                return false;
+
+            continue;
+        }
+
+        float invDelta = 1.0f / delta[c];
+        float t0 = (boundsMin[c] - from[c]) * invDelta;
+        float t1 = (boundsMax[c] - from[c]) * invDelta;
+
+        tMin = max(tMin, min(t0, t1));
+        tMax = min(tMax, max(t0, t1));
+
+        if (tMin > tMax)
+            return false;
+    }
+
+    return true;
+}
+
+bool IntersectSegmentTriangle(const float from[3], const float delta[3], const D3DXVECTOR3 *pTriangle)
+{
+    // Returns whether the segment from + t * delta, 0 < t < 1, crosses the
+    // triangle from either side. Moller-Trumbore.
+
+    D3DXVECTOR3 direction(delta[0], delta[1], delta[2]);
+    D3DXVECTOR3 edge1 = pTriangle[1] - pTriangle[0];
+    D3DXVECTOR3 edge2 = pTriangle[2] - pTriangle[0];
+    D3DXVECTOR3 p;
+
+    D3DXVec3Cross(&p, &direction, &edge2);
+
+    float determinant = D3DXVec3Dot(&edge1, &p);
+
+    if (fabsf(determinant) < 1.0e-12f)
+        return false;
+
+    float invDeterminant = 1.0f / determinant;
+    D3DXVECTOR3 s(from[0] - pTriangle[0].x, from[1] - pTriangle[0].y, from[2] - pTriangle[0].z);
+    float u = D3DXVec3Dot(&s, &p) * invDeterminant;
+
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    D3DXVECTOR3 q;
+
+    D3DXVec3Cross(&q, &s, &edge1);
+
+    float v = D3DXVec3Dot(&direction, &q) * invDeterminant;
+
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    float t = D3DXVec3Dot(&edge2, &q) * invDeterminant;
+
+    return t > 0.0f && t < 1.0f;
+}
+
+void InvalidateShadowCasters(ShadowCache &cache, const float boundsMin[3], const float boundsMax[3])
+{
+    // Marks out of date the resident faces that see any of the box, which
+    // bounds a caster that has moved, before or after the move.
+
+    for (size_t i = 0; i < cache.lights.size(); ++i)
+    {
+        ShadowLight &light = cache.lights[i];
+        bool overlaps = light.radius > 0.0f;
+
+        for (int c = 0; c < 3 && overlaps; ++c)
+            overlaps = boundsMin[c] <= light.pos[c] + light.radius && boundsMax[c] >= light.pos[c] - light.radius;
+
+        if (!overlaps)
+            continue;
+
+        for (int j = 0; j < SHADOW_CUBE_FACES; ++j)
+        {
+            ShadowFace &face = light.faces[j];
+            float faceMin[3];
+            float faceMax[3];
+
+            if (face.tile < 0 || face.dirtyFrame >= 0)
+                continue;
+
+            GetShadowFaceBounds(light, j, faceMin, faceMax);
+
+            if (boundsMin[j / 2] <= faceMax[j / 2] && boundsMax[j / 2] >= faceMin[j / 2])
+                face.dirtyFrame = cache.frame;
+        }
+    }
+}
+
+bool IsSegmentBlocked(const Octree &tree, const D3DXVECTOR3 *pTriangles, const float from[3], const float to[3])
+{
+    // Returns whether any triangle in the tree crosses the segment. Item i
+    // of the tree is the triangle with vertices pTriangles[i * 3] to
+    // pTriangles[i * 3 + 2]. Nodes are skipped with their descendants
+    // when the segment misses their loose bounds.
+
+    int stack[OCTREE_MAX_DEPTH * 8 + 1];
+    int depth = 0;
+    float delta[3] = {to[0] - from[0], to[1] - from[1], to[2] - from[2]};
+
+    if (tree.nodes.empty() || tree.nodes[0].itemCount == 0)
+        return false;
+
+    stack[depth++] = 0;
+
+    while (depth > 0)
+    {
+        const OctreeNode &node = tree.nodes[stack[--depth]];
+        float looseMin[3];
+        float looseMax[3];
+
+        for (int c = 0; c < 3; ++c)
+        {
+            looseMin[c] = node.center[c] - node.halfSize * 2.0f;
+            looseMax[c] = node.center[c] + node.halfSize * 2.0f;
+        }
+
+        if (!IntersectSegmentBox(from, delta, looseMin, looseMax))
+            continue;
+
+        for (int i = node.firstItem; i >= 0; i = tree.items[i].next)
+        {
+            const OctreeItem &item = tree.items[i];
+
+            if (IntersectSegmentBox(from, delta, item.boundsMin, item.boundsMax) &&
+                IntersectSegmentTriangle(from, delta, &pTriangles[item.value * 3]))
+                return true;
+        }
+
+        for (int i = 0; i < 8; ++i)
+        {
+            int child = node.children[i];
+
+            if (child >= 0 && tree.nodes[child].itemCount > 0)
+                stack[depth++] = child;
+        }
+    }
+
+    return false;
+}
+
+void LayoutText(const GlyphAtlas &atlas, const char *pszText, int x, int y,
+                D3DCOLOR color, TextLayout &layout)
+{
+    // Convert the text into a list of screen space quads, two triangles per
+    // visible character. Supports new lines and tab stops in the same way as
+    // ID3DXFont::DrawText() with DT_EXPANDTABS. The result is cached in the
+    // layout so it only needs to be rebuilt when the text changes.
+
+    static const float corners[6][2] =
+    {
+        {0.0f, 0.0f}, {1.0f, 0.0f}, {1.0f, 1.0f},
+        {1.0f, 1.0f}, {0.0f, 1.0f}, {0.0f, 0.0f}
+    };
+
+    const int cellHeight = atlas.lineHeight + GLYPH_PADDING * 2;
+    const int tabWidth = atlas.glyphs[' ' - GLYPH_FIRST_CHAR].width * GLYPH_TAB_SPACES;
+
+    TextVertex *pVertex = layout.vertices;
+    int penX = x;
+    int penY = y;
+    int index = 0;
+    float left = 0.0f;
+    float top = 0.0f;
+    float right = 0.0f;
+    float bottom = 0.0f;
+
+    layout.numQuads = 0;
+
+    for (const char *pCh = pszText; *pCh && layout.numQuads < HUD_TEXT_MAX_CHARS; ++pCh)
+    {
+        if (*pCh == '\n')
+        {
+            penX = x;
+            penY += atlas.lineHeight;
+            continue;
+        }
+
+        if (*pCh == '\t')
+        {
+            if (tabWidth > 0)
+                penX = x + ((penX - x) / tabWidth + 1) * tabWidth;
+            continue;
+        }
+
+        index = static_cast<unsigned char>(*pCh) - GLYPH_FIRST_CHAR;
+
+        if (index < 0 || index >= GLYPH_COUNT)
+            index = '?' - GLYPH_FIRST_CHAR;
+
+        const Glyph &glyph = atlas.glyphs[index];
+
+        if (*pCh != ' ')
+        {
+            // Offset by half a pixel so that texels map directly to pixels.
+
+            left = static_cast<float>(penX - GLYPH_PADDING) - 0.5f;
+            top = static_cast<float>(penY - GLYPH_PADDING) - 0.5f;
+            right = left + static_cast<float>(glyph.width + GLYPH_PADDING * 2);
+            bottom = top + static_cast<float>(cellHeight);
+
+            for (int i = 0; i < 6; ++i, ++pVertex)
+            {
+                pVertex->pos[0] = (corners[i][0] == 0.0f) ? left : right;
+                pVertex->pos[1] = (corners[i][1] == 0.0f) ? top : bottom;
+                pVertex->pos[2] = 0.0f;
+                pVertex->pos[3] = 1.0f;
+                pVertex->color = color;
+                pVertex->texCoord[0] = (corners[i][0] == 0.0f) ? glyph.texCoord[0] : glyph.texCoord[2];
+                pVertex->texCoord[1] = (corners[i][1] == 0.0f) ? glyph.texCoord[1] : glyph.texCoord[3];
+            }
+
+            ++layout.numQuads;
+        }
+
+        penX += glyph.width;
+    }
+
+    strncpy(layout.text, pszText, HUD_TEXT_MAX_CHARS - 1);
+    layout.text[HUD_TEXT_MAX_CHARS - 1] = '\0';
+    layout.x = x;
+    layout.y = y;
+    layout.color = color;
+}
+
+void LinkOctreeItem(Octree &tree, int index)
+{
+    // Stores an item in the node its bounds belong in, creating that node
+    // and any missing nodes above it.
+
+    int cell[3];
+    int depth = GetOctreeCell(tree, tree.items[index].boundsMin, tree.items[index].boundsMax, cell);
+    int node = 0;
+
+    ++tree.nodes[0].itemCount;
+
+    for (int level = 1; level <= depth; ++level)
+    {
+        int shift = depth - level;
+        int child = ((cell[0] >> shift) & 1) | (((cell[1] >> shift) & 1) << 1) | (((cell[2] >> shift) & 1) << 2);
+        int next = tree.nodes[node].children[child];
+
+        if (next < 0)
+        {
+            int childCell[3] = {cell[0] >> shift, cell[1] >> shift, cell[2] >> shift};
+
+            next = tree.freeNode;
+
+            if (next >= 0)
+            {
+                tree.freeNode = tree.nodes[next].parent;
+            }
+            else
+            {
+                next = static_cast<int>(tree.nodes.size());
+                tree.nodes.push_back(OctreeNode());
+            }
+
+            InitOctreeNode(tree, level, childCell, node, tree.nodes[next]);
+            tree.nodes[node].children[child] = next;
+        }
+
+        node = next;
+        ++tree.nodes[node].itemCount;
+    }
+
+    OctreeItem &item = tree.items[index];
+
+    item.node = node;
+    item.prev = -1;
+    item.next = tree.nodes[node].firstItem;
+
+    if (item.next >= 0)
+        tree.items[item.next].prev = index;
+
+    tree.nodes[node].firstItem = index;
+}
+
+bool LoadModel(const char *pszFilename, WorkerPool &pool, bool useCache,
+               CookedMesh &mesh, bool &fromCache)
+{
+    // Maps the OBJ file's mesh cache if it is up to date. Otherwise parses
+    // the OBJ file, welds and optimizes the result, and writes the cache for
+    // next time. Failing to write the cache isn't an error.
+
+    char szCacheFilename[MAX_PATH];
+    ULONGLONG sourceSize = 0;
+    ULONGLONG sourceTime = 0;
+
+    memset(&mesh, 0, sizeof(mesh));
+    fromCache = false;
+
+    if (!GetFileStamp(pszFilename, sourceSize, sourceTime))
+        return false;
+
+    snprintf(szCacheFilename, sizeof(szCacheFilename), "%s%s", pszFilename, MESH_CACHE_EXTENSION);
+
+    if (useCache && MapMeshCache(szCacheFilename, sourceSize, sourceTime, mesh))
+    {
+        fromCache = true;
+        return true;
+    }
+
+    std::vector<Vertex> triangles;
+    Mesh welded;
+
+    if (!ParseObjFile(pszFilename, pool, triangles) || triangles.empty())
+        return false;
+
+    CreateIndexedMesh(&triangles[0], static_cast<int>(triangles.size()), welded);
+    std::vector<Vertex>().swap(triangles);
+
+    OptimizeVertexCache(&welded.indices[0], static_cast<int>(welded.indices.size()),
+        static_cast<int>(welded.vertices.size()));
+    OptimizeVertexFetch(welded);
+
+    if (!CreateCookedMesh(welded, mesh))
+        return false;
+
+    if (useCache)
+        WriteMeshCache(szCacheFilename, sourceSize, sourceTime, mesh);
+
+    return true;
+}
+
+bool LoadShader(ShaderCompile &shader, LPD3DXEFFECT &pEffect)
+{
+    // Creates an effect from code compiled by CompileShaderJob(). The
+    // compiled code is released whether or not this succeeds.
+
+    ID3DXBuffer *pCompilationErrors = shader.pErrors;
+    HRESULT hr = E_FAIL;
+
+    AllocationZone zone("LoadShader");
+
+    shader.pErrors = 0;
+
+    if (shader.pEffectCode)
+    {
+        SAFE_RELEASE(pCompilationErrors);
+
+        hr = D3DXCreateEffect(g_pDevice, shader.pEffectCode->GetBufferPointer(),
+                shader.pEffectCode->GetBufferSize(), 0, 0, D3DXFX_NOT_CLONEABLE,
+                0, &pEffect, &pCompilationErrors);
+
+        SAFE_RELEASE(shader.pEffectCode);
+    }
+
+    if (FAILED(hr))
+    {
+        if (pCompilationErrors)
+        {
+            // Construct the exception straight from the error buffer. There
+            // is no need for an intermediate std::string copy.
+
+            std::runtime_error error(static_cast<const char *>(
+                pCompilationErrors->GetBufferPointer()));
+
+            pCompilationErrors->Release();
+            throw error;
+        }
+    }
+
+    if (pCompilationErrors)
+        pCompilationErrors->Release();
+
+    return pEffect != 0;
+}
+
+void LoadVirtualPageJob(void *pParam)
+{
+    // Runs on the load pool.
+
+    VirtualPageLoad &load = *static_cast<VirtualPageLoad*>(pParam);
+
+    load.succeeded = ReadVirtualPage(*load.pTexture, load.page, load.pTexels);
+    InterlockedExchange(&load.done, 1);
+}
+
+void Log(const char *pszMessage)
+{
+    MessageBox(0, pszMessage, "Error", MB_ICONSTOP);
+}
+
+bool MapMeshCache(const char *pszFilename, ULONGLONG sourceSize, ULONGLONG sourceTime,
+                  CookedMesh &mesh)
+{
+    // Maps a mesh cache file read only and points the mesh at the data
+    // inside the mapping, ready to be copied into vertex and index buffers
+    // as is. Fails if the file is missing, truncated, or was cooked from a
+    // different version of the OBJ file.
+
+    memset(&mesh, 0, sizeof(mesh));
+
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_READ, FILE_SHARE_READ, 0,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize = {0};
+
+    mesh.hFile = hFile;
+
+    if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart < sizeof(MeshCacheHeader) ||
+        !(mesh.hMapping = CreateFileMapping(hFile, 0, PAGE_READONLY, 0, 0, 0)) ||
+        !(mesh.pView = MapViewOfFile(mesh.hMapping, FILE_MAP_READ, 0, 0, 0)))
+    {
+        DestroyCookedMesh(mesh);
+        return false;
+    }
+
+    const MeshCacheHeader &header = *static_cast<const MeshCacheHeader*>(mesh.pView);
+    ULONGLONG dataSize = sizeof(Vertex) * static_cast<ULONGLONG>(header.vertexCount) +
+                         sizeof(DWORD) * static_cast<ULONGLONG>(header.indexCount);
+
+    if (header.magic != MESH_CACHE_MAGIC || header.version != MESH_CACHE_VERSION ||
+        header.sourceSize != sourceSize || header.sourceTime != sourceTime ||
+        header.indexCount % 3 != 0 ||
+        static_cast<ULONGLONG>(fileSize.QuadPart) != sizeof(MeshCacheHeader) + dataSize)
+    {
+        DestroyCookedMesh(mesh);
+        return false;
+    }
+
+    const BYTE *pData = static_cast<const BYTE*>(mesh.pView) + sizeof(MeshCacheHeader);
+
+    mesh.pVertices = reinterpret_cast<const Vertex*>(pData);
+    mesh.pIndices = reinterpret_cast<const DWORD*>(pData + sizeof(Vertex) * header.vertexCount);
+    mesh.vertexCount = header.vertexCount;
+    mesh.indexCount = header.indexCount;
+    mesh.dataSize = static_cast<size_t>(dataSize);
+    memcpy(mesh.boundsMin, header.boundsMin, sizeof(mesh.boundsMin));
+    memcpy(mesh.boundsMax, header.boundsMax, sizeof(mesh.boundsMax));
+    return true;
+}
+
+bool MapTextureCache(const char *pszFilename, ULONGLONG sourceHash, CompressedImage &image)
+{
+    // Maps a texture cache file read only and points the image at the level
+    // data inside the mapping. Nothing is copied or decoded. Fails if the
+    // file is missing, damaged, or was built from a different source file.
+
+    memset(&image, 0, sizeof(image));
+
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_READ, FILE_SHARE_READ, 0,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize = {0};
+
+    image.hFile = hFile;
+
+    if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart < sizeof(TextureCacheHeader) ||
+        !(image.hMapping = CreateFileMapping(hFile, 0, PAGE_READONLY, 0, 0, 0)) ||
+        !(image.pView = MapViewOfFile(image.hMapping, FILE_MAP_READ, 0, 0, 0)))
+    {
+        DestroyCompressedImage(image);
+        return false;
+    }
+
+    const TextureCacheHeader &header = *static_cast<const TextureCacheHeader*>(image.pView);
+    bool valid = header.magic == TEXTURE_CACHE_MAGIC && header.version == TEXTURE_CACHE_VERSION &&
+                 header.sourceHash == sourceHash &&
+                 (header.format == D3DFMT_DXT1 || header.format == D3DFMT_DXT5) &&
+                 header.width > 0 && header.height > 0 &&
+                 header.levels > 0 && header.levels <= IMAGE_MAX_LEVELS &&
+                 fileSize.QuadPart == sizeof(TextureCacheHeader) + static_cast<LONGLONG>(header.dataSize);
+
+    for (int i = 0; valid && i < header.levels; ++i)
+    {
+        valid = header.levelSizes[i] == GetCompressedLevelSize(static_cast<D3DFORMAT>(header.format),
+                    max(1, header.width >> i), max(1, header.height >> i)) &&
+                header.levelOffsets[i] <= header.dataSize &&
+                header.levelSizes[i] <= header.dataSize - header.levelOffsets[i];
+    }
+
+    if (!valid)
+    {
+        DestroyCompressedImage(image);
+        return false;
+    }
+
+    image.format = static_cast<D3DFORMAT>(header.format);
+    image.width = header.width;
+    image.height = header.height;
+    image.levels = header.levels;
+    image.pData = static_cast<const BYTE*>(image.pView) + sizeof(TextureCacheHeader);
+    image.dataSize = header.dataSize;
+    memcpy(image.levelOffsets, header.levelOffsets, sizeof(image.levelOffsets));
+    memcpy(image.levelSizes, header.levelSizes, sizeof(image.levelSizes));
+    return true;
+}
+
+bool MSAAModeSupported(D3DMULTISAMPLE_TYPE type, D3DFORMAT backBufferFmt,
+                       D3DFORMAT depthStencilFmt, BOOL windowed,
+                       DWORD &qualityLevels)
+{
+    DWORD backBufferQualityLevels = 0;
+    DWORD depthStencilQualityLevels = 0;
+
+    HRESULT hr = g_pDirect3D->CheckDeviceMultiSampleType(D3DADAPTER_DEFAULT,
+                    D3DDEVTYPE_HAL, backBufferFmt, windowed, type,
+                    &backBufferQualityLevels);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = g_pDirect3D->CheckDeviceMultiSampleType(D3DADAPTER_DEFAULT,
+                D3DDEVTYPE_HAL, depthStencilFmt, windowed, type,
+                &depthStencilQualityLevels);
+
+        if (SUCCEEDED(hr))
+        {
+            if (backBufferQualityLevels == depthStencilQualityLevels)
+            {
+                // The valid range is between zero and one less than the level
+                // returned by IDirect3D9::CheckDeviceMultiSampleType().
+
+                if (backBufferQualityLevels > 0)
+                    qualityLevels = backBufferQualityLevels - 1;
+                else
+                    qualityLevels = backBufferQualityLevels;
+
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+size_t MortonIndex(int x, int y, int widthLog2, int heightLog2)
+{
+    // Interleaves the low bits of x and y, x in the even bits, for as many
+    // bits as the smaller dimension has. The rest of the larger coordinate
+    // goes above them, so a non-square level is a row or column of squares.
+
+    int shared = min(widthLog2, heightLog2);
+    DWORD mask = (1u << shared) - 1;
+    DWORD bitsX = x & mask;
+    DWORD bitsY = y & mask;
+
+    bitsX = (bitsX | (bitsX << 8)) & 0x00ff00ff;
+    bitsX = (bitsX | (bitsX << 4)) & 0x0f0f0f0f;
+    bitsX = (bitsX | (bitsX << 2)) & 0x33333333;
+    bitsX = (bitsX | (bitsX << 1)) & 0x55555555;
+    bitsY = (bitsY | (bitsY << 8)) & 0x00ff00ff;
+    bitsY = (bitsY | (bitsY << 4)) & 0x0f0f0f0f;
+    bitsY = (bitsY | (bitsY << 2)) & 0x33333333;
+    bitsY = (bitsY | (bitsY << 1)) & 0x55555555;
+
+    size_t high = (widthLog2 > heightLog2) ? (x >> shared) : (y >> shared);
+
+    return (high << (shared * 2)) | bitsX | (bitsY << 1);
+}
+
+bool MoveOctreeItem(Octree &tree, int index, const float boundsMin[3], const float boundsMax[3])
+{
+    // Changes an item's bounds. The item only moves to another node when
+    // its new bounds belong in one, and true is returned when it does.
+
+    OctreeItem &item = tree.items[index];
+    const OctreeNode &node = tree.nodes[item.node];
+    int cell[3];
+    int depth = GetOctreeCell(tree, boundsMin, boundsMax, cell);
+
+    memcpy(item.boundsMin, boundsMin, sizeof(item.boundsMin));
+    memcpy(item.boundsMax, boundsMax, sizeof(item.boundsMax));
+
+    if (depth == node.depth && cell[0] == node.cell[0] && cell[1] == node.cell[1] && cell[2] == node.cell[2])
+        return false;
+
+    UnlinkOctreeItem(tree, index);
+    LinkOctreeItem(tree, index);
+    return true;
+}
+
+unsigned int NextRandom(unsigned int &seed)
+{
+    // Small linear congruential generator with explicit state. Unlike rand()
+    // the sequence is independent of anything else using the C runtime's
+    // random number generator, so benchmarks are repeatable.
+
+    seed = seed * 1664525U + 1013904223U;
+    return seed >> 8;
+}
+
+float NextRandomFloat(unsigned int &seed)
+{
+    // Returns a number from 0 to 1.
+
+    return (NextRandom(seed) & 0xffff) / 65535.0f;
+}
+
+bool OpenVirtualTexture(const char *pszFilename, WorkerPool &loadPool, VirtualTexture &texture)
+{
+    // Opens a page file written by CookVirtualTexture(), sets up an empty
+    // page table and physical cache, and reads the mip tail. Other pages are
+    // loaded on loadPool as UpdateVirtualTexture() asks for them.
+
+    memset(&texture, 0, sizeof(texture));
+
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_READ, FILE_SHARE_READ, 0,
+                    OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    VirtualTextureHeader &header = texture.header;
+    LARGE_INTEGER fileSize = {0};
+    DWORD bytesRead = 0;
+
+    texture.hFile = hFile;
+    texture.pLoadPool = &loadPool;
+
+    bool valid = GetFileSizeEx(hFile, &fileSize) &&
+                 ReadFile(hFile, &header, sizeof(header), &bytesRead, 0) && bytesRead == sizeof(header) &&
+                 header.magic == VIRTUAL_TEXTURE_MAGIC && header.version == VIRTUAL_TEXTURE_VERSION &&
+                 header.format == D3DFMT_DXT1 &&
+                 header.pageSize == VIRTUAL_PAGE_SIZE && header.pageBorder == VIRTUAL_PAGE_BORDER &&
+                 header.pageBytes == GetCompressedLevelSize(D3DFMT_DXT1, VIRTUAL_PAGE_STRIDE, VIRTUAL_PAGE_STRIDE) &&
+                 header.width > 0 && header.height > 0 &&
+                 header.levels > 0 && header.levels <= IMAGE_MAX_LEVELS;
+
+    for (int i = 0; valid && i < header.levels; ++i)
+    {
+        texture.levelFirstPage[i] = texture.pageCount;
+        texture.levelPagesWide[i] = (max(1, header.width >> i) + VIRTUAL_PAGE_SIZE - 1) / VIRTUAL_PAGE_SIZE;
+        texture.levelPagesHigh[i] = (max(1, header.height >> i) + VIRTUAL_PAGE_SIZE - 1) / VIRTUAL_PAGE_SIZE;
+        texture.pageCount += texture.levelPagesWide[i] * texture.levelPagesHigh[i];
+
+        if (texture.levelPagesWide[i] * texture.levelPagesHigh[i] == 1)
+            ++texture.tailSlots;
+    }
+
+    valid = valid && texture.tailSlots > 0 && texture.tailSlots < VIRTUAL_PHYSICAL_PAGES &&
+            fileSize.QuadPart == sizeof(header) + static_cast<LONGLONG>(texture.pageCount) * header.pageBytes;
+
+    if (!valid ||
+        !(texture.pPageTable = static_cast<int*>(malloc(texture.pageCount * sizeof(int)))) ||
+        !(texture.pPageLoading = static_cast<bool*>(calloc(texture.pageCount, sizeof(bool)))) ||
+        !(texture.pPageRequested = static_cast<bool*>(calloc(texture.pageCount, sizeof(bool)))) ||
+        !(texture.pPhysical = static_cast<DWORD*>(_aligned_malloc(
+            VIRTUAL_PHYSICAL_PAGES * VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE * sizeof(DWORD), 16))))
+    {
+        CloseVirtualTexture(texture);
+        return false;
+    }
+
+    for (int i = 0; i < VIRTUAL_MAX_PAGE_LOADS; ++i)
+    {
+        texture.loads[i].pTexture = &texture;
+        texture.loads[i].page = -1;
+
+        if (!(texture.loads[i].pTexels = static_cast<DWORD*>(malloc(VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE * sizeof(DWORD)))))
+        {
+            CloseVirtualTexture(texture);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < texture.pageCount; ++i)
+        texture.pPageTable[i] = -1;
+
+    for (int i = 0; i < VIRTUAL_PHYSICAL_PAGES; ++i)
+    {
+        texture.slotPages[i] = -1;
+        texture.slotPrev[i] = i - 1;
+        texture.slotNext[i] = (i + 1 < VIRTUAL_PHYSICAL_PAGES) ? i + 1 : -1;
+    }
+
+    // The mip tail is the last tailSlots levels, one page each. Its slots
+    // are left out of the LRU list.
+
+    for (int i = 0; i < texture.tailSlots; ++i)
+    {
+        int page = texture.pageCount - texture.tailSlots + i;
+
+        if (!ReadVirtualPage(texture, page, texture.pPhysical + i * VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE))
+        {
+            CloseVirtualTexture(texture);
+            return false;
+        }
+
+        texture.pPageTable[page] = i;
+        texture.slotPages[i] = page;
+    }
+
+    texture.slotPrev[texture.tailSlots] = -1;
+    texture.lruHead = texture.tailSlots;
+    texture.lruTail = VIRTUAL_PHYSICAL_PAGES - 1;
+    return true;
+}
+
+void OptimizeVertexCache(DWORD *pIndices, int indexCount, int vertexCount)
+{
+    // Reorders the triangles of an indexed triangle list for the post-
+    // transform vertex cache, using Tom Forsyth's linear-speed algorithm.
+    // Triangles are emitted one at a time, each time the one whose
+    // vertices score highest (see GetVertexCacheScore()) in a modelled LRU
+    // cache. Only the triangles of cached vertices are rescored after each
+    // step, so the best next triangle is always among them. When none of
+    // them is left, the next unemitted triangle in the original order is
+    // taken.
+
+    int triangleCount = indexCount / 3;
+
+    if (triangleCount == 0)
+        return;
+
+    // Scores by cache position (-1 for not cached) and remaining triangles.
+
+    float scores[VERTEX_CACHE_SCORE_SIZE + 1][VERTEX_CACHE_MAX_VALENCE + 1];
+
+    for (int i = 0; i <= VERTEX_CACHE_SCORE_SIZE; ++i)
+    {
+        for (int j = 0; j <= VERTEX_CACHE_MAX_VALENCE; ++j)
+            scores[i][j] = GetVertexCacheScore(i - 1, j);
+    }
+
+    // Each vertex's remaining triangles are kept at the start of its range
+    // of the adjacency array.
+
+    std::vector<int> firstTriangle(vertexCount + 1, 0);
+    std::vector<int> remaining(vertexCount, 0);
+    std::vector<int> adjacency(triangleCount * 3);
+    std::vector<int> cachePositions(vertexCount, -1);
+    std::vector<float> vertexScores(vertexCount);
+    std::vector<char> emitted(triangleCount, 0);
+    std::vector<DWORD> output(triangleCount * 3);
+
+    for (int i = 0; i < triangleCount * 3; ++i)
+        ++remaining[pIndices[i]];
+
+    for (int i = 0; i < vertexCount; ++i)
+    {
+        firstTriangle[i + 1] = firstTriangle[i] + remaining[i];
+        vertexScores[i] = scores[0][min(remaining[i], VERTEX_CACHE_MAX_VALENCE)];
+        remaining[i] = 0;
+    }
+
+    for (int i = 0; i < triangleCount * 3; ++i)
+    {
+        DWORD vertex = pIndices[i];
+
+        adjacency[firstTriangle[vertex] + remaining[vertex]++] = i / 3;
+    }
+
+    int best = -1;
+    float bestScore = -FLT_MAX;
+
+    for (int i = 0; i < triangleCount; ++i)
+    {
+        float score = vertexScores[pIndices[i * 3]] + vertexScores[pIndices[i * 3 + 1]] + vertexScores[pIndices[i * 3 + 2]];
+
+        if (score > bestScore)
+        {
+            bestScore = score;
+            best = i;
+        }
+    }
+
+    int cache[VERTEX_CACHE_SCORE_SIZE + 3];
+    int cacheCount = 0;
+    int nextTriangle = 0;
+
+    for (int emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+    {
+        if (best < 0)
+        {
+            while (emitted[nextTriangle])
+                ++nextTriangle;
+
+            best = nextTriangle;
+        }
+
+        const DWORD *pTriangle = &pIndices[best * 3];
+
+        emitted[best] = 1;
+        memcpy(&output[emittedCount * 3], pTriangle, 3 * sizeof(DWORD));
+
+        // Take the triangle off its vertices' lists, and put its vertices at
+        // the front of the cache followed by the rest in their old order.
+
+        int newCache[VERTEX_CACHE_SCORE_SIZE + 3];
+        int newCount = 0;
+
+        for (int k = 0; k < 3; ++k)
+        {
+            int vertex = pTriangle[k];
+            int *pList = &adjacency[firstTriangle[vertex]];
+
+            for (int j = 0; j < remaining[vertex]; ++j)
+            {
+                if (pList[j] == best)
+                {
+                    pList[j] = pList[--remaining[vertex]];
+                    break;
+                }
+            }
+
+            if (std::find(newCache, newCache + newCount, vertex) == newCache + newCount)
+                newCache[newCount++] = vertex;
+        }
+
+        int triangleVertices = newCount;
+
+        for (int i = 0; i < cacheCount; ++i)
+        {
+            if (std::find(newCache, newCache + triangleVertices, cache[i]) == newCache + triangleVertices)
+                newCache[newCount++] = cache[i];
+        }
+
+        // Rescore the vertices, including those pushed out of the cache,
+        // then the triangles they're still part of.
+
+        for (int i = 0; i < newCount; ++i)
+        {
+            int vertex = newCache[i];
+
+            cachePositions[vertex] = (i < VERTEX_CACHE_SCORE_SIZE) ? i : -1;
+            vertexScores[vertex] = scores[cachePositions[vertex] + 1][min(remaining[vertex], VERTEX_CACHE_MAX_VALENCE)];
+        }
+
+        best = -1;
+        bestScore = -FLT_MAX;
+
+        for (int i = 0; i < newCount; ++i)
+        {
+            int vertex = newCache[i];
+            const int *pList = &adjacency[firstTriangle[vertex]];
+
+            for (int j = 0; j < remaining[vertex]; ++j)
+            {
+                const DWORD *pCandidate = &pIndices[pList[j] * 3];
+                float score = vertexScores[pCandidate[0]] + vertexScores[pCandidate[1]] + vertexScores[pCandidate[2]];
+
+                if (score > bestScore)
+                {
+                    bestScore = score;
+                    best = pList[j];
+                }
+            }
+        }
+
+        cacheCount = min(newCount, VERTEX_CACHE_SCORE_SIZE);
+        memcpy(cache, newCache, cacheCount * sizeof(int));
+    }
+
+    memcpy(pIndices, &output[0], triangleCount * 3 * sizeof(DWORD));
+}
+
+void OptimizeVertexFetch(Mesh &mesh)
+{
+    // Renumbers the vertices in the order the indices first use them, so
+    // that vertex fetches walk through the vertex buffer mostly forwards.
+    // Vertices no index uses are dropped.
+
+    std::vector<DWORD> remap(mesh.vertices.size(), 0xffffffff);
+    std::vector<Vertex> vertices;
+
+    vertices.reserve(mesh.vertices.size());
+
+    for (size_t i = 0; i < mesh.indices.size(); ++i)
+    {
+        DWORD &index = mesh.indices[i];
+
+        if (remap[index] == 0xffffffff)
+        {
+            remap[index] = static_cast<DWORD>(vertices.size());
+            vertices.push_back(mesh.vertices[index]);
+        }
+
+        index = remap[index];
+    }
+
+    mesh.vertices.swap(vertices);
+}
+
+void PackVertices(const Vertex *pVertices, int count, const VertexQuantization &quantization,
+                  PackedVertex *pPacked)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        const Vertex &vertex = pVertices[i];
+        PackedVertex &packed = pPacked[i];
+
+        for (int c = 0; c < 3; ++c)
+            packed.pos[c] = FloatToSnorm16((vertex.pos[c] - quantization.center[c]) / quantization.halfExtent[c]);
+
+        packed.pos[3] = 32767;
+        D3DXFloat32To16Array(packed.texCoord, vertex.texCoord, 2);
+        EncodeOctahedralNormal(vertex.normal, packed.normal);
+    }
+}
+
+void ParallelFor(WorkerPool &pool, int count, void (*pfnRun)(void *pParam, int begin, int end),
+                 void *pParam)
+{
+    // Calls pfnRun for consecutive ranges covering [0, count) on the pool's
+    // threads and on this thread, and returns once all of them are done.
+    // Several ranges are queued per thread to even out the load.
+
+    ParallelForJob jobs[PARALLEL_FOR_MAX_JOBS];
+    LONG volatile remaining = 0;
+    int numJobs = min(min(count, (pool.numThreads + 1) * 4), PARALLEL_FOR_MAX_JOBS);
+
+    if (numJobs <= 1 || pool.numThreads == 0)
+    {
+        if (count > 0)
+            pfnRun(pParam, 0, count);
+
+        return;
+    }
+
+    remaining = numJobs;
+
+    for (int i = 0; i < numJobs; ++i)
+    {
+        jobs[i].pfnRun = pfnRun;
+        jobs[i].pParam = pParam;
+        jobs[i].begin = static_cast<int>(static_cast<LONGLONG>(count) * i / numJobs);
+        jobs[i].end = static_cast<int>(static_cast<LONGLONG>(count) * (i + 1) / numJobs);
+        jobs[i].pRemaining = &remaining;
+
+        pool.submit(ParallelForJobProc, &jobs[i]);
+    }
+
+    while (remaining > 0)
+    {
+        if (!pool.runOne())
+            WaitForSingleObject(pool.hJobDone, 1);
+    }
+}
+
+void ParallelForJobProc(void *pParam)
+{
+    ParallelForJob &job = *static_cast<ParallelForJob*>(pParam);
+
+    job.pfnRun(job.pParam, job.begin, job.end);
+    InterlockedDecrement(job.pRemaining);
+}
+
+void ParseCommandLine(const char *pszCmdLine)
+{
+    // Supported command line switches:
+    //
+    //  -allocbudget N  Quit with exit code 1 as soon as a steady state frame
+    //                  makes more than N heap allocations. Intended for
+    //                  automated runs that must not allocate per frame.
+    //
+    //  -benchmark [name]
+    //                  Run all benchmarks, or only the named one, and quit.
+    //
+    //  -model file.obj Load an OBJ file and place it in the middle of the
+    //                  room. The parsed mesh is cooked into file.obj.mesh,
+    //                  which is mapped instead while the OBJ is unchanged.
+    //
+    //  -nocache        Always decode the JPEG textures instead of using or
+    //                  writing their block compressed texture cache files,
+    //                  and always parse the model's OBJ file.
+    //
+    //  -pipeline N     Let the simulation run up to N frames ahead of the
+    //                  frame being rendered on a separate thread. 0 (the
+    //                  default) simulates and renders each frame serially.
+    //
+    //  -scene grid|maze N
+    //                  Generate a grid of N rooms or a corridor maze of N
+    //                  cells, with SCENE_PROPS_PER_ROOM props in each, and
+    //                  draw it instead of the room.
+    //
+    //  -serialload     Load the startup assets one after another on the main
+    //                  thread instead of on worker threads.
+    //
+    //  -seed N         Seed the random number generator with N instead of
+    //                  the current time so light trajectories are repeatable.
+    //
+    //  -simrate N      Simulate the lights at N Hz (default 60 Hz).
+
+    std::istringstream args(pszCmdLine);
+    std::string arg;
+
+    while (args >> arg)
+    {
+        if (arg == "-allocbudget")
+        {
+            if (!(args >> g_allocationBudget))
+                g_allocationBudget = 0;
+
+            g_failOnAllocationBudget = true;
+        }
+        else if (arg == "-model")
+        {
+            if (!(args >> g_modelFilename))
+                g_modelFilename.clear();
+        }
+        else if (arg == "-nocache")
+        {
+            g_useTextureCache = false;
+        }
+        else if (arg == "-pipeline")
+        {
+            int depth = 0;
+
+            if ((args >> depth) && depth >= 0 && depth <= PIPELINE_MAX_DEPTH)
+                g_pipelineDepth = depth;
+        }
+        else if (arg == "-scene")
+        {
+            std::string layout;
+            int rooms = 0;
+
+            if ((args >> layout >> rooms) && rooms > 0 && (layout == "grid" || layout == "maze"))
+            {
+                g_sceneDesc.layout = (layout == "maze") ? SCENE_LAYOUT_MAZE : SCENE_LAYOUT_GRID;
+                g_sceneDesc.rooms = rooms;
+                g_sceneDesc.props = rooms * SCENE_PROPS_PER_ROOM;
+                g_sceneDesc.lights = 0;
+                g_sceneDesc.seed = SCENE_DEFAULT_SEED;
+            }
+        }
+        else if (arg == "-serialload")
+        {
+            g_serialLoading = true;
+        }
+        else if (arg == "-seed")
+        {
+            if (args >> g_randomSeed)
+                g_fixedRandomSeed = true;
+        }
+        else if (arg == "-simrate")
+        {
+            float rate = 0.0f;
+
+            if ((args >> rate) && rate > 0.0f)
+                g_simulationTimestep = 1.0f / rate;
+        }
+        else if (arg == "-benchmark")
+        {
+            g_runBenchmarks = true;
+
+            if (args.peek() != EOF)
+            {
+                std::istringstream::pos_type pos = args.tellg();
+
+                if ((args >> arg) && arg[0] != '-')
+                    g_benchmarkFilter = arg;
+                else
+                    args.seekg(pos);
+            }
+        }
+    }
+}
+
+bool ParseObj(const char *pText, size_t size, WorkerPool &pool, std::vector<Vertex> &triangles)
+{
+    // Parses the positions, texture coordinates, normals and faces of OBJ
+    // text into a triangle list, 3 vertices per triangle. Everything else
+    // (groups, materials, smoothing groups) is ignored.
+    //
+    // The text is split into chunks at line breaks and the chunks are parsed
+    // in parallel. Once every chunk's counts are known, the chunks' arrays are
+    // joined and a second parallel pass resolves the faces' indices. Faces
+    // with more than 3 corners become triangle fans. Positions and normals
+    // are mirrored in z, triangles' winding reversed and texture coordinates
+    // flipped vertically, to go from OBJ's right handed, counterclockwise,
+    // bottom up conventions to Direct3D's.
+
+    int numChunks = static_cast<int>((size + OBJ_CHUNK_SIZE - 1) / OBJ_CHUNK_SIZE);
+    std::vector<ObjChunk> chunks(numChunks);
+    const char *pEnd = pText + size;
+    ObjParseJob job = {0};
+
+    triangles.clear();
+
+    if (numChunks == 0)
+        return true;
+
+    for (int i = 0; i < numChunks; ++i)
+    {
+        const char *pBegin = pText + static_cast<size_t>(i) * OBJ_CHUNK_SIZE;
+
+        if (i > 0)
+        {
+            while (pBegin < pEnd && pBegin[-1] != '\n')
+                ++pBegin;
+
+            chunks[i - 1].pEnd = pBegin;
+        }
+
+        chunks[i].pBegin = pBegin;
+    }
+
+    chunks[numChunks - 1].pEnd = pEnd;
+    job.pChunks = &chunks[0];
+
+    ParallelFor(pool, numChunks, ParseObjChunks, &job);
+
+    if (job.failed)
+        return false;
+
+    size_t positionCount = 0;
+    size_t texCoordCount = 0;
+    size_t normalCount = 0;
+    size_t cornerCount = 0;
+
+    for (int i = 0; i < numChunks; ++i)
+    {
+        chunks[i].positionBase = static_cast<int>(positionCount);
+        chunks[i].texCoordBase = static_cast<int>(texCoordCount);
+        chunks[i].normalBase = static_cast<int>(normalCount);
+        chunks[i].firstCorner = cornerCount;
+
+        positionCount += chunks[i].positions.size() / 3;
+        texCoordCount += chunks[i].texCoords.size() / 2;
+        normalCount += chunks[i].normals.size() / 3;
+        cornerCount += chunks[i].corners.size();
+    }
+
+    if (positionCount > INT_MAX || texCoordCount > INT_MAX || normalCount > INT_MAX)
+        return false;
+
+    std::vector<float> positions;
+    std::vector<float> texCoords;
+    std::vector<float> normals;
+
+    positions.reserve(positionCount * 3);
+    texCoords.reserve(texCoordCount * 2);
+    normals.reserve(normalCount * 3);
+
+    for (int i = 0; i < numChunks; ++i)
+    {
+        positions.insert(positions.end(), chunks[i].positions.begin(), chunks[i].positions.end());
+        texCoords.insert(texCoords.end(), chunks[i].texCoords.begin(), chunks[i].texCoords.end());
+        normals.insert(normals.end(), chunks[i].normals.begin(), chunks[i].normals.end());
+
+        std::vector<float>().swap(chunks[i].positions);
+        std::vector<float>().swap(chunks[i].texCoords);
+        std::vector<float>().swap(chunks[i].normals);
+    }
+
+    triangles.resize(cornerCount);
+
+    if (cornerCount == 0)
+        return true;
+
+    job.pPositions = positions.empty() ? 0 : &positions[0];
+    job.pTexCoords = texCoords.empty() ? 0 : &texCoords[0];
+    job.pNormals = normals.empty() ? 0 : &normals[0];
+    job.positionCount = static_cast<int>(positionCount);
+    job.texCoordCount = static_cast<int>(texCoordCount);
+    job.normalCount = static_cast<int>(normalCount);
+    job.pTriangles = &triangles[0];
+
+    ParallelFor(pool, numChunks, ResolveObjChunks, &job);
+
+    if (job.failed)
+    {
+        triangles.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool ParseObjChunk(ObjChunk &chunk)
+{
+    // Parses the lines of one chunk. Values are read straight out of the
+    // text, so nothing is allocated per line or per number, only when the
+    // chunk's arrays grow. Fails on a malformed vertex or face.
+
+    const char *p = chunk.pBegin;
+    const char *pEnd = chunk.pEnd;
+
+    while (p < pEnd)
+    {
+        while (p < pEnd && (*p == ' ' || *p == '\t'))
+            ++p;
+
+        size_t remaining = pEnd - p;
+
+        if (remaining >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            float x, y, z;
+
+            p += 2;
+
+            if (!ParseObjFloat(p, pEnd, x) || !ParseObjFloat(p, pEnd, y) || !ParseObjFloat(p, pEnd, z))
+                return false;
+
+            chunk.positions.push_back(x);
+            chunk.positions.push_back(y);
+            chunk.positions.push_back(-z);
+        }
+        else if (remaining >= 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+        {
+            float u, v = 0.0f;
+
+            p += 3;
+
+            if (!ParseObjFloat(p, pEnd, u))
+                return false;
+
+            ParseObjFloat(p, pEnd, v);
+            chunk.texCoords.push_back(u);
+            chunk.texCoords.push_back(1.0f - v);
+        }
+        else if (remaining >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+        {
+            float x, y, z;
+
+            p += 3;
+
+            if (!ParseObjFloat(p, pEnd, x) || !ParseObjFloat(p, pEnd, y) || !ParseObjFloat(p, pEnd, z))
+                return false;
+
+            chunk.normals.push_back(x);
+            chunk.normals.push_back(y);
+            chunk.normals.push_back(-z);
+        }
+        else if (remaining >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            int counts[3] =
+            {
+                static_cast<int>(chunk.positions.size() / 3),
+                static_cast<int>(chunk.texCoords.size() / 2),
+                static_cast<int>(chunk.normals.size() / 3)
+            };
+            ObjCorner first = {{0}};
+            ObjCorner previous = {{0}};
+            int numCorners = 0;
+
+            p += 2;
+
+            for (;;)
+            {
+                while (p < pEnd && (*p == ' ' || *p == '\t'))
+                    ++p;
+
+                if (p == pEnd || *p == '\r' || *p == '\n' || *p == '#')
+                    break;
+
+                // v, v/vt, v//vn or v/vt/vn.
+
+                ObjCorner corner = {{0}};
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    int index = 0;
+
+                    if (c > 0)
+                    {
+                        if (p == pEnd || *p != '/')
+                            break;
+
+                        if (++p < pEnd && *p == '/' && c == 1)
+                            continue;
+                    }
+
+                    if (!ParseObjIndex(p, pEnd, index))
+                        return false;
+
+                    corner.index[c] = (index > 0) ? index - 1 : counts[c] + index;
+                    corner.present |= 1 << c;
+
+                    if (index < 0)
+                        corner.relative |= 1 << c;
+                }
+
+                if ((corner.present & 1) == 0)
+                    return false;
+
+                if (numCorners == 0)
+                    first = corner;
+
+                if (numCorners >= 2)
+                {
+                    chunk.corners.push_back(first);
+                    chunk.corners.push_back(corner);
+                    chunk.corners.push_back(previous);
+                }
+
+                previous = corner;
+                ++numCorners;
+            }
+
+            if (numCorners < 3)
+                return false;
+        }
+
+        while (p < pEnd && *p != '\n')
+            ++p;
+
+        if (p < pEnd)
+            ++p;
+    }
+
+    return true;
+}
+
+void ParseObjChunks(void *pParam, int begin, int end)
+{
+    ObjParseJob &job = *static_cast<ObjParseJob*>(pParam);
+
+    for (int i = begin; i < end; ++i)
+    {
+        if (!ParseObjChunk(job.pChunks[i]))
+            InterlockedExchange(&job.failed, 1);
+    }
+}
+
+bool ParseObjFile(const char *pszFilename, WorkerPool &pool, std::vector<Vertex> &triangles)
+{
+    // Maps an OBJ file read only and parses it in place.
+
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_READ, FILE_SHARE_READ, 0,
+                    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize = {0};
+    HANDLE hMapping = 0;
+    const void *pView = 0;
+    bool succeeded = false;
+
+    if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0 &&
+        static_cast<ULONGLONG>(fileSize.QuadPart) <= static_cast<size_t>(-1) &&
+        (hMapping = CreateFileMapping(hFile, 0, PAGE_READONLY, 0, 0, 0)) &&
+        (pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0)))
+    {
+        succeeded = ParseObj(static_cast<const char*>(pView), static_cast<size_t>(fileSize.QuadPart),
+                        pool, triangles);
+    }
+
+    if (pView)
+        UnmapViewOfFile(pView);
+
+    if (hMapping)
+        CloseHandle(hMapping);
+
+    CloseHandle(hFile);
+    return succeeded;
+}
+
+bool ParseObjFloat(const char *&p, const char *pEnd, float &value)
+{
+    // Parses a decimal number such as -1.25e-3 after any leading blanks.
+    // strtod() would need a terminated copy of the number and looks up the
+    // locale on every call. The first 18 significant digits are kept, which
+    // is plenty for a float.
+
+    static const double powersOf10[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    while (p < pEnd && (*p == ' ' || *p == '\t'))
+        ++p;
+
+    bool negative = false;
+
+    if (p < pEnd && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    ULONGLONG mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
+
+    for (; p < pEnd && *p >= '0' && *p <= '9'; ++p)
+    {
+        if (digits < 18)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += (mantissa != 0);
+        }
+        else
+        {
+            ++exponent;
+        }
+
+        anyDigits = true;
+    }
+
+    if (p < pEnd && *p == '.')
+    {
+        for (++p; p < pEnd && *p >= '0' && *p <= '9'; ++p)
+        {
+            if (digits < 18)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += (mantissa != 0);
+                --exponent;
+            }
+
+            anyDigits = true;
+        }
+    }
+
+    if (!anyDigits)
+        return false;
+
+    if (p < pEnd && (*p == 'e' || *p == 'E'))
+    {
+        const char *pExponent = p + 1;
+        bool negativeExponent = false;
+        int value10 = 0;
+
+        if (pExponent < pEnd && (*pExponent == '-' || *pExponent == '+'))
+            negativeExponent = (*pExponent++ == '-');
+
+        if (pExponent < pEnd && *pExponent >= '0' && *pExponent <= '9')
+        {
+            for (; pExponent < pEnd && *pExponent >= '0' && *pExponent <= '9'; ++pExponent)
+                value10 = min(value10 * 10 + (*pExponent - '0'), 1000);
+
+            exponent += negativeExponent ? -value10 : value10;
+            p = pExponent;
+        }
+    }
+
+    double result = static_cast<double>(mantissa);
+
+    if (exponent < 0)
+        result = (exponent >= -22) ? result / powersOf10[-exponent] : result * pow(10.0, exponent);
+    else if (exponent > 0)
+        result = (exponent <= 22) ? result * powersOf10[exponent] : result * pow(10.0, exponent);
+
+    value = static_cast<float>(negative ? -result : result);
+    return true;
+}
+
+bool ParseObjIndex(const char *&p, const char *pEnd, int &value)
+{
+    // Parses a non-zero, possibly negative, OBJ index.
+
+    bool negative = (p < pEnd && *p == '-');
+
+    if (negative)
+        ++p;
+
+    if (p == pEnd || *p < '0' || *p > '9')
+        return false;
+
+    value = 0;
+
+    for (; p < pEnd && *p >= '0' && *p <= '9'; ++p)
+    {
+        if (value > (INT_MAX - 9) / 10)
+            return false;
+
+        value = value * 10 + (*p - '0');
+    }
+
+    if (negative)
+        value = -value;
+
+    return value != 0;
+}
+
+void PlaceOctreeItems(void *pParam, int begin, int end)
+{
+    // Sets up the items of chunks [begin, end) and finds their cells.
+
+    OctreeBuildJob &job = *static_cast<OctreeBuildJob*>(pParam);
+
+    for (int i = begin; i < end; ++i)
+    {
+        const SceneChunk &chunk = job.pScene->chunks[i];
+        OctreeItem &item = job.pTree->items[i];
+
+        memcpy(item.boundsMin, chunk.boundsMin, sizeof(item.boundsMin));
+        memcpy(item.boundsMax, chunk.boundsMax, sizeof(item.boundsMax));
+        item.node = -1;
+        item.prev = -1;
+        item.next = -1;
+        item.value = i;
+        item.lastCulledPlane = 0;
+
+        job.depths[i] = GetOctreeCell(*job.pTree, chunk.boundsMin, chunk.boundsMax, &job.cells[i * 3]);
+    }
+}
+
+void ProcessMouseInput(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+    // Use the left mouse button to track the camera.
+    // Use the middle mouse button to dolly the camera.
+    // Use the right mouse button to orbit the camera.
+
+    enum CameraMode {CAMERA_NONE, CAMERA_TRACK, CAMERA_DOLLY, CAMERA_ORBIT};
+
+    static CameraMode cameraMode = CAMERA_NONE;
+    static POINT ptMousePrev = {0};
+    static POINT ptMouseCurrent = {0};
+    static int mouseButtonsDown = 0;
+    static float dx = 0.0f;
+    static float dy = 0.0f;
+    static float wheelDelta = 0.0f;
+    static D3DXVECTOR3 xAxis(1.0f, 0.0f, 0.0f);
+    static D3DXVECTOR3 yAxis(0.0f, 1.0f, 0.0f);
+    static D3DXQUATERNION temp;
+
+    switch (msg)
+    {
+    case WM_LBUTTONDOWN:
+        cameraMode = CAMERA_TRACK;
+        ++mouseButtonsDown;
+        SetCapture(hWnd);
+        ptMousePrev.x = static_cast<int>(static_cast<short>(LOWORD(lParam)));
+        ptMousePrev.y = static_cast<int>(static_cast<short>(HIWORD(lParam)));
+        ClientToScreen(hWnd, &ptMousePrev);
+        break;
+
+    case WM_RBUTTONDOWN:
+        cameraMode = CAMERA_ORBIT;
+        ++mouseButtonsDown;
+        SetCapture(hWnd);
+        ptMousePrev.x = static_cast<int>(static_cast<short>(LOWORD(lParam)));
+        ptMousePrev.y = static_cast<int>(static_cast<short>(HIWORD(lParam)));
+        ClientToScreen(hWnd, &ptMousePrev);
+        break;
+
+    case WM_MBUTTONDOWN:
+        cameraMode = CAMERA_DOLLY;
+        ++mouseButtonsDown;
+        SetCapture(hWnd);
+        ptMousePrev.x = static_cast<int>(static_cast<short>(LOWORD(lParam)));
+        ptMousePrev.y = static_cast<int>(static_cast<short>(HIWORD(lParam)));
+        ClientToScreen(hWnd, &ptMousePrev);
+        break;
+
+    case WM_MOUSEMOVE:
+        ptMouseCurrent.x = static_cast<int>(static_cast<short>(LOWORD(lParam)));
+        ptMouseCurrent.y = static_cast<int>(static_cast<short>(HIWORD(lParam)));
+        ClientToScreen(hWnd, &ptMouseCurrent);
+
+        switch (cameraMode)
+        {
+        case CAMERA_TRACK:
+            dx = static_cast<float>(ptMouseCurrent.x - ptMousePrev.x);
+            dx *= MOUSE_TRACK_SPEED;
+
+            dy = static_cast<float>(ptMouseCurrent.y - ptMousePrev.y);
+            dy *= MOUSE_TRACK_SPEED;
+
+            g_camera.target -= g_camera.xAxis * dx;
+            g_camera.target += g_camera.yAxis * dy;
+    
+            break;
+
+        case CAMERA_DOLLY:
+            dy = static_cast<float>(ptMousePrev.y - ptMouseCurrent.y);
+            dy *= MOUSE_DOLLY_SPEED;
+
+            g_camera.offset -= dy;
+
+            if (g_camera.offset > DOLLY_MAX)
+                g_camera.offset = DOLLY_MAX;
+
+            if (g_camera.offset < DOLLY_MIN)
+                g_camera.offset = DOLLY_MIN;
+
+            break;
+
+        case CAMERA_ORBIT:
+            dx = static_cast<float>(ptMousePrev.x - ptMouseCurrent.x);
+            dx *= MOUSE_ORBIT_SPEED;
+
+            dy = static_cast<float>(ptMousePrev.y - ptMouseCurrent.y);
+            dy *= MOUSE_ORBIT_SPEED;
+
+            g_camera.pitch += dy;
+
+            if (g_camera.pitch > 90.0f)
+            {
+                dy = 90.0f - (g_camera.pitch - dy);
+                g_camera.pitch = 90.0f;
+            }
+
+            if (g_camera.pitch < -90.0f)
+            {
+                dy = -90.0f - (g_camera.pitch - dy);
+                g_camera.pitch = -90.0f;
+            }
+
+            dx = D3DXToRadian(dx);
+            dy = D3DXToRadian(dy);
+            
+            if (dx != 0.0f)
+            {
+                D3DXQuaternionRotationAxis(&temp, &yAxis, dx);
+                D3DXQuaternionMultiply(&g_camera.orientation, &temp, &g_camera.orientation);
+            }
+
+            if (dy != 0.0f)
+            {
+                D3DXQuaternionRotationAxis(&temp, &xAxis, dy);
+                D3DXQuaternionMultiply(&g_camera.orientation, &g_camera.orientation, &temp);
+            }
+
+            break;
+        }
+
+        ptMousePrev.x = ptMouseCurrent.x;
+        ptMousePrev.y = ptMouseCurrent.y;
+        break;
+
+    case WM_LBUTTONUP:
+    case WM_RBUTTONUP:
+    case WM_MBUTTONUP:
+        if (--mouseButtonsDown <= 0)
+        {
+            mouseButtonsDown = 0;
+            cameraMode = CAMERA_NONE;
+            ReleaseCapture();
+        }
+        else
+        {
+            if (wParam & MK_LBUTTON)
+                cameraMode = CAMERA_TRACK;
+            else if (wParam & MK_RBUTTON)
+                cameraMode = CAMERA_ORBIT;
+            else if (wParam & MK_MBUTTON)
+                cameraMode = CAMERA_DOLLY;
+        }
+        break;
+
+    case WM_MOUSEWHEEL:
+        wheelDelta = static_cast<float>(static_cast<int>(wParam) >> 16);
+        g_camera.offset -= wheelDelta * MOUSE_WHEEL_DOLLY_SPEED;
+
+        if (g_camera.offset > DOLLY_MAX)
+            g_camera.offset = DOLLY_MAX;
+
+        if (g_camera.offset < DOLLY_MIN)
+            g_camera.offset = DOLLY_MIN;
+
+        break;
+
+    default:
+        break;
+    }
+}
+
+void PublishFrameInput()
+{
+    // Hands the latest camera and UI state to the simulation stage. The time
+    // stamp travels with the frame built from this input so that the delay
+    // from input to present can be measured.
+
+    EnterCriticalSection(&g_frameInputLock);
+
+    g_frameInput.viewProjectionMatrix = g_camera.viewProjectionMatrix;
+    g_frameInput.cameraPos = g_camera.pos;
+    g_frameInput.animateLights = g_animateLights;
+    g_frameInput.time = GetTimeInSeconds();
+
+    LeaveCriticalSection(&g_frameInputLock);
+}
+
+void RasterizeOccluderTriangle(OcclusionBuffer &buffer, const D3DXVECTOR3 *pPositions)
+{
+    // Transforms a triangle into clip space and clips it against the near
+    // plane, which can leave a quad. The other planes need no clipping as
+    // the rasterizer only visits pixels inside the buffer.
+
+    D3DXVECTOR4 clip[3];
+    D3DXVECTOR4 polygon[4];
+    int count = 0;
+
+    for (int i = 0; i < 3; ++i)
+        D3DXVec3Transform(&clip[i], &pPositions[i], &buffer.viewProjection);
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const D3DXVECTOR4 &a = clip[i];
+        const D3DXVECTOR4 &b = clip[(i + 1) % 3];
+
+        if (a.z >= 0.0f)
+            polygon[count++] = a;
+
+        if ((a.z >= 0.0f) != (b.z >= 0.0f))
+            polygon[count++] = a + (b - a) * (a.z / (a.z - b.z));
+    }
+
+    if (count < 3)
+        return;
+
+    float screen[4][3];
+
+    for (int i = 0; i < count; ++i)
+    {
+        float invW = 1.0f / polygon[i].w;
+
+        screen[i][0] = (polygon[i].x * invW * 0.5f + 0.5f) * buffer.width;
+        screen[i][1] = (0.5f - polygon[i].y * invW * 0.5f) * buffer.height;
+        screen[i][2] = invW;
+    }
+
+    for (int i = 2; i < count; ++i)
+        FillOcclusionTriangle(buffer, screen[0], screen[i - 1], screen[i]);
+}
+
+DWORD ReadBlockBits(const BYTE *pBlock, int &offset, int count)
+{
+    // Reads count bits, least significant first, starting at bit offset of
+    // a compressed block.
+
+    DWORD value = 0;
+
+    for (int i = 0; i < count; ++i, ++offset)
+        value |= ((pBlock[offset >> 3] >> (offset & 7)) & 1) << i;
+
+    return value;
+}
+
+bool ReadFileContents(const char *pszFilename, std::vector<BYTE> &data)
+{
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_READ, FILE_SHARE_READ, 0,
+                    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size = {0};
+    DWORD bytesRead = 0;
+    bool succeeded = false;
+
+    if (GetFileSizeEx(hFile, &size) && size.QuadPart > 0 && size.QuadPart < 0x7fffffff)
+    {
+        data.resize(static_cast<size_t>(size.QuadPart));
+
+        succeeded = ReadFile(hFile, &data[0], static_cast<DWORD>(data.size()), &bytesRead, 0)
+                    && bytesRead == data.size();
+    }
+
+    CloseHandle(hFile);
+    return succeeded;
+}
+
+void ReadTextureJob(void *pParam)
+{
+    TextureLoad &load = *static_cast<TextureLoad*>(pParam);
+
+    AllocationZone zone("ReadTexture");
+
+    if (!ReadFileContents(load.pszFilename, load.fileData))
+        return;
+
+    if (load.useCache)
+    {
+        load.sourceHash = HashBytes(&load.fileData[0], load.fileData.size());
+
+        if (MapTextureCache(load.szCacheFilename, load.sourceHash, load.compressed))
+        {
+            std::vector<BYTE>().swap(load.fileData);
+            load.fromCache = true;
+            load.succeeded = true;
+            return;
+        }
+    }
+
+    load.pDecodePool->submit(DecodeTextureJob, &load);
+}
+
+bool ReadVirtualPage(const VirtualTexture &texture, int page, DWORD *pTexels)
+{
+    // Reads one page from the page file and decompresses it. The read
+    // gives its own file offset, so pages can be read from several threads
+    // at once through the one handle.
+
+    BYTE blocks[VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE / 2];
+    ULONGLONG offset = sizeof(VirtualTextureHeader) + static_cast<ULONGLONG>(page) * texture.header.pageBytes;
+    OVERLAPPED overlapped = {0};
+    DWORD bytesRead = 0;
+
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    if (texture.header.pageBytes != sizeof(blocks) ||
+        !ReadFile(texture.hFile, blocks, sizeof(blocks), &bytesRead, &overlapped) ||
+        bytesRead != sizeof(blocks))
+    {
+        return false;
+    }
+
+    const int blocksWide = VIRTUAL_PAGE_STRIDE / 4;
+    DWORD pixels[16];
+
+    for (int by = 0; by < blocksWide; ++by)
+    {
+        for (int bx = 0; bx < blocksWide; ++bx)
+        {
+            DecompressBlockBC1(blocks + (by * blocksWide + bx) * 8, false, pixels);
+
+            for (int y = 0; y < 4; ++y)
+                memcpy(pTexels + (by * 4 + y) * VIRTUAL_PAGE_STRIDE + bx * 4, pixels + y * 4, 4 * sizeof(DWORD));
+        }
+    }
+
+    return true;
+}
+
+void RecordAllocationSite(void *pAddress, int zone, size_t size)
+{
+    // Call sites are kept in a fixed size open addressed hash table keyed on
+    // the return address of operator new. Allocations from sites that no
+    // longer fit in the table are still counted in the totals.
+
+    UINT_PTR hash = (reinterpret_cast<UINT_PTR>(pAddress) >> 2) * 2654435761U;
+
+    for (int i = 0; i < ALLOCATION_MAX_SITES; ++i)
+    {
+        AllocationSite &site = g_allocationSites[(hash + i) & (ALLOCATION_MAX_SITES - 1)];
+        void *pExisting = site.pAddress;
+
+        if (!pExisting)
+        {
+            pExisting = InterlockedCompareExchangePointer(&site.pAddress, pAddress, 0);
+
+            if (!pExisting)
+            {
+                site.zone = zone;
+                pExisting = pAddress;
+            }
+        }
+
+        if (pExisting == pAddress)
+        {
+            InterlockedIncrement(&site.allocations);
+            InterlockedExchangeAdd64(&site.bytes, size);
+            return;
+        }
+    }
+}
+
+void RemoveOctreeItem(Octree &tree, int index)
+{
+    if (tree.items[index].node < 0)
+        return;
+
+    UnlinkOctreeItem(tree, index);
+    tree.items[index].next = tree.freeItem;
+    tree.freeItem = index;
+}
+
+void RenderFrame(const FrameSnapshot &frame)
+{
+    g_pDevice->Clear(0, 0, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, 0, 1.0f, 0);
+
+    if (FAILED(g_pDevice->BeginScene()))
+        return;
+
+    // The occlusion buffer started for this frame is finished by the time
+    // the scene has been drawn, and also hides the lights behind walls.
+
+    bool testLights = g_occlusionJob.pending;
+
+    if (g_pSceneVertexBuffer)
+        RenderSceneUsingBlinnPhong(frame);
+    else
+        RenderRoomUsingBlinnPhong();
+
+    if (g_pModelVertexBuffer)
+        RenderModelUsingBlinnPhong();
+
+    g_lightTriangles = 0;
+
+    if (g_renderLights)
+    {
+        for (int i = 0; i < g_numLights; ++i)
+        {
+            if (testLights)
+            {
+                ++g_occlusionStats.lightsTested;
+
+                if (!TestOcclusionSphere(g_occlusionBuffer, frame.lights[i].renderPos, LIGHT_OBJECT_RADIUS))
+                {
+                    ++g_occlusionStats.lightsOccluded;
+                    continue;
+                }
+            }
+
+            RenderLight(frame, i);
+        }
+    }
+
+    RenderText(frame);
+
+    g_pDevice->EndScene();
+    g_pDevice->Present(0, 0, 0, 0);
+
+    // Present() returns once the frame has been queued, which is as close
+    // to the display as we can observe without vendor specific extensions.
+
+    g_inputLatencyAccumMs += (GetTimeInSeconds() - frame.inputTime) * 1000.0;
+    ++g_inputLatencySamples;
+
+    if (g_timeToFirstFrameMs == 0.0f)
+    {
+        char szMessage[128];
+
+        g_timeToFirstFrameMs = static_cast<float>((GetTimeInSeconds() - g_startupTime) * 1000.0);
+        snprintf(szMessage, sizeof(szMessage), "Time to first frame: %.1f ms (%.1f ms loading assets)\n",
+            g_timeToFirstFrameMs, g_assetLoadTimeMs);
+        OutputDebugString(szMessage);
+    }
+}
+
+void RenderLight(const FrameSnapshot &frame, int i)
+{
+    static UINT totalPasses;
+    static D3DXHANDLE hTechnique;
+    static D3DXMATRIX world;
+    static D3DXMATRIX worldViewProjection;
+
+    const PointLight &light = frame.lights[i];
+    const D3DXMATRIX &viewProjection = frame.viewProjectionMatrix;
+
+    // Pick the light's LOD from how big it is on screen.
+
+    float projectedRadius = GetProjectedRadius(viewProjection, light.renderPos, LIGHT_OBJECT_RADIUS, g_windowHeight);
+    int lod = g_lightLods[i] = UpdateLightLod(g_lightLods[i], projectedRadius);
+
+    if (lod == LIGHT_LOD_IMPOSTOR)
+        hTechnique = g_pAmbientEffect->GetTechniqueByName("AmbientImpostor");
+    else
+        hTechnique = g_pAmbientEffect->GetTechniqueByName("AmbientLighting");
+
+    if (FAILED(g_pAmbientEffect->SetTechnique(hTechnique)))
+        return;
+
+    D3DXMatrixTranslation(&world, light.renderPos[0], light.renderPos[1], light.renderPos[2]);
+    worldViewProjection = world * viewProjection;
+
+    g_pAmbientEffect->SetMatrix("worldViewProjectionMatrix", &worldViewProjection);
+    g_pAmbientEffect->SetFloat("ambientIntensity", 1.0f);
+    g_pAmbientEffect->SetValue("ambientColor", light.ambient, sizeof(light.ambient));
+
+    if (lod == LIGHT_LOD_IMPOSTOR)
+    {
+        // The camera's axes are the directions of the first two columns of
+        // the view-projection matrix.
+
+        D3DXVECTOR3 right(viewProjection._11, viewProjection._21, viewProjection._31);
+        D3DXVECTOR3 up(viewProjection._12, viewProjection._22, viewProjection._32);
+
+        D3DXVec3Normalize(&right, &right);
+        D3DXVec3Normalize(&up, &up);
+
+        g_pAmbientEffect->SetValue("cameraRight", &right, sizeof(right));
+        g_pAmbientEffect->SetValue("cameraUp", &up, sizeof(up));
+        g_pAmbientEffect->SetFloat("impostorRadius", LIGHT_OBJECT_RADIUS);
+        g_pDevice->SetVertexDeclaration(g_pLightImpostorVertexDecl);
+        g_pDevice->SetStreamSource(0, g_pLightImpostorVertexBuffer, 0, sizeof(float) * 2);
+    }
+
+    // Draw the light object.
+
+    if (SUCCEEDED(g_pAmbientEffect->Begin(&totalPasses, 0)))
+    {
+        for (UINT pass = 0; pass < totalPasses; ++pass)
+        {
+            if (SUCCEEDED(g_pAmbientEffect->BeginPass(pass)))
+            {
+                if (lod == LIGHT_LOD_IMPOSTOR)
+                    g_pDevice->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2);
+                else
+                    g_pLightMeshes[lod]->DrawSubset(0);
+
+                g_pAmbientEffect->EndPass();
+            }
+        }
+
+        g_pAmbientEffect->End();
+    }
+
+    g_lightTriangles += GetLightLodTriangles(lod);
+}
+
+void RenderModelUsingBlinnPhong()
+{
+    // The model has no texture or materials of its own, so it is drawn in
+    // the shiny material with the white null texture.
+
+    static const float identityScale[3] = {1.0f, 1.0f, 1.0f};
+    static const float identityOffset[3] = {0.0f, 0.0f, 0.0f};
+
+    if (FAILED(g_pBlinnPhongEffect->SetTechnique(GetBlinnPhongTechnique(false))))
+        return;
+
+    g_pBlinnPhongEffect->SetFloatArray("positionScale", identityScale, 3);
+    g_pBlinnPhongEffect->SetFloatArray("positionOffset", identityOffset, 3);
+    g_pBlinnPhongEffect->SetBool("packedNormals", FALSE);
+    g_pBlinnPhongEffect->SetValue("material.ambient", g_shinyMaterial.ambient, sizeof(g_shinyMaterial.ambient));
+    g_pBlinnPhongEffect->SetValue("material.diffuse", g_shinyMaterial.diffuse, sizeof(g_shinyMaterial.diffuse));
+    g_pBlinnPhongEffect->SetValue("material.emissive", g_shinyMaterial.emissive, sizeof(g_shinyMaterial.emissive));
+    g_pBlinnPhongEffect->SetValue("material.specular", g_shinyMaterial.specular, sizeof(g_shinyMaterial.specular));
+    g_pBlinnPhongEffect->SetFloat("material.shininess", g_shinyMaterial.shininess);
+    g_pBlinnPhongEffect->SetTexture("colorMapTexture", g_pNullTexture);
+
+    g_pDevice->SetVertexDeclaration(g_pRoomVertexDecl);
+    g_pDevice->SetStreamSource(0, g_pModelVertexBuffer, 0, sizeof(Vertex));
+    g_pDevice->SetIndices(g_pModelIndexBuffer);
+
+    UINT totalPasses = 0;
+
+    if (FAILED(g_pBlinnPhongEffect->Begin(&totalPasses, 0)))
+        return;
+
+    for (UINT pass = 0; pass < totalPasses; ++pass)
+    {
+        if (SUCCEEDED(g_pBlinnPhongEffect->BeginPass(pass)))
+        {
+            g_pDevice->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, 0, g_modelVertexCount, 0, g_modelTriangleCount);
+            g_pBlinnPhongEffect->EndPass();
+        }
+    }
+
+    g_pBlinnPhongEffect->End();
+}
+
+void RenderOccluders(const OccluderSet &occluders, const D3DXMATRIX &viewProjection,
+                     const D3DXVECTOR3 &cameraPos, OcclusionBuffer &buffer, OcclusionStats &stats)
+{
+    // Clears the buffer, rasterizes the occluders in view into it and
+    // builds its pyramid. Occluders that are small for their distance from
+    // the camera hide little and are skipped.
+
+    D3DXPLANE planes[FRUSTUM_PLANES];
+    const __m128 far = _mm_setzero_ps();
+
+    GetFrustumPlanes(viewProjection, planes);
+    buffer.viewProjection = viewProjection;
+    stats.occluders = 0;
+    stats.triangles = 0;
+
+    for (int i = 0; i < buffer.width * buffer.height; i += 4)
+        _mm_store_ps(buffer.pDepth + i, far);
+
+    for (size_t i = 0; i < occluders.occluders.size(); ++i)
+    {
+        const Occluder &occluder = occluders.occluders[i];
+        int planeMask = FRUSTUM_ALL_PLANES;
+        int lastCulledPlane = 0;
+
+        if (!CullBox(planes, occluder.boundsMin, occluder.boundsMax, planeMask, lastCulledPlane))
+            continue;
+
+        // Compare the occluder's size with the distance to its nearest
+        // point, which is 0 when the camera is inside it.
+
+        float size = 0.0f;
+        float distance = 0.0f;
+
+        for (int c = 0; c < 3; ++c)
+        {
+            float extent = occluder.boundsMax[c] - occluder.boundsMin[c];
+            float gap = max(0.0f, max(occluder.boundsMin[c] - cameraPos[c], cameraPos[c] - occluder.boundsMax[c]));
+
+            size += extent * extent;
+            distance += gap * gap;
+        }
+
+        if (size < OCCLUSION_MIN_OCCLUDER_SIZE * OCCLUSION_MIN_OCCLUDER_SIZE * distance)
+            continue;
+
+        for (int j = 0; j < occluder.vertexCount; j += 3)
+            RasterizeOccluderTriangle(buffer, &occluders.positions[occluder.firstVertex + j]);
+
+        ++stats.occluders;
+        stats.triangles += occluder.vertexCount / 3;
+    }
+
+    BuildOcclusionPyramid(buffer);
+}
+
+void RenderOccludersJob(void *pParam)
+{
+    OcclusionJob &job = *static_cast<OcclusionJob*>(pParam);
+    double startTime = GetTimeInSeconds();
+
+    RenderOccluders(*job.pOccluders, job.viewProjection, job.cameraPos, *job.pBuffer, job.stats);
+    job.stats.rasterizeTimeMs = static_cast<float>((GetTimeInSeconds() - startTime) * 1000.0);
+
+    InterlockedExchange(&job.done, 1);
+}
+
+void RenderRoomUsingBlinnPhong()
+{
+    bool useAtlas = g_useRoomAtlas && g_pRoomAtlasTexture && g_pBlinnPhongEffect == g_pBlinnPhongEffectSM30;
+
+    if (FAILED(g_pBlinnPhongEffect->SetTechnique(GetBlinnPhongTechnique(useAtlas))))
+        return;
+    
+    // Packed positions are scaled and offset back into place by the vertex
+    // shader, which also decodes packed normals.
+
+    static const float identityScale[3] = {1.0f, 1.0f, 1.0f};
+    static const float identityOffset[3] = {0.0f, 0.0f, 0.0f};
+    bool usePacked = g_usePackedVertices && g_pRoomPackedVertexBuffer;
+
+    g_pBlinnPhongEffect->SetFloatArray("positionScale", usePacked ? g_roomQuantization.halfExtent : identityScale, 3);
+    g_pBlinnPhongEffect->SetFloatArray("positionOffset", usePacked ? g_roomQuantization.center : identityOffset, 3);
+    g_pBlinnPhongEffect->SetBool("packedNormals", usePacked);
+
+    if (usePacked)
+        g_pDevice->SetStreamSource(0, g_pRoomPackedVertexBuffer, 0, sizeof(PackedVertex));
+    else
+        g_pDevice->SetStreamSource(0, g_pRoomVertexBuffer, 0, sizeof(Vertex));
+
+    g_pDevice->SetIndices(g_pRoomIndexBuffer);
+
+    if (useAtlas)
+    {
+        g_pDevice->SetVertexDeclaration(usePacked ? g_pRoomPackedAtlasVertexDecl : g_pRoomAtlasVertexDecl);
+        g_pDevice->SetStreamSource(1, g_pRoomAtlasVertexBuffer, 0, sizeof(RoomAtlasVertex));
+    }
+    else
+    {
+        g_pDevice->SetVertexDeclaration(usePacked ? g_pRoomPackedVertexDecl : g_pRoomVertexDecl);
+    }
+
+    RoomBatch batches[ROOM_MAX_BATCHES];
+    int count = BuildRoomBatches(useAtlas, batches);
+
+    // Once the lights have been baked into the lightmap the room is lit by
+    // it alone, and no lights are left to loop over per pixel.
+
+    if (g_lightmapActive)
+    {
+        int numLights = 0;
+
+        g_pBlinnPhongEffect->SetBool("useLightmap", TRUE);
+        g_pBlinnPhongEffect->SetValue("numLights", &numLights, sizeof(numLights));
+    }
+
+    memset(&g_roomSubmissions, 0, sizeof(g_roomSubmissions));
+    SubmitRoomBatches(g_pBlinnPhongEffect, batches, count, g_roomSubmissions);
+
+    if (g_lightmapActive)
+    {
+        g_pBlinnPhongEffect->SetBool("useLightmap", FALSE);
+        g_pBlinnPhongEffect->SetValue("numLights", &g_numLights, sizeof(g_numLights));
+    }
+
+    if (useAtlas)
+        g_pDevice->SetStreamSource(1, 0, 0, 0);
+}
+
+void RenderSceneUsingBlinnPhong(const FrameSnapshot &frame)
+{
+    // Draws the chunks of the generated scene that may be in view, found
+    // with the octree or, for comparison, by testing every chunk. Chunks
+    // the walls rasterized into the occlusion buffer hide are dropped. The
+    // buffer has been drawn on a worker thread in the meantime. The walls
+    // and props, the ceilings and the floors are drawn one after another
+    // with the room's materials and color maps. Visible chunks that follow
+    // each other in the vertex buffer are drawn together.
+
+    static const float identityScale[3] = {1.0f, 1.0f, 1.0f};
+    static const float identityOffset[3] = {0.0f, 0.0f, 0.0f};
+
+    D3DXPLANE planes[FRUSTUM_PLANES];
+    int *pVisible = g_frameArena.allocateArray<int>(g_scene.chunks.size());
+    int count = 0;
+
+    GetFrustumPlanes(frame.viewProjectionMatrix, planes);
+
+    if (g_useSceneOctree)
+        count = CullOctree(g_sceneOctree, planes, pVisible, g_sceneCullStats);
+    else
+        count = CullSceneChunks(g_scene, planes, pVisible, g_sceneCullStats);
+
+    if (g_occlusionJob.pending)
+    {
+        int unoccluded = 0;
+
+        FinishOcclusionJob(g_occlusionJob, g_workerPool);
+        g_occlusionStats = g_occlusionJob.stats;
+
+        for (int i = 0; i < count; ++i)
+        {
+            const SceneChunk &chunk = g_scene.chunks[pVisible[i]];
+
+            if (TestOcclusionBox(g_occlusionBuffer, chunk.boundsMin, chunk.boundsMax))
+                pVisible[unoccluded++] = pVisible[i];
+        }
+
+        g_occlusionStats.objectsTested = count;
+        g_occlusionStats.objectsOccluded = count - unoccluded;
+        count = unoccluded;
+    }
+
+    std::sort(pVisible, pVisible + count);
+
+    g_sceneVisibleChunks = count;
+    g_sceneDrawCalls = 0;
+
+    if (FAILED(g_pBlinnPhongEffect->SetTechnique(GetBlinnPhongTechnique(false))))
+        return;
+
+    g_pBlinnPhongEffect->SetFloatArray("positionScale", identityScale, 3);
+    g_pBlinnPhongEffect->SetFloatArray("positionOffset", identityOffset, 3);
+    g_pBlinnPhongEffect->SetBool("packedNormals", FALSE);
+
+    g_pDevice->SetVertexDeclaration(g_pRoomVertexDecl);
+    g_pDevice->SetStreamSource(0, g_pSceneVertexBuffer, 0, sizeof(Vertex));
+
+    RoomBatch batches[ROOM_MAX_BATCHES];
+
+    BuildRoomBatches(false, batches);
+
+    for (int surface = 0; surface < ROOM_SURFACE_COUNT; ++surface)
+    {
+        const Material &material = *batches[surface].pMaterial;
+
+        g_pBlinnPhongEffect->SetValue("material.ambient", material.ambient, sizeof(material.ambient));
+        g_pBlinnPhongEffect->SetValue("material.diffuse", material.diffuse, sizeof(material.diffuse));
+        g_pBlinnPhongEffect->SetValue("material.emissive", material.emissive, sizeof(material.emissive));
+        g_pBlinnPhongEffect->SetValue("material.specular", material.specular, sizeof(material.specular));
+        g_pBlinnPhongEffect->SetFloat("material.shininess", material.shininess);
+        g_pBlinnPhongEffect->SetTexture(batches[surface].pszTextureName, *batches[surface].ppTexture);
+
+        UINT totalPasses = 0;
+
+        if (FAILED(g_pBlinnPhongEffect->Begin(&totalPasses, 0)))
+            continue;
+
+        for (UINT pass = 0; pass < totalPasses; ++pass)
+        {
+            if (FAILED(g_pBlinnPhongEffect->BeginPass(pass)))
+                continue;
+
+            for (int i = 0; i < count; )
+            {
+                const SceneChunk &chunk = g_scene.chunks[pVisible[i++]];
+
+                if (chunk.surface != surface)
+                    continue;
+
+                int firstVertex = chunk.firstVertex;
+                int vertexCount = chunk.vertexCount;
+
+                while (i < count)
+                {
+                    const SceneChunk &next = g_scene.chunks[pVisible[i]];
+
+                    if (next.surface != surface || next.firstVertex != firstVertex + vertexCount ||
+                        static_cast<DWORD>(vertexCount + next.vertexCount) / 3 > g_caps.MaxPrimitiveCount)
+                        break;
+
+                    vertexCount += next.vertexCount;
+                    ++i;
+                }
+
+                g_pDevice->DrawPrimitive(D3DPT_TRIANGLELIST, firstVertex, vertexCount / 3);
+                ++g_sceneDrawCalls;
+            }
+
+            g_pBlinnPhongEffect->EndPass();
+        }
+
+        g_pBlinnPhongEffect->End();
+    }
+}
+
+void RenderShadowFaces(void *pParam, int begin, int end)
+{
+    // Draws faces [begin, end) of the frame's updates into their tiles.
+    // Each face only rasterizes the casters inside its frustum, and faces
+    // have tiles of their own, so they can be drawn in parallel.
+
+    ShadowCache &cache = *static_cast<ShadowCache*>(pParam);
+    const OccluderSet &casters = *cache.pCasters;
+    const __m128 far = _mm_setzero_ps();
+
+    for (int i = begin; i < end; ++i)
+    {
+        int index = cache.updates[i];
+        ShadowFace &face = cache.lights[index / SHADOW_CUBE_FACES].faces[index % SHADOW_CUBE_FACES];
+        OcclusionBuffer buffer;
+        D3DXPLANE planes[FRUSTUM_PLANES];
+
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.width = cache.tileSize;
+        buffer.height = cache.tileSize;
+        buffer.levels = 1;
+        buffer.levelWidths[0] = cache.tileSize;
+        buffer.levelHeights[0] = cache.tileSize;
+        buffer.pDepth = cache.pTexels + static_cast<size_t>(face.tile) * cache.tileSize * cache.tileSize;
+        buffer.viewProjection = face.viewProjection;
+        face.drawnViewProjection = face.viewProjection;
+
+        for (int j = 0; j < cache.tileSize * cache.tileSize; j += 4)
+            _mm_store_ps(buffer.pDepth + j, far);
+
+        GetFrustumPlanes(face.viewProjection, planes);
+
+        for (size_t j = 0; j < casters.occluders.size(); ++j)
+        {
+            const Occluder &caster = casters.occluders[j];
+            int planeMask = FRUSTUM_ALL_PLANES;
+            int lastCulledPlane = 0;
+
+            if (!CullBox(planes, caster.boundsMin, caster.boundsMax, planeMask, lastCulledPlane))
+                continue;
+
+            for (int k = 0; k < caster.vertexCount; k += 3)
+                RasterizeOccluderTriangle(buffer, &casters.positions[caster.firstVertex + k]);
+        }
+    }
+}
+
+void RenderText(const FrameSnapshot &frame)
+{
+    // The HUD text is formatted into a fixed size buffer from the frame arena
+    // rather than a std::ostringstream so that rendering the HUD doesn't
+    // allocate any heap memory in steady state frames.
+
+    static RECT rcClient;
+
+    AllocationZone zone("RenderText");
+    char *szOutput = g_frameArena.allocateArray<char>(HUD_TEXT_MAX_CHARS);
+    double startTime = GetTimeInSeconds();
+    int length = 0;
+
+    szOutput[0] = '\0';
+
+    if (g_displayHelp)
+    {
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length,
+            "Left mouse click and drag to track camera\n"
+            "Middle mouse click and drag to dolly camera\n"
+            "Right mouse click and drag to orbit camera\n"
+            "Mouse wheel to dolly camera\n"
+            "\n"
+            "Press +/- to increase/decrease light radius\n"
+            "Press A to display/hide heap allocation statistics\n"
+            "Press B to enable/disable baking paused lights into the room lightmap [Shader Model 3.0]\n"
+            "Press C to toggle octree/brute force culling of the scene\n"
+            "Press F to toggle glyph atlas/D3DX font text rendering\n"
+            "Press SPACE to start/stop light animation\n"
+            "Press L to enable/disable rendering of lights\n"
+            "Press M to enable/disable multi pass lighting [Shader Model 2.0]\n"
+            "Press O to enable/disable occlusion culling of the scene\n"
+            "Press P to cycle the number of frames in flight (0 = serial)\n"
+            "Press R to enable/disable the room texture atlas [Shader Model 3.0]\n"
+            "Press S to toggle between Shader Model 2.0 and 3.0\n"
+            "Press T to enable/disable textures\n"
+            "Press V to toggle packed/full precision room vertices\n"
+            "Press ALT + ENTER to toggle full screen\n"
+            "Press ESC to exit\n"
+            "\n"
+            "Press H to hide help");
+    }
+    else if (g_displayAllocations)
+    {
+        AppendAllocationReport(szOutput, HUD_TEXT_MAX_CHARS, length);
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "\nPress A to hide heap allocation statistics");
+    }
+    else
+    {
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "FPS: %d\n", g_framesPerSecond);
+
+        if (g_msaaSamples > 1)
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Multisample anti-aliasing: %dx\n",
+                static_cast<int>(g_msaaSamples));
+
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Anisotropic filtering: %dx\n",
+            static_cast<int>(g_maxAnisotrophy));
+
+        if (g_pBlinnPhongEffect == g_pBlinnPhongEffectSM30)
+        {
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length,
+                "Shader Model 3.0\n"
+                "Technique: Single pass lighting\n");
+        }
+        else
+        {
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Shader Model 2.0\n");
+
+            if (g_enableMultipassLighting)
+                AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Technique: Multi pass lighting\n");
+            else
+                AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Technique: Single pass lighting\n");
+        }
+
+        if (g_pSceneVertexBuffer)
+        {
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Scene: %d %s, %d of %d chunks visible in %d draw calls\n",
+                g_scene.desc.rooms, (g_scene.desc.layout == SCENE_LAYOUT_MAZE) ? "maze cells" : "rooms",
+                g_sceneVisibleChunks, static_cast<int>(g_scene.chunks.size()), g_sceneDrawCalls);
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Culling: %d nodes visited, %d chunks culled, %d boxes tested [%s]\n",
+                g_sceneCullStats.nodesVisited, g_sceneCullStats.itemsCulled, g_sceneCullStats.itemsTested,
+                g_useSceneOctree ? "octree" : "brute force");
+
+            if (g_useOcclusionCulling)
+            {
+                AppendText(szOutput, HUD_TEXT_MAX_CHARS, length,
+                    "Occlusion: %d walls in %.2f ms, %d of %d chunks and %d of %d lights hidden\n",
+                    g_occlusionStats.occluders, g_occlusionStats.rasterizeTimeMs,
+                    g_occlusionStats.objectsOccluded, g_occlusionStats.objectsTested,
+                    g_occlusionStats.lightsOccluded, g_occlusionStats.lightsTested);
+            }
+            else
+            {
+                AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Occlusion: off\n");
+            }
+        }
+        else
+        {
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Room: %d draw calls, %d effect rounds, %d parameter sets [%s]\n",
+                g_roomSubmissions.drawCalls, g_roomSubmissions.effectRounds, g_roomSubmissions.parameterSets,
+                (g_useRoomAtlas && g_pRoomAtlasTexture && g_pBlinnPhongEffect == g_pBlinnPhongEffectSM30) ?
+                "texture atlas" : "separate textures");
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Room vertices: %d x %d bytes [%s]\n",
+                static_cast<int>(g_roomMesh.vertices.size()),
+                (g_usePackedVertices && g_pRoomPackedVertexBuffer) ? static_cast<int>(sizeof(PackedVertex)) : static_cast<int>(sizeof(Vertex)),
+                (g_usePackedVertices && g_pRoomPackedVertexBuffer) ? "packed" : "full precision");
+
+            if (g_pLightmapTexture && g_pBlinnPhongEffect == g_pBlinnPhongEffectSM30)
+            {
+                if (g_lightmapActive)
+                {
+                    AppendText(szOutput, HUD_TEXT_MAX_CHARS, length,
+                        "Lightmap: %dx%d texels baked in %.0f ms (%d shadow rays), 0 lights per pixel\n",
+                        g_lightmap.width, g_lightmap.height, g_lightmapBake.bakeTimeMs,
+                        g_lightmapBake.raysTraced);
+                }
+                else
+                {
+                    AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Lightmap: %s, %d lights per pixel\n",
+                        !g_useLightmap ? "off" : ((g_lightmapBake.pending && !g_lightmapBake.cancel) ? "baking" : "waiting for lights to stop"),
+                        g_numLights);
+                }
+            }
+        }
+
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Light radius: %g\n", frame.lights[0].radius);
+
+        if (g_renderLights)
+        {
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Light markers: %d triangles (%d without LODs)\n",
+                g_lightTriangles, g_numLights * GetLightLodTriangles(0));
+        }
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Simulation: %g Hz fixed timestep\n",
+            1.0f / g_simulationTimestep);
+
+        if (g_framePipeline.depth > 0)
+        {
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length,
+                "Pipeline: %d frames in flight, %d simulated frames/s\n",
+                g_framePipeline.depth, g_simulatedFramesPerSecond);
+        }
+        else
+        {
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Pipeline: serial\n");
+        }
+
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Input to present latency: %.2f ms\n",
+            g_inputLatencyMs);
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Startup: %.0f ms to first frame, %.0f ms loading [%s, %d/3 textures cached]\n",
+            g_timeToFirstFrameMs, g_assetLoadTimeMs, g_serialLoading ? "serial" : "parallel", g_texturesFromCache);
+
+        if (g_pModelVertexBuffer)
+        {
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Model: %u triangles, %u vertices, %.0f ms [%s]\n",
+                g_modelTriangleCount, g_modelVertexCount, g_modelLoadTimeMs,
+                g_modelFromCache ? "mesh cache" : "parsed OBJ");
+        }
+
+        if (g_useGlyphAtlasText)
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Text: %g ms [glyph atlas]\n", g_textTimeMs);
+        else
+            AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Text: %g ms [D3DX font]\n", g_textTimeMs);
+
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "Heap allocations: %g per frame (%g bytes)\n",
+            g_allocationStats.allocationsPerFrame, g_allocationStats.bytesPerFrame);
+
+        AppendText(szOutput, HUD_TEXT_MAX_CHARS, length, "\nPress H to display help");
+    }
+
+    GetClientRect(g_hWnd, &rcClient);
+    rcClient.left += 4;
+    rcClient.top += 2;
+
+    if (g_useGlyphAtlasText)
+    {
+        // Only lay the text out again when it has actually changed.
+
+        const D3DCOLOR color = D3DCOLOR_XRGB(255, 255, 0);
+
+        if (strcmp(szOutput, g_hudLayout.text) != 0 || rcClient.left != g_hudLayout.x ||
+            rcClient.top != g_hudLayout.y || color != g_hudLayout.color)
+        {
+            LayoutText(g_glyphAtlas, szOutput, rcClient.left, rcClient.top,
+                color, g_hudLayout);
+        }
+
+        DrawTextLayout(g_hudLayout);
+    }
+    else
+    {
+        g_pFont->DrawText(0, szOutput, -1, &rcClient,
+            DT_EXPANDTABS | DT_LEFT, D3DCOLOR_XRGB(255, 255, 0));
+    }
+
+    g_textTimeAccumMs += (GetTimeInSeconds() - startTime) * 1000.0;
+    ++g_textTimeSamples;
+}
+
+int ReprojectLighting(LightingCache &cache, const float *pPositions, const float *pNormals, float *pColors,
+                      int *pShade)
+{
+    // Fills in the lighting of the current frame's pixels, whose surfaces
+    // are given, from the last frame's, and lists in pShade the pixels
+    // that must be shaded instead. Returns how many there are. Each pixel's
+    // surface is projected with the last frame's view projection, and the
+    // pixel it lands on keeps its lighting for this one if it saw a
+    // surface at about the same depth facing about the same way. Pixels
+    // that don't find history, whose history is too old, or whose turn it
+    // is in the rotating pattern are shaded. UpdateLightingCache() stores
+    // the frame once they are.
+
+    const D3DXMATRIX &m = cache.viewProjection;
+    const int tileSize = LIGHTING_CACHE_REFRESH_TILE * LIGHTING_CACHE_REFRESH_TILE;
+    int turn = cache.frame % tileSize;
+    int count = 0;
+
+    for (int y = 0; y < cache.height; ++y)
+    {
+        for (int x = 0; x < cache.width; ++x)
+        {
+            int i = y * cache.width + x;
+            const float *pPos = &pPositions[i * 3];
+            const float *pNormal = &pNormals[i * 3];
+            int history = -1;
+
+            cache.nextAges[i] = 0;
+
+            if (cache.valid)
+            {
+                float clipX = pPos[0] * m._11 + pPos[1] * m._21 + pPos[2] * m._31 + m._41;
+                float clipY = pPos[0] * m._12 + pPos[1] * m._22 + pPos[2] * m._32 + m._42;
+                float clipW = pPos[0] * m._14 + pPos[1] * m._24 + pPos[2] * m._34 + m._44;
+
+                if (clipW > 0.0f)
+                {
+                    float lastX = (clipX / clipW * 0.5f + 0.5f) * cache.width;
+                    float lastY = (0.5f - clipY / clipW * 0.5f) * cache.height;
+
+                    if (lastX >= 0.0f && lastX < cache.width && lastY >= 0.0f && lastY < cache.height)
+                        history = static_cast<int>(lastY) * cache.width + static_cast<int>(lastX);
+                }
+
+                // The surface the last frame saw there must be as deep in
+                // its view and face the same way.
+
+                if (history >= 0)
+                {
+                    const float *pLastPos = &cache.positions[history * 3];
+                    const float *pLastNormal = &cache.normals[history * 3];
+                    float lastW = pLastPos[0] * m._14 + pLastPos[1] * m._24 + pLastPos[2] * m._34 + m._44;
+                    float normalDot = pNormal[0] * pLastNormal[0] + pNormal[1] * pLastNormal[1] + pNormal[2] * pLastNormal[2];
+
+                    if (fabsf(lastW - clipW) > LIGHTING_CACHE_DEPTH_TOLERANCE * clipW ||
+                        normalDot < LIGHTING_CACHE_MIN_NORMAL_DOT)
+                    {
+                        history = -1;
+                    }
+                }
+            }
+
+            if (history >= 0 && cache.ages[history] + 1 < LIGHTING_CACHE_MAX_AGE &&
+                (x % LIGHTING_CACHE_REFRESH_TILE) + (y % LIGHTING_CACHE_REFRESH_TILE) * LIGHTING_CACHE_REFRESH_TILE != turn)
+            {
+                memcpy(&pColors[i * 4], &cache.colors[history * 4], sizeof(float) * 4);
+                cache.nextAges[i] = cache.ages[history] + 1;
+            }
+            else
+            {
+                pShade[count++] = i;
+            }
+        }
+    }
+
+    return count;
+}
+
+bool ResetDevice()
+{
+    if (FAILED(g_pBlinnPhongEffectSM20->OnLostDevice()))
+        return false;
+
+    if (FAILED(g_pBlinnPhongEffectSM30->OnLostDevice()))
+        return false;
+
+    if (FAILED(g_pAmbientEffect->OnLostDevice()))
+        return false;
+
+    if (FAILED(g_pFont->OnLostDevice()))
+        return false;
+
+    if (FAILED(g_pDevice->Reset(&g_params)))
+        return false;
+
+    if (FAILED(g_pFont->OnResetDevice()))
+        return false;
+
+    if (FAILED(g_pAmbientEffect->OnResetDevice()))
+        return false;
+
+    if (FAILED(g_pBlinnPhongEffectSM20->OnResetDevice()))
+        return false;
+
+    if (FAILED(g_pBlinnPhongEffectSM30->OnResetDevice()))
+        return false;
+
+    return true;
+}
+
+bool ResizeImage(const Image &src, int width, int height, Image &dst)
+{
+    // Bilinearly resamples level 0 of src into a new image with room for a
+    // full mip chain.
+
+    int levels = 1;
+
+    while (((width | height) >> levels) != 0 && levels < IMAGE_MAX_LEVELS)
+        ++levels;
+
+    if (!CreateImage(width, height, levels, dst))
+        return false;
+
+    const BYTE *pSrc = reinterpret_cast<const BYTE*>(src.pPixels);
+    BYTE *pDst = reinterpret_cast<BYTE*>(dst.pPixels);
+
+    for (int y = 0; y < height; ++y)
+    {
+        float v = (y + 0.5f) * src.height / height - 0.5f;
+        int y0 = max(0, static_cast<int>(floor(v)));
+        int y1 = min(y0 + 1, src.height - 1);
+        float fy = max(0.0f, v - y0);
+
+        for (int x = 0; x < width; ++x)
+        {
+            float u = (x + 0.5f) * src.width / width - 0.5f;
+            int x0 = max(0, static_cast<int>(floor(u)));
+            int x1 = min(x0 + 1, src.width - 1);
+            float fx = max(0.0f, u - x0);
+
+            for (int c = 0; c < 4; ++c)
+            {
+                float top = pSrc[(y0 * src.width + x0) * 4 + c] * (1.0f - fx) + pSrc[(y0 * src.width + x1) * 4 + c] * fx;
+                float bottom = pSrc[(y1 * src.width + x0) * 4 + c] * (1.0f - fx) + pSrc[(y1 * src.width + x1) * 4 + c] * fx;
+
+                *pDst++ = static_cast<BYTE>(top + (bottom - top) * fy + 0.5f);
+            }
+        }
+    }
+
+    return true;
+}
+
+void ResolveObjChunks(void *pParam, int begin, int end)
+{
+    // Turns the chunks' corners into vertices. A triangle whose corners
+    // don't all have normals gets its face normal at those corners, and a
+    // corner without a texture coordinate gets (0, 0).
+
+    ObjParseJob &job = *static_cast<ObjParseJob*>(pParam);
+    const int counts[3] = {job.positionCount, job.texCoordCount, job.normalCount};
+
+    for (int i = begin; i < end; ++i)
+    {
+        const ObjChunk &chunk = job.pChunks[i];
+        const int bases[3] = {chunk.positionBase, chunk.texCoordBase, chunk.normalBase};
+        Vertex *pTriangle = job.pTriangles + chunk.firstCorner;
+
+        for (size_t first = 0; first < chunk.corners.size(); first += 3, pTriangle += 3)
+        {
+            bool hasNormals = true;
+
+            for (int k = 0; k < 3; ++k)
+            {
+                const ObjCorner &corner = chunk.corners[first + k];
+                Vertex &vertex = pTriangle[k];
+                int index[3];
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    index[c] = corner.index[c] + (((corner.relative >> c) & 1) ? bases[c] : 0);
+
+                    if (((corner.present >> c) & 1) && (index[c] < 0 || index[c] >= counts[c]))
+                    {
+                        InterlockedExchange(&job.failed, 1);
+                        return;
+                    }
+                }
+
+                memcpy(vertex.pos, &job.pPositions[index[0] * 3], sizeof(vertex.pos));
+
+                if (corner.present & 2)
+                    memcpy(vertex.texCoord, &job.pTexCoords[index[1] * 2], sizeof(vertex.texCoord));
+                else
+                    vertex.texCoord[0] = vertex.texCoord[1] = 0.0f;
+
+                if (corner.present & 4)
+                    memcpy(vertex.normal, &job.pNormals[index[2] * 3], sizeof(vertex.normal));
+                else
+                    hasNormals = false;
+            }
+
+            if (!hasNormals)
+            {
+                D3DXVECTOR3 edge1(pTriangle[1].pos[0] - pTriangle[0].pos[0],
+                                  pTriangle[1].pos[1] - pTriangle[0].pos[1],
+                                  pTriangle[1].pos[2] - pTriangle[0].pos[2]);
+                D3DXVECTOR3 edge2(pTriangle[2].pos[0] - pTriangle[0].pos[0],
+                                  pTriangle[2].pos[1] - pTriangle[0].pos[1],
+                                  pTriangle[2].pos[2] - pTriangle[0].pos[2]);
+                D3DXVECTOR3 normal;
+
+                D3DXVec3Cross(&normal, &edge1, &edge2);
+                D3DXVec3Normalize(&normal, &normal);
+
+                for (int k = 0; k < 3; ++k)
+                {
+                    if ((chunk.corners[first + k].present & 4) == 0)
+                        memcpy(pTriangle[k].normal, &normal, sizeof(pTriangle[k].normal));
+                }
+            }
+        }
+    }
+}
+
+void RunBenchmarks()
+{
+    // Runs the benchmarks selected on the command line without creating a
+    // window or a Direct3D device. Results are written to the file
+    // BENCHMARK_OUTPUT_FILE and to the debugger output window.
+
+    static const struct
+    {
+        const char *pszName;
+        void (*pfnBenchmark)();
+    }
+    benchmarks[] =
+    {
+        { "arena", BenchmarkFrameArena },
+        { "encoder", BenchmarkTextureEncoder },
+        { "lightingcache", BenchmarkLightingCache },
+        { "lightlods", BenchmarkLightLods },
+        { "lightmap", BenchmarkLightmapBaking },
+        { "loading", BenchmarkAssetLoading },
+        { "manylights", BenchmarkManyLights },
+        { "meshloading", BenchmarkMeshLoading },
+        { "mips", BenchmarkMipGeneration },
+        { "occlusion", BenchmarkOcclusionCulling },
+        { "sampler", BenchmarkTextureSampler },
+        { "sceneculling", BenchmarkSceneCulling },
+        { "scenes", BenchmarkSceneGeneration },
+        { "shadows", BenchmarkShadowMaps },
+        { "simulation", BenchmarkSimulation },
+        { "submissions", BenchmarkRoomSubmission },
+        { "text", BenchmarkTextRendering },
+        { "texturecache", BenchmarkTextureCache },
+        { "vertexcache", BenchmarkVertexCache },
+        { "vertexformat", BenchmarkVertexFormat },
+        { "virtualtexture", BenchmarkVirtualTexture }
+    };
+
+    g_pBenchmarkFile = fopen(BENCHMARK_OUTPUT_FILE, "w");
+
+    if (!g_workerPool.create(max(1, min(GetProcessorCount() - 1, WORKER_MAX_THREADS))))
+        BenchmarkPrint("Failed to create worker threads. Parallel benchmarks will run serially.\n");
+
+    for (int i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+    {
+        if (!g_benchmarkFilter.empty() && g_benchmarkFilter != benchmarks[i].pszName)
+            continue;
+
+        double startTime = GetTimeInSeconds();
+
+        BenchmarkPrint("[%s]\n", benchmarks[i].pszName);
+        benchmarks[i].pfnBenchmark();
+        BenchmarkPrint("(%.2f seconds)\n\n", GetTimeInSeconds() - startTime);
+    }
+
+    g_workerPool.destroy();
+
+    if (g_pBenchmarkFile)
+    {
+        fclose(g_pBenchmarkFile);
+        g_pBenchmarkFile = 0;
+    }
+}
+
+void SampleBilinear4(const SoftwareTexture &texture, int level, __m128 u, __m128 v, __m128 channels[4])
+{
+    // Bilinearly filters one level at 4 points with wrap addressing. The
+    // points' texel coordinates and weights are worked out side by side,
+    // one point to a lane, and their texels blended a channel at a time.
+    // Gives the points' B, G, R and A in channels[0] to channels[3], in the
+    // range 0 to 255.
+
+    int widthLog2 = max(0, texture.widthLog2 - level);
+    int heightLog2 = max(0, texture.heightLog2 - level);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 x = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(static_cast<float>(1 << widthLog2))), half);
+    __m128 y = _mm_sub_ps(_mm_mul_ps(v, _mm_set1_ps(static_cast<float>(1 << heightLog2))), half);
+
+    // Truncation rounds negative coordinates up, so those are moved down.
+
+    __m128 truncX = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    __m128 truncY = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+    __m128 floorX = _mm_sub_ps(truncX, _mm_and_ps(_mm_cmpgt_ps(truncX, x), one));
+    __m128 floorY = _mm_sub_ps(truncY, _mm_and_ps(_mm_cmpgt_ps(truncY, y), one));
+    __m128 fracX = _mm_sub_ps(x, floorX);
+    __m128 fracY = _mm_sub_ps(y, floorY);
+    __m128i maskX = _mm_set1_epi32((1 << widthLog2) - 1);
+    __m128i maskY = _mm_set1_epi32((1 << heightLog2) - 1);
+    __m128i x0 = _mm_and_si128(_mm_cvttps_epi32(floorX), maskX);
+    __m128i y0 = _mm_and_si128(_mm_cvttps_epi32(floorY), maskY);
+    int xs[2][4];   // left and right texel of each point
+    int ys[2][4];   // top and bottom
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(xs[0]), x0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(xs[1]), _mm_and_si128(_mm_add_epi32(x0, _mm_set1_epi32(1)), maskX));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(ys[0]), y0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(ys[1]), _mm_and_si128(_mm_add_epi32(y0, _mm_set1_epi32(1)), maskY));
+
+    // The points' top left, top right, bottom left and bottom right texels
+    // each make up a vector.
+
+    const DWORD *pTexels = texture.pTexels;
+    __m128i corners[4];
+
+    for (int corner = 0; corner < 4; ++corner)
+    {
+        const int *pX = xs[corner & 1];
+        const int *pY = ys[corner >> 1];
+
+        corners[corner] = _mm_set_epi32(
+            pTexels[GetTexelIndex(texture, level, pX[3], pY[3])], pTexels[GetTexelIndex(texture, level, pX[2], pY[2])],
+            pTexels[GetTexelIndex(texture, level, pX[1], pY[1])], pTexels[GetTexelIndex(texture, level, pX[0], pY[0])]);
+    }
+
+    __m128i byteMask = _mm_set1_epi32(0xff);
+
+    for (int c = 0; c < 4; ++c)
+    {
+        __m128 t00 = _mm_cvtepi32_ps(_mm_and_si128(corners[0], byteMask));
+        __m128 t10 = _mm_cvtepi32_ps(_mm_and_si128(corners[1], byteMask));
+        __m128 t01 = _mm_cvtepi32_ps(_mm_and_si128(corners[2], byteMask));
+        __m128 t11 = _mm_cvtepi32_ps(_mm_and_si128(corners[3], byteMask));
+        __m128 upper = _mm_add_ps(t00, _mm_mul_ps(_mm_sub_ps(t10, t00), fracX));
+        __m128 lower = _mm_add_ps(t01, _mm_mul_ps(_mm_sub_ps(t11, t01), fracX));
+
+        channels[c] = _mm_add_ps(upper, _mm_mul_ps(_mm_sub_ps(lower, upper), fracY));
+
+        for (int corner = 0; corner < 4; ++corner)
+            corners[corner] = _mm_srli_epi32(corners[corner], 8);
+    }
+}
+
+void SampleIrradianceVolume(const IrradianceVolume &volume, const float pos[3], float color[4])
+{
+    // Adds the lights' ambient term at pos, interpolated trilinearly
+    // between the corners of its cell and clamped at the grid's edges.
+    // Multiplied by a material's ambient reflectance it stands in for the
+    // ambient terms ShadePointLight() adds for each light.
+
+    int cell[3];
+    float weights[3];
+
+    for (int c = 0; c < 3; ++c)
+    {
+        float x = min(max((pos[c] - volume.origin[c]) / volume.cellSize, 0.0f),
+                      static_cast<float>(volume.corners[c] - 1));
+
+        cell[c] = min(static_cast<int>(x), max(volume.corners[c] - 2, 0));
+        weights[c] = x - cell[c];
+    }
+
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        float weight = 1.0f;
+        int index = 0;
+        int stride = 1;
+
+        for (int c = 0; c < 3; ++c)
+        {
+            int side = (corner >> c) & 1;
+
+            weight *= side ? weights[c] : 1.0f - weights[c];
+            index += min(cell[c] + side, volume.corners[c] - 1) * stride;
+            stride *= volume.corners[c];
+        }
+
+        if (weight <= 0.0f)
+            continue;
+
+        for (int c = 0; c < 4; ++c)
+            color[c] += volume.colors[index * 4 + c] * weight;
+    }
+}
+
+void SampleLightmap(const Lightmap &lightmap, const float coords[2], float color[4])
+{
+    // Looks up the lightmap with bilinear filtering, clamped at its edges,
+    // as the room's pixel shader does.
+
+    float x = coords[0] * lightmap.width - 0.5f;
+    float y = coords[1] * lightmap.height - 0.5f;
+    float fx = floorf(x);
+    float fy = floorf(y);
+    float weightX = x - fx;
+    float weightY = y - fy;
+    int x0 = min(max(static_cast<int>(fx), 0), lightmap.width - 1);
+    int y0 = min(max(static_cast<int>(fy), 0), lightmap.height - 1);
+    int x1 = min(max(static_cast<int>(fx) + 1, 0), lightmap.width - 1);
+    int y1 = min(max(static_cast<int>(fy) + 1, 0), lightmap.height - 1);
+    const float *pTexels = &lightmap.texels[0];
+
+    for (int c = 0; c < 4; ++c)
+    {
+        float top = pTexels[(y0 * lightmap.width + x0) * 4 + c] * (1.0f - weightX) +
+                    pTexels[(y0 * lightmap.width + x1) * 4 + c] * weightX;
+        float bottom = pTexels[(y1 * lightmap.width + x0) * 4 + c] * (1.0f - weightX) +
+                       pTexels[(y1 * lightmap.width + x1) * 4 + c] * weightX;
+
+        color[c] = top * (1.0f - weightY) + bottom * weightY;
+    }
+}
+
+bool SampleShadowMap(const ShadowCache &cache, int light, const float pos[3], const float normal[3])
+{
+    // Returns whether the point is lit by the light according to its cube
+    // shadow map: whether no caster is nearer the light at the point's
+    // texel of the face that sees it. The point is moved off its surface
+    // by the size of a few texels where it is, so that a surface at a
+    // grazing angle to the light doesn't shadow itself. Faces that aren't
+    // resident shadow nothing. Out of date faces are looked up with the
+    // view projection they were drawn with, not where the light is now.
+
+    const ShadowLight &shadowLight = cache.lights[light];
+    float distance = 0.0f;
+
+    for (int c = 0; c < 3; ++c)
+        distance = max(distance, fabsf(pos[c] - shadowLight.pos[c]));
+
+    // A face's texels are 2 / tileSize of the depth across.
+
+    float offset = SHADOW_NORMAL_OFFSET * 2.0f * distance / cache.tileSize;
+    D3DXVECTOR3 position(pos[0] + normal[0] * offset, pos[1] + normal[1] * offset, pos[2] + normal[2] * offset);
+    float direction[3];
+
+    for (int c = 0; c < 3; ++c)
+        direction[c] = position[c] - shadowLight.pos[c];
+
+    const ShadowFace &face = shadowLight.faces[GetLightmapFace(direction)];
+
+    if (face.tile < 0)
+        return true;
+
+    D3DXVECTOR4 clip;
+
+    D3DXVec3Transform(&clip, &position, &face.drawnViewProjection);
+
+    if (clip.w <= 0.0f)
+        return true;
+
+    float invW = 1.0f / clip.w;
+    int x = static_cast<int>((clip.x * invW * 0.5f + 0.5f) * cache.tileSize);
+    int y = static_cast<int>((0.5f - clip.y * invW * 0.5f) * cache.tileSize);
+
+    x = min(max(x, 0), cache.tileSize - 1);
+    y = min(max(y, 0), cache.tileSize - 1);
+
+    float casterInvW = cache.pTexels[(static_cast<size_t>(face.tile) * cache.tileSize + y) * cache.tileSize + x];
+
+    return casterInvW * clip.w <= 1.0f + SHADOW_DEPTH_BIAS;
+}
+
+void SampleTexture4(const SoftwareTexture &texture, int filter, int maxAnisotropy,
+                    const float u[4], const float v[4], const float gradients[4],
+                    __m128 colors[4])
+{
+    // Samples 4 points that share the same gradients, such as a 2x2 quad or
+    // a short span of pixels, like a sampler set to the given
+    // TEXTURE_FILTER_* filter and wrap addressing. The footprint is only
+    // worked out once, and the points are filtered together, a channel to
+    // a vector, until the end. gradients holds du/dx, dv/dx, du/dy and
+    // dv/dy. Returns BGRA in the range 0 to 1.
+
+    SampleFootprint footprint;
+
+    GetSampleFootprint(texture, filter, maxAnisotropy, gradients, footprint);
+
+    float offset = -0.5f * (footprint.taps - 1);
+    __m128 levelWeight = _mm_set1_ps(footprint.levelWeight);
+    __m128 scale = _mm_set1_ps(1.0f / (255.0f * footprint.taps));
+    __m128 pointsU = _mm_loadu_ps(u);
+    __m128 pointsV = _mm_loadu_ps(v);
+    __m128 sums[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+
+    for (int tap = 0; tap < footprint.taps; ++tap)
+    {
+        __m128 tapU = _mm_add_ps(pointsU, _mm_set1_ps(footprint.stepU * (offset + tap)));
+        __m128 tapV = _mm_add_ps(pointsV, _mm_set1_ps(footprint.stepV * (offset + tap)));
+        __m128 channels[4];
+
+        SampleBilinear4(texture, footprint.level0, tapU, tapV, channels);
+
+        if (footprint.level1 != footprint.level0)
+        {
+            __m128 next[4];
+
+            SampleBilinear4(texture, footprint.level1, tapU, tapV, next);
+
+            for (int c = 0; c < 4; ++c)
+                channels[c] = _mm_add_ps(channels[c], _mm_mul_ps(_mm_sub_ps(next[c], channels[c]), levelWeight));
+        }
+
+        for (int c = 0; c < 4; ++c)
+            sums[c] = _mm_add_ps(sums[c], channels[c]);
+    }
+
+    // From a vector per channel to one per point.
+
+    for (int c = 0; c < 4; ++c)
+        sums[c] = _mm_mul_ps(sums[c], scale);
+
+    _MM_TRANSPOSE4_PS(sums[0], sums[1], sums[2], sums[3]);
+
+    for (int i = 0; i < 4; ++i)
+        colors[i] = sums[i];
+}
+
+__m128 SampleVirtualTexture(const VirtualTexture &texture, float u, float v, int level,
+                            int &residentLevel)
+{
+    // Bilinearly filters the virtual texture at (u, v) with wrap addressing
+    // in the given level or, if its page isn't resident, the finest coarser
+    // level whose page is. residentLevel is set to the level used. Returns
+    // BGRA in the range 0 to 1.
+
+    u -= floorf(u);
+    v -= floorf(v);
+
+    for (;; ++level)
+    {
+        int width = max(1, texture.header.width >> level);
+        int height = max(1, texture.header.height >> level);
+        float x = u * width;
+        float y = v * height;
+        int pageX = min(static_cast<int>(x) / VIRTUAL_PAGE_SIZE, texture.levelPagesWide[level] - 1);
+        int pageY = min(static_cast<int>(y) / VIRTUAL_PAGE_SIZE, texture.levelPagesHigh[level] - 1);
+        int slot = texture.pPageTable[GetVirtualPageIndex(texture, level, pageX, pageY)];
+
+        // The mip tail is always resident, so this ends at the last level.
+
+        if (slot < 0)
+            continue;
+
+        // Texel position within the page, including its border.
+
+        float pageU = x - pageX * VIRTUAL_PAGE_SIZE + VIRTUAL_PAGE_BORDER - 0.5f;
+        float pageV = y - pageY * VIRTUAL_PAGE_SIZE + VIRTUAL_PAGE_BORDER - 0.5f;
+        float floorU = floorf(pageU);
+        float floorV = floorf(pageV);
+        int x0 = static_cast<int>(floorU);
+        int y0 = static_cast<int>(floorV);
+        const DWORD *pTexels = texture.pPhysical + slot * VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE +
+                               y0 * VIRTUAL_PAGE_STRIDE + x0;
+
+        residentLevel = level;
+
+        return _mm_mul_ps(BlendTexels(pTexels[0], pTexels[1], pTexels[VIRTUAL_PAGE_STRIDE], pTexels[VIRTUAL_PAGE_STRIDE + 1],
+                                      pageU - floorU, pageV - floorV),
+                          _mm_set1_ps(1.0f / 255.0f));
+    }
+}
+
+__m128 SelectPS(__m128 mask, __m128 a, __m128 b)
+{
+    // Per lane mask ? a : b.
+
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+__m128i SelectEpi32(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+void SetProcessorAffinity()
+{
+    // Assign the current thread to one processor. This ensures that timing
+    // code runs on only one processor, and will not suffer any ill effects
+    // from power management.
+    //
+    // Based on the DXUTSetProcessorAffinity() function in the DXUT framework.
+
+    DWORD_PTR dwProcessAffinityMask = 0;
+    DWORD_PTR dwSystemAffinityMask = 0;
+    HANDLE hCurrentProcess = GetCurrentProcess();
+
+    if (!GetProcessAffinityMask(hCurrentProcess, &dwProcessAffinityMask, &dwSystemAffinityMask))
+        return;
+
+    if (dwProcessAffinityMask)
+    {
+        // Find the lowest processor that our process is allowed to run against.
+
+        DWORD_PTR dwAffinityMask = (dwProcessAffinityMask & ((~dwProcessAffinityMask) + 1));
+
+        // Set this as the processor that our thread must always run against.
+        // This must be a subset of the process affinity mask.
+
+        HANDLE hCurrentThread = GetCurrentThread();
+
+        if (hCurrentThread != INVALID_HANDLE_VALUE)
+        {
+            SetThreadAffinityMask(hCurrentThread, dwAffinityMask);
+            CloseHandle(hCurrentThread);
+        }
+    }
+
+    CloseHandle(hCurrentProcess);
+}
+
+int ShadeLightCut(const LightTree &tree, const float pos[3], const float normal[3], const float *pViewDir,
+                  const Material &material, float maxError, float color[4])
+{
+    // Adds the lighting ShadePointLight() sums over every light of the
+    // tree, without the global ambient term, as worked out from a cut
+    // through the tree: clusters that between them hold each light once,
+    // each lit by its cluster light. Starting from the root, the cluster
+    // that could be the most wrong is split into its children until none
+    // could be wrong by more than maxError of the lighting found so far,
+    // or the cut has LIGHT_CUT_MAX_SIZE clusters. Clusters that can't
+    // reach the point are never split. Returns the size of the cut.
+    //
+    // maxError is a threshold on each cluster, not a bound on the result:
+    // the errors of the clusters in the cut add up, so the lighting can
+    // be off by several times maxError.
+
+    static const float noAmbient[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    std::pair<float, int> heap[LIGHT_CUT_MAX_SIZE];   // the most a cluster could be wrong by, and its slot
+    int slotNodes[LIGHT_CUT_MAX_SIZE];
+    float slotLighting[LIGHT_CUT_MAX_SIZE][4];
+    int added[2] = {0, -1};                 // nodes to add to the cut, and their slots
+    int addedSlots[2] = {0, -1};
+    int heapSize = 0;
+    int size = 1;
+    float total[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    float reflectances[3] = {0.0f, 0.0f, 0.0f};    // largest ambient, diffuse and specular
+
+    if (tree.nodes.empty())
+        return 0;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        reflectances[0] = max(reflectances[0], material.ambient[c]);
+        reflectances[1] = max(reflectances[1], material.diffuse[c]);
+        reflectances[2] = max(reflectances[2], material.specular[c]);
+    }
+
+    // A cluster adds between nothing and its importance under the material
+    // to the sum of the channels, and so can't be wrong by more. Single
+    // lights are exact.
+
+    for (;;)
+    {
+        for (int i = 0; i < 2 && added[i] >= 0; ++i)
+        {
+            const LightTreeNode &node = tree.nodes[added[i]];
+            int slot = addedSlots[i];
+            float bound = GetLightClusterImportance(node, pos, normal, reflectances);
+
+            slotNodes[slot] = added[i];
+            memset(slotLighting[slot], 0, sizeof(slotLighting[slot]));
+
+            if (bound > 0.0f)
+            {
+                ShadePointLight(tree.clusterLights[added[i]], pos, normal, pViewDir, material, noAmbient, true,
+                    slotLighting[slot]);
+            }
+
+            for (int c = 0; c < 4; ++c)
+                total[c] += slotLighting[slot][c];
+
+            heap[heapSize++] = std::make_pair((node.light < 0) ? bound : 0.0f, slot);
+            std::push_heap(heap, heap + heapSize);
+        }
+
+        if (size == LIGHT_CUT_MAX_SIZE || heap[0].first <= maxError * (total[0] + total[1] + total[2]))
+            break;
+
+        std::pop_heap(heap, heap + heapSize--);
+
+        int slot = heap[heapSize].second;
+        const LightTreeNode &node = tree.nodes[slotNodes[slot]];
+
+        for (int c = 0; c < 4; ++c)
+            total[c] -= slotLighting[slot][c];
+
+        added[0] = node.children[0];
+        added[1] = node.children[1];
+        addedSlots[0] = slot;
+        addedSlots[1] = size++;
+    }
+
+    // Sum the cut afresh rather than trust what's left of the running
+    // total after clusters were taken out of it.
+
+    for (int slot = 0; slot < size; ++slot)
+    {
+        for (int c = 0; c < 4; ++c)
+            color[c] += slotLighting[slot][c];
+    }
+
+    return size;
+}
+
+void ShadePointLight(const PointLight &light, const float pos[3], const float normal[3], const float *pViewDir,
+                     const Material &material, const float globalAmbient[4], bool visible, float color[4])
+{
+    // Adds a light's Blinn-Phong lighting of a point to color, as the
+    // room's pixel shader does. The specular term needs the normalized
+    // direction to the viewer and is left out without one. A light the
+    // point is in shadow from only adds its ambient term.
+
+    float l[3];
+    float distanceSq = 0.0f;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        l[c] = light.renderPos[c] - pos[c];
+        distanceSq += l[c] * l[c];
+    }
+
+    float atten = (light.radius > 0.0f) ? min(max(1.0f - distanceSq / (light.radius * light.radius), 0.0f), 1.0f) : 0.0f;
+    float nDotL = 0.0f;
+    float power = 0.0f;
+
+    if (visible && atten > 0.0f && distanceSq > 0.0f)
+    {
+        float invDistance = 1.0f / sqrtf(distanceSq);
+
+        for (int c = 0; c < 3; ++c)
+        {
+            l[c] *= invDistance;
+            nDotL += normal[c] * l[c];
+        }
+
+        nDotL = min(max(nDotL, 0.0f), 1.0f);
+
+        if (pViewDir && nDotL > 0.0f)
+        {
+            D3DXVECTOR3 h(l[0] + pViewDir[0], l[1] + pViewDir[1], l[2] + pViewDir[2]);
+
+            D3DXVec3Normalize(&h, &h);
+
+            float nDotH = min(max(normal[0] * h.x + normal[1] * h.y + normal[2] * h.z, 0.0f), 1.0f);
+
+            power = powf(nDotH, material.shininess);
+        }
+    }
 
-//-----------------------------------------------------------------------------
-// Functions.
-//-----------------------------------------------------------------------------
+    for (int c = 0; c < 4; ++c)
+    {
+        color[c] += material.ambient[c] * (globalAmbient[c] + atten * light.ambient[c]) +
+                    material.diffuse[c] * light.diffuse[c] * nDotL * atten +
+                    material.specular[c] * light.specular[c] * power * atten;
+    }
+}
 
-int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nShowCmd)
+void SimulateFrame(float elapsedTimeSec, FrameSnapshot &frame)
 {
-#if defined(_DEBUG)
-    _CrtSetDbgFlag(_CRTDBG_LEAK_CHECK_DF | _CRTDBG_ALLOC_MEM_DF);
-    _CrtSetReportMode(_CRT_ASSERT, _CRTDBG_MODE_FILE);
-    _CrtSetReportFile(_CRT_ASSERT, _CRTDBG_FILE_STDERR);
-#endif
+    // Advances the simulation and captures its state, together with the most
+    // recently published input, into a frame snapshot. Called on the main
+    // thread when frames are processed serially and on the simulation thread
+    // otherwise.
 
-    MSG msg = {0};
-    WNDCLASSEX wcl = {0};
+    static int frameNumber;
 
-    wcl.cbSize = sizeof(wcl);
-    wcl.style = CS_OWNDC | CS_HREDRAW | CS_VREDRAW;
-    wcl.lpfnWndProc = WindowProc;
-    wcl.cbClsExtra = 0;
-    wcl.cbWndExtra = 0;
-    wcl.hInstance = g_hInstance = hInstance;
-    wcl.hIcon = LoadIcon(0, IDI_APPLICATION);
-    wcl.hCursor = LoadCursor(0, IDC_ARROW);
-    wcl.hbrBackground = 0;
-    wcl.lpszMenuName = 0;
-    wcl.lpszClassName = "D3D9WindowClass";
-    wcl.hIconSm = 0;
+    EnterCriticalSection(&g_frameInputLock);
 
-    if (!RegisterClassEx(&wcl))
-        return 0;
+    FrameInput input = g_frameInput;
 
-    g_hWnd = CreateAppWindow(wcl, APP_TITLE);
+    // The lights are simulated with a fixed timestep so that their motion
+    // doesn't depend on the frame rate. Pausing the animation also freezes
+    // the interpolation between simulation steps.
 
-    if (g_hWnd)
-    {
-        SetProcessorAffinity();
+    if (input.animateLights)
+        UpdateSimulation(elapsedTimeSec, SIMULATION_MAX_STEPS_PER_FRAME);
 
-        if (Init())
-        {
-            ShowWindow(g_hWnd, nShowCmd);
-            UpdateWindow(g_hWnd);
+    memcpy(frame.lights, g_lights, sizeof(frame.lights));
 
-            while (true)
-            {
-                while (PeekMessage(&msg, 0, 0, 0, PM_REMOVE))
-                {
-                    if (msg.message == WM_QUIT)
-                        break;
+    LeaveCriticalSection(&g_frameInputLock);
 
-                    TranslateMessage(&msg);
-                    DispatchMessage(&msg);
-                }
+    frame.viewProjectionMatrix = input.viewProjectionMatrix;
+    frame.cameraPos = input.cameraPos;
+    frame.inputTime = input.time;
+    frame.frameNumber = ++frameNumber;
+    frame.animateLights = input.animateLights;
+}
 
-                if (msg.message == WM_QUIT)
-                    break;
+DWORD WINAPI SimulationThreadProc(LPVOID pParam)
+{
+    // Simulates frames into the pipeline until asked to quit. The thread
+    // blocks while every slot is full, so the simulation never gets more
+    // than the pipeline depth ahead of the renderer.
 
-                if (g_hasFocus)
-                {
-                    UpdateFrame(GetElapsedTimeInSeconds());
+    FramePipeline &pipeline = *static_cast<FramePipeline*>(pParam);
+    HANDLE handles[] = {pipeline.hQuitEvent, pipeline.hFreeSlots};
+    double lastTime = GetTimeInSeconds();
 
-                    if (DeviceIsValid())
-                        RenderFrame();
-                }
-                else
-                {
-                    WaitMessage();
-                }
-            }
-        }
+    AllocationZone zone("Simulation");
 
-        Cleanup();
-        UnregisterClass(wcl.lpszClassName, hInstance);
+    while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+    {
+        double time = GetTimeInSeconds();
+
+        SimulateFrame(static_cast<float>(time - lastTime), pipeline.slots[pipeline.writeIndex]);
+        lastTime = time;
+
+        pipeline.writeIndex = (pipeline.writeIndex + 1) % pipeline.depth;
+        InterlockedIncrement(&pipeline.framesSimulated);
+
+        ReleaseSemaphore(pipeline.hFilledSlots, 1, 0);
     }
 
-    return static_cast<int>(msg.wParam);
+    return 0;
 }
 
-LRESULT CALLBACK WindowProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
+float Snorm16ToFloat(SHORT value)
 {
-    switch (msg)
+    // D3DDECLTYPE_SHORT2N/SHORT4N: -32767 and -32768 both map to -1.
+
+    return max(value / 32767.0f, -1.0f);
+}
+
+void SplatIrradianceBands(void *pParam, int begin, int end)
+{
+    // Splats bands [begin, end) of the update's changed lights into their
+    // own grids of changes, so that bands can be splatted in parallel
+    // without sharing any corners.
+
+    IrradianceVolume &volume = *static_cast<IrradianceVolume*>(pParam);
+    int cornerCount = volume.corners[0] * volume.corners[1] * volume.corners[2];
+    int changedCount = static_cast<int>(volume.changed.size());
+
+    for (int band = begin; band < end; ++band)
     {
-    case WM_ACTIVATE:
-        switch (wParam)
+        float *pColors = &volume.bandColors[static_cast<size_t>(band) * cornerCount * 4];
+
+        memset(pColors, 0, sizeof(float) * cornerCount * 4);
+
+        for (int i = band * volume.bandSize; i < min((band + 1) * volume.bandSize, changedCount); ++i)
         {
-        default:
-            break;
+            int light = volume.changed[i];
 
-        case WA_ACTIVE:
-        case WA_CLICKACTIVE:
-            g_hasFocus = true;
-            break;
+            if (!volume.rebuild)
+                SplatIrradianceLight(volume, volume.splatted[light], -1.0f, pColors);
 
-        case WA_INACTIVE:
-            if (g_isFullScreen)
-                ShowWindow(hWnd, SW_MINIMIZE);
-            g_hasFocus = false;
-            break;
+            SplatIrradianceLight(volume, volume.pLights[light], 1.0f, pColors);
         }
-        break;
+    }
+}
 
-    case WM_CHAR:
-        switch (static_cast<int>(wParam))
-        {
-        case VK_ESCAPE:
-            PostMessage(hWnd, WM_CLOSE, 0, 0);
-            break;
+void SplatIrradianceLight(const IrradianceVolume &volume, const PointLight &light, float sign, float *pColors)
+{
+    // Adds a light's ambient color times its attenuation, as
+    // ShadePointLight() works it out, times sign to each corner within
+    // its radius.
 
-        case VK_SPACE:
-            g_animateLights = !g_animateLights;
-            break;
+    if (light.radius <= 0.0f)
+        return;
 
-        case '+':
-        case '=':
-            for (int i = 0; i < sizeof(g_lights) / sizeof(g_lights[0]); ++i)
-            {
-                if ((g_lights[i].radius += 1.0f) > LIGHT_RADIUS_MAX)
-                    g_lights[i].radius = LIGHT_RADIUS_MAX;
-            }
-            break;
+    float radiusSq = light.radius * light.radius;
+    int first[3];
+    int last[3];
 
-        case '-':
-            for (int i = 0; i < sizeof(g_lights) / sizeof(g_lights[0]); ++i)
-            {
-                if ((g_lights[i].radius -= 1.0f) < LIGHT_RADIUS_MIN)
-                    g_lights[i].radius = LIGHT_RADIUS_MIN;
-            }
-            break;
+    for (int c = 0; c < 3; ++c)
+    {
+        first[c] = max(0, static_cast<int>(ceilf((light.renderPos[c] - light.radius - volume.origin[c]) / volume.cellSize)));
+        last[c] = min(volume.corners[c] - 1,
+                      static_cast<int>(floorf((light.renderPos[c] + light.radius - volume.origin[c]) / volume.cellSize)));
 
-        case 'h':
-        case 'H':
-            g_displayHelp = !g_displayHelp;
-            break;
+        if (first[c] > last[c])
+            return;
+    }
 
-        case 'l':
-        case 'L':
-            g_renderLights = !g_renderLights;
-            break;
+    for (int z = first[2]; z <= last[2]; ++z)
+    {
+        float dz = volume.origin[2] + z * volume.cellSize - light.renderPos[2];
 
-        case 'm':
-        case 'M':
-            if (g_pBlinnPhongEffect == g_pBlinnPhongEffectSM20)
-                g_enableMultipassLighting = !g_enableMultipassLighting;
-            break;
+        for (int y = first[1]; y <= last[1]; ++y)
+        {
+            float dy = volume.origin[1] + y * volume.cellSize - light.renderPos[1];
+            float *pRow = pColors + ((z * volume.corners[1] + y) * volume.corners[0]) * 4;
 
-        case 's':
-        case 'S':
-            if (g_supportsShaderModel30)
+            for (int x = first[0]; x <= last[0]; ++x)
             {
-                if (g_pBlinnPhongEffect == g_pBlinnPhongEffectSM20)
-                {
-                    g_pBlinnPhongEffect = g_pBlinnPhongEffectSM30;
-                    g_numLights = MAX_LIGHTS_SM30;
-                }
-                else
-                {
-                    g_pBlinnPhongEffect = g_pBlinnPhongEffectSM20;
-                    g_numLights = MAX_LIGHTS_SM20;
-                }
-            }
-            break;
+                float dx = volume.origin[0] + x * volume.cellSize - light.renderPos[0];
+                float distanceSq = dx * dx + dy * dy + dz * dz;
 
-        case 'T':
-        case 't':
-            g_disableColorMapTexture = !g_disableColorMapTexture;
-            break;
+                if (distanceSq >= radiusSq)
+                    continue;
 
-        default:
-            break;
+                float atten = sign * (1.0f - distanceSq / radiusSq);
+
+                for (int c = 0; c < 4; ++c)
+                    pRow[x * 4 + c] += light.ambient[c] * atten;
+            }
         }
-        break;
+    }
+}
 
-    case WM_DESTROY:
-        PostQuitMessage(0);
-        return 0;
+bool StartFramePipeline(int depth)
+{
+    // Starts simulating frames on a separate thread, up to depth frames ahead
+    // of the frame being rendered. The main thread keeps ownership of the
+    // Direct3D device and does all of the rendering. A depth of 0 leaves the
+    // simulation on the main thread.
 
-    case WM_SIZE:
-        g_windowWidth = static_cast<int>(LOWORD(lParam));
-        g_windowHeight = static_cast<int>(HIWORD(lParam));
-        break;
+    FramePipeline &pipeline = g_framePipeline;
 
-    case WM_SYSKEYDOWN:
-        if (wParam == VK_RETURN)
-            ToggleFullScreen();
-        break;
+    // Make sure there's always a valid frame to render, even if the first
+    // snapshot from the simulation thread is late.
 
-    default:
-        ProcessMouseInput(hWnd, msg, wParam, lParam);
-        break;
-    }
+    UpdateCamera();
+    PublishFrameInput();
+    SimulateFrame(0.0f, g_renderFrame);
 
-    return DefWindowProc(hWnd, msg, wParam, lParam);
-}
+    if (depth <= 0)
+        return true;
 
-void ChooseBestMSAAMode(D3DFORMAT backBufferFmt, D3DFORMAT depthStencilFmt,
-                        BOOL windowed, D3DMULTISAMPLE_TYPE &type,
-                        DWORD &qualityLevels, DWORD &samplesPerPixel)
-{
-    bool supported = false;
+    if (depth > PIPELINE_MAX_DEPTH)
+        depth = PIPELINE_MAX_DEPTH;
 
-    struct MSAAMode
+    pipeline.depth = depth;
+    pipeline.writeIndex = 0;
+    pipeline.readIndex = 0;
+    pipeline.framesSimulated = 0;
+    pipeline.hFreeSlots = CreateSemaphore(0, depth, depth, 0);
+    pipeline.hFilledSlots = CreateSemaphore(0, 0, depth, 0);
+    pipeline.hQuitEvent = CreateEvent(0, TRUE, FALSE, 0);
+
+    if (pipeline.hFreeSlots && pipeline.hFilledSlots && pipeline.hQuitEvent)
+        pipeline.hThread = CreateThread(0, 0, SimulationThreadProc, &pipeline, 0, 0);
+
+    if (!pipeline.hThread)
     {
-        D3DMULTISAMPLE_TYPE type;
-        DWORD samples;
+        StopFramePipeline();
+        return false;
     }
-    multsamplingTypes[15] =
-    {
-        { D3DMULTISAMPLE_16_SAMPLES,  16 },
-        { D3DMULTISAMPLE_15_SAMPLES,  15 },
-        { D3DMULTISAMPLE_14_SAMPLES,  14 },
-        { D3DMULTISAMPLE_13_SAMPLES,  13 },
-        { D3DMULTISAMPLE_12_SAMPLES,  12 },
-        { D3DMULTISAMPLE_11_SAMPLES,  11 },
-        { D3DMULTISAMPLE_10_SAMPLES,  10 },
-        { D3DMULTISAMPLE_9_SAMPLES,   9  },
-        { D3DMULTISAMPLE_8_SAMPLES,   8  },
-        { D3DMULTISAMPLE_7_SAMPLES,   7  },
-        { D3DMULTISAMPLE_6_SAMPLES,   6  },
-        { D3DMULTISAMPLE_5_SAMPLES,   5  },
-        { D3DMULTISAMPLE_4_SAMPLES,   4  },
-        { D3DMULTISAMPLE_3_SAMPLES,   3  },
-        { D3DMULTISAMPLE_2_SAMPLES,   2  }
-    };
 
-    for (int i = 0; i < 15; ++i)
-    {
-        type = multsamplingTypes[i].type;
+    // The main thread is pinned to the lowest processor the process may run
+    // on. Keep the simulation thread off that processor when there's another
+    // one available.
 
-        supported = MSAAModeSupported(type, backBufferFmt, depthStencilFmt,
-                        windowed, qualityLevels);
+    DWORD_PTR dwProcessAffinityMask = 0;
+    DWORD_PTR dwSystemAffinityMask = 0;
 
-        if (supported)
-        {
-            samplesPerPixel = multsamplingTypes[i].samples;
-            return;
-        }
+    if (GetProcessAffinityMask(GetCurrentProcess(), &dwProcessAffinityMask, &dwSystemAffinityMask))
+    {
+        DWORD_PTR dwOtherProcessors = dwProcessAffinityMask & (dwProcessAffinityMask - 1);
+
+        if (dwOtherProcessors)
+            SetThreadAffinityMask(pipeline.hThread, dwOtherProcessors & ((~dwOtherProcessors) + 1));
     }
 
-    type = D3DMULTISAMPLE_NONE;
-    qualityLevels = 0;
-    samplesPerPixel = 1;
+    return true;
 }
 
-void Cleanup()
+void StartLightmapBake(LightmapBake &bake, WorkerPool &pool, const PointLight *pLights, int count,
+                       ULONGLONG lightsHash)
 {
-    CleanupApp();
+    // Queues baking the lights into the lightmap, a band of rows per job,
+    // for the pool's threads to get on with while frames are drawn. The
+    // lightmap mustn't be read until FinishLightmapBake() has returned.
 
-    SAFE_RELEASE(g_pNullTexture);
-    SAFE_RELEASE(g_pFont);
-    SAFE_RELEASE(g_pDevice);
-    SAFE_RELEASE(g_pDirect3D);
+    FinishLightmapBake(bake, pool);
+
+    int height = bake.pLightmap->height;
+    int numBands = (height + LIGHTMAP_BAND_ROWS - 1) / LIGHTMAP_BAND_ROWS;
+
+    memcpy(bake.lights, pLights, sizeof(PointLight) * count);
+    bake.numLights = count;
+    bake.lightsHash = lightsHash;
+    bake.bands.resize(numBands);
+    bake.remainingBands = numBands;
+    bake.cancel = 0;
+    bake.startTime = GetTimeInSeconds();
+    bake.pending = true;
+
+    for (int i = 0; i < numBands; ++i)
+    {
+        LightmapBakeBand &band = bake.bands[i];
+
+        band.pBake = &bake;
+        band.firstRow = i * LIGHTMAP_BAND_ROWS;
+        band.rowCount = min(LIGHTMAP_BAND_ROWS, height - band.firstRow);
+        band.raysTraced = 0;
+        band.endTime = bake.startTime;
+    }
+
+    for (int i = 0; i < numBands; ++i)
+        pool.submit(BakeLightmapBand, &bake.bands[i]);
 }
 
-void CleanupApp()
+void StartOcclusionJob(OcclusionJob &job, WorkerPool &pool, const D3DXMATRIX &viewProjection,
+                       const D3DXVECTOR3 &cameraPos)
 {
-    SAFE_RELEASE(g_pAmbientEffect);
-    SAFE_RELEASE(g_pBlinnPhongEffectSM20);
-    SAFE_RELEASE(g_pBlinnPhongEffectSM30);
-    SAFE_RELEASE(g_pWallColorTexture);
-    SAFE_RELEASE(g_pCeilingColorTexture);
-    SAFE_RELEASE(g_pFloorColorTexture);
-    SAFE_RELEASE(g_pRoomVertexBuffer);
-    SAFE_RELEASE(g_pRoomVertexDecl);
-    SAFE_RELEASE(g_pLightMesh);
+    // Queues rasterizing the occluders for a view. The buffer mustn't be
+    // used until FinishOcclusionJob() has returned.
+
+    FinishOcclusionJob(job, pool);
+
+    memset(&job.stats, 0, sizeof(job.stats));
+    job.viewProjection = viewProjection;
+    job.cameraPos = cameraPos;
+    job.done = 0;
+    job.pending = true;
+
+    pool.submit(RenderOccludersJob, &job);
 }
 
-HWND CreateAppWindow(const WNDCLASSEX &wcl, const char *pszTitle)
+void StartShaderCompile(ShaderCompile &shader, const char *pszFilename, WorkerPool &pool)
 {
-    // Create a window that is centered on the desktop. It's exactly 1/4 the
-    // size of the desktop. Don't allow it to be resized.
+    shader.pszFilename = pszFilename;
+    shader.pEffectCode = 0;
+    shader.pErrors = 0;
 
-    DWORD wndExStyle = WS_EX_OVERLAPPEDWINDOW;
-    DWORD wndStyle = WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU |
-                     WS_MINIMIZEBOX | WS_CLIPCHILDREN | WS_CLIPSIBLINGS;
+    pool.submit(CompileShaderJob, &shader);
+}
 
-    HWND hWnd = CreateWindowEx(wndExStyle, wcl.lpszClassName, pszTitle,
-                    wndStyle, 0, 0, 0, 0, 0, 0, wcl.hInstance, 0);
+void StartTextureLoad(TextureLoad &load, const char *pszFilename, bool useCache,
+                      WorkerPool &ioPool, WorkerPool &decodePool)
+{
+    load.pszFilename = pszFilename;
+    load.pDecodePool = &decodePool;
+    load.sourceHash = 0;
+    load.useCache = useCache;
+    load.fromCache = false;
+    load.succeeded = false;
+    memset(&load.image, 0, sizeof(load.image));
+    memset(&load.compressed, 0, sizeof(load.compressed));
+
+    snprintf(load.szCacheFilename, sizeof(load.szCacheFilename), "%s%s",
+        pszFilename, TEXTURE_CACHE_EXTENSION);
+
+    ioPool.submit(ReadTextureJob, &load);
+}
 
-    if (hWnd)
-    {
-        int screenWidth = GetSystemMetrics(SM_CXSCREEN);
-        int screenHeight = GetSystemMetrics(SM_CYSCREEN);
-        int halfScreenWidth = screenWidth / 2;
-        int halfScreenHeight = screenHeight / 2;
-        int left = (screenWidth - halfScreenWidth) / 2;
-        int top = (screenHeight - halfScreenHeight) / 2;
-        RECT rc = {0};
+void StopFramePipeline()
+{
+    // Stops the simulation thread and returns to simulating frames serially.
+    // Any snapshots still queued are discarded.
 
-        SetRect(&rc, left, top, left + halfScreenWidth, top + halfScreenHeight);
-        AdjustWindowRectEx(&rc, wndStyle, FALSE, wndExStyle);
-        MoveWindow(hWnd, rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top, TRUE);
+    FramePipeline &pipeline = g_framePipeline;
 
-        GetClientRect(hWnd, &rc);
-        g_windowWidth = rc.right - rc.left;
-        g_windowHeight = rc.bottom - rc.top;
+    if (pipeline.hThread)
+    {
+        SetEvent(pipeline.hQuitEvent);
+        WaitForSingleObject(pipeline.hThread, INFINITE);
+        CloseHandle(pipeline.hThread);
     }
 
-    return hWnd;
-}
+    if (pipeline.hQuitEvent)
+        CloseHandle(pipeline.hQuitEvent);
 
-bool CreateNullTexture(int width, int height, LPDIRECT3DTEXTURE9 &pTexture)
-{
-    // Create an empty white texture. This texture is applied to geometry
-    // that doesn't have any texture maps. This trick allows the same shader to
-    // be used to draw the geometry with and without textures applied.
+    if (pipeline.hFilledSlots)
+        CloseHandle(pipeline.hFilledSlots);
 
-    HRESULT hr = D3DXCreateTexture(g_pDevice, width, height, 0, 0,
-                    D3DFMT_X8R8G8B8, D3DPOOL_MANAGED, &pTexture);
+    if (pipeline.hFreeSlots)
+        CloseHandle(pipeline.hFreeSlots);
 
-    if (FAILED(hr))
-        return false;
+    pipeline.hThread = 0;
+    pipeline.hQuitEvent = 0;
+    pipeline.hFilledSlots = 0;
+    pipeline.hFreeSlots = 0;
+    pipeline.depth = 0;
+}
 
-    LPDIRECT3DSURFACE9 pSurface = 0;
+void SubmitRoomBatches(ID3DXEffect *pEffect, const RoomBatch *pBatches, int count,
+                       SubmissionCounters &counters)
+{
+    // Draws the room batches with the effect's current technique, skipping
+    // material and texture changes that wouldn't change anything, and counts
+    // what was submitted. Given a null effect nothing is submitted and each
+    // round counts as one pass, which records what would have been.
 
-    if (SUCCEEDED(pTexture->GetSurfaceLevel(0, &pSurface)))
+    const Material *pMaterial = 0;
+    IDirect3DTexture9 *const *ppTexture = 0;
+
+    for (int i = 0; i < count; ++i)
     {
-        D3DLOCKED_RECT rcLock = {0};
+        const RoomBatch &batch = pBatches[i];
 
-        if (SUCCEEDED(pSurface->LockRect(&rcLock, 0, 0)))
+        if (batch.pMaterial && batch.pMaterial != pMaterial)
         {
-            BYTE *pPixels = static_cast<BYTE*>(rcLock.pBits);
-            int widthInBytes = width * 4;
-
-            if (widthInBytes == rcLock.Pitch)
+            if (pEffect)
             {
-                memset(pPixels, 0xff, widthInBytes * height);
+                pEffect->SetValue("material.ambient", batch.pMaterial->ambient, sizeof(batch.pMaterial->ambient));
+                pEffect->SetValue("material.diffuse", batch.pMaterial->diffuse, sizeof(batch.pMaterial->diffuse));
+                pEffect->SetValue("material.emissive", batch.pMaterial->emissive, sizeof(batch.pMaterial->emissive));
+                pEffect->SetValue("material.specular", batch.pMaterial->specular, sizeof(batch.pMaterial->specular));
+                pEffect->SetFloat("material.shininess", batch.pMaterial->shininess);
             }
-            else
+
+            counters.parameterSets += 5;
+            pMaterial = batch.pMaterial;
+        }
+
+        if (batch.ppTexture != ppTexture)
+        {
+            if (pEffect)
+                pEffect->SetTexture(batch.pszTextureName, *batch.ppTexture);
+
+            ++counters.parameterSets;
+            ++counters.textureBinds;
+            ppTexture = batch.ppTexture;
+        }
+
+        UINT totalPasses = 1;
+
+        if (pEffect && FAILED(pEffect->Begin(&totalPasses, 0)))
+            continue;
+
+        ++counters.effectRounds;
+
+        for (UINT pass = 0; pass < totalPasses; ++pass)
+        {
+            if (pEffect && FAILED(pEffect->BeginPass(pass)))
+                continue;
+
+            if (pEffect)
             {
-                for (int y = 0; y < height; ++y)
-                    memset(&pPixels[y * rcLock.Pitch], 0xff, rcLock.Pitch);
+                g_pDevice->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, 0,
+                    static_cast<UINT>(g_roomMesh.vertices.size()), batch.firstIndex, batch.primitiveCount);
+                pEffect->EndPass();
             }
 
-            pSurface->UnlockRect();
-            pSurface->Release();
-            return true;
+            ++counters.drawCalls;
         }
 
-        pSurface->Release();
+        if (pEffect)
+            pEffect->End();
     }
-
-    pTexture->Release();
-    return false;
 }
 
-bool DeviceIsValid()
+bool TestOcclusionBox(const OcclusionBuffer &buffer, const float boundsMin[3], const float boundsMax[3])
 {
-    HRESULT hr = g_pDevice->TestCooperativeLevel();
+    // Returns false when the box is certainly hidden, because its nearest
+    // corner is farther away than the occluders everywhere its screen
+    // rectangle covers. The rectangle is looked up in the pyramid level
+    // where it spans fewer than OCCLUSION_MAX_TEST_TEXELS texels each way.
+    // Boxes crossing the near plane are never hidden. The 8 corners are
+    // projected 4 at a time.
+
+    const D3DXMATRIX &m = buffer.viewProjection;
+    const __m128 cornersX = _mm_setr_ps(boundsMin[0], boundsMax[0], boundsMin[0], boundsMax[0]);
+    const __m128 cornersY = _mm_setr_ps(boundsMin[1], boundsMin[1], boundsMax[1], boundsMax[1]);
+    __m128 minX = _mm_set1_ps(FLT_MAX);
+    __m128 minY = _mm_set1_ps(FLT_MAX);
+    __m128 maxInvW = _mm_setzero_ps();
+    __m128 maxX = _mm_set1_ps(-FLT_MAX);
+    __m128 maxY = _mm_set1_ps(-FLT_MAX);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        __m128 cornersZ = _mm_set1_ps(i ? boundsMax[2] : boundsMin[2]);
+        __m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cornersX, _mm_set1_ps(m._11)), _mm_mul_ps(cornersY, _mm_set1_ps(m._21))),
+                              _mm_add_ps(_mm_mul_ps(cornersZ, _mm_set1_ps(m._31)), _mm_set1_ps(m._41)));
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cornersX, _mm_set1_ps(m._12)), _mm_mul_ps(cornersY, _mm_set1_ps(m._22))),
+                              _mm_add_ps(_mm_mul_ps(cornersZ, _mm_set1_ps(m._32)), _mm_set1_ps(m._42)));
+        __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cornersX, _mm_set1_ps(m._13)), _mm_mul_ps(cornersY, _mm_set1_ps(m._23))),
+                              _mm_add_ps(_mm_mul_ps(cornersZ, _mm_set1_ps(m._33)), _mm_set1_ps(m._43)));
+        __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cornersX, _mm_set1_ps(m._14)), _mm_mul_ps(cornersY, _mm_set1_ps(m._24))),
+                              _mm_add_ps(_mm_mul_ps(cornersZ, _mm_set1_ps(m._34)), _mm_set1_ps(m._44)));
+
+        if (_mm_movemask_ps(_mm_cmple_ps(z, _mm_setzero_ps())) != 0)
+            return true;
 
-    if (FAILED(hr))
+        __m128 invW = _mm_div_ps(_mm_set1_ps(1.0f), w);
+
+        x = _mm_mul_ps(x, invW);
+        y = _mm_mul_ps(y, invW);
+        minX = _mm_min_ps(minX, x);
+        maxX = _mm_max_ps(maxX, x);
+        minY = _mm_min_ps(minY, y);
+        maxY = _mm_max_ps(maxY, y);
+        maxInvW = _mm_max_ps(maxInvW, invW);
+    }
+
+    float extremes[5][4];
+
+    _mm_storeu_ps(extremes[0], minX);
+    _mm_storeu_ps(extremes[1], maxX);
+    _mm_storeu_ps(extremes[2], minY);
+    _mm_storeu_ps(extremes[3], maxY);
+    _mm_storeu_ps(extremes[4], maxInvW);
+
+    for (int i = 1; i < 4; ++i)
     {
-        if (hr == D3DERR_DEVICENOTRESET)
-            return ResetDevice();
+        extremes[0][0] = min(extremes[0][0], extremes[0][i]);
+        extremes[1][0] = max(extremes[1][0], extremes[1][i]);
+        extremes[2][0] = min(extremes[2][0], extremes[2][i]);
+        extremes[3][0] = max(extremes[3][0], extremes[3][i]);
+        extremes[4][0] = max(extremes[4][0], extremes[4][i]);
     }
 
-    return true;
+    // Boxes off the screen are left to the frustum culling.
+
+    float nearest = extremes[4][0];
+    int left = max(0, static_cast<int>(floorf((extremes[0][0] * 0.5f + 0.5f) * buffer.width)));
+    int right = min(buffer.width - 1, static_cast<int>(floorf((extremes[1][0] * 0.5f + 0.5f) * buffer.width)));
+    int top = max(0, static_cast<int>(floorf((0.5f - extremes[3][0] * 0.5f) * buffer.height)));
+    int bottom = min(buffer.height - 1, static_cast<int>(floorf((0.5f - extremes[2][0] * 0.5f) * buffer.height)));
+
+    if (left > right || top > bottom)
+        return true;
+
+    int level = 0;
+
+    while (level < buffer.levels - 1 &&
+           ((right >> level) - (left >> level) >= OCCLUSION_MAX_TEST_TEXELS ||
+            (bottom >> level) - (top >> level) >= OCCLUSION_MAX_TEST_TEXELS))
+        ++level;
+
+    const float *pLevel = buffer.pDepth + buffer.levelOffsets[level];
+    int levelWidth = buffer.levelWidths[level];
+
+    for (int y = top >> level; y <= (bottom >> level); ++y)
+    {
+        for (int x = left >> level; x <= (right >> level); ++x)
+        {
+            if (pLevel[y * levelWidth + x] <= nearest)
+                return true;
+        }
+    }
+
+    return false;
 }
 
-float GetElapsedTimeInSeconds()
+bool TestOcclusionSphere(const OcclusionBuffer &buffer, const float center[3], float radius)
 {
-    // Returns the elapsed time (in seconds) since the last time this function
-    // was called. This elaborate setup is to guard against large spikes in
-    // the time returned by QueryPerformanceCounter().
+    float boundsMin[3] = {center[0] - radius, center[1] - radius, center[2] - radius};
+    float boundsMax[3] = {center[0] + radius, center[1] + radius, center[2] + radius};
 
-    static const int MAX_SAMPLE_COUNT = 50;
+    return TestOcclusionBox(buffer, boundsMin, boundsMax);
+}
 
-    static float frameTimes[MAX_SAMPLE_COUNT];
-    static float timeScale = 0.0f;
-    static float actualElapsedTimeSec = 0.0f;
-    static INT64 freq = 0;
-    static INT64 lastTime = 0;
-    static int sampleCount = 0;
-    static bool initialized = false;
+void ToggleFullScreen()
+{
+    static DWORD savedExStyle;
+    static DWORD savedStyle;
+    static RECT rcSaved;
 
-    INT64 time = 0;
-    float elapsedTimeSec = 0.0f;
+    g_isFullScreen = !g_isFullScreen;
 
-    if (!initialized)
+    if (g_isFullScreen)
     {
-        initialized = true;
-        QueryPerformanceFrequency(reinterpret_cast<LARGE_INTEGER*>(&freq));
-        QueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&lastTime));
-        timeScale = 1.0f / freq;
-    }
+        // Moving to full screen mode.
 
-    QueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&time));
-    elapsedTimeSec = (time - lastTime) * timeScale;
-    lastTime = time;
+        savedExStyle = GetWindowLong(g_hWnd, GWL_EXSTYLE);
+        savedStyle = GetWindowLong(g_hWnd, GWL_STYLE);
+        GetWindowRect(g_hWnd, &rcSaved);
 
-    if (fabsf(elapsedTimeSec - actualElapsedTimeSec) < 1.0f)
+        SetWindowLong(g_hWnd, GWL_EXSTYLE, 0);
+        SetWindowLong(g_hWnd, GWL_STYLE, WS_POPUP);
+        SetWindowPos(g_hWnd, HWND_TOPMOST, 0, 0, 0, 0,
+            SWP_NOMOVE | SWP_NOSIZE | SWP_FRAMECHANGED | SWP_SHOWWINDOW);
+
+        g_windowWidth = GetSystemMetrics(SM_CXSCREEN);
+        g_windowHeight = GetSystemMetrics(SM_CYSCREEN);
+
+        SetWindowPos(g_hWnd, HWND_TOPMOST, 0, 0,
+            g_windowWidth, g_windowHeight, SWP_SHOWWINDOW);
+
+        // Update presentation parameters.
+
+        g_params.Windowed = FALSE;
+        g_params.BackBufferWidth = g_windowWidth;
+        g_params.BackBufferHeight = g_windowHeight;
+
+        if (g_enableVerticalSync)
+        {
+            g_params.FullScreen_RefreshRateInHz = D3DPRESENT_INTERVAL_DEFAULT;
+            g_params.PresentationInterval = D3DPRESENT_INTERVAL_DEFAULT;
+        }
+        else
+        {
+            g_params.FullScreen_RefreshRateInHz = D3DPRESENT_INTERVAL_IMMEDIATE;
+            g_params.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
+        }
+    }
+    else
     {
-        memmove(&frameTimes[1], frameTimes, sizeof(frameTimes) - sizeof(frameTimes[0]));
-        frameTimes[0] = elapsedTimeSec;
+        // Moving back to windowed mode.
 
-        if (sampleCount < MAX_SAMPLE_COUNT)
-            ++sampleCount;
+        SetWindowLong(g_hWnd, GWL_EXSTYLE, savedExStyle);
+        SetWindowLong(g_hWnd, GWL_STYLE, savedStyle);
+        SetWindowPos(g_hWnd, HWND_NOTOPMOST, 0, 0, 0, 0,
+            SWP_NOMOVE | SWP_NOSIZE | SWP_FRAMECHANGED | SWP_SHOWWINDOW);
+
+        g_windowWidth = rcSaved.right - rcSaved.left;
+        g_windowHeight = rcSaved.bottom - rcSaved.top;
+
+        SetWindowPos(g_hWnd, HWND_NOTOPMOST, rcSaved.left, rcSaved.top,
+            g_windowWidth, g_windowHeight, SWP_SHOWWINDOW);
+
+        // Update presentation parameters.
+
+        g_params.Windowed = TRUE;
+        g_params.BackBufferWidth = g_windowWidth;
+        g_params.BackBufferHeight = g_windowHeight;
+        g_params.FullScreen_RefreshRateInHz = 0;
+
+        if (g_enableVerticalSync)
+            g_params.PresentationInterval = D3DPRESENT_INTERVAL_DEFAULT;
+        else
+            g_params.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
     }
 
-    actualElapsedTimeSec = 0.0f;
+    ResetDevice();
+}
 
-    for (int i = 0; i < sampleCount; ++i)
-        actualElapsedTimeSec += frameTimes[i];
+void TouchVirtualSlot(VirtualTexture &texture, int slot)
+{
+    // Moves a physical page slot to the front of the LRU list.
 
-    if (sampleCount > 0)
-        actualElapsedTimeSec /= sampleCount;
+    if (slot == texture.lruHead)
+        return;
 
-    return actualElapsedTimeSec;
+    int prev = texture.slotPrev[slot];
+    int next = texture.slotNext[slot];
+
+    texture.slotNext[prev] = next;
+
+    if (next >= 0)
+        texture.slotPrev[next] = prev;
+    else
+        texture.lruTail = prev;
+
+    texture.slotPrev[slot] = -1;
+    texture.slotNext[slot] = texture.lruHead;
+    texture.slotPrev[texture.lruHead] = slot;
+    texture.lruHead = slot;
 }
 
-bool Init()
+int TraceRoom(const D3DXVECTOR3 &origin, const D3DXVECTOR3 &direction, float pos[3], float normal[3])
 {
-    if (!InitD3D())
+    // Finds where a ray starting inside the room meets its walls, ceiling
+    // or floor, and the normal there, which faces into the room. Returns
+    // which ROOM_SURFACE_* it meets, or -1 if it doesn't leave the room.
+
+    const float halfSizes[3] = {ROOM_SIZE_X_HALF, ROOM_SIZE_Y_HALF, ROOM_SIZE_Z_HALF};
+    float nearest = FLT_MAX;
+    int axis = -1;
+
+    for (int i = 0; i < 3; ++i)
     {
-        Log("Direct3D initialization failed!");
-        return false;
+        if (direction[i] == 0.0f)
+            continue;
+
+        float t = ((direction[i] > 0.0f ? halfSizes[i] : -halfSizes[i]) - origin[i]) / direction[i];
+
+        if (t > 0.0f && t < nearest)
+        {
+            nearest = t;
+            axis = i;
+        }
     }
 
-    try
+    if (axis < 0)
+        return -1;
+
+    for (int c = 0; c < 3; ++c)
     {
-        InitApp();
-        return true;
+        pos[c] = origin[c] + direction[c] * nearest;
+        normal[c] = (c == axis) ? ((direction[c] > 0.0f) ? -1.0f : 1.0f) : 0.0f;
     }
-    catch (const std::exception &e)
-    {
-        std::ostringstream msg;
 
-        msg << "Application initialization failed!" << std::endl << std::endl;
-        msg << e.what();
+    pos[axis] = (direction[axis] > 0.0f) ? halfSizes[axis] : -halfSizes[axis];
 
-        Log(msg.str().c_str());
-        return false;
-    }
+    if (axis != 1)
+        return ROOM_SURFACE_WALLS;
+
+    return (direction[1] > 0.0f) ? ROOM_SURFACE_CEILING : ROOM_SURFACE_FLOOR;
 }
 
-void InitApp()
+void UnlinkOctreeItem(Octree &tree, int index)
 {
-    // Verify that shader model 2.0 or higher is supported.
+    // Takes an item out of its node, and frees that node and any nodes
+    // above it that are left without items.
 
-    DWORD dwVSVersion = g_caps.VertexShaderVersion;
-    DWORD dwPSVersion = g_caps.PixelShaderVersion;
+    OctreeItem &item = tree.items[index];
+    int node = item.node;
 
-    if (dwVSVersion >= D3DVS_VERSION(3,0) && dwPSVersion >= D3DPS_VERSION(3,0))
-        g_supportsShaderModel30 = true;
-    else if (dwVSVersion >= D3DVS_VERSION(2,0) && dwPSVersion >= D3DPS_VERSION(2,0))
-        g_supportsShaderModel30 = false;
+    if (item.prev >= 0)
+        tree.items[item.prev].next = item.next;
     else
-        throw std::runtime_error("Shader model 2.0 or higher is required.");
+        tree.nodes[node].firstItem = item.next;
+
+    if (item.next >= 0)
+        tree.items[item.next].prev = item.prev;
+
+    item.node = -1;
+    item.prev = -1;
+    item.next = -1;
+
+    while (node >= 0)
+    {
+        OctreeNode &current = tree.nodes[node];
+        int parent = current.parent;
+
+        if (--current.itemCount == 0 && parent >= 0)
+        {
+            for (int c = 0; c < 8; ++c)
+            {
+                if (tree.nodes[parent].children[c] == node)
+                    tree.nodes[parent].children[c] = -1;
+            }
+
+            current.parent = tree.freeNode;
+            tree.freeNode = node;
+        }
+
+        node = parent;
+    }
+}
+
+void UnpackColor565(WORD color, int rgb[3])
+{
+    // Expands a 5:6:5 color to 8 bits per channel by replicating the high
+    // bits into the low bits, the same as the hardware does.
+
+    rgb[0] = ((color >> 11) << 3) | (color >> 13);
+    rgb[1] = (((color >> 5) & 0x3f) << 2) | ((color >> 9) & 0x03);
+    rgb[2] = ((color & 0x1f) << 3) | ((color >> 2) & 0x07);
+}
 
-    // Setup fonts.
+void UnpackVertices(const PackedVertex *pPacked, int count, const VertexQuantization &quantization,
+                    Vertex *pVertices)
+{
+    // The CPU side of the vertex shader's decode, for code that reads
+    // packed vertices back.
 
-    if (!InitFont("Arial", 10, g_pFont))
-        throw std::runtime_error("Failed to create font.");
+    for (int i = 0; i < count; ++i)
+    {
+        const PackedVertex &packed = pPacked[i];
+        Vertex &vertex = pVertices[i];
 
-    // Load shaders.
+        for (int c = 0; c < 3; ++c)
+            vertex.pos[c] = Snorm16ToFloat(packed.pos[c]) * quantization.halfExtent[c] + quantization.center[c];
 
-    if (!LoadShader("Content/Shaders/ambient.fx", g_pAmbientEffect))
-        throw std::runtime_error("Failed to load shader: ambient.fx.");
+        D3DXFloat16To32Array(vertex.texCoord, packed.texCoord, 2);
+        DecodeOctahedralNormal(packed.normal, vertex.normal);
+    }
+}
 
-    if (!LoadShader("Content/Shaders/blinn_phong_sm20.fx", g_pBlinnPhongEffectSM20))
-        throw std::runtime_error("Failed to load shader: blinn_phong_sm20.fx.");
+void UpdateAllocationStats()
+{
+    // Called once at the start of every frame. Everything allocated since
+    // the previous call is charged to the previous frame. The first call
+    // marks the end of startup.
 
-    if (g_supportsShaderModel30)
-    {
-        if (!LoadShader("Content/Shaders/blinn_phong_sm30.fx", g_pBlinnPhongEffectSM30))
-            throw std::runtime_error("Failed to load shader: blinn_phong_sm30.fx.");
+    AllocationStats &stats = g_allocationStats;
+    LONG allocations = g_allocations.allocations;
+    LONGLONG bytes = g_allocations.bytes;
 
-        g_pBlinnPhongEffect = g_pBlinnPhongEffectSM30;
-        g_numLights = MAX_LIGHTS_SM30;
+    if (stats.frames == 0)
+    {
+        stats.startupAllocations = allocations;
+        stats.startupBytes = bytes;
     }
     else
     {
-        g_pBlinnPhongEffect = g_pBlinnPhongEffectSM20;
-        g_numLights = MAX_LIGHTS_SM20;
-    }
-    
-    // Load textures.
+        stats.frameAllocations = allocations - stats.frameStartAllocations;
+        stats.frameBytes = bytes - stats.frameStartBytes;
 
-    if (!CreateNullTexture(2, 2, g_pNullTexture))
-        throw std::runtime_error("Failed to create null texture.");
+        ++stats.accumFrames;
+        stats.accumAllocations += stats.frameAllocations;
+        stats.accumBytes += stats.frameBytes;
 
-    if (FAILED(D3DXCreateTextureFromFile(g_pDevice,
-            "Content/Textures/brick_color_map.jpg", &g_pWallColorTexture)))
-        throw std::runtime_error("Failed to load texture: brick_color_map.jpg.");
+        if (stats.frameAllocations > stats.accumMaxAllocations)
+            stats.accumMaxAllocations = stats.frameAllocations;
 
-    if (FAILED(D3DXCreateTextureFromFile(g_pDevice,
-            "Content/Textures/wood_color_map.jpg", &g_pCeilingColorTexture)))
-        throw std::runtime_error("Failed to load texture: wood_color_map.jpg.");
+        if (stats.frames > ALLOCATION_WARMUP_FRAMES && stats.frameAllocations > g_allocationBudget)
+        {
+            ++stats.budgetViolations;
 
-    if (FAILED(D3DXCreateTextureFromFile(g_pDevice,
-            "Content/Textures/stone_color_map.jpg", &g_pFloorColorTexture)))
-        throw std::runtime_error("Failed to load texture: stone_color_map.jpg.");
+            if (g_failOnAllocationBudget && stats.budgetViolations == 1)
+            {
+                static char szReport[HUD_TEXT_MAX_CHARS];
+                int length = 0;
 
-    // Create geometry for the room.
+                AppendText(szReport, HUD_TEXT_MAX_CHARS, length,
+                    "Steady state frame made %d heap allocations (%d bytes).\n",
+                    stats.frameAllocations, static_cast<int>(stats.frameBytes));
+                AppendAllocationReport(szReport, HUD_TEXT_MAX_CHARS, length);
 
-    InitRoom();
+                OutputDebugString(szReport);
+                PostQuitMessage(1);
+            }
+        }
+    }
 
-    // Create geometry for the light.
+    stats.frameStartAllocations = g_allocations.allocations;
+    stats.frameStartBytes = g_allocations.bytes;
+    ++stats.frames;
+}
 
-    if (FAILED(D3DXCreateSphere(g_pDevice, LIGHT_OBJECT_RADIUS,
-            LIGHT_OBJECT_SLICES, LIGHT_OBJECT_STACKS, &g_pLightMesh, 0)))
-        throw std::runtime_error("Failed to create the point light mesh.");
+void UpdateCamera()
+{
+    UpdateCameraView(g_camera, static_cast<float>(g_windowWidth) / static_cast<float>(g_windowHeight));
+}
 
-    // Seed the random number generator.
+void UpdateCameraView(Camera &camera, float aspect)
+{
+    // Works out a camera's axes, position and view projection from its
+    // orientation, target and offset.
 
-    srand(GetTickCount());
+    D3DXMATRIX view, proj;
 
-    // Initialize the point lights in the scene.
+    // Build the perspective projection matrix.
 
-    for (int i = 0; i < g_numLights; ++i)
-        g_lights[i].init();
+    D3DXMatrixPerspectiveFovLH(&proj, CAMERA_FOVY, aspect, CAMERA_ZNEAR, CAMERA_ZFAR);
+
+    // Build the view matrix.
+
+    D3DXQuaternionNormalize(&camera.orientation, &camera.orientation);
+    D3DXMatrixRotationQuaternion(&view, &camera.orientation);
+    
+    camera.xAxis = D3DXVECTOR3(view(0,0), view(1,0), view(2,0));
+    camera.yAxis = D3DXVECTOR3(view(0,1), view(1,1), view(2,1));
+    camera.zAxis = D3DXVECTOR3(view(0,2), view(1,2), view(2,2));
+   
+    camera.pos = camera.target + camera.zAxis * -camera.offset;
+
+    view(3,0) = -D3DXVec3Dot(&camera.xAxis, &camera.pos);
+    view(3,1) = -D3DXVec3Dot(&camera.yAxis, &camera.pos);
+    view(3,2) = -D3DXVec3Dot(&camera.zAxis, &camera.pos);
+    
+    camera.viewProjectionMatrix = view * proj;
 }
 
-bool InitD3D()
+void UpdateFrame(float elapsedTimeSec)
 {
-    HRESULT hr = 0;
-    D3DDISPLAYMODE desktop = {0};
-
-    g_pDirect3D = Direct3DCreate9(D3D_SDK_VERSION);
+    UpdateAllocationStats();
+    UpdateFrameRate(elapsedTimeSec);
 
-    if (!g_pDirect3D)
-        return false;
+    // Everything allocated from the frame arena by the oldest frame in
+    // flight is released here in one go.
 
-    // Just use the current desktop display mode.
-    hr = g_pDirect3D->GetAdapterDisplayMode(D3DADAPTER_DEFAULT, &desktop);
+    g_frameArena.nextFrame();
 
-    if (FAILED(hr))
-    {
-        g_pDirect3D->Release();
-        g_pDirect3D = 0;
-        return false;
-    }
+    // The camera is driven by window messages and so is always updated on
+    // the main thread. The resulting input is then either simulated right
+    // away or picked up by the simulation thread for a later frame.
 
-    // Setup Direct3D for windowed rendering.
-    g_params.BackBufferWidth = 0;
-    g_params.BackBufferHeight = 0;
-    g_params.BackBufferFormat = desktop.Format;
-    g_params.BackBufferCount = 1;
-    g_params.hDeviceWindow = g_hWnd;
-    g_params.Windowed = TRUE;
-    g_params.EnableAutoDepthStencil = TRUE;
-    g_params.AutoDepthStencilFormat = D3DFMT_D24S8;
-    g_params.Flags = D3DPRESENTFLAG_DISCARD_DEPTHSTENCIL;
-    g_params.FullScreen_RefreshRateInHz = 0;
+    UpdateCamera();
+    PublishFrameInput();
 
-    if (g_enableVerticalSync)
-        g_params.PresentationInterval = D3DPRESENT_INTERVAL_DEFAULT;
+    if (g_framePipeline.depth > 0)
+        AcquireFrame(g_renderFrame);
     else
-        g_params.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
+        SimulateFrame(elapsedTimeSec, g_renderFrame);
 
-    // Swap effect must be D3DSWAPEFFECT_DISCARD for multi-sampling support.
-    g_params.SwapEffect = D3DSWAPEFFECT_DISCARD;
+    // The scene's walls are rasterized for occlusion culling on a worker
+    // thread while the effects are updated and the frame is culled.
 
-    // Select the highest quality multi-sample anti-aliasing (MSAA) mode.
-    ChooseBestMSAAMode(g_params.BackBufferFormat, g_params.AutoDepthStencilFormat,
-        g_params.Windowed, g_params.MultiSampleType, g_params.MultiSampleQuality,
-        g_msaaSamples);
+    if (g_pSceneVertexBuffer && g_useOcclusionCulling)
+        StartOcclusionJob(g_occlusionJob, g_workerPool, g_renderFrame.viewProjectionMatrix, g_renderFrame.cameraPos);
 
-    // Most modern video cards should have no problems creating pure devices.
-    // Note that by creating a pure device we lose the ability to debug vertex
-    // and pixel shaders.
-    hr = g_pDirect3D->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, g_hWnd,
-            D3DCREATE_HARDWARE_VERTEXPROCESSING | D3DCREATE_PUREDEVICE,
-            &g_params, &g_pDevice);
+    UpdateLightmap(g_renderFrame);
+    UpdateEffects(g_renderFrame);
+}
 
-    if (FAILED(hr))
-    {
-        // Fall back to software vertex processing for less capable hardware.
-        // Note that in order to debug vertex shaders we must use a software
-        // vertex processing device.
-        hr = g_pDirect3D->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, g_hWnd,
-                D3DCREATE_SOFTWARE_VERTEXPROCESSING, &g_params, &g_pDevice);
-    }
+void UpdateFrameRate(float elapsedTimeSec)
+{
+    static float accumTimeSec = 0.0f;
+    static int frames = 0;
 
-    if (FAILED(hr))
-    {
-        g_pDirect3D->Release();
-        g_pDirect3D = 0;
-        return false;
-    }   
+    accumTimeSec += elapsedTimeSec;
 
-    if (SUCCEEDED(g_pDevice->GetDeviceCaps(&g_caps)))
+    if (accumTimeSec > 1.0f)
     {
-        // Prefer anisotropic texture filtering if it's supported.
-        if (g_caps.RasterCaps & D3DPRASTERCAPS_ANISOTROPY)
-            g_maxAnisotrophy = g_caps.MaxAnisotropy;
-        else
-            g_maxAnisotrophy = 1;
-    }
+        g_framesPerSecond = frames;
 
-    return true;
-}
+        // The HUD text timing is published at the same rate as the frame
+        // rate so that the HUD text, and therefore its layout, stays stable.
 
-bool InitFont(const char *pszFont, int ptSize, LPD3DXFONT &pFont)
-{
-    static DWORD dwQuality = 0;
+        if (g_textTimeSamples > 0)
+            g_textTimeMs = static_cast<float>(g_textTimeAccumMs / g_textTimeSamples);
 
-    // Prefer ClearType font quality if available.
+        g_textTimeAccumMs = 0.0;
+        g_textTimeSamples = 0;
 
-    if (!dwQuality)
-    {
-        DWORD dwVersion = GetVersion();
-        DWORD dwMajorVersion = static_cast<DWORD>((LOBYTE(LOWORD(dwVersion))));
-        DWORD dwMinorVersion = static_cast<DWORD>((HIBYTE(LOWORD(dwVersion))));
+        if (g_inputLatencySamples > 0)
+            g_inputLatencyMs = static_cast<float>(g_inputLatencyAccumMs / g_inputLatencySamples);
 
-        // Windows XP and higher will support ClearType quality fonts.
-        if (dwMajorVersion >= 6 || (dwMajorVersion == 5 && dwMinorVersion == 1))
-            dwQuality = CLEARTYPE_QUALITY;
-        else
-            dwQuality = ANTIALIASED_QUALITY;
-    }
+        g_inputLatencyAccumMs = 0.0;
+        g_inputLatencySamples = 0;
+        g_simulatedFramesPerSecond = InterlockedExchange(&g_framePipeline.framesSimulated, 0);
 
-    int logPixelsY = 0;
+        AllocationStats &stats = g_allocationStats;
 
-    // Convert from font point size to pixel size.
+        if (stats.accumFrames > 0)
+        {
+            stats.allocationsPerFrame = static_cast<float>(stats.accumAllocations) / stats.accumFrames;
+            stats.bytesPerFrame = static_cast<float>(stats.accumBytes) / stats.accumFrames;
+            stats.maxAllocationsPerFrame = stats.accumMaxAllocations;
+        }
 
-    if (HDC hDC = GetDC((0)))
+        stats.accumFrames = 0;
+        stats.accumAllocations = 0;
+        stats.accumBytes = 0;
+        stats.accumMaxAllocations = 0;
+
+        frames = 0;
+        accumTimeSec = 0.0f;
+    }
+    else
     {
-        logPixelsY = GetDeviceCaps(hDC, LOGPIXELSY);
-        ReleaseDC(0, hDC);
+        ++frames;
     }
+}
 
-    int fontCharHeight = -ptSize * logPixelsY / 72;
+void UpdateEffects(const FrameSnapshot &frame)
+{
+    static const D3DXMATRIX identity(1.0f, 0.0f, 0.0f, 0.0f,
+                                     0.0f, 1.0f, 0.0f, 0.0f,
+                                     0.0f, 0.0f, 1.0f, 0.0f,
+                                     0.0f, 0.0f, 0.0f, 1.0f);
 
-    // Now create the font. Prefer anti-aliased text.
+    ID3DXEffect *pEffect = g_pBlinnPhongEffect;
 
-    HRESULT hr = D3DXCreateFont(
-        g_pDevice,
-        fontCharHeight,                 // height
-        0,                              // width
-        FW_BOLD,                        // weight
-        1,                              // mipmap levels
-        FALSE,                          // italic
-        DEFAULT_CHARSET,                // char set
-        OUT_DEFAULT_PRECIS,             // output precision
-        dwQuality,                      // quality
-        DEFAULT_PITCH | FF_DONTCARE,    // pitch and family
-        pszFont,                        // font name
-        &pFont);
+    // Set the matrices for the shader.
 
-    return SUCCEEDED(hr) ? true : false;
-}
+    pEffect->SetMatrix("worldMatrix", &identity);
+    pEffect->SetMatrix("worldInverseTransposeMatrix", &identity);
+    pEffect->SetMatrix("worldViewProjectionMatrix", &frame.viewProjectionMatrix);
 
-void InitRoom()
-{
-    if (FAILED(g_pDevice->CreateVertexDeclaration(g_roomVertexElements, &g_pRoomVertexDecl)))
-        throw std::runtime_error("Failed to create vertex declaration for room.");
+    // Set the camera position.
+    
+    pEffect->SetValue("cameraPos", &frame.cameraPos, sizeof(frame.cameraPos));
 
-    if (FAILED(g_pDevice->CreateVertexBuffer(sizeof(Vertex) * 36, 0, 0,
-            D3DPOOL_MANAGED, &g_pRoomVertexBuffer, 0)))
-        throw std::runtime_error("Failed to create vertex buffer for room.");
+    // Set the scene global ambient term.
+    
+    pEffect->SetValue("globalAmbient", &g_sceneAmbient, sizeof(g_sceneAmbient));
 
-    Vertex *pVertices = 0;
+    // Set the number of active lights. For shader model 3.0 only.
+    
+    if (pEffect == g_pBlinnPhongEffectSM30)
+        pEffect->SetValue("numLights", &g_numLights, sizeof(g_numLights));
 
-    if (FAILED(g_pRoomVertexBuffer->Lock(0, 0, reinterpret_cast<void**>(&pVertices), 0)))
-        throw std::runtime_error("Failed to lock room vertex buffer.");
+    // Set the lighting parameters for the shader.
+    
+    const PointLight *pLight = 0;
+    D3DXHANDLE hLight;
+    D3DXHANDLE hLightPos;
+    D3DXHANDLE hLightAmbient;
+    D3DXHANDLE hLightDiffuse;
+    D3DXHANDLE hLightSpecular;
+    D3DXHANDLE hLightRadius;
 
-    memcpy(pVertices, g_room, sizeof(g_room));
-    g_pRoomVertexBuffer->Unlock();
+    for (int i = 0; i < g_numLights; ++i)
+    {
+        pLight = &frame.lights[i];
+        hLight = pEffect->GetParameterElement("lights", i);
+        
+        hLightPos = pEffect->GetParameterByName(hLight, "pos");
+        hLightAmbient = pEffect->GetParameterByName(hLight, "ambient");
+        hLightDiffuse = pEffect->GetParameterByName(hLight, "diffuse");
+        hLightSpecular = pEffect->GetParameterByName(hLight, "specular");
+        hLightRadius = pEffect->GetParameterByName(hLight, "radius");
+
+        pEffect->SetValue(hLightPos, pLight->renderPos, sizeof(pLight->renderPos));
+        pEffect->SetValue(hLightAmbient, pLight->ambient, sizeof(pLight->ambient));
+        pEffect->SetValue(hLightDiffuse, pLight->diffuse, sizeof(pLight->diffuse));
+        pEffect->SetValue(hLightSpecular, pLight->specular, sizeof(pLight->specular));
+        pEffect->SetFloat(hLightRadius, pLight->radius);
+    }
 }
 
-bool LoadShader(const char *pszFilename, LPD3DXEFFECT &pEffect)
+int UpdateIrradianceVolume(IrradianceVolume &volume, const PointLight *pLights, int count, WorkerPool &pool)
 {
-    ID3DXBuffer *pCompilationErrors = 0;
-    DWORD dwShaderFlags = D3DXFX_NOT_CLONEABLE | D3DXSHADER_NO_PRESHADER;
+    // Brings the volume up to date with the lights and returns how many
+    // were splatted. Only lights whose position, radius or ambient color
+    // changed since they were last splatted are, unless the number of
+    // lights changed or enough updates went by that rounding may have
+    // built up, in which case the grid is cleared and rebuilt. Bands of
+    // changed lights are splatted in parallel on the pool and their
+    // changes added to the grid afterwards.
 
-    // Both vertex and pixel shaders can be debugged. To enable shader
-    // debugging add the following flag to the dwShaderFlags variable:
-    //      dwShaderFlags |= D3DXSHADER_DEBUG;
-    //
-    // Vertex shaders can be debugged with either the REF device or a device
-    // created for software vertex processing (i.e., the IDirect3DDevice9
-    // object must be created with the D3DCREATE_SOFTWARE_VERTEXPROCESSING
-    // behavior). Pixel shaders can be debugged only using the REF device.
-    //
-    // To enable vertex shader debugging add the following flag to the
-    // dwShaderFlags variable:
-    //     dwShaderFlags |= D3DXSHADER_FORCE_VS_SOFTWARE_NOOPT;
-    //
-    // To enable pixel shader debugging add the following flag to the
-    // dwShaderFlags variable:
-    //     dwShaderFlags |= D3DXSHADER_FORCE_PS_SOFTWARE_NOOPT;
+    int cornerCount = volume.corners[0] * volume.corners[1] * volume.corners[2];
 
-    HRESULT hr = D3DXCreateEffectFromFile(g_pDevice, pszFilename, 0, 0,
-                    dwShaderFlags, 0, &pEffect, &pCompilationErrors);
+    volume.pLights = pLights;
+    volume.changed.clear();
+    volume.rebuild = (static_cast<int>(volume.splatted.size()) != count) || (++volume.updates >= IRRADIANCE_REBUILD_UPDATES);
 
-    if (FAILED(hr))
+    if (volume.rebuild)
     {
-        if (pCompilationErrors)
+        volume.colors.assign(cornerCount * 4, 0.0f);
+        volume.splatted.resize(count);
+        volume.updates = 0;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        const PointLight &light = pLights[i];
+        const PointLight &splatted = volume.splatted[i];
+
+        if (volume.rebuild || light.radius != splatted.radius ||
+            memcmp(light.renderPos, splatted.renderPos, sizeof(light.renderPos)) ||
+            memcmp(light.ambient, splatted.ambient, sizeof(light.ambient)))
         {
-            std::string compilationErrors(static_cast<const char *>(
-                            pCompilationErrors->GetBufferPointer()));
+            volume.changed.push_back(i);
+        }
+    }
+
+    int changedCount = static_cast<int>(volume.changed.size());
+
+    if (changedCount == 0)
+        return 0;
+
+    int bands = min(IRRADIANCE_SPLAT_BANDS, changedCount);
+
+    volume.bandSize = (changedCount + bands - 1) / bands;
+    bands = (changedCount + volume.bandSize - 1) / volume.bandSize;
+    volume.bandColors.resize(static_cast<size_t>(bands) * cornerCount * 4);
+
+    ParallelFor(pool, bands, SplatIrradianceBands, &volume);
+
+    for (int band = 0; band < bands; ++band)
+    {
+        const float *pColors = &volume.bandColors[static_cast<size_t>(band) * cornerCount * 4];
+
+        for (int i = 0; i < cornerCount * 4; ++i)
+            volume.colors[i] += pColors[i];
+    }
+
+    for (int i = 0; i < changedCount; ++i)
+        volume.splatted[volume.changed[i]] = pLights[volume.changed[i]];
+
+    return changedCount;
+}
+
+int UpdateLightLod(int lod, float projectedRadius)
+{
+    // Switches to a finer LOD as soon as the current one is too coarse, but
+    // only to a coarser one once the light is LIGHT_LOD_HYSTERESIS smaller
+    // than that LOD's switch point, so that a light hovering around a switch
+    // point doesn't flicker between two LODs.
 
-            pCompilationErrors->Release();
-            throw std::runtime_error(compilationErrors);
-        }
-    }
+    int wanted = GetLightLod(projectedRadius);
 
-    if (pCompilationErrors)
-        pCompilationErrors->Release();
+    if (wanted <= lod)
+        return wanted;
 
-    return pEffect != 0;
+    return max(lod, GetLightLod(projectedRadius * (1.0f + LIGHT_LOD_HYSTERESIS)));
 }
 
-void Log(const char *pszMessage)
+void UpdateLightingCache(LightingCache &cache, const D3DXMATRIX &viewProjection, const float *pPositions,
+                         const float *pNormals, const float *pColors)
 {
-    MessageBox(0, pszMessage, "Error", MB_ICONSTOP);
+    // Keeps the frame ReprojectLighting() was last called for, now that
+    // its pixels are all lit, for the next frame.
+
+    int pixels = cache.width * cache.height;
+
+    memcpy(&cache.colors[0], pColors, sizeof(float) * 4 * pixels);
+    memcpy(&cache.positions[0], pPositions, sizeof(float) * 3 * pixels);
+    memcpy(&cache.normals[0], pNormals, sizeof(float) * 3 * pixels);
+    cache.ages.swap(cache.nextAges);
+    cache.viewProjection = viewProjection;
+    cache.valid = true;
+    ++cache.frame;
 }
 
-bool MSAAModeSupported(D3DMULTISAMPLE_TYPE type, D3DFORMAT backBufferFmt,
-                       D3DFORMAT depthStencilFmt, BOOL windowed,
-                       DWORD &qualityLevels)
+void UpdateLightmap(const FrameSnapshot &frame)
 {
-    DWORD backBufferQualityLevels = 0;
-    DWORD depthStencilQualityLevels = 0;
+    // Bakes the lights into the room's lightmap once they stop moving, and
+    // has the room drawn from the lightmap in place of its per-pixel
+    // lighting once the bake is done. Lights changed while they are still,
+    // for example in radius, are baked again. A bake is cancelled when the
+    // lights start moving before it is done.
 
-    HRESULT hr = g_pDirect3D->CheckDeviceMultiSampleType(D3DADAPTER_DEFAULT,
-                    D3DDEVTYPE_HAL, backBufferFmt, windowed, type,
-                    &backBufferQualityLevels);
+    g_lightmapActive = false;
 
-    if (SUCCEEDED(hr))
+    if (!g_pLightmapTexture)
+        return;
+
+    if (frame.animateLights || !g_useLightmap || g_pBlinnPhongEffect != g_pBlinnPhongEffectSM30)
     {
-        hr = g_pDirect3D->CheckDeviceMultiSampleType(D3DADAPTER_DEFAULT,
-                D3DDEVTYPE_HAL, depthStencilFmt, windowed, type,
-                &depthStencilQualityLevels);
+        if (g_lightmapBake.pending)
+            InterlockedExchange(&g_lightmapBake.cancel, 1);
 
-        if (SUCCEEDED(hr))
-        {
-            if (backBufferQualityLevels == depthStencilQualityLevels)
-            {
-                // The valid range is between zero and one less than the level
-                // returned by IDirect3D9::CheckDeviceMultiSampleType().
+        return;
+    }
 
-                if (backBufferQualityLevels > 0)
-                    qualityLevels = backBufferQualityLevels - 1;
-                else
-                    qualityLevels = backBufferQualityLevels;
+    // Nothing about the lights changes while they are still unless it
+    // changes what they light.
 
-                return true;
-            }
-        }
+    ULONGLONG lightsHash = HashBytes(frame.lights, sizeof(PointLight) * g_numLights);
+
+    if (g_lightmapBake.pending && g_lightmapBake.remainingBands == 0 &&
+        FinishLightmapBake(g_lightmapBake, g_workerPool) &&
+        CopyLightmapToTexture(g_lightmap, g_pLightmapTexture))
+    {
+        g_lightmapHash = g_lightmapBake.lightsHash;
     }
 
-    return false;
+    if (g_lightmapHash == lightsHash)
+    {
+        g_lightmapActive = true;
+        return;
+    }
+
+    if (!g_lightmapBake.pending || g_lightmapBake.lightsHash != lightsHash)
+    {
+        if (g_lightmapBake.pending)
+            InterlockedExchange(&g_lightmapBake.cancel, 1);
+
+        StartLightmapBake(g_lightmapBake, g_workerPool, frame.lights, g_numLights, lightsHash);
+    }
 }
 
-void ProcessMouseInput(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
+void UpdateLights(float elapsedTimeSec)
 {
-    // Use the left mouse button to track the camera.
-    // Use the middle mouse button to dolly the camera.
-    // Use the right mouse button to orbit the camera.
-
-    enum CameraMode {CAMERA_NONE, CAMERA_TRACK, CAMERA_DOLLY, CAMERA_ORBIT};
+    for (int i = 0; i < sizeof(g_lights) / sizeof(g_lights[0]); ++i)
+        g_lights[i].update(elapsedTimeSec);   
+}
 
-    static CameraMode cameraMode = CAMERA_NONE;
-    static POINT ptMousePrev = {0};
-    static POINT ptMouseCurrent = {0};
-    static int mouseButtonsDown = 0;
-    static float dx = 0.0f;
-    static float dy = 0.0f;
-    static float wheelDelta = 0.0f;
-    static D3DXVECTOR3 xAxis(1.0f, 0.0f, 0.0f);
-    static D3DXVECTOR3 yAxis(0.0f, 1.0f, 0.0f);
-    static D3DXQUATERNION temp;
+void UpdateShadowCache(ShadowCache &cache, const PointLight *pLights, const OccluderSet &casters,
+                       const D3DXPLANE *pViewPlanes, const D3DXVECTOR3 &cameraPos, int budget,
+                       WorkerPool &pool, ShadowStats &stats)
+{
+    // Brings the cube map faces that can light what is in view up to date,
+    // drawing at most budget of them. A face is needed when its part of
+    // the light's sphere is in the view frustum, and its light is within
+    // SHADOW_MAX_DISTANCE of the camera. Faces that aren't resident
+    // go first, then those that light more of the view and have been out
+    // of date longer. Faces left over wait for a later frame, and until
+    // then shadow with what they last drew. Pass no view planes to need
+    // every face.
+
+    double startTime = GetTimeInSeconds();
+
+    memset(&stats, 0, sizeof(stats));
+    cache.pCasters = &casters;
+    cache.candidates.clear();
+    cache.updates.clear();
+    ++cache.frame;
+
+    static const D3DXVECTOR3 directions[SHADOW_CUBE_FACES] =
+    {
+        D3DXVECTOR3(1.0f, 0.0f, 0.0f), D3DXVECTOR3(-1.0f, 0.0f, 0.0f),
+        D3DXVECTOR3(0.0f, 1.0f, 0.0f), D3DXVECTOR3(0.0f, -1.0f, 0.0f),
+        D3DXVECTOR3(0.0f, 0.0f, 1.0f), D3DXVECTOR3(0.0f, 0.0f, -1.0f)
+    };
+    static const D3DXVECTOR3 ups[SHADOW_CUBE_FACES] =
+    {
+        D3DXVECTOR3(0.0f, 1.0f, 0.0f), D3DXVECTOR3(0.0f, 1.0f, 0.0f),
+        D3DXVECTOR3(0.0f, 0.0f, -1.0f), D3DXVECTOR3(0.0f, 0.0f, 1.0f),
+        D3DXVECTOR3(0.0f, 1.0f, 0.0f), D3DXVECTOR3(0.0f, 1.0f, 0.0f)
+    };
 
-    switch (msg)
+    for (size_t i = 0; i < cache.lights.size(); ++i)
     {
-    case WM_LBUTTONDOWN:
-        cameraMode = CAMERA_TRACK;
-        ++mouseButtonsDown;
-        SetCapture(hWnd);
-        ptMousePrev.x = static_cast<int>(static_cast<short>(LOWORD(lParam)));
-        ptMousePrev.y = static_cast<int>(static_cast<short>(HIWORD(lParam)));
-        ClientToScreen(hWnd, &ptMousePrev);
-        break;
+        ShadowLight &light = cache.lights[i];
+        const PointLight &pointLight = pLights[i];
 
-    case WM_RBUTTONDOWN:
-        cameraMode = CAMERA_ORBIT;
-        ++mouseButtonsDown;
-        SetCapture(hWnd);
-        ptMousePrev.x = static_cast<int>(static_cast<short>(LOWORD(lParam)));
-        ptMousePrev.y = static_cast<int>(static_cast<short>(HIWORD(lParam)));
-        ClientToScreen(hWnd, &ptMousePrev);
-        break;
+        // A light that has moved needs all of its faces drawn again.
 
-    case WM_MBUTTONDOWN:
-        cameraMode = CAMERA_DOLLY;
-        ++mouseButtonsDown;
-        SetCapture(hWnd);
-        ptMousePrev.x = static_cast<int>(static_cast<short>(LOWORD(lParam)));
-        ptMousePrev.y = static_cast<int>(static_cast<short>(HIWORD(lParam)));
-        ClientToScreen(hWnd, &ptMousePrev);
-        break;
+        if (memcmp(light.pos, pointLight.pos, sizeof(light.pos)) != 0 || light.radius != pointLight.radius)
+        {
+            D3DXVECTOR3 eye(pointLight.pos[0], pointLight.pos[1], pointLight.pos[2]);
+            D3DXMATRIX projection;
 
-    case WM_MOUSEMOVE:
-        ptMouseCurrent.x = static_cast<int>(static_cast<short>(LOWORD(lParam)));
-        ptMouseCurrent.y = static_cast<int>(static_cast<short>(HIWORD(lParam)));
-        ClientToScreen(hWnd, &ptMouseCurrent);
+            memcpy(light.pos, pointLight.pos, sizeof(light.pos));
+            light.radius = pointLight.radius;
+            D3DXMatrixPerspectiveFovLH(&projection, D3DX_PI * 0.5f, 1.0f, SHADOW_NEAR_PLANE,
+                max(light.radius, SHADOW_NEAR_PLANE * 2.0f));
 
-        switch (cameraMode)
-        {
-        case CAMERA_TRACK:
-            dx = static_cast<float>(ptMouseCurrent.x - ptMousePrev.x);
-            dx *= MOUSE_TRACK_SPEED;
+            for (int j = 0; j < SHADOW_CUBE_FACES; ++j)
+            {
+                D3DXVECTOR3 target = eye + directions[j];
+                D3DXMATRIX view;
 
-            dy = static_cast<float>(ptMouseCurrent.y - ptMousePrev.y);
-            dy *= MOUSE_TRACK_SPEED;
+                D3DXMatrixLookAtLH(&view, &eye, &target, &ups[j]);
+                light.faces[j].viewProjection = view * projection;
 
-            g_camera.target -= g_camera.xAxis * dx;
-            g_camera.target += g_camera.yAxis * dy;
-    
-            break;
+                if (light.faces[j].dirtyFrame < 0)
+                    light.faces[j].dirtyFrame = cache.frame;
+            }
+        }
 
-        case CAMERA_DOLLY:
-            dy = static_cast<float>(ptMousePrev.y - ptMouseCurrent.y);
-            dy *= MOUSE_DOLLY_SPEED;
+        if (light.radius <= 0.0f)
+            continue;
 
-            g_camera.offset -= dy;
+        // Lights that look bigger from the camera light more of the view.
 
-            if (g_camera.offset > DOLLY_MAX)
-                g_camera.offset = DOLLY_MAX;
+        float distanceSq = 0.0f;
 
-            if (g_camera.offset < DOLLY_MIN)
-                g_camera.offset = DOLLY_MIN;
+        for (int c = 0; c < 3; ++c)
+            distanceSq += (light.pos[c] - cameraPos[c]) * (light.pos[c] - cameraPos[c]);
 
-            break;
+        if (distanceSq > (SHADOW_MAX_DISTANCE + light.radius) * (SHADOW_MAX_DISTANCE + light.radius))
+            continue;
 
-        case CAMERA_ORBIT:
-            dx = static_cast<float>(ptMousePrev.x - ptMouseCurrent.x);
-            dx *= MOUSE_ORBIT_SPEED;
+        float importance = light.radius * light.radius / max(distanceSq, light.radius * light.radius);
 
-            dy = static_cast<float>(ptMousePrev.y - ptMouseCurrent.y);
-            dy *= MOUSE_ORBIT_SPEED;
+        for (int j = 0; j < SHADOW_CUBE_FACES; ++j)
+        {
+            ShadowFace &face = light.faces[j];
+            float faceMin[3];
+            float faceMax[3];
+            int planeMask = FRUSTUM_ALL_PLANES;
+            int lastCulledPlane = 0;
 
-            g_camera.pitch += dy;
+            GetShadowFaceBounds(light, j, faceMin, faceMax);
 
-            if (g_camera.pitch > 90.0f)
-            {
-                dy = 90.0f - (g_camera.pitch - dy);
-                g_camera.pitch = 90.0f;
-            }
+            if (pViewPlanes && !CullBox(pViewPlanes, faceMin, faceMax, planeMask, lastCulledPlane))
+                continue;
 
-            if (g_camera.pitch < -90.0f)
-            {
-                dy = -90.0f - (g_camera.pitch - dy);
-                g_camera.pitch = -90.0f;
-            }
+            ++stats.facesNeeded;
 
-            dx = D3DXToRadian(dx);
-            dy = D3DXToRadian(dy);
-            
-            if (dx != 0.0f)
-            {
-                D3DXQuaternionRotationAxis(&temp, &yAxis, dx);
-                D3DXQuaternionMultiply(&g_camera.orientation, &temp, &g_camera.orientation);
-            }
+            if (face.tile >= 0)
+                cache.tileLastUsed[face.tile] = cache.frame;
 
-            if (dy != 0.0f)
-            {
-                D3DXQuaternionRotationAxis(&temp, &xAxis, dy);
-                D3DXQuaternionMultiply(&g_camera.orientation, &g_camera.orientation, &temp);
-            }
+            if (face.tile >= 0 && face.dirtyFrame < 0)
+                continue;
 
-            break;
-        }
+            // Faces that aren't resident rank above every other face.
 
-        ptMousePrev.x = ptMouseCurrent.x;
-        ptMousePrev.y = ptMouseCurrent.y;
-        break;
+            float age = static_cast<float>(cache.frame - face.dirtyFrame + 1);
+            float priority = (face.tile < 0) ? (1.0f + importance) * 1.0e30f : importance * age;
 
-    case WM_LBUTTONUP:
-    case WM_RBUTTONUP:
-    case WM_MBUTTONUP:
-        if (--mouseButtonsDown <= 0)
-        {
-            mouseButtonsDown = 0;
-            cameraMode = CAMERA_NONE;
-            ReleaseCapture();
-        }
-        else
-        {
-            if (wParam & MK_LBUTTON)
-                cameraMode = CAMERA_TRACK;
-            else if (wParam & MK_RBUTTON)
-                cameraMode = CAMERA_ORBIT;
-            else if (wParam & MK_MBUTTON)
-                cameraMode = CAMERA_DOLLY;
+            cache.candidates.push_back(std::make_pair(-priority, static_cast<int>(i) * SHADOW_CUBE_FACES + j));
         }
-        break;
+    }
 
-    case WM_MOUSEWHEEL:
-        wheelDelta = static_cast<float>(static_cast<int>(wParam) >> 16);
-        g_camera.offset -= wheelDelta * MOUSE_WHEEL_DOLLY_SPEED;
+    int count = min(budget, static_cast<int>(cache.candidates.size()));
 
-        if (g_camera.offset > DOLLY_MAX)
-            g_camera.offset = DOLLY_MAX;
+    std::partial_sort(cache.candidates.begin(), cache.candidates.begin() + count, cache.candidates.end());
 
-        if (g_camera.offset < DOLLY_MIN)
-            g_camera.offset = DOLLY_MIN;
+    for (int i = 0; i < count; ++i)
+    {
+        int index = cache.candidates[i].second;
+        ShadowFace &face = cache.lights[index / SHADOW_CUBE_FACES].faces[index % SHADOW_CUBE_FACES];
 
-        break;
+        if (face.tile < 0 && AllocateShadowTile(cache, index, stats) < 0)
+            break;
 
-    default:
-        break;
+        face.dirtyFrame = -1;
+        cache.updates.push_back(index);
     }
-}
-
-void RenderFrame()
-{
-    g_pDevice->Clear(0, 0, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, 0, 1.0f, 0);
-
-    if (FAILED(g_pDevice->BeginScene()))
-        return;
-
-    RenderRoomUsingBlinnPhong();
 
-    if (g_renderLights)
+    for (size_t i = cache.updates.size(); i < cache.candidates.size(); ++i)
     {
-        for (int i = 0; i < g_numLights; ++i)
-            RenderLight(i);
+        int index = cache.candidates[i].second;
+
+        if (cache.lights[index / SHADOW_CUBE_FACES].faces[index % SHADOW_CUBE_FACES].tile < 0)
+            ++stats.facesMissing;
+        else
+            ++stats.facesStale;
     }
 
-    RenderText();
+    ParallelFor(pool, static_cast<int>(cache.updates.size()), RenderShadowFaces, &cache);
 
-    g_pDevice->EndScene();
-    g_pDevice->Present(0, 0, 0, 0);
+    stats.facesUpdated = static_cast<int>(cache.updates.size());
+    stats.updateTimeMs = static_cast<float>((GetTimeInSeconds() - startTime) * 1000.0);
 }
 
-void RenderLight(int i)
+int UpdateSimulation(float elapsedTimeSec, int maxSteps)
 {
-    static UINT totalPasses;
-    static D3DXHANDLE hTechnique;
-    static D3DXMATRIX world;
-    static D3DXMATRIX worldViewProjection;
-
-    hTechnique = g_pAmbientEffect->GetTechniqueByName("AmbientLighting");
-
-    if (FAILED(g_pAmbientEffect->SetTechnique(hTechnique)))
-        return;
+    // Accumulate the elapsed frame time and consume it in fixed size steps.
+    // At most maxSteps steps are taken per call. Any whole steps left over
+    // after that are dropped rather than carried into the next frame, which
+    // would otherwise cause the simulation to fall further and further
+    // behind on slow frames. Returns the number of steps taken.
 
-    D3DXMatrixTranslation(&world, g_lights[i].pos[0], g_lights[i].pos[1], g_lights[i].pos[2]);
-    worldViewProjection = world * g_camera.viewProjectionMatrix;
-
-    g_pAmbientEffect->SetMatrix("worldViewProjectionMatrix", &worldViewProjection);
-    g_pAmbientEffect->SetFloat("ambientIntensity", 1.0f);
-    g_pAmbientEffect->SetValue("ambientColor", g_lights[i].ambient, sizeof(g_lights[i].ambient));
+    int steps = 0;
 
-    // Draw the light object.
+    g_simulationAccumulator += elapsedTimeSec;
 
-    if (SUCCEEDED(g_pAmbientEffect->Begin(&totalPasses, 0)))
+    while (g_simulationAccumulator >= g_simulationTimestep && steps < maxSteps)
     {
-        for (UINT pass = 0; pass < totalPasses; ++pass)
-        {
-            if (SUCCEEDED(g_pAmbientEffect->BeginPass(pass)))
-            {
-                g_pLightMesh->DrawSubset(0);
-                g_pAmbientEffect->EndPass();
-            }
-        }
-
-        g_pAmbientEffect->End();
+        UpdateLights(g_simulationTimestep);
+        g_simulationAccumulator -= g_simulationTimestep;
+        ++steps;
     }
-}
 
-void RenderRoomUsingBlinnPhong()
-{
-    static UINT totalPasses;
-    static D3DXHANDLE hTechnique;
+    g_simulationSteps += steps;
 
-    if (g_pBlinnPhongEffect == g_pBlinnPhongEffectSM30)
-    {
-        hTechnique = g_pBlinnPhongEffect->GetTechniqueByName("PerPixelPointLighting");
-    }
-    else
+    if (g_simulationAccumulator >= g_simulationTimestep)
     {
-        if (g_enableMultipassLighting)
-            hTechnique = g_pBlinnPhongEffect->GetTechniqueByName("PerPixelPointLightingMultiPass");
-        else
-            hTechnique = g_pBlinnPhongEffect->GetTechniqueByName("PerPixelPointLightingSinglePass");
+        g_simulationStepsDropped += static_cast<int>(g_simulationAccumulator / g_simulationTimestep);
+        g_simulationAccumulator = fmod(g_simulationAccumulator, static_cast<double>(g_simulationTimestep));
     }
-        
-    if (FAILED(g_pBlinnPhongEffect->SetTechnique(hTechnique)))
-        return;
-    
-    g_pDevice->SetVertexDeclaration(g_pRoomVertexDecl);
-    g_pDevice->SetStreamSource(0, g_pRoomVertexBuffer, 0, sizeof(Vertex));
-
-    if (g_disableColorMapTexture)
-        g_pBlinnPhongEffect->SetTexture("colorMapTexture", g_pNullTexture);
 
-    g_pBlinnPhongEffect->SetValue("material.ambient", g_dullMaterial.ambient, sizeof(g_dullMaterial.ambient));
-    g_pBlinnPhongEffect->SetValue("material.diffuse", g_dullMaterial.diffuse, sizeof(g_dullMaterial.diffuse));
-    g_pBlinnPhongEffect->SetValue("material.emissive", g_dullMaterial.emissive, sizeof(g_dullMaterial.emissive));
-    g_pBlinnPhongEffect->SetValue("material.specular", g_dullMaterial.specular, sizeof(g_dullMaterial.specular));
-    g_pBlinnPhongEffect->SetFloat("material.shininess", g_dullMaterial.shininess);
-
-    // Draw walls.
-
-    if (!g_disableColorMapTexture)
-        g_pBlinnPhongEffect->SetTexture("colorMapTexture", g_pWallColorTexture);
-
-    if (SUCCEEDED(g_pBlinnPhongEffect->Begin(&totalPasses, 0)))
-    {
-        for (UINT pass = 0; pass < totalPasses; ++pass)
-        {
-            if (SUCCEEDED(g_pBlinnPhongEffect->BeginPass(pass)))
-            {
-                g_pDevice->DrawPrimitive(D3DPT_TRIANGLELIST, 0, 8);
-                g_pBlinnPhongEffect->EndPass();
-            }
-        }
+    float alpha = static_cast<float>(g_simulationAccumulator / g_simulationTimestep);
 
-        g_pBlinnPhongEffect->End();
-    }
+    for (int i = 0; i < sizeof(g_lights) / sizeof(g_lights[0]); ++i)
+        g_lights[i].interpolate(alpha);
 
-    g_pBlinnPhongEffect->SetValue("material.ambient", g_shinyMaterial.ambient, sizeof(g_shinyMaterial.ambient));
-    g_pBlinnPhongEffect->SetValue("material.diffuse", g_shinyMaterial.diffuse, sizeof(g_shinyMaterial.diffuse));
-    g_pBlinnPhongEffect->SetValue("material.emissive", g_shinyMaterial.emissive, sizeof(g_shinyMaterial.emissive));
-    g_pBlinnPhongEffect->SetValue("material.specular", g_shinyMaterial.specular, sizeof(g_shinyMaterial.specular));
-    g_pBlinnPhongEffect->SetFloat("material.shininess", g_shinyMaterial.shininess);
+    return steps;
+}
+
+void UpdateVirtualTexture(VirtualTexture &texture, int *pPages, int count)
+{
+    // Installs the pages that finished loading since the last update, then
+    // goes through the pages the latest feedback asked for. Resident pages
+    // are marked as used. Missing pages are loaded, coarsest level first
+    // (pages are numbered from the finest level), so that a sample falls
+    // back as few levels as possible while the finer pages arrive. Sorts
+    // pPages in place.
 
-    // Draw ceiling.
+    VirtualTextureStats &stats = texture.stats;
 
-    if (!g_disableColorMapTexture)
-        g_pBlinnPhongEffect->SetTexture("colorMapTexture", g_pCeilingColorTexture);
+    ++stats.updates;
 
-    if (SUCCEEDED(g_pBlinnPhongEffect->Begin(&totalPasses, 0)))
+    for (int i = 0; i < VIRTUAL_MAX_PAGE_LOADS; ++i)
     {
-        for (UINT pass = 0; pass < totalPasses; ++pass)
+        VirtualPageLoad &load = texture.loads[i];
+
+        if (load.page < 0 || !load.done)
+            continue;
+
+        if (load.succeeded)
         {
-            if (SUCCEEDED(g_pBlinnPhongEffect->BeginPass(pass)))
+            int slot = texture.lruTail;
+
+            if (texture.slotPages[slot] >= 0)
             {
-                g_pDevice->DrawPrimitive(D3DPT_TRIANGLELIST, 24, 2);
-                g_pBlinnPhongEffect->EndPass();
+                texture.pPageTable[texture.slotPages[slot]] = -1;
+                ++stats.pagesEvicted;
             }
+
+            memcpy(texture.pPhysical + slot * VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE, load.pTexels,
+                   VIRTUAL_PAGE_STRIDE * VIRTUAL_PAGE_STRIDE * sizeof(DWORD));
+            texture.pPageTable[load.page] = slot;
+            texture.slotPages[slot] = load.page;
+            TouchVirtualSlot(texture, slot);
+            ++stats.pagesLoaded;
+            stats.bytesStreamed += texture.header.pageBytes;
         }
 
-        g_pBlinnPhongEffect->End();
+        texture.pPageLoading[load.page] = false;
+        load.page = -1;
     }
 
-    // Draw floor.
+    std::sort(pPages, pPages + count);
 
-    if (!g_disableColorMapTexture)
-        g_pBlinnPhongEffect->SetTexture("colorMapTexture", g_pFloorColorTexture);
+    int freeLoad = 0;
 
-    if (SUCCEEDED(g_pBlinnPhongEffect->Begin(&totalPasses, 0)))
+    for (int i = count - 1; i >= 0; --i)
     {
-        for (UINT pass = 0; pass < totalPasses; ++pass)
-        {
-            if (SUCCEEDED(g_pBlinnPhongEffect->BeginPass(pass)))
-            {
-                g_pDevice->DrawPrimitive(D3DPT_TRIANGLELIST, 30, 2);
-                g_pBlinnPhongEffect->EndPass();
-            }
-        }
+        int page = pPages[i];
+        int slot = texture.pPageTable[page];
 
-        g_pBlinnPhongEffect->End();
-    }
-}
+        ++stats.pagesRequested;
 
-void RenderText()
-{
-    static RECT rcClient;
+        if (slot >= 0)
+        {
+            if (slot >= texture.tailSlots)
+                TouchVirtualSlot(texture, slot);
 
-    std::ostringstream output;
+            ++stats.pageHits;
+            continue;
+        }
 
-    if (g_displayHelp)
-    {
-        output
-            << "Left mouse click and drag to track camera" << std::endl
-            << "Middle mouse click and drag to dolly camera" << std::endl
-            << "Right mouse click and drag to orbit camera" << std::endl
-            << "Mouse wheel to dolly camera" << std::endl
-            << std::endl
-            << "Press +/- to increase/decrease light radius" << std::endl
-            << "Press SPACE to start/stop light animation" << std::endl
-            << "Press L to enable/disable rendering of lights" << std::endl
-            << "Press M to enable/disable multi pass lighting [Shader Model 2.0]" << std::endl
-            << "Press S to toggle between Shader Model 2.0 and 3.0" << std::endl
-            << "Press T to enable/disable textures" << std::endl
-            << "Press ALT + ENTER to toggle full screen" << std::endl
-            << "Press ESC to exit" << std::endl
-            << std::endl
-            << "Press H to hide help";
-    }
-    else
-    {
-        output << "FPS: " << g_framesPerSecond << std::endl;
+        ++stats.pageMisses;
 
-        if (g_msaaSamples > 1)
-            output << "Multisample anti-aliasing: " << g_msaaSamples << "x" << std::endl;
+        if (texture.pPageLoading[page])
+            continue;
 
-        output << "Anisotropic filtering: " << g_maxAnisotrophy << "x" << std::endl;
+        while (freeLoad < VIRTUAL_MAX_PAGE_LOADS && texture.loads[freeLoad].page >= 0)
+            ++freeLoad;
 
-        if (g_pBlinnPhongEffect == g_pBlinnPhongEffectSM30)
+        if (freeLoad == VIRTUAL_MAX_PAGE_LOADS)
         {
-            output
-                << "Shader Model 3.0" << std::endl
-                << "Technique: Single pass lighting" << std::endl;
+            ++stats.loadsDeferred;
+            continue;
         }
-        else
-        {
-            output << "Shader Model 2.0" << std::endl;
 
-            if (g_enableMultipassLighting)
-                output << "Technique: Multi pass lighting" << std::endl;
-            else
-                output << "Technique: Single pass lighting" << std::endl;
-        }
+        VirtualPageLoad &load = texture.loads[freeLoad];
 
-        output
-            << "Light radius: " << g_lights[0].radius << std::endl
-            << std::endl
-            << "Press H to display help";
+        load.page = page;
+        load.done = 0;
+        load.succeeded = false;
+        texture.pPageLoading[page] = true;
+        ++stats.loadsStarted;
+        texture.pLoadPool->submit(LoadVirtualPageJob, &load);
     }
-
-    GetClientRect(g_hWnd, &rcClient);
-    rcClient.left += 4;
-    rcClient.top += 2;
-
-    g_pFont->DrawText(0, output.str().c_str(), -1, &rcClient,
-        DT_EXPANDTABS | DT_LEFT, D3DCOLOR_XRGB(255, 255, 0));
 }
 
-bool ResetDevice()
+DWORD WINAPI WorkerThreadProc(LPVOID pParam)
 {
-    if (FAILED(g_pBlinnPhongEffectSM20->OnLostDevice()))
-        return false;
+    // Runs jobs for a worker pool until the pool is destroyed. COM is
+    // initialized so that jobs can decode images with WIC.
 
-    if (FAILED(g_pBlinnPhongEffectSM30->OnLostDevice()))
-        return false;
+    WorkerPool &pool = *static_cast<WorkerPool*>(pParam);
+    HANDLE handles[] = {pool.hQuitEvent, pool.hJobsAvailable};
 
-    if (FAILED(g_pAmbientEffect->OnLostDevice()))
-        return false;
+    CoInitializeEx(0, COINIT_MULTITHREADED);
 
-    if (FAILED(g_pFont->OnLostDevice()))
-        return false;
+    {
+        AllocationZone zone("Worker");
 
-    if (FAILED(g_pDevice->Reset(&g_params)))
-        return false;
+        while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+            pool.runOne();
+    }
 
-    if (FAILED(g_pFont->OnResetDevice()))
-        return false;
+    CoUninitialize();
+    return 0;
+}
 
-    if (FAILED(g_pAmbientEffect->OnResetDevice()))
-        return false;
+int WriteBlockBC1(const DWORD *pPixels, WORD color0, WORD color1, BYTE *pBlock)
+{
+    // Writes a 4 color mode DXT1 color block with the given end points,
+    // swapping them if needed, and the nearest palette entry for each pixel.
+    // Returns the block's squared error.
 
-    if (FAILED(g_pBlinnPhongEffectSM20->OnResetDevice()))
-        return false;
+    if (color0 < color1)
+        std::swap(color0, color1);
 
-    if (FAILED(g_pBlinnPhongEffectSM30->OnResetDevice()))
-        return false;
+    DWORD decoded[16];
+    int error = 0;
 
-    return true;
-}
+    pBlock[0] = static_cast<BYTE>(color0);
+    pBlock[1] = static_cast<BYTE>(color0 >> 8);
+    pBlock[2] = static_cast<BYTE>(color1);
+    pBlock[3] = static_cast<BYTE>(color1 >> 8);
+    memset(pBlock + 4, 0, 4);
 
-void SetProcessorAffinity()
-{
-    // Assign the current thread to one processor. This ensures that timing
-    // code runs on only one processor, and will not suffer any ill effects
-    // from power management.
-    //
-    // Based on the DXUTSetProcessorAffinity() function in the DXUT framework.
+    if (color0 != color1)
+    {
+        int palette[4][3];
 
-    DWORD_PTR dwProcessAffinityMask = 0;
-    DWORD_PTR dwSystemAffinityMask = 0;
-    HANDLE hCurrentProcess = GetCurrentProcess();
+        UnpackColor565(color0, palette[0]);
+        UnpackColor565(color1, palette[1]);
 
-    if (!GetProcessAffinityMask(hCurrentProcess, &dwProcessAffinityMask, &dwSystemAffinityMask))
-        return;
+        for (int c = 0; c < 3; ++c)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
 
-    if (dwProcessAffinityMask)
-    {
-        // Find the lowest processor that our process is allowed to run against.
+        for (int i = 0; i < 16; ++i)
+        {
+            int bestIndex = 0;
+            int bestError = INT_MAX;
 
-        DWORD_PTR dwAffinityMask = (dwProcessAffinityMask & ((~dwProcessAffinityMask) + 1));
+            for (int j = 0; j < 4; ++j)
+            {
+                int dr = static_cast<int>((pPixels[i] >> 16) & 0xff) - palette[j][0];
+                int dg = static_cast<int>((pPixels[i] >> 8) & 0xff) - palette[j][1];
+                int db = static_cast<int>(pPixels[i] & 0xff) - palette[j][2];
+                int pixelError = dr * dr + dg * dg + db * db;
 
-        // Set this as the processor that our thread must always run against.
-        // This must be a subset of the process affinity mask.
+                if (pixelError < bestError)
+                {
+                    bestError = pixelError;
+                    bestIndex = j;
+                }
+            }
 
-        HANDLE hCurrentThread = GetCurrentThread();
+            pBlock[4 + i / 4] |= static_cast<BYTE>(bestIndex << ((i % 4) * 2));
+        }
+    }
 
-        if (hCurrentThread != INVALID_HANDLE_VALUE)
+    DecompressBlockBC1(pBlock, false, decoded);
+
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
         {
-            SetThreadAffinityMask(hCurrentThread, dwAffinityMask);
-            CloseHandle(hCurrentThread);
+            int difference = static_cast<int>((pPixels[i] >> (c * 8)) & 0xff) -
+                             static_cast<int>((decoded[i] >> (c * 8)) & 0xff);
+
+            error += difference * difference;
         }
     }
 
-    CloseHandle(hCurrentProcess);
+    return error;
 }
 
-void ToggleFullScreen()
+void WriteBlockBits(BYTE *pBlock, int &offset, DWORD value, int count)
 {
-    static DWORD savedExStyle;
-    static DWORD savedStyle;
-    static RECT rcSaved;
+    // Writes the low count bits of value, least significant first, starting
+    // at bit offset of a zeroed compressed block.
 
-    g_isFullScreen = !g_isFullScreen;
+    for (int i = 0; i < count; ++i, ++offset)
+        pBlock[offset >> 3] |= static_cast<BYTE>(((value >> i) & 1) << (offset & 7));
+}
 
-    if (g_isFullScreen)
-    {
-        // Moving to full screen mode.
+bool WriteTextureCache(const char *pszFilename, ULONGLONG sourceHash, const CompressedImage &image)
+{
+    TextureCacheHeader header = {0};
+
+    header.magic = TEXTURE_CACHE_MAGIC;
+    header.version = TEXTURE_CACHE_VERSION;
+    header.sourceHash = sourceHash;
+    header.format = image.format;
+    header.width = image.width;
+    header.height = image.height;
+    header.levels = image.levels;
+    header.dataSize = image.dataSize;
+    memcpy(header.levelOffsets, image.levelOffsets, sizeof(header.levelOffsets));
+    memcpy(header.levelSizes, image.levelSizes, sizeof(header.levelSizes));
+
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_WRITE, 0, 0, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL, 0);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
 
-        savedExStyle = GetWindowLong(g_hWnd, GWL_EXSTYLE);
-        savedStyle = GetWindowLong(g_hWnd, GWL_STYLE);
-        GetWindowRect(g_hWnd, &rcSaved);
+    DWORD bytesWritten = 0;
+    bool succeeded = WriteFile(hFile, &header, sizeof(header), &bytesWritten, 0) &&
+                     bytesWritten == sizeof(header) &&
+                     WriteFile(hFile, image.pData, image.dataSize, &bytesWritten, 0) &&
+                     bytesWritten == image.dataSize;
 
-        SetWindowLong(g_hWnd, GWL_EXSTYLE, 0);
-        SetWindowLong(g_hWnd, GWL_STYLE, WS_POPUP);
-        SetWindowPos(g_hWnd, HWND_TOPMOST, 0, 0, 0, 0,
-            SWP_NOMOVE | SWP_NOSIZE | SWP_FRAMECHANGED | SWP_SHOWWINDOW);
+    CloseHandle(hFile);
 
-        g_windowWidth = GetSystemMetrics(SM_CXSCREEN);
-        g_windowHeight = GetSystemMetrics(SM_CYSCREEN);
+    // A partially written file would be rejected by MapTextureCache() anyway,
+    // but don't leave it lying around.
 
-        SetWindowPos(g_hWnd, HWND_TOPMOST, 0, 0,
-            g_windowWidth, g_windowHeight, SWP_SHOWWINDOW);
+    if (!succeeded)
+        DeleteFile(pszFilename);
 
-        // Update presentation parameters.
+    return succeeded;
+}
 
-        g_params.Windowed = FALSE;
-        g_params.BackBufferWidth = g_windowWidth;
-        g_params.BackBufferHeight = g_windowHeight;
+bool WriteMeshCache(const char *pszFilename, ULONGLONG sourceSize, ULONGLONG sourceTime,
+                    const CookedMesh &mesh)
+{
+    MeshCacheHeader header = {0};
 
-        if (g_enableVerticalSync)
-        {
-            g_params.FullScreen_RefreshRateInHz = D3DPRESENT_INTERVAL_DEFAULT;
-            g_params.PresentationInterval = D3DPRESENT_INTERVAL_DEFAULT;
-        }
-        else
-        {
-            g_params.FullScreen_RefreshRateInHz = D3DPRESENT_INTERVAL_IMMEDIATE;
-            g_params.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
-        }
-    }
-    else
-    {
-        // Moving back to windowed mode.
+    if (mesh.dataSize > 0xffffffff - sizeof(header))
+        return false;
 
-        SetWindowLong(g_hWnd, GWL_EXSTYLE, savedExStyle);
-        SetWindowLong(g_hWnd, GWL_STYLE, savedStyle);
-        SetWindowPos(g_hWnd, HWND_NOTOPMOST, 0, 0, 0, 0,
-            SWP_NOMOVE | SWP_NOSIZE | SWP_FRAMECHANGED | SWP_SHOWWINDOW);
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceTime;
+    header.vertexCount = mesh.vertexCount;
+    header.indexCount = mesh.indexCount;
+    memcpy(header.boundsMin, mesh.boundsMin, sizeof(header.boundsMin));
+    memcpy(header.boundsMax, mesh.boundsMax, sizeof(header.boundsMax));
 
-        g_windowWidth = rcSaved.right - rcSaved.left;
-        g_windowHeight = rcSaved.bottom - rcSaved.top;
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_WRITE, 0, 0, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL, 0);
 
-        SetWindowPos(g_hWnd, HWND_NOTOPMOST, rcSaved.left, rcSaved.top,
-            g_windowWidth, g_windowHeight, SWP_SHOWWINDOW);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
 
-        // Update presentation parameters.
+    DWORD bytesWritten = 0;
+    bool succeeded = WriteFile(hFile, &header, sizeof(header), &bytesWritten, 0) &&
+                     bytesWritten == sizeof(header) &&
+                     WriteFile(hFile, mesh.pVertices, static_cast<DWORD>(mesh.dataSize), &bytesWritten, 0) &&
+                     bytesWritten == mesh.dataSize;
 
-        g_params.Windowed = TRUE;
-        g_params.BackBufferWidth = g_windowWidth;
-        g_params.BackBufferHeight = g_windowHeight;
-        g_params.FullScreen_RefreshRateInHz = 0;
+    CloseHandle(hFile);
 
-        if (g_enableVerticalSync)
-            g_params.PresentationInterval = D3DPRESENT_INTERVAL_DEFAULT;
-        else
-            g_params.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
-    }
+    // A partially written file would be rejected by MapMeshCache() anyway,
+    // but don't leave it lying around.
 
-    ResetDevice();
-}
+    if (!succeeded)
+        DeleteFile(pszFilename);
 
-void UpdateFrame(float elapsedTimeSec)
-{
-    UpdateFrameRate(elapsedTimeSec);
-    
-    if (g_animateLights)
-        UpdateLights(elapsedTimeSec);
-    
-    UpdateEffects();
+    return succeeded;
 }
 
-void UpdateFrameRate(float elapsedTimeSec)
+bool WriteTorusObj(const char *pszFilename, int rings, int sides)
 {
-    static float accumTimeSec = 0.0f;
-    static int frames = 0;
+    // Writes a torus made of rings x sides quads as an OBJ file, with
+    // positions, texture coordinates and normals. Used to benchmark the OBJ
+    // parser on a file of any size.
 
-    accumTimeSec += elapsedTimeSec;
-
-    if (accumTimeSec > 1.0f)
-    {
-        g_framesPerSecond = frames;
+    const float majorRadius = 1.0f;
+    const float minorRadius = 0.35f;
+    const size_t bufferSize = 1024 * 1024;
 
-        frames = 0;
-        accumTimeSec = 0.0f;
-    }
-    else
-    {
-        ++frames;
-    }
-}
+    HANDLE hFile = CreateFile(pszFilename, GENERIC_WRITE, 0, 0, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL, 0);
 
-void UpdateEffects()
-{
-    static const D3DXMATRIX identity(1.0f, 0.0f, 0.0f, 0.0f,
-                                     0.0f, 1.0f, 0.0f, 0.0f,
-                                     0.0f, 0.0f, 1.0f, 0.0f,
-                                     0.0f, 0.0f, 0.0f, 1.0f);
-    static D3DXMATRIX view, proj;
-    static D3DXMATRIX rot, xRot, yRot;
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
 
-    // Build the perspective projection matrix.
+    std::vector<char> buffer(bufferSize);
+    size_t used = 0;
+    bool succeeded = true;
 
-    D3DXMatrixPerspectiveFovLH(&proj, CAMERA_FOVY,
-        static_cast<float>(g_windowWidth) / static_cast<float>(g_windowHeight),
-        CAMERA_ZNEAR, CAMERA_ZFAR);
+    for (int pass = 0; pass < 4 && succeeded; ++pass)
+    {
+        for (int i = 0; i < rings && succeeded; ++i)
+        {
+            for (int j = 0; j < sides && succeeded; ++j)
+            {
+                float theta = 2.0f * D3DX_PI * i / rings;
+                float phi = 2.0f * D3DX_PI * j / sides;
+                float ringRadius = majorRadius + minorRadius * cosf(phi);
+                char *pLine = &buffer[used];
+                size_t space = bufferSize - used;
 
-    // Build the view matrix.
+                switch (pass)
+                {
+                case 0:
+                    used += snprintf(pLine, space, "v %f %f %f\n", ringRadius * cosf(theta),
+                        minorRadius * sinf(phi), ringRadius * sinf(theta));
+                    break;
 
-    D3DXQuaternionNormalize(&g_camera.orientation, &g_camera.orientation);
-    D3DXMatrixRotationQuaternion(&view, &g_camera.orientation);
-    
-    g_camera.xAxis = D3DXVECTOR3(view(0,0), view(1,0), view(2,0));
-    g_camera.yAxis = D3DXVECTOR3(view(0,1), view(1,1), view(2,1));
-    g_camera.zAxis = D3DXVECTOR3(view(0,2), view(1,2), view(2,2));
-   
-    g_camera.pos = g_camera.target + g_camera.zAxis * -g_camera.offset;
+                case 1:
+                    used += snprintf(pLine, space, "vt %f %f\n", static_cast<float>(i) / rings,
+                        static_cast<float>(j) / sides);
+                    break;
 
-    view(3,0) = -D3DXVec3Dot(&g_camera.xAxis, &g_camera.pos);
-    view(3,1) = -D3DXVec3Dot(&g_camera.yAxis, &g_camera.pos);
-    view(3,2) = -D3DXVec3Dot(&g_camera.zAxis, &g_camera.pos);
-    
-    g_camera.viewProjectionMatrix = view * proj;
+                case 2:
+                    used += snprintf(pLine, space, "vn %f %f %f\n", cosf(phi) * cosf(theta),
+                        sinf(phi), cosf(phi) * sinf(theta));
+                    break;
 
-    ID3DXEffect *pEffect = g_pBlinnPhongEffect;
+                case 3:
+                    {
+                        int a = i * sides + j + 1;
+                        int b = i * sides + (j + 1) % sides + 1;
+                        int c = ((i + 1) % rings) * sides + (j + 1) % sides + 1;
+                        int d = ((i + 1) % rings) * sides + j + 1;
 
-    // Set the matrices for the shader.
+                        used += snprintf(pLine, space, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n",
+                            a, a, a, b, b, b, c, c, c, d, d, d);
+                    }
+                    break;
+                }
 
-    pEffect->SetMatrix("worldMatrix", &identity);
-    pEffect->SetMatrix("worldInverseTransposeMatrix", &identity);
-    pEffect->SetMatrix("worldViewProjectionMatrix", &g_camera.viewProjectionMatrix);
+                // Flush whenever the buffer is nearly full, and at the end.
 
-    // Set the camera position.
-    
-    pEffect->SetValue("cameraPos", &g_camera.pos, sizeof(g_camera.pos));
+                bool last = pass == 3 && i == rings - 1 && j == sides - 1;
 
-    // Set the scene global ambient term.
-    
-    pEffect->SetValue("globalAmbient", &g_sceneAmbient, sizeof(g_sceneAmbient));
+                if (used > bufferSize - 256 || last)
+                {
+                    DWORD bytesWritten = 0;
 
-    // Set the number of active lights. For shader model 3.0 only.
-    
-    if (pEffect == g_pBlinnPhongEffectSM30)
-        pEffect->SetValue("numLights", &g_numLights, sizeof(g_numLights));
+                    succeeded = WriteFile(hFile, &buffer[0], static_cast<DWORD>(used), &bytesWritten, 0) &&
+                                bytesWritten == used;
+                    used = 0;
+                }
+            }
+        }
+    }
 
-    // Set the lighting parameters for the shader.
-    
-    const PointLight *pLight = 0;
-    D3DXHANDLE hLight;
-    D3DXHANDLE hLightPos;
-    D3DXHANDLE hLightAmbient;
-    D3DXHANDLE hLightDiffuse;
-    D3DXHANDLE hLightSpecular;
-    D3DXHANDLE hLightRadius;
+    CloseHandle(hFile);
 
-    for (int i = 0; i < g_numLights; ++i)
-    {
-        pLight = &g_lights[i];
-        hLight = pEffect->GetParameterElement("lights", i);
-        
-        hLightPos = pEffect->GetParameterByName(hLight, "pos");
-        hLightAmbient = pEffect->GetParameterByName(hLight, "ambient");
-        hLightDiffuse = pEffect->GetParameterByName(hLight, "diffuse");
-        hLightSpecular = pEffect->GetParameterByName(hLight, "specular");
-        hLightRadius = pEffect->GetParameterByName(hLight, "radius");
+    if (!succeeded)
+        DeleteFile(pszFilename);
 
-        pEffect->SetValue(hLightPos, pLight->pos, sizeof(pLight->pos));
-        pEffect->SetValue(hLightAmbient, pLight->ambient, sizeof(pLight->ambient));
-        pEffect->SetValue(hLightDiffuse, pLight->diffuse, sizeof(pLight->diffuse));
-        pEffect->SetValue(hLightSpecular, pLight->specular, sizeof(pLight->specular));
-        pEffect->SetFloat(hLightRadius, pLight->radius);
-    }
+    return succeeded;
 }
-
-void UpdateLights(float elapsedTimeSec)
-{
-    for (int i = 0; i < sizeof(g_lights) / sizeof(g_lights[0]); ++i)
-        g_lights[i].update(elapsedTimeSec);   
-}
\ No newline at end of file